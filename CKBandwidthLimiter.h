@@ -0,0 +1,39 @@
+//
+//  CKBandwidthLimiter.h
+//  Connection
+//
+//  Copyright (c) 2012 Karelia Software. All rights reserved.
+//
+
+#import <Foundation/Foundation.h>
+
+
+/*  Token bucket. Transfers call -waitToTransferLength: before sending each chunk, which blocks for as long as it takes
+ *  the bucket to cover it. Give a limiter a parent to have it count against both, e.g. one per uploader under
+ *  +sharedLimiter, so each job is held to its own rate and all of them together to the global one.
+ *
+ *  Rate and burst can be changed at any time, from any thread; waiting transfers pick the change up straight away.
+ */
+@interface CKBandwidthLimiter : NSObject
+{
+  @private
+    double              _rate;          // bytes per second, 0 for no limit
+    NSUInteger          _burst;         // most the bucket holds
+    double              _tokens;        // may go negative, paying off a chunk bigger than what was in the bucket
+    NSTimeInterval      _lastFill;
+    CKBandwidthLimiter  *_parent;
+    NSCondition         *_condition;
+}
+
++ (CKBandwidthLimiter *)sharedLimiter;  // global limit; unlimited until given a rate
+
+- (id)initWithRate:(double)bytesPerSecond burst:(NSUInteger)burst parent:(CKBandwidthLimiter *)parent;
+
+@property(atomic) double rate;          // bytes per second. 0 means unlimited
+@property(atomic) NSUInteger burst;     // bytes that can go at once after a quiet spell. 0 means a quarter second's worth
+@property(nonatomic, retain, readonly) CKBandwidthLimiter *parent;
+- (BOOL)isLimited;  // whether this or any parent has a rate
+
+- (void)waitToTransferLength:(NSUInteger)length;
+
+@end
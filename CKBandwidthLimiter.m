@@ -0,0 +1,148 @@
+//
+//  CKBandwidthLimiter.m
+//  Connection
+//
+//  Copyright (c) 2012 Karelia Software. All rights reserved.
+//
+
+#import "CKBandwidthLimiter.h"
+
+
+@implementation CKBandwidthLimiter
+
++ (CKBandwidthLimiter *)sharedLimiter;
+{
+    static CKBandwidthLimiter *sharedLimiter;
+    static dispatch_once_t onceToken;
+    
+    dispatch_once(&onceToken, ^{
+        sharedLimiter = [[CKBandwidthLimiter alloc] initWithRate:0 burst:0 parent:nil];
+    });
+    
+    return sharedLimiter;
+}
+
+#pragma mark Lifecycle
+
+- (id)initWithRate:(double)bytesPerSecond burst:(NSUInteger)burst parent:(CKBandwidthLimiter *)parent;
+{
+    if (self = [super init])
+    {
+        _rate = bytesPerSecond;
+        _burst = burst;
+        _parent = [parent retain];
+        _condition = [[NSCondition alloc] init];
+        
+        _lastFill = [NSDate timeIntervalSinceReferenceDate];
+        _tokens = [self capacity];
+    }
+    
+    return self;
+}
+
+- (id)init;
+{
+    return [self initWithRate:0 burst:0 parent:nil];
+}
+
+- (void)dealloc;
+{
+    [_parent release];
+    [_condition release];
+    
+    [super dealloc];
+}
+
+#pragma mark Bucket
+
+// Must hold _condition for these two
+
+- (double)capacity;
+{
+    return (_burst > 0 ? _burst : _rate / 4);
+}
+
+- (void)fill;
+{
+    NSTimeInterval now = [NSDate timeIntervalSinceReferenceDate];
+    _tokens = MIN(_tokens + (now - _lastFill) * _rate, [self capacity]);
+    _lastFill = now;
+}
+
+- (void)waitToTransferLength:(NSUInteger)length;
+{
+    [_condition lock];
+    
+    if (_rate > 0)
+    {
+        // Take it all up front, even past empty. Anyone waiting behind then waits for this chunk to be paid off too
+        [self fill];
+        _tokens -= length;
+        
+        while (_rate > 0 && _tokens < 0)
+        {
+            [_condition waitUntilDate:[NSDate dateWithTimeIntervalSinceNow:(-_tokens / _rate)]];
+            [self fill];
+        }
+    }
+    
+    [_condition unlock];
+    
+    
+    [_parent waitToTransferLength:length];
+}
+
+#pragma mark Configuration
+
+- (BOOL)isLimited;
+{
+    return ([self rate] > 0 || [[self parent] isLimited]);
+}
+
+- (double)rate;
+{
+    [_condition lock];
+    double result = _rate;
+    [_condition unlock];
+    
+    return result;
+}
+
+- (void)setRate:(double)rate;
+{
+    [_condition lock];
+    
+    [self fill];
+    BOOL wasUnlimited = (_rate <= 0);
+    
+    _rate = MAX(rate, 0);
+    _tokens = (wasUnlimited ? [self capacity] : MIN(_tokens, [self capacity]));    // nothing was counted while unlimited
+    
+    [_condition broadcast];         // waiters work out their time again
+    [_condition unlock];
+}
+
+- (NSUInteger)burst;
+{
+    [_condition lock];
+    NSUInteger result = _burst;
+    [_condition unlock];
+    
+    return result;
+}
+
+- (void)setBurst:(NSUInteger)burst;
+{
+    [_condition lock];
+    
+    [self fill];
+    _burst = burst;
+    _tokens = MIN(_tokens, [self capacity]);
+    
+    [_condition broadcast];
+    [_condition unlock];
+}
+
+@synthesize parent = _parent;
+
+@end
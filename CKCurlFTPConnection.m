@@ -9,6 +9,7 @@
 #import "CKCurlFTPConnection.h"
 
 #import "UKMainThreadProxy.h"
+#import "CKBandwidthLimiter.h"
 #import "NSInvocation+Connection.h"
 
 #import <sys/dirent.h>
@@ -198,7 +199,26 @@
 
 - (CKTransferRecord *)uploadFileAtURL:(NSURL *)url toPath:(NSString *)path openingPosixPermissions:(unsigned long)permissions;
 {
-    return [self uploadData:[NSData dataWithContentsOfURL:url] toPath:path openingPosixPermissions:permissions];
+    NSParameterAssert(url);
+    
+    NSNumber *size;
+    if (![url getResourceValue:&size forKey:NSURLFileSizeKey error:NULL]) size = nil;
+    
+    CKTransferRecord *result = [CKTransferRecord recordWithName:[path lastPathComponent] size:[size unsignedLongLongValue]];
+    
+    path = [self canonicalPathForPath:path];
+    
+    
+    NSInvocation *invocation = [NSInvocation invocationWithSelector:@selector(threaded_writeContentsOfURL:toPath:transferRecord:)
+                                                             target:self
+                                                          arguments:[NSArray arrayWithObjects:url, path, result, nil]];
+    
+    NSInvocationOperation *op = [[NSInvocationOperation alloc] initWithInvocation:invocation];
+    [self enqueueOperation:op];
+    [op release];
+    
+    
+    return result;
 }
 
 - (CKTransferRecord *)uploadData:(NSData *)data toPath:(NSString *)path openingPosixPermissions:(unsigned long)permissions;
@@ -236,6 +256,29 @@
     }
 }
 
+- (void)threaded_writeContentsOfURL:(NSURL *)url toPath:(NSString *)path transferRecord:(CKTransferRecord *)record
+{
+    // Streams from the file, so memory use doesn't depend on its size
+    NSError *error;
+    BOOL result = [_session createFileAtPath:path
+                           withContentsOfURL:url
+                 withIntermediateDirectories:NO
+                                       error:&error
+                               progressBlock:^(NSUInteger bytesWritten) {
+                                   [[CKBandwidthLimiter sharedLimiter] waitToTransferLength:bytesWritten];
+                                   [[record mainThreadProxy] transfer:record transferredDataOfLength:bytesWritten];
+                               }];
+    
+    [[record mainThreadProxy] transferDidFinish:record error:(result ? nil : error)];
+    
+    if ([[self delegate] respondsToSelector:@selector(connection:uploadDidFinish:error:)])
+    {
+        id proxy = [[UKMainThreadProxy alloc] initWithTarget:[self delegate]];
+        [proxy connection:self uploadDidFinish:path error:(result ? nil : error)];
+        [proxy release];
+    }
+}
+
 - (void)createDirectoryAtPath:(NSString *)path posixPermissions:(NSNumber *)permissions;
 {
     NSInvocation *invocation = [NSInvocation invocationWithSelector:@selector(threaded_createDirectoryAtPath:permissions:)
@@ -8,10 +8,14 @@
 
 #import "CKSFTPConnection.h"
 #import "CK2SFTPSession.h"
+#import "CKBandwidthLimiter.h"
 
 #import "UKMainThreadProxy.h"
 #import "NSInvocation+Connection.h"
 
+#include <fcntl.h>
+#include <unistd.h>
+
 
 @interface CKSFTPConnection () <CK2SFTPSessionDelegate>
 @end
@@ -167,7 +171,26 @@
 
 - (CKTransferRecord *)uploadFileAtURL:(NSURL *)url toPath:(NSString *)path openingPosixPermissions:(unsigned long)permissions;
 {
-    return [self uploadData:[NSData dataWithContentsOfURL:url] toPath:path openingPosixPermissions:permissions];
+    NSParameterAssert(url);
+    
+    NSNumber *size;
+    if (![url getResourceValue:&size forKey:NSURLFileSizeKey error:NULL]) size = nil;
+    
+    CKTransferRecord *result = [CKTransferRecord recordWithName:[path lastPathComponent] size:[size unsignedLongLongValue]];
+    
+    path = [self canonicalPathForPath:path];
+    
+    
+    NSInvocation *invocation = [NSInvocation invocationWithSelector:@selector(threaded_writeContentsOfURL:toPath:transferRecord:permissions:)
+                                                             target:self
+                                                          arguments:[NSArray arrayWithObjects:url, path, result, @(permissions), nil]];
+    
+    NSInvocationOperation *op = [[NSInvocationOperation alloc] initWithInvocation:invocation];
+    [self enqueueOperation:op];
+    [op release];
+    
+    
+    return result;
 }
 
 - (CKTransferRecord *)uploadData:(NSData *)data toPath:(NSString *)path openingPosixPermissions:(unsigned long)permissions;
@@ -193,6 +216,67 @@
 }
 
 - (void)threaded_writeData:(NSData *)data toPath:(NSString *)path transferRecord:(CKTransferRecord *)record permissions:(NSNumber *)permissions;
+{
+    [self threaded_writeToPath:path permissions:permissions usingBlock:^BOOL(CK2SFTPFileHandle *handle, NSError **outError) {
+        return [handle writeData:data error:outError];
+    }];
+}
+
+- (void)threaded_writeContentsOfURL:(NSURL *)url toPath:(NSString *)path transferRecord:(CKTransferRecord *)record permissions:(NSNumber *)permissions;
+{
+    int fd = open([[url path] fileSystemRepresentation], O_RDONLY);
+    if (fd < 0)
+    {
+        NSError *error = [NSError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:nil];
+        id proxy = [[UKMainThreadProxy alloc] initWithTarget:[self delegate]];
+        [proxy connection:self uploadDidFinish:path error:error];
+        [proxy release];
+        return;
+    }
+    
+    // A chunk at a time, so memory use doesn't depend on the size of the file. read() rather than NSFileHandle, which
+    // raises on an I/O error instead of failing the upload
+    [self threaded_writeToPath:path permissions:permissions usingBlock:^BOOL(CK2SFTPFileHandle *handle, NSError **outError) {
+        
+        NSMutableData *buffer = [[NSMutableData alloc] initWithLength:CK2SFTPPreferredChunkSize];
+        
+        BOOL result = YES;
+        while (result)
+        {
+            ssize_t length = read(fd, [buffer mutableBytes], [buffer length]);
+            if (length < 0)
+            {
+                if (errno == EINTR) continue;
+                
+                if (outError) *outError = [NSError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:nil];
+                result = NO;
+                break;
+            }
+            if (length == 0) break;
+            
+            [[CKBandwidthLimiter sharedLimiter] waitToTransferLength:length];
+            
+            NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+            
+            NSData *data = [[NSData alloc] initWithBytesNoCopy:[buffer mutableBytes] length:length freeWhenDone:NO];
+            result = [handle writeData:data error:outError];
+            [data release];
+            
+            if (result) [[record mainThreadProxy] transfer:record transferredDataOfLength:length];
+            
+            if (!result && outError) [*outError retain];
+            [pool release];
+            if (!result && outError) [*outError autorelease];
+        }
+        
+        [buffer release];
+        return result;
+    }];
+    
+    close(fd);
+}
+
+- (void)threaded_writeToPath:(NSString *)path permissions:(NSNumber *)permissions usingBlock:(BOOL (^)(CK2SFTPFileHandle *handle, NSError **outError))block;
 {
     CK2SFTPSession *sftpSession = [self SFTPSession];
     NSAssert(sftpSession, @"Trying to write data without having started session");
@@ -205,7 +289,7 @@
     
     if (handle)
     {
-        BOOL result = [handle writeData:data error:&error];
+        BOOL result = block(handle, &error);
         [handle closeFile];         // don't really care if this fails
         
         if (result)
@@ -0,0 +1,60 @@
+//
+//  CKUploadManifest.h
+//  Connection
+//
+//  Copyright (c) 2012 Karelia Software. All rights reserved.
+//
+
+#import <Foundation/Foundation.h>
+
+
+typedef enum
+{
+    CKUploadManifestFileChanged,
+    CKUploadManifestFileUnchanged,
+    CKUploadManifestFileTouched,    // same size, different modification date. Only the content can tell
+} CKUploadManifestFileStatus;
+
+
+/*  What was last uploaded successfully to each path of one destination: size, modification date and SHA-1 of the
+ *  local file. Lets a publish skip files which haven't changed since.
+ *
+ *  Kept as a binary plist, plus a journal that each new entry is appended to so a crash loses at most the entry
+ *  being written. The journal is folded back into the plist by -synchronize, or once it grows long. Whoever owns the
+ *  manifest should call -synchronize: before letting go of it; nothing is written out on dealloc.
+ *
+ *  Safe to use from any thread.
+ */
+@interface CKUploadManifest : NSObject
+{
+  @private
+    NSURL               *_URL;
+    NSMutableDictionary *_entries;      // path -> [size, modification date interval, SHA-1]
+    int                 _journal;
+    NSUInteger          _journalCount;
+    dispatch_queue_t    _queue;
+    dispatch_group_t    _hashes;        // recordings still being hashed, off _queue
+    NSMutableDictionary *_pendingHashes;    // path -> token of the latest recording in flight
+}
+
+- (id)initWithURL:(NSURL *)URL;    // creates the manifest if there isn't one there yet
+
+// Size and modification date only, so cheap enough for the main thread
+- (CKUploadManifestFileStatus)statusOfFileAtURL:(NSURL *)URL uploadedToPath:(NSString *)path;
+
+// For touched files. Hashes the file, so keep it off the main thread. If the content's as uploaded, the entry takes
+// on the file's new modification date
+- (BOOL)isContentOfFileAtURL:(NSURL *)URL sameAsUploadToPath:(NSString *)path;
+
+// Size recorded for the path, or nil
+- (NSNumber *)sizeOfFileUploadedToPath:(NSString *)path;
+
+// Call once the file has been uploaded successfully, with the size and modification date it had when the upload was
+// queued. Hashing and writing happen in the background. Should the file have changed since, what's on the server
+// isn't what's on disk, so the path is forgotten instead
+- (void)recordUploadOfFileAtURL:(NSURL *)URL toPath:(NSString *)path size:(NSNumber *)size modificationDate:(NSDate *)date;
+- (void)removeEntryForPath:(NSString *)path;
+
+- (BOOL)synchronize:(NSError **)error;  // waits for pending entries and writes out the full manifest
+
+@end
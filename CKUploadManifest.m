@@ -0,0 +1,364 @@
+//
+//  CKUploadManifest.m
+//  Connection
+//
+//  Copyright (c) 2012 Karelia Software. All rights reserved.
+//
+
+#import "CKUploadManifest.h"
+
+#import <CommonCrypto/CommonDigest.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+
+#define CKUploadManifestVersion 1
+
+// Journal entries to collect before folding them into the manifest proper
+#define CKUploadManifestJournalLimit 4096
+
+
+@interface CKUploadManifest ()
+- (void)queue_appendToJournal:(NSArray *)record;
+- (BOOL)queue_synchronize:(NSError **)error;
+@end
+
+
+#pragma mark -
+
+
+@implementation CKUploadManifest
+
+#pragma mark Lifecycle
+
+- (id)initWithURL:(NSURL *)URL;
+{
+    NSParameterAssert([URL isFileURL]);
+    
+    if (self = [self init])
+    {
+        _URL = [URL copy];
+        _queue = dispatch_queue_create("com.karelia.connection.uploadmanifest", NULL);
+        _hashes = dispatch_group_create();
+        _pendingHashes = [[NSMutableDictionary alloc] init];
+        
+        
+        // Start from the last full write. Anything unreadable, or from another version, means starting over
+        NSData *data = [NSData dataWithContentsOfURL:_URL options:NSDataReadingMappedIfSafe error:NULL];
+        if (data)
+        {
+            NSDictionary *plist = [NSPropertyListSerialization propertyListWithData:data options:0 format:NULL error:NULL];
+            if ([plist isKindOfClass:[NSDictionary class]] &&
+                [[plist objectForKey:@"Version"] integerValue] == CKUploadManifestVersion)
+            {
+                _entries = [[plist objectForKey:@"Entries"] mutableCopy];
+            }
+        }
+        if (!_entries) _entries = [[NSMutableDictionary alloc] init];
+        
+        
+        // Then replay whatever's been journalled since. A record cut short by a crash ends it
+        NSURL *journalURL = [_URL URLByAppendingPathExtension:@"journal"];
+        NSData *journal = [NSData dataWithContentsOfURL:journalURL options:NSDataReadingMappedIfSafe error:NULL];
+        
+        const uint8_t *bytes = [journal bytes];
+        NSUInteger length = [journal length], offset = 0;
+        
+        while (offset + 4 <= length)
+        {
+            uint32_t recordLength = CFSwapInt32BigToHost(*(const uint32_t *)(bytes + offset));
+            if (recordLength > length - offset - 4) break;
+            
+            NSData *recordData = [[NSData alloc] initWithBytesNoCopy:(void *)(bytes + offset + 4) length:recordLength freeWhenDone:NO];
+            NSArray *record = [NSPropertyListSerialization propertyListWithData:recordData options:0 format:NULL error:NULL];
+            [recordData release];
+            
+            if (![record isKindOfClass:[NSArray class]] || ![record count]) break;
+            
+            if ([record count] == 4)
+            {
+                [_entries setObject:[record subarrayWithRange:NSMakeRange(1, 3)] forKey:[record objectAtIndex:0]];
+            }
+            else
+            {
+                [_entries removeObjectForKey:[record objectAtIndex:0]];
+            }
+            
+            offset += 4 + recordLength;
+            _journalCount++;
+        }
+        
+        
+        [[NSFileManager defaultManager] createDirectoryAtPath:[[_URL path] stringByDeletingLastPathComponent]
+                                  withIntermediateDirectories:YES
+                                                   attributes:nil
+                                                        error:NULL];
+        
+        _journal = open([[journalURL path] fileSystemRepresentation], O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (_journal >= 0) ftruncate(_journal, offset);   // drop any partial record so new ones line up
+    }
+    
+    return self;
+}
+
+// Pending blocks hold on to the manifest, so this can be running on _queue; synchronizing here would deadlock
+- (void)dealloc;
+{
+    if (_journal >= 0) close(_journal);
+    
+    [_URL release];
+    [_entries release];
+    [_pendingHashes release];
+    dispatch_release(_hashes);
+    dispatch_release(_queue);
+    
+    [super dealloc];
+}
+
+#pragma mark Entries
+
+static NSData *CKSHA1OfFileAtPath(NSString *path)
+{
+    int fd = open([path fileSystemRepresentation], O_RDONLY);
+    if (fd < 0) return nil;
+    
+    CC_SHA1_CTX context;
+    CC_SHA1_Init(&context);
+    
+    NSMutableData *buffer = [[NSMutableData alloc] initWithLength:1024*1024];
+    ssize_t length;
+    
+    while ((length = read(fd, [buffer mutableBytes], [buffer length])) != 0)
+    {
+        if (length < 0)
+        {
+            if (errno == EINTR) continue;
+            break;
+        }
+        CC_SHA1_Update(&context, [buffer bytes], (CC_LONG)length);
+    }
+    
+    [buffer release];
+    close(fd);
+    if (length < 0) return nil;
+    
+    unsigned char digest[CC_SHA1_DIGEST_LENGTH];
+    CC_SHA1_Final(digest, &context);
+    return [NSData dataWithBytes:digest length:CC_SHA1_DIGEST_LENGTH];
+}
+
+- (NSArray *)entryForPath:(NSString *)path;
+{
+    __block NSArray *result;
+    dispatch_sync(_queue, ^{
+        result = [[_entries objectForKey:path] retain];
+    });
+    return [result autorelease];
+}
+
+// URLs cache resource values, so a fresh one each time, or a file changed on disk meanwhile would look the same
+static BOOL CKGetSizeAndModificationDate(NSURL *URL, NSNumber **size, NSDate **modificationDate)
+{
+    URL = [NSURL fileURLWithPath:[URL path]];
+    return ([URL getResourceValue:size forKey:NSURLFileSizeKey error:NULL] &&
+            [URL getResourceValue:modificationDate forKey:NSURLContentModificationDateKey error:NULL] &&
+            *size && *modificationDate);
+}
+
+- (CKUploadManifestFileStatus)statusOfFileAtURL:(NSURL *)URL uploadedToPath:(NSString *)path;
+{
+    NSArray *entry = [self entryForPath:path];
+    if (!entry) return CKUploadManifestFileChanged;
+    
+    NSNumber *size;
+    NSDate *modificationDate;
+    if (!CKGetSizeAndModificationDate(URL, &size, &modificationDate)) return CKUploadManifestFileChanged;
+    
+    if (![size isEqualToNumber:[entry objectAtIndex:0]]) return CKUploadManifestFileChanged;
+    if ([modificationDate timeIntervalSinceReferenceDate] == [[entry objectAtIndex:1] doubleValue]) return CKUploadManifestFileUnchanged;
+    
+    return CKUploadManifestFileTouched;
+}
+
+- (BOOL)isContentOfFileAtURL:(NSURL *)URL sameAsUploadToPath:(NSString *)path;
+{
+    NSArray *entry = [self entryForPath:path];
+    if (!entry) return NO;
+    
+    // Dated before hashing, so a change made while hashing leaves it looking touched again next time
+    NSNumber *size;
+    NSDate *modificationDate;
+    if (!CKGetSizeAndModificationDate(URL, &size, &modificationDate)) return NO;
+    if (![size isEqualToNumber:[entry objectAtIndex:0]]) return NO;
+    
+    NSData *hash = CKSHA1OfFileAtPath([URL path]);
+    if (![hash isEqualToData:[entry objectAtIndex:2]]) return NO;
+    
+    NSArray *record = [NSArray arrayWithObjects:path, size, [NSNumber numberWithDouble:[modificationDate timeIntervalSinceReferenceDate]], hash, nil];
+    dispatch_async(_queue, ^{
+        [_pendingHashes removeObjectForKey:path];   // this is newer than any recording still hashing
+        [self queue_appendToJournal:record];
+    });
+    
+    return YES;
+}
+
+- (NSNumber *)sizeOfFileUploadedToPath:(NSString *)path;
+{
+    return [[self entryForPath:path] objectAtIndex:0];
+}
+
+- (void)recordUploadOfFileAtURL:(NSURL *)URL toPath:(NSString *)path size:(NSNumber *)size modificationDate:(NSDate *)date;
+{
+    URL = [[URL copy] autorelease];
+    path = [[path copy] autorelease];
+    NSNumber *modificationInterval = [NSNumber numberWithDouble:[date timeIntervalSinceReferenceDate]];
+    
+    dispatch_async(_queue, ^{
+        
+        // Uploads skipped after a content check were recorded by it already
+        NSArray *entry = [_entries objectForKey:path];
+        if ([[entry objectAtIndex:0] isEqualToNumber:size] && [[entry objectAtIndex:1] isEqualToNumber:modificationInterval]) return;
+        
+        // Hashing can take a while, and _queue is what -entryForPath: waits on, so it happens elsewhere. Anything asked
+        // of the path meanwhile replaces the token, which tells the result it's out of date
+        NSObject *token = [[NSObject alloc] init];
+        [_pendingHashes setObject:token forKey:path];
+        
+        dispatch_group_async(_hashes, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_LOW, 0), ^{
+            NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+            
+            // The hash has to be of what was uploaded, so the file must still be as it was when queued, both before and
+            // after hashing
+            NSNumber *currentSize;
+            NSDate *currentDate;
+            NSData *hash = nil;
+            
+            if (size && date &&
+                CKGetSizeAndModificationDate(URL, &currentSize, &currentDate) &&
+                [currentSize isEqualToNumber:size] && [currentDate isEqualToDate:date])
+            {
+                hash = CKSHA1OfFileAtPath([URL path]);
+                
+                if (!CKGetSizeAndModificationDate(URL, &currentSize, &currentDate) ||
+                    ![currentSize isEqualToNumber:size] || ![currentDate isEqualToDate:date])
+                {
+                    hash = nil;
+                }
+            }
+            
+            // Can't vouch for it without a hash, so make sure it's uploaded next time
+            NSArray *record = (hash ?
+                               [NSArray arrayWithObjects:path, size, modificationInterval, hash, nil] :
+                               [NSArray arrayWithObject:path]);
+            
+            dispatch_async(_queue, ^{
+                if ([_pendingHashes objectForKey:path] != token) return;
+                [_pendingHashes removeObjectForKey:path];
+                [self queue_appendToJournal:record];
+            });
+            
+            [pool release];
+        });
+        
+        [token release];
+    });
+}
+
+- (void)removeEntryForPath:(NSString *)path;
+{
+    path = [[path copy] autorelease];
+    
+    dispatch_async(_queue, ^{
+        [_pendingHashes removeObjectForKey:path];
+        [self queue_appendToJournal:[NSArray arrayWithObject:path]];
+    });
+}
+
+#pragma mark Storage
+
+- (void)queue_appendToJournal:(NSArray *)record;
+{
+    if ([record count] == 4)
+    {
+        [_entries setObject:[record subarrayWithRange:NSMakeRange(1, 3)] forKey:[record objectAtIndex:0]];
+    }
+    else
+    {
+        if (![_entries objectForKey:[record objectAtIndex:0]]) return;
+        [_entries removeObjectForKey:[record objectAtIndex:0]];
+    }
+    
+    if (_journal < 0) return;   // still correct in memory; -synchronize writes it out
+    
+    
+    NSData *data = [NSPropertyListSerialization dataWithPropertyList:record
+                                                              format:NSPropertyListBinaryFormat_v1_0
+                                                             options:0
+                                                               error:NULL];
+    
+    // Length and record go out in a single write, so a crash can only ever cut the last one short
+    uint32_t length = CFSwapInt32HostToBig((uint32_t)[data length]);
+    NSMutableData *buffer = [[NSMutableData alloc] initWithBytes:&length length:sizeof(length)];
+    [buffer appendData:data];
+    ssize_t expected = [buffer length];
+    ssize_t written = write(_journal, [buffer bytes], expected);
+    [buffer release];
+    
+    // Out of space or the like. Later records can't go after a torn one, so stop journalling; the entries are still
+    // right in memory for -synchronize to write out in full
+    if (written != expected)
+    {
+        NSLog(@"Upload manifest journal write failed: %s", (written < 0 ? strerror(errno) : "short write"));
+        close(_journal);
+        _journal = -1;
+        return;
+    }
+    
+    if (++_journalCount >= CKUploadManifestJournalLimit) [self queue_synchronize:NULL];
+}
+
+- (BOOL)queue_synchronize:(NSError **)error;
+{
+    NSDictionary *plist = [NSDictionary dictionaryWithObjectsAndKeys:
+                           [NSNumber numberWithInteger:CKUploadManifestVersion], @"Version",
+                           _entries, @"Entries",
+                           nil];
+    
+    NSData *data = [NSPropertyListSerialization dataWithPropertyList:plist
+                                                              format:NSPropertyListBinaryFormat_v1_0
+                                                             options:0
+                                                               error:error];
+    
+    // The journal only goes once the new manifest is safely in place; replaying it over that is harmless
+    BOOL result = [data writeToURL:_URL options:NSDataWritingAtomic error:error];
+    if (result && _journal >= 0)
+    {
+        ftruncate(_journal, 0);
+        _journalCount = 0;
+    }
+    
+    return result;
+}
+
+- (BOOL)synchronize:(NSError **)error;
+{
+    __block BOOL result;
+    __block NSError *blockError = nil;
+    
+    // Let recordings already on _queue start hashing, then wait for them to land back there
+    dispatch_sync(_queue, ^{ });
+    dispatch_group_wait(_hashes, DISPATCH_TIME_FOREVER);
+    
+    dispatch_sync(_queue, ^{
+        result = [self queue_synchronize:&blockError];
+        [blockError retain];
+    });
+    
+    if (error) *error = blockError;
+    [blockError autorelease];
+    return result;
+}
+
+@end
@@ -15,11 +15,13 @@
 enum {
     CKUploadingDeleteExistingFileFirst = 1 << 0,
     CKUploadingDryRun = 1 << 1,
+    CKUploadingVerifyManifest = 1 << 2,     // only skip unchanged files the server can be seen to still have
 };
 typedef NSUInteger CKUploadingOptions;
 
 
 @protocol CKUploaderDelegate;
+@class CKUploadManifest, CKBandwidthLimiter;
 
 
 @interface CKUploader : NSObject
@@ -34,6 +36,14 @@ typedef NSUInteger CKUploadingOptions;
     CKTransferRecord            *_baseRecord;
     BOOL                        _hasUploads;
     
+    NSURL               *_manifestURL;
+    CKUploadManifest    *_manifest;
+    NSMapTable          *_manifestUploads;  // record -> [file URL, path, size, date when queued] for uploads to note once they succeed
+    
+    NSSet   *_filenamesToUploadLast;
+    
+    CKBandwidthLimiter  *_bandwidthLimiter;
+    
     id <CKUploaderDelegate> _delegate;
 }
 
@@ -45,6 +55,18 @@ typedef NSUInteger CKUploadingOptions;
 @property (nonatomic, assign, readonly) CKUploadingOptions options;
 @property (nonatomic, assign) id <CKUploaderDelegate> delegate;
 
+// Set before uploading to skip files which haven't changed since they were last uploaded to the same path. Use one
+// manifest per destination. Skipped files get a finished transfer record which isn't added to the tree
+@property (nonatomic, copy) NSURL *manifestURL;
+
+// Files with these names (e.g. index.html) are held back until everything else has been uploaded, so pages never link
+// to things that aren't there yet. Only uploaders which work in parallel need this; the rest go in the order called
+@property (nonatomic, copy) NSSet *filenamesToUploadLast;
+
+// Unlimited until given a rate. Uploads count against +[CKBandwidthLimiter sharedLimiter] too. WebDAV uploads aren't
+// limited, since the whole body goes to the system in one go
+@property (nonatomic, retain, readonly) CKBandwidthLimiter *bandwidthLimiter;
+
 - (CKTransferRecord *)uploadFileAtURL:(NSURL *)url toPath:(NSString *)path;
 - (CKTransferRecord *)uploadData:(NSData *)data toPath:(NSString *)path;
 - (void)removeFileAtPath:(NSString *)path;
@@ -7,6 +7,8 @@
 //
 
 #import "CKUploader.h"
+#import "CKUploadManifest.h"
+#import "CKBandwidthLimiter.h"
 
 #import "CKConnectionRegistry.h"
 #import "UKMainThreadProxy.h"
@@ -17,20 +19,75 @@
 
 #import "NSInvocation+Connection.h"
 
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <copyfile.h>
+
+#if MAC_OS_X_VERSION_MAX_ALLOWED >= 101200
+#include <sys/clonefile.h>
+#define CK_HAVE_CLONEFILE 1
+#endif
+
+
+@interface CKUploader ()
+@property(nonatomic, retain, readonly) CKUploadManifest *manifest;
+- (CKUploadManifestFileStatus)manifestStatusOfFileAtURL:(NSURL *)url toPath:(NSString *)path;
+- (BOOL)shouldSkipUploadOfFileAtURL:(NSURL *)url toPath:(NSString *)path;
+- (BOOL)threaded_shouldSkipUploadOfFileAtURL:(NSURL *)url toPath:(NSString *)path;
+- (CKTransferRecord *)recordForSkippedUploadOfFileAtURL:(NSURL *)url toPath:(NSString *)path;
+- (void)noteUploadOfFileAtURL:(NSURL *)url toPath:(NSString *)path transferRecord:(CKTransferRecord *)record;
+- (void)noteRemovalOfFileAtPath:(NSString *)path;
+@end
+
+
+#pragma mark -
+
 
 @interface CKSFTPUploader : CKUploader <CK2SFTPSessionDelegate, NSURLAuthenticationChallengeSender>
 {
 @private
+    NSURL               *_URL;
     CK2SFTPSession      *_session;
     NSOperationQueue    *_queue;
     NSOperationQueue    *_startupQueue;
     
+    // Pool of connected sessions; _session is the first of them and handles authentication for the rest
+    NSMutableArray      *_sessions;
+    NSMutableArray      *_idleSessions;
+    NSCondition         *_idleSessionsCondition;
+    NSCondition         *_directoryLock;        // only ever held for bookkeeping, never across a round trip
+    NSURLCredential     *_credential;
+    BOOL                _continuedWithoutCredential;    // the primary session got in with the key or agent instead
+    NSData              *_hostKeyFingerprint;   // what the primary session connected to; the rest must match it
+    
+    NSMutableDictionary *_removalOperations;
+    NSMutableDictionary *_directoryOperations;  // mkdirs planned so far, by path
+    NSMutableSet        *_knownDirectories;     // created or found to exist, guarded by _directoryLock
+    NSMutableDictionary *_existingAttributes;   // directory path -> filename -> attributes of what was there, guarded likewise
+    NSMutableSet        *_removedPaths;         // queued for deletion, so whatever was listed there doesn't count. Guarded likewise
+    NSMutableSet        *_creatingDirectories;  // being made by an upload which found them missing. Guarded likewise
+    
+    NSMutableArray      *_largeUploadLanes;     // the last large upload queued on each lane
+    NSUInteger          _largeUploadCount;
+    NSMutableArray      *_deferredUploads;      // held back for -filenamesToUploadLast
+    
     NSURLAuthenticationChallenge    *_challenge;
     NSURLAuthenticationChallenge    *_mainThreadChallenge;
 }
 
 @property(nonatomic, retain, readonly) CK2SFTPSession *SFTPSession;
 
+// Each upload borrows a session for its duration. Blocks until one is free
+- (CK2SFTPSession *)threaded_checkOutSession;  // nil once there are no sessions left to wait for
+- (void)threaded_checkInSession:(CK2SFTPSession *)session;
+- (void)threaded_replaceSession:(CK2SFTPSession *)session;  // instead of checking in one whose connection has failed
+
+- (CK2SFTPFileHandle *)threaded_openHandleAtPath:(NSString *)path session:(CK2SFTPSession *)sftpSession error:(NSError **)outError;
+- (CK2SFTPFileHandle *)threaded_openHandleAtPath:(NSString *)path flags:(unsigned long)flags session:(CK2SFTPSession *)sftpSession error:(NSError **)outError;
+- (NSNumber *)threaded_sizeOfItemAtPath:(NSString *)path session:(CK2SFTPSession *)sftpSession;
+- (BOOL)threaded_setPermissions:(unsigned long)mode forItemAtPath:(NSString *)path session:(CK2SFTPSession *)sftpSession error:(NSError **)outError;
+- (NSDictionary *)threaded_attributesOfExistingItemAtPath:(NSString *)path;
+
 @end
 
 
@@ -67,6 +124,8 @@
     NSOutputStream      *_writingStream;
     NSInputStream       *_inputStream;
     NSMutableData       *_buffer;
+    NSUInteger          _bufferStart;   // bytes of the buffer already written out
+    NSUInteger          _bufferEnd;     // bytes of the buffer filled from the input stream
     NSURL               *_URLForWritingTo;
 }
 
@@ -94,6 +153,8 @@
         
         _rootRecord = [[CKTransferRecord rootRecordWithPath:[[request URL] path]] retain];
         _baseRecord = [_rootRecord retain];
+        
+        _bandwidthLimiter = [[CKBandwidthLimiter alloc] initWithRate:0 burst:0 parent:[CKBandwidthLimiter sharedLimiter]];
     }
     return self;
 }
@@ -132,7 +193,14 @@
 - (void)dealloc
 {
     [_connection setDelegate:nil];
-    
+    [[NSNotificationCenter defaultCenter] removeObserver:self name:CKTransferRecordTransferDidFinishNotification object:nil];
+    
+    [_manifestURL release];
+    [_manifest synchronize:NULL];
+    [_manifest release];
+    [_manifestUploads release];
+    [_filenamesToUploadLast release];
+    [_bandwidthLimiter release];
     [_request release];
     [_connection release];
     [_rootRecord release];
@@ -146,6 +214,8 @@
 @synthesize delegate = _delegate;
 
 @synthesize options = _options;
+@synthesize filenamesToUploadLast = _filenamesToUploadLast;
+@synthesize bandwidthLimiter = _bandwidthLimiter;
 @synthesize rootTransferRecord = _rootRecord;
 @synthesize baseTransferRecord = _baseRecord;
 
@@ -224,6 +294,7 @@
 
 - (void)removeFileAtPath:(NSString *)path;
 {
+    [self noteRemovalOfFileAtPath:path];
     [_connection deleteFile:path];
 }
 
@@ -252,6 +323,8 @@
 
 - (CKTransferRecord *)uploadFileAtURL:(NSURL *)url toPath:(NSString *)path;
 {
+    if ([self shouldSkipUploadOfFileAtURL:url toPath:path]) return [self recordForSkippedUploadOfFileAtURL:url toPath:path];
+    
     [self willUploadToPath:path];
     
     CKTransferRecord *result = [_connection uploadFileAtURL:url
@@ -259,6 +332,7 @@
                                     openingPosixPermissions:[self posixPermissionsForPath:path isDirectory:NO]];
     
     [self didEnqueueUpload:result toPath:path];
+    [self noteUploadOfFileAtURL:url toPath:path transferRecord:result];
     return result;
 }
 
@@ -278,6 +352,142 @@
     [_connection setDelegate:nil];
 }
 
+#pragma mark Manifest
+
+@synthesize manifestURL = _manifestURL;
+@synthesize manifest = _manifest;
+
+- (void)setManifestURL:(NSURL *)URL;
+{
+    URL = [URL copy];
+    [_manifestURL release]; _manifestURL = URL;
+    
+    [_manifest synchronize:NULL];
+    [_manifest release]; _manifest = (URL ? [[CKUploadManifest alloc] initWithURL:URL] : nil);
+}
+
+- (CKUploadManifestFileStatus)manifestStatusOfFileAtURL:(NSURL *)url toPath:(NSString *)path;
+{
+    if (!_manifest || ![url isFileURL]) return CKUploadManifestFileChanged;
+    return [_manifest statusOfFileAtURL:url uploadedToPath:path];
+}
+
+/*  Subclasses which can check cheaply whether the server still has the file override this for
+ *  CKUploadingVerifyManifest. Otherwise nothing is skipped in that mode
+ */
+- (BOOL)hasFileOfSize:(NSNumber *)size atPath:(NSString *)path;
+{
+    return NO;
+}
+
+// Touched files need hashing to be sure, which is left to the upload itself; see below
+- (BOOL)shouldSkipUploadOfFileAtURL:(NSURL *)url toPath:(NSString *)path;
+{
+    if ([self manifestStatusOfFileAtURL:url toPath:path] != CKUploadManifestFileUnchanged) return NO;
+    if (!(_options & CKUploadingVerifyManifest)) return YES;
+    
+    return [self hasFileOfSize:[_manifest sizeOfFileUploadedToPath:path] atPath:path];
+}
+
+// For upload operations to call before sending anything. Hashes touched files, so never on the main thread
+- (BOOL)threaded_shouldSkipUploadOfFileAtURL:(NSURL *)url toPath:(NSString *)path;
+{
+    switch ([self manifestStatusOfFileAtURL:url toPath:path])
+    {
+        case CKUploadManifestFileUnchanged:
+            break;
+        case CKUploadManifestFileTouched:
+            if (![_manifest isContentOfFileAtURL:url sameAsUploadToPath:path]) return NO;
+            break;
+        default:
+            return NO;
+    }
+    
+    if (!(_options & CKUploadingVerifyManifest)) return YES;
+    return [self hasFileOfSize:[_manifest sizeOfFileUploadedToPath:path] atPath:path];
+}
+
+- (CKTransferRecord *)recordForSkippedUploadOfFileAtURL:(NSURL *)url toPath:(NSString *)path;
+{
+    CKTransferRecord *result = [CKTransferRecord recordWithName:[path lastPathComponent]
+                                                           size:[[_manifest sizeOfFileUploadedToPath:path] unsignedLongLongValue]];
+    [result transferDidFinish:result error:nil];
+    return result;
+}
+
+- (void)noteUploadOfFileAtURL:(NSURL *)url toPath:(NSString *)path transferRecord:(CKTransferRecord *)record;
+{
+    if (!_manifest || !record || ![url isFileURL] || (_options & CKUploadingDryRun)) return;
+    
+    // What gets recorded is the file as it is now. A fresh URL, since resource values are cached
+    NSURL *fileURL = [NSURL fileURLWithPath:[url path]];
+    NSNumber *size;
+    NSDate *modificationDate;
+    if (![fileURL getResourceValue:&size forKey:NSURLFileSizeKey error:NULL] || !size ||
+        ![fileURL getResourceValue:&modificationDate forKey:NSURLContentModificationDateKey error:NULL] || !modificationDate)
+    {
+        [_manifest removeEntryForPath:path];
+        return;
+    }
+    
+    if (!_manifestUploads) _manifestUploads = [[NSMapTable mapTableWithStrongToStrongObjects] retain];
+    [_manifestUploads setObject:[NSArray arrayWithObjects:url, path, size, modificationDate, nil] forKey:record];
+    
+    [[NSNotificationCenter defaultCenter] addObserver:self
+                                             selector:@selector(manifestUploadDidFinish:)
+                                                 name:CKTransferRecordTransferDidFinishNotification
+                                               object:record];
+}
+
+- (void)manifestUploadDidFinish:(NSNotification *)notification;
+{
+    CKTransferRecord *record = [notification object];
+    NSArray *upload = [_manifestUploads objectForKey:record];
+    if (!upload) return;
+    
+    // A failed or cancelled upload may have left a partial file behind, so forget the old one too. Only a
+    // transfer which delivered every byte noted at the start counts as done
+    if ([record error] || [record transferred] != [[upload objectAtIndex:2] unsignedLongLongValue])
+    {
+        [_manifest removeEntryForPath:[upload objectAtIndex:1]];
+    }
+    else
+    {
+        [_manifest recordUploadOfFileAtURL:[upload objectAtIndex:0]
+                                    toPath:[upload objectAtIndex:1]
+                                      size:[upload objectAtIndex:2]
+                          modificationDate:[upload objectAtIndex:3]];
+    }
+    
+    [[NSNotificationCenter defaultCenter] removeObserver:self name:CKTransferRecordTransferDidFinishNotification object:record];
+    [_manifestUploads removeObjectForKey:record];
+}
+
+- (void)noteRemovalOfFileAtPath:(NSString *)path;
+{
+    [_manifest removeEntryForPath:path];
+}
+
+#pragma mark Retrying
+
+// Uploads which fail because the connection did are tried this many more times before giving up
+#define CKUploaderMaxRetries 5
+
+// Sits out the backoff before the given retry, counting from 0: 1s, 2s, 4s and so on. NO as soon as the block says
+// the upload has been cancelled
+static BOOL CKUploaderWaitToRetry(NSUInteger retry, BOOL (^isCancelled)(void))
+{
+    NSDate *date = [NSDate dateWithTimeIntervalSinceNow:(1 << retry)];
+    
+    while ([date timeIntervalSinceNow] > 0)
+    {
+        if (isCancelled()) return NO;
+        [NSThread sleepForTimeInterval:MIN(0.25, [date timeIntervalSinceNow])];
+    }
+    
+    return !isCancelled();
+}
+
 #pragma mark Connection Delegate
 
 - (void)connection:(id <CKPublishingConnection>)con didDisconnectFromHost:(NSString *)host;
@@ -395,10 +605,40 @@
     NSString            *_path;
     CKSFTPUploader      *_engine;
     CKTransferRecord    *_record;
+    BOOL                _checksManifest;
 }
 
 - (id)initWithURL:(NSURL *)URL path:(NSString *)path uploader:(CKSFTPUploader *)uploader transferRecord:(CKTransferRecord *)record;
 
+// Whether the manifest might let the upload be skipped, once the file's been hashed or the server checked
+@property(nonatomic) BOOL checksManifest;
+
+@end
+
+
+#pragma mark -
+
+
+/*  Hands out a file front to back, pread() into one reused buffer with the kernel asked to read ahead of it. Each
+ *  slice is only good until the next read, or -closeFile. A file that changes size partway through fails the read.
+ *  Not mapped, since a file cut short while a slice of the mapping is still being sent takes the app down with SIGBUS
+ */
+@interface CKSequentialFileReader : NSObject
+{
+@private
+    int             _fd;
+    off_t           _size;
+    off_t           _offset;        // next byte to hand out
+    
+    NSMutableData   *_buffer;
+}
+
+- (id)initWithPath:(NSString *)path;
+- (NSData *)readDataOfLength:(NSUInteger)length error:(NSError **)outError;   // empty at the end of the file
+- (void)seekToFileOffset:(unsigned long long)offset;
+- (unsigned long long)fileSize;
+- (void)closeFile;
+
 @end
 
 
@@ -407,6 +647,12 @@
 
 @implementation CKSFTPUploader
 
+// How many SFTP sessions to publish over at once. Override with the CKSFTPUploaderSessionCount default
+#define CKSFTPUploaderDefaultSessionCount 4
+
+// Uploads at least this big are large, and kept off one session so small files don't queue up behind them
+#define CKSFTPUploaderLargeFileSize (1024 * 1024)
+
 #pragma mark Lifecycle
 
 - (id)initWithRequest:(NSURLRequest *)request filePosixPermissions:(unsigned long)customPermissions options:(CKUploadingOptions)options;
@@ -416,11 +662,28 @@
         // HACK clear out super's connection ref
         [self setValue:nil forKey:@"connection"];
         
+        _URL = [[request URL] copy];
+        
+        // Concurrency grows by one as each session in the pool comes up
         _queue = [[NSOperationQueue alloc] init];
         [_queue setMaxConcurrentOperationCount:1];
         [_queue setSuspended:YES];  // we'll resume once authenticated
         
-        _session = [[CK2SFTPSession alloc] initWithURL:[request URL] delegate:self startImmediately:NO];
+        _sessions = [[NSMutableArray alloc] init];
+        _idleSessions = [[NSMutableArray alloc] init];
+        _idleSessionsCondition = [[NSCondition alloc] init];
+        _directoryLock = [[NSCondition alloc] init];
+        _removalOperations = [[NSMutableDictionary alloc] init];
+        _directoryOperations = [[NSMutableDictionary alloc] init];
+        _knownDirectories = [[NSMutableSet alloc] init];
+        _existingAttributes = [[NSMutableDictionary alloc] init];
+        _removedPaths = [[NSMutableSet alloc] init];
+        _creatingDirectories = [[NSMutableSet alloc] init];
+        _largeUploadLanes = [[NSMutableArray alloc] init];
+        _deferredUploads = [[NSMutableArray alloc] init];
+        
+        _session = [[CK2SFTPSession alloc] initWithURL:_URL delegate:self startImmediately:NO];
+        [_sessions addObject:_session];
     }
     
     return self;
@@ -431,6 +694,19 @@
     [super finishUploading];
     
     
+    // Held back uploads can go now, once everything else has
+    NSArray *others = [_queue operations];
+    for (NSOperation *anOp in _deferredUploads)
+    {
+        for (NSOperation *other in others)
+        {
+            [anOp addDependency:other];
+        }
+        [_queue addOperation:anOp];
+    }
+    [_deferredUploads removeAllObjects];
+    
+    
     // Disconnect once all else is done
     NSOperation *closeOp = [[NSInvocationOperation alloc] initWithTarget:self
                                                                 selector:@selector(threaded_finish)
@@ -447,11 +723,20 @@
     
 }
 
+- (void)threaded_cancelSessions;
+{
+    [_idleSessionsCondition lock];
+    NSArray *sessions = [[_sessions copy] autorelease];
+    [_idleSessionsCondition unlock];
+    
+    [sessions makeObjectsPerformSelector:@selector(cancel)];
+}
+
 - (void)threaded_finish;
 {
     [[(id)[self delegate] mainThreadProxy] uploaderDidFinishUploading:self];
     
-    [_session cancel];
+    [self threaded_cancelSessions];
     [_session release]; _session = nil;
 }
 
@@ -460,9 +745,9 @@
     // Stop any pending ops
     [_queue cancelAllOperations];
     
-    // Close the connection as quick as possible
-    NSOperation *closeOp = [[NSInvocationOperation alloc] initWithTarget:[self SFTPSession]
-                                                                selector:@selector(cancel)
+    // Close the connections as quick as possible
+    NSOperation *closeOp = [[NSInvocationOperation alloc] initWithTarget:self
+                                                                selector:@selector(threaded_cancelSessions)
                                                                   object:nil];
     
     [closeOp setQueuePriority:NSOperationQueuePriorityVeryHigh];
@@ -476,13 +761,118 @@
 
 - (void)dealloc;
 {
+    [_URL release];
     [_session release];
     [_queue release];
     [_startupQueue release];
+    [_sessions release];
+    [_idleSessions release];
+    [_idleSessionsCondition release];
+    [_directoryLock release];
+    [_credential release];
+    [_hostKeyFingerprint release];
+    [_removalOperations release];
+    [_directoryOperations release];
+    [_knownDirectories release];
+    [_existingAttributes release];
+    [_removedPaths release];
+    [_creatingDirectories release];
+    [_largeUploadLanes release];
+    [_deferredUploads release];
     
     [super dealloc];
 }
 
+#pragma mark Session Pool
+
+- (CK2SFTPSession *)threaded_checkOutSession;
+{
+    [_idleSessionsCondition lock];
+    
+    // The queue never runs more uploads than there are sessions, so this shouldn't have to wait long
+    while (![_idleSessions count] && [_sessions count])
+    {
+        [_idleSessionsCondition wait];
+    }
+    
+    CK2SFTPSession *result = [[[_idleSessions lastObject] retain] autorelease];
+    [_idleSessions removeLastObject];
+    
+    [_idleSessionsCondition unlock];
+    
+    return result;
+}
+
+- (void)threaded_checkInSession:(CK2SFTPSession *)session;
+{
+    if (!session) return;
+    
+    [_idleSessionsCondition lock];
+    if ([_sessions containsObject:session]) // might have failed while in use
+    {
+        [_idleSessions addObject:session];
+        [_idleSessionsCondition signal];
+    }
+    [_idleSessionsCondition unlock];
+}
+
+// What to fail with when -threaded_checkOutSession comes back empty handed, as it does once every session has failed
+static NSError *CKSFTPNoSessionError(void)
+{
+    return [NSError errorWithDomain:NSURLErrorDomain code:NSURLErrorNotConnectedToInternet userInfo:nil];
+}
+
+- (void)threaded_replaceSession:(CK2SFTPSession *)session;
+{
+    if (!session) return;
+    
+    [[session retain] autorelease];
+    
+    // Out of the pool first, so its failure callback knows not to treat it as fatal. Concurrency comes back once
+    // the replacement is up
+    [_idleSessionsCondition lock];
+    [_sessions removeObjectIdenticalTo:session];
+    [_idleSessions removeObjectIdenticalTo:session];
+    if ([_queue maxConcurrentOperationCount] > 1) [_queue setMaxConcurrentOperationCount:[_queue maxConcurrentOperationCount] - 1];
+    
+    CK2SFTPSession *replacement = [[CK2SFTPSession alloc] initWithURL:_URL delegate:self startImmediately:NO];
+    [_sessions addObject:replacement];
+    [_idleSessionsCondition unlock];
+    
+    [session cancel];
+    
+    NSOperation *op = [[NSInvocationOperation alloc] initWithTarget:replacement selector:@selector(start) object:nil];
+    [_startupQueue addOperation:op];
+    [op release];
+    [replacement release];
+}
+
+- (NSInteger)sessionCount;
+{
+    NSInteger result = [[NSUserDefaults standardUserDefaults] integerForKey:@"CKSFTPUploaderSessionCount"];
+    if (result <= 0) result = CKSFTPUploaderDefaultSessionCount;
+    return result;
+}
+
+- (void)startAdditionalSessions;
+{
+    NSInteger count = [self sessionCount];
+    
+    for (NSInteger i = 1; i < count; i++)
+    {
+        CK2SFTPSession *session = [[CK2SFTPSession alloc] initWithURL:_URL delegate:self startImmediately:NO];
+        
+        [_idleSessionsCondition lock];
+        [_sessions addObject:session];
+        [_idleSessionsCondition unlock];
+        
+        NSOperation *op = [[NSInvocationOperation alloc] initWithTarget:session selector:@selector(start) object:nil];
+        [_startupQueue addOperation:op];
+        [op release];
+        [session release];
+    }
+}
+
 #pragma mark Upload
 
 - (void)didEnqueueUpload:(CKTransferRecord *)record toPath:(NSString *)path
@@ -498,6 +888,103 @@
     [super didEnqueueUpload:record toPath:path];
 }
 
+// Only the publish's own directories are worth creating or listing. Those above it, the likes of /home on a shared
+// host, are there already, can be huge, and are never uploaded into
+- (BOOL)isWithinBasePath:(NSString *)path;
+{
+    NSString *base = [_URL path];
+    if (![base length] || [base isEqualToString:@"/"]) return YES;
+    
+    return ([path isEqualToString:base] || [path hasPrefix:[base stringByAppendingString:@"/"]]);
+}
+
+/*  Plans a mkdir for each directory of the publish the first time an upload needs it. Super works up from the root, so
+ *  parents are always planned first and each mkdir waits on its parent's. They run ahead of uploads, spread across the
+ *  pool. Should the base directory's own parents turn out to be missing, the first upload creates them.
+ */
+- (CKTransferRecord *)createDirectoryAtPath:(NSString *)path;
+{
+    CKTransferRecord *result = [super createDirectoryAtPath:path];
+    
+    if (result != [self rootTransferRecord] &&
+        [self isWithinBasePath:path] &&
+        ![_directoryOperations objectForKey:path] &&
+        !([self options] & CKUploadingDryRun))
+    {
+        NSOperation *op = [NSBlockOperation blockOperationWithBlock:^{
+            [self threaded_makeDirectoryAtPath:path];
+        }];
+        [op setQueuePriority:NSOperationQueuePriorityHigh];
+        
+        NSOperation *parentOp = [_directoryOperations objectForKey:[path stringByDeletingLastPathComponent]];
+        if (parentOp) [op addDependency:parentOp];
+        
+        [_directoryOperations setObject:op forKey:path];
+        [_queue addOperation:op];
+    }
+    
+    return result;
+}
+
+- (BOOL)shouldUploadLast:(NSString *)path;
+{
+    return [[self filenamesToUploadLast] containsObject:[path lastPathComponent]];
+}
+
+/*  Large files take turns on lanes, one fewer than there are sessions, each waiting on the last one queued on its lane.
+ *  Until its turn comes it isn't ready, so doesn't tie up a place in the queue, and small files always have a session
+ *  to themselves. Where the two are both ready, small files go first.
+ */
+- (void)addUploadOperation:(NSOperation *)op toPath:(NSString *)path size:(unsigned long long)size;
+{
+    // Held back uploads stay off the lanes, else whatever came after them on the lane would be held back too
+    if (size >= CKSFTPUploaderLargeFileSize && ![self shouldUploadLast:path])
+    {
+        NSUInteger laneCount = MAX([self sessionCount] - 1, 1);
+        NSUInteger lane = _largeUploadCount++ % laneCount;
+        
+        if (lane < [_largeUploadLanes count])
+        {
+            [op addDependency:[_largeUploadLanes objectAtIndex:lane]];
+            [_largeUploadLanes replaceObjectAtIndex:lane withObject:op];
+        }
+        else
+        {
+            [_largeUploadLanes addObject:op];
+        }
+        
+        [op setQueuePriority:NSOperationQueuePriorityLow];
+    }
+    
+    [self addUploadOperation:op toPath:path];
+}
+
+- (void)addUploadOperation:(NSOperation *)op toPath:(NSString *)path;
+{
+    // Uploads run in parallel, so make sure a deletion requested for this path goes first
+    NSOperation *removal = [_removalOperations objectForKey:path];
+    if (removal)
+    {
+        [op addDependency:removal];
+        [_removalOperations removeObjectForKey:path];
+    }
+    
+    // And that the parent directory has been seen to
+    NSString *directoryPath = [path stringByDeletingLastPathComponent];
+    [self createDirectoryAtPath:directoryPath];
+    NSOperation *mkdir = [_directoryOperations objectForKey:directoryPath];
+    if (mkdir) [op addDependency:mkdir];
+    
+    if ([self shouldUploadLast:path])
+    {
+        [_deferredUploads addObject:op];    // queued by -finishUploading
+    }
+    else
+    {
+        [_queue addOperation:op];
+    }
+}
+
 - (CKTransferRecord *)uploadData:(NSData *)data toPath:(NSString *)path;
 {
     CKTransferRecord *result = nil;
@@ -512,7 +999,7 @@
                                                               arguments:[NSArray arrayWithObjects:data, path, result, nil]];
         
         NSInvocationOperation *op = [[NSInvocationOperation alloc] initWithInvocation:invocation];
-        [_queue addOperation:op];
+        [self addUploadOperation:op toPath:path size:[data length]];
         [op release];
         
         
@@ -528,6 +1015,14 @@
     // Cheat and send non-file URLs direct
     if (![localURL isFileURL]) return [self uploadData:[NSData dataWithContentsOfURL:localURL] toPath:path];
     
+    // Verifying against the server has to wait until the parent directory has been listed, and hashing touched files
+    // is for the operation too
+    CKUploadManifestFileStatus status = [self manifestStatusOfFileAtURL:localURL toPath:path];
+    if (status == CKUploadManifestFileUnchanged && !([self options] & CKUploadingVerifyManifest))
+    {
+        return [self recordForSkippedUploadOfFileAtURL:localURL toPath:path];
+    }
+    
     
     CKTransferRecord *result = nil;
     
@@ -545,9 +1040,13 @@
                                                                                         path:path
                                                                                     uploader:self
                                                                               transferRecord:result];
-            [_queue addOperation:op];
+            if (status != CKUploadManifestFileChanged) [op setChecksManifest:YES];
+            
+            [self addUploadOperation:op toPath:path size:[size unsignedLongLongValue]];
             [op release];
             
+            [self noteUploadOfFileAtURL:localURL toPath:path transferRecord:result];
+            
             
             
         }
@@ -558,18 +1057,214 @@
 
 - (void)removeFileAtPath:(NSString *)path;
 {
-    [_queue addOperationWithBlock:^{
-        [[self SFTPSession] removeFileAtPath:path error:NULL];
+    [self noteRemovalOfFileAtPath:path];
+    
+    // Whatever the directory listing says was there is about to go, so its mode mustn't stand in for the new file's
+    [_directoryLock lock];
+    [_removedPaths addObject:path];
+    [_directoryLock unlock];
+    
+    NSOperation *op = [NSBlockOperation blockOperationWithBlock:^{
+        CK2SFTPSession *session = [self threaded_checkOutSession];
+        [session removeFileAtPath:path error:NULL];
+        [self threaded_checkInSession:session];
     }];
+    
+    [_removalOperations setObject:op forKey:path];
+    [_queue addOperation:op];
+}
+
+- (BOOL)threaded_isKnownDirectory:(NSString *)path;
+{
+    [_directoryLock lock];
+    BOOL result = [_knownDirectories containsObject:path];
+    [_directoryLock unlock];
+    
+    return result;
+}
+
+- (void)threaded_addKnownDirectory:(NSString *)path;
+{
+    [_directoryLock lock];
+    while (![path isEqualToString:@"/"] && ![path isEqualToString:@""] && ![_knownDirectories containsObject:path])
+    {
+        [_knownDirectories addObject:path];
+        path = [path stringByDeletingLastPathComponent];    // an existing directory implies its parents
+    }
+    [_directoryLock unlock];
+}
+
+- (void)threaded_makeDirectoryAtPath:(NSString *)path;
+{
+    if ([self threaded_isKnownDirectory:path]) return;
+    
+    
+    CK2SFTPSession *sftpSession = [self threaded_checkOutSession];
+    if (!sftpSession) return;   // uploads into it will fail for the same reason, and report it
+    
+    NSError *error = nil;
+    BOOL result = [sftpSession createDirectoryAtPath:path
+                         withIntermediateDirectories:NO
+                                                mode:[self posixPermissionsForPath:path isDirectory:YES]
+                                               error:&error];
+    
+    // Note the attributes of whatever's already in there. One listing per directory is much cheaper than a SETSTAT per file
+    NSMutableDictionary *existing = [NSMutableDictionary dictionary];
+    BOOL exists = (!result && [[error domain] isEqualToString:CK2LibSSH2SFTPErrorDomain] && [error code] == LIBSSH2_FX_FAILURE);
+    if (exists)
+    {
+        NSArray *contents = [sftpSession attributesOfContentsOfDirectoryAtPath:path error:NULL];
+        if (contents)
+        {
+            for (NSDictionary *attributes in contents)
+            {
+                NSString *filename = [attributes objectForKey:cxFilenameKey];
+                if (filename) [existing setObject:attributes forKey:filename];
+            }
+        }
+        else
+        {
+            existing = nil;    // no idea then
+        }
+    }
+    
+    [self threaded_checkInSession:sftpSession];
+    
+    
+    // A plain failure almost always means it's already there. Should it be a file in the way instead, opening the
+    // first child fails and -threaded_openHandleAtPath:session:error: clears it out
+    if (result || exists)
+    {
+        [self threaded_addKnownDirectory:path];
+        
+        if (existing)
+        {
+            [_directoryLock lock];
+            [_existingAttributes setObject:existing forKey:path];
+            [_directoryLock unlock];
+        }
+    }
+}
+
+#pragma mark Permissions
+
+// Per server, whether a newly created file ends up with the mode it was opened with. Keyed by user@host:port, then mode
+static NSMutableDictionary *sOpenModeHonoured;
+
+- (NSString *)serverKey;
+{
+    return [NSString stringWithFormat:@"%@@%@:%@", [_credential user], [_URL host], [_URL port]];
+}
+
+- (NSNumber *)threaded_isOpenModeHonoured:(unsigned long)mode;
+{
+    @synchronized([CKSFTPUploader class])
+    {
+        return [[[[sOpenModeHonoured objectForKey:[self serverKey]] objectForKey:[NSNumber numberWithUnsignedLong:mode]] retain] autorelease];
+    }
+}
+
+- (void)threaded_setOpenModeHonoured:(BOOL)honoured forMode:(unsigned long)mode;
+{
+    @synchronized([CKSFTPUploader class])
+    {
+        if (!sOpenModeHonoured) sOpenModeHonoured = [[NSMutableDictionary alloc] init];
+        
+        NSMutableDictionary *modes = [sOpenModeHonoured objectForKey:[self serverKey]];
+        if (!modes)
+        {
+            modes = [NSMutableDictionary dictionary];
+            [sOpenModeHonoured setObject:modes forKey:[self serverKey]];
+        }
+        
+        [modes setObject:[NSNumber numberWithBool:honoured] forKey:[NSNumber numberWithUnsignedLong:mode]];
+    }
+}
+
+/*  Only the first new file for each server and mode pays for this
+ */
+- (BOOL)threaded_isMode:(unsigned long)mode ofItemAtPath:(NSString *)path session:(CK2SFTPSession *)sftpSession;
+{
+    NSArray *contents = [sftpSession attributesOfContentsOfDirectoryAtPath:[path stringByDeletingLastPathComponent] error:NULL];
+    
+    for (NSDictionary *attributes in contents)
+    {
+        if ([[attributes objectForKey:cxFilenameKey] isEqualToString:[path lastPathComponent]])
+        {
+            return (([[attributes objectForKey:NSFilePosixPermissions] unsignedLongValue] & 07777) == mode);
+        }
+    }
+    
+    return NO;
+}
+
+/*  Servers which ignore the mode given at open still need a SETSTAT. Skip it where it's known to make no difference
+ */
+- (BOOL)threaded_setPermissions:(unsigned long)mode forItemAtPath:(NSString *)path session:(CK2SFTPSession *)sftpSession error:(NSError **)outError;
+{
+    NSString *directory = [path stringByDeletingLastPathComponent];
+    
+    [_directoryLock lock];
+    NSDictionary *existing = [[[_existingAttributes objectForKey:directory] retain] autorelease];
+    BOOL removed = [_removedPaths containsObject:path];
+    [_directoryLock unlock];
+    
+    if (existing)
+    {
+        // A file deleted first is recreated by the open, the same as a new one
+        NSNumber *existingMode = (removed ? nil : [[existing objectForKey:[path lastPathComponent]] objectForKey:NSFilePosixPermissions]);
+        if (existingMode)
+        {
+            // Opening with TRUNC leaves an existing file's mode alone, so it only matters whether that was right already
+            if (([existingMode unsignedLongValue] & 07777) == mode) return YES;
+        }
+        else
+        {
+            // A new file, so it got whatever the server made of the mode it was opened with
+            NSNumber *honoured = [self threaded_isOpenModeHonoured:mode];
+            if (!honoured)
+            {
+                honoured = [NSNumber numberWithBool:[self threaded_isMode:mode ofItemAtPath:path session:sftpSession]];
+                [self threaded_setOpenModeHonoured:[honoured boolValue] forMode:mode];
+            }
+            
+            if ([honoured boolValue]) return YES;
+        }
+    }
+    
+    return [sftpSession setPermissions:mode forItemAtPath:path error:outError];
 }
 
-- (BOOL)threaded_createDirectoryAtPath:(NSString *)path error:(NSError **)outError;
+- (NSDictionary *)threaded_attributesOfExistingItemAtPath:(NSString *)path;
 {
-    CK2SFTPSession *sftpSession = [self SFTPSession];
-    NSParameterAssert(sftpSession);
+    [_directoryLock lock];
+    NSDictionary *result = nil;
+    if (![_removedPaths containsObject:path])
+    {
+        result = [[[[_existingAttributes objectForKey:[path stringByDeletingLastPathComponent]]
+                    objectForKey:[path lastPathComponent]] retain] autorelease];
+    }
+    [_directoryLock unlock];
     
+    return result;
+}
+
+// The directory was listed while being planned, so checking for the file costs nothing extra
+- (BOOL)hasFileOfSize:(NSNumber *)size atPath:(NSString *)path;
+{
+    return [[[self threaded_attributesOfExistingItemAtPath:path] objectForKey:NSFileSize] isEqualToNumber:size];
+}
+
+- (BOOL)threaded_createDirectoryAtPath:(NSString *)path session:(CK2SFTPSession *)sftpSession error:(NSError **)outError;
+{
+    if (!sftpSession)
+    {
+        if (outError) *outError = CKSFTPNoSessionError();
+        return NO;
+    }
     
-    NSError *error;
+    
+    NSError *error = nil;
     BOOL result = [sftpSession createDirectoryAtPath:path
                          withIntermediateDirectories:YES
                                                 mode:[self posixPermissionsForPath:path isDirectory:YES]
@@ -603,7 +1298,7 @@
                         }
                         else
                         {
-                            result = [self threaded_createDirectoryAtPath:path error:outError];
+                            result = [self threaded_createDirectoryAtPath:path session:sftpSession error:outError];
                         }
                     }
                 }
@@ -614,15 +1309,26 @@
     return result;
 }
 
-- (CK2SFTPFileHandle *)threaded_openHandleAtPath:(NSString *)path error:(NSError **)outError;
+- (CK2SFTPFileHandle *)threaded_openHandleAtPath:(NSString *)path session:(CK2SFTPSession *)sftpSession error:(NSError **)outError;
+{
+    return [self threaded_openHandleAtPath:path
+                                     flags:LIBSSH2_FXF_WRITE|LIBSSH2_FXF_CREAT|LIBSSH2_FXF_TRUNC
+                                   session:sftpSession
+                                     error:outError];
+}
+
+- (CK2SFTPFileHandle *)threaded_openHandleAtPath:(NSString *)path flags:(unsigned long)flags session:(CK2SFTPSession *)sftpSession error:(NSError **)outError;
 {
-    CK2SFTPSession *sftpSession = [self SFTPSession];
-    NSParameterAssert(sftpSession);
+    if (!sftpSession)
+    {
+        if (outError) *outError = CKSFTPNoSessionError();
+        return nil;
+    }
     
     
-    NSError *error;
+    NSError *error = nil;
     CK2SFTPFileHandle *result = [sftpSession openHandleAtPath:path
-                                                        flags:LIBSSH2_FXF_WRITE|LIBSSH2_FXF_CREAT|LIBSSH2_FXF_TRUNC
+                                                        flags:flags
                                                          mode:[self posixPermissionsForPath:path isDirectory:NO]
                                                         error:&error];
     
@@ -633,17 +1339,43 @@
         if ([[error domain] isEqualToString:CK2LibSSH2SFTPErrorDomain] &&
             [error code] == LIBSSH2_FX_NO_SUCH_FILE)
         {
-            // Parent directory probably doesn't exist, so create it
-            BOOL madeDir = [self threaded_createDirectoryAtPath:[path stringByDeletingLastPathComponent]
-                                                          error:outError];
+            // Parent directory probably doesn't exist, so create it. A sibling upload may be creating the very same
+            // directory, so wait for that to finish, then try again first in case it just did. Other directories
+            // carry on meanwhile
+            NSString *directory = [path stringByDeletingLastPathComponent];
             
-            if (madeDir)
+            [_directoryLock lock];
+            while ([_creatingDirectories containsObject:directory]) [_directoryLock wait];
+            [_creatingDirectories addObject:directory];
+            [_directoryLock unlock];
+            
+            result = [sftpSession openHandleAtPath:path
+                                             flags:flags
+                                              mode:[self posixPermissionsForPath:path isDirectory:NO]
+                                             error:outError];
+            
+            if (!result)
             {
-                result = [sftpSession openHandleAtPath:path
-                                                 flags:LIBSSH2_FXF_WRITE|LIBSSH2_FXF_CREAT|LIBSSH2_FXF_TRUNC
-                                                  mode:[self posixPermissionsForPath:path isDirectory:NO]
-                                                 error:outError];
+                // Uploads into different directories can both find a shared parent missing. Whichever loses the race
+                // to create it sees it there on a second go
+                BOOL madeDir = ([self threaded_createDirectoryAtPath:directory session:sftpSession error:NULL] ||
+                                [self threaded_createDirectoryAtPath:directory session:sftpSession error:outError]);
+                
+                if (madeDir)
+                {
+                    result = [sftpSession openHandleAtPath:path
+                                                     flags:flags
+                                                      mode:[self posixPermissionsForPath:path isDirectory:NO]
+                                                     error:outError];
+                }
             }
+            
+            [_directoryLock lock];
+            [_creatingDirectories removeObject:directory];
+            [_directoryLock broadcast];
+            [_directoryLock unlock];
+            
+            if (result) [self threaded_addKnownDirectory:directory];
         }
     }
     
@@ -655,13 +1387,27 @@
     return result;
 }
 
+- (NSNumber *)threaded_sizeOfItemAtPath:(NSString *)path session:(CK2SFTPSession *)sftpSession;
+{
+    // No stat of a single item to hand, so list its directory. Deliberately not the cached listing; this is for
+    // finding how much of an interrupted upload made it
+    NSArray *contents = [sftpSession attributesOfContentsOfDirectoryAtPath:[path stringByDeletingLastPathComponent] error:NULL];
+    NSString *filename = [path lastPathComponent];
+    
+    for (NSDictionary *attributes in contents)
+    {
+        if ([[attributes objectForKey:cxFilenameKey] isEqualToString:filename]) return [attributes objectForKey:NSFileSize];
+    }
+    
+    return nil;
+}
+
 - (void)threaded_writeData:(NSData *)data toPath:(NSString *)path transferRecord:(CKTransferRecord *)record;
 {
-    CK2SFTPSession *sftpSession = [self SFTPSession];
-    NSParameterAssert(sftpSession);
+    CK2SFTPSession *sftpSession = [self threaded_checkOutSession];
     
-    NSError *error;
-    CK2SFTPFileHandle *handle = [self threaded_openHandleAtPath:path error:&error];
+    NSError *error = nil;
+    CK2SFTPFileHandle *handle = [self threaded_openHandleAtPath:path session:sftpSession error:&error];
     
     if (handle)
     {
@@ -673,12 +1419,14 @@
         if (result)
         {
             // Handle servers which ignore initial permissions
-            result = [sftpSession setPermissions:[self posixPermissionsForPath:path isDirectory:NO] forItemAtPath:path error:&error];
+            result = [self threaded_setPermissions:[self posixPermissionsForPath:path isDirectory:NO] forItemAtPath:path session:sftpSession error:&error];
         }
         
         if (!result) handle = nil;  // so error gets sent
     }
     
+    [self threaded_checkInSession:sftpSession];
+    
     [[record mainThreadProxy] transferDidFinish:record
                                                                 error:(handle ? nil : error)];
 }
@@ -695,19 +1443,94 @@
 
 - (void)SFTPSessionDidInitialize:(CK2SFTPSession *)session;
 {
-    [_queue setSuspended:NO];
+    [_idleSessionsCondition lock];
+    [_idleSessions addObject:session];
+    [_idleSessionsCondition signal];
+    
+    // One more upload can run now
+    if (session != _session) [_queue setMaxConcurrentOperationCount:[_queue maxConcurrentOperationCount] + 1];
+    [_idleSessionsCondition unlock];
+    
+    if (session == _session)
+    {
+        [_queue setSuspended:NO];
+        
+        // Authenticated, so bring up the rest of the pool with the same credential
+        [self startAdditionalSessions];
+    }
 }
 
 - (void)SFTPSession:(CK2SFTPSession *)session didFailWithError:(NSError *)error;
 {
+    [_idleSessionsCondition lock];
+    BOOL replaced = ![_sessions containsObject:session];
+    
+    if (replaced || session != _session)
+    {
+        // The primary session carries on regardless; this one just drops out of the pool. Uploads waiting for a
+        // session need to hear if that leaves none
+        [_idleSessions removeObjectIdenticalTo:session];
+        [_sessions removeObjectIdenticalTo:session];
+        [_idleSessionsCondition broadcast];
+        [_idleSessionsCondition unlock];
+        return;
+    }
+    [_idleSessionsCondition unlock];
+    
     [[self mainThreadProxy] connection:nil didReceiveError:error];
 }
 
 - (void)SFTPSession:(CK2SFTPSession *)session didReceiveAuthenticationChallenge:(NSURLAuthenticationChallenge *)challenge;
 {
+    if (session != _session)
+    {
+        // Additional sessions reuse whatever got the primary one in, never bothering the user again. Only if they've
+        // reached the same host though, or the credential would go to anyone who intercepted one of the extra connections
+        NSData *fingerprint = [session hostkeyHashForType:LIBSSH2_HOSTKEY_HASH_SHA1];
+        BOOL sameHost = (fingerprint && [fingerprint isEqualToData:_hostKeyFingerprint]);
+        if (!sameHost)
+        {
+            [self SFTPSession:session appendStringToTranscript:[NSString stringWithFormat:
+                                                                @"Fingerprint %@ doesn't match %@; not authenticating",
+                                                                fingerprint,
+                                                                _hostKeyFingerprint]
+                     received:YES];
+        }
+        
+        BOOL firstTry = (sameHost && [challenge previousFailureCount] == 0);
+        BOOL useCredential = (firstTry && _credential);
+        BOOL continueWithout = (firstTry && !_credential && _continuedWithoutCredential);
+        
+        SEL selector = @selector(cancelAuthenticationChallenge:);
+        NSArray *arguments = [NSArray arrayWithObject:challenge];
+        if (useCredential)
+        {
+            selector = @selector(useCredential:forAuthenticationChallenge:);
+            arguments = [NSArray arrayWithObjects:_credential, challenge, nil];
+        }
+        else if (continueWithout)
+        {
+            selector = @selector(continueWithoutCredentialForAuthenticationChallenge:);
+        }
+        else if (sameHost)
+        {
+            // The session drops out of the pool, so uploads carry on with however many did get in
+            [self SFTPSession:session appendStringToTranscript:@"Nothing to authenticate an additional session with; uploading over fewer connections"
+                     received:YES];
+        }
+        
+        NSInvocation *invocation = [NSInvocation invocationWithSelector:selector target:[challenge sender] arguments:arguments];
+        
+        NSOperation *op = [[NSInvocationOperation alloc] initWithInvocation:invocation];
+        [_startupQueue addOperation:op];
+        [op release];
+        return;
+    }
+    
     if ([challenge previousFailureCount] == 0)
     {
         NSData *fingerprint = [session hostkeyHashForType:LIBSSH2_HOSTKEY_HASH_SHA1];
+        [_hostKeyFingerprint release]; _hostKeyFingerprint = [fingerprint copy];
         
         [self SFTPSession:session appendStringToTranscript:[NSString stringWithFormat:
                                                             @"Fingerprint: %@",
@@ -724,6 +1547,8 @@
 
 - (void)SFTPSession:(CK2SFTPSession *)session didCancelAuthenticationChallenge:(NSURLAuthenticationChallenge *)challenge;
 {
+    if (session != _session) return;
+    
     [[self mainThreadProxy] connection:nil didCancelAuthenticationChallenge:_mainThreadChallenge];
 }
 
@@ -741,6 +1566,9 @@
     NSURLAuthenticationChallenge *realChallenge = _challenge;
     _challenge = nil;   // gets released in a moment; just want to clear out the ivar right now
     
+    // Kept for the rest of the session pool
+    [_credential release]; _credential = [credential retain];
+    
     [[realChallenge sender] useCredential:credential forAuthenticationChallenge:realChallenge];
     [realChallenge release];
 }
@@ -756,6 +1584,8 @@
 
 - (void)continueWithoutCredentialForAuthenticationChallenge:(NSURLAuthenticationChallenge *)challenge;
 {
+    _continuedWithoutCredential = YES;  // so the rest of the pool gets in the same way
+    
     NSInvocationOperation *op = [[NSInvocationOperation alloc] initWithTarget:[_challenge sender] selector:_cmd object:_challenge];
     NSOperationQueue *queue = ([_queue isSuspended] ? _startupQueue : _queue);
     [queue addOperation:op];
@@ -782,6 +1612,34 @@
 
 @implementation CKWriteContentsOfURLToSFTPHandleOperation
 
+// Whether an upload failed because the connection did, rather than the server turning it down
+static BOOL CKSFTPUploadErrorIsTransient(NSError *error)
+{
+    NSString *domain = [error domain];
+    NSInteger code = [error code];
+    
+    if ([domain isEqualToString:CK2LibSSH2SFTPErrorDomain])
+    {
+        return (code == LIBSSH2_FX_NO_CONNECTION || code == LIBSSH2_FX_CONNECTION_LOST);
+    }
+    
+    if ([domain isEqualToString:NSPOSIXErrorDomain])
+    {
+        return (code == ECONNRESET || code == ECONNABORTED || code == ETIMEDOUT || code == EPIPE ||
+                code == ENETDOWN || code == ENETUNREACH || code == EHOSTUNREACH);
+    }
+    
+    // libssh2's own session errors. Their small negative codes mean something else entirely in other domains
+    if ([domain isEqualToString:CK2LibSSH2ErrorDomain])
+    {
+        return (code == LIBSSH2_ERROR_SOCKET_SEND || code == LIBSSH2_ERROR_TIMEOUT ||
+                code == LIBSSH2_ERROR_SOCKET_DISCONNECT || code == LIBSSH2_ERROR_CHANNEL_CLOSED ||
+                code == LIBSSH2_ERROR_SOCKET_TIMEOUT);
+    }
+    
+    return NO;
+}
+
 - (id)initWithURL:(NSURL *)URL path:(NSString *)path uploader:(CKSFTPUploader *)uploader transferRecord:(CKTransferRecord *)record;
 {
     if (self = [self init])
@@ -805,33 +1663,70 @@
     [super dealloc];
 }
 
+@synthesize checksManifest = _checksManifest;
+
 - (void)main
 {
-    NSFileHandle *handle = [NSFileHandle fileHandleForReadingAtPath:[_URL path]];
+    if (_checksManifest && [_engine threaded_shouldSkipUploadOfFileAtURL:_URL toPath:_path])
+    {
+        // Counts as fully sent, so the manifest keeps its entry
+        [[_record mainThreadProxy] transfer:_record transferredDataOfLength:[_record size]];
+        [[_record mainThreadProxy] transferDidFinish:_record error:nil];
+        return;
+    }
     
-    if (handle)
+    
+    CKSequentialFileReader *reader = [[CKSequentialFileReader alloc] initWithPath:[_URL path]];
+    int openError = errno;
+    
+    if (reader)
     {
-        NSError *error;
-        CK2SFTPFileHandle *sftpHandle = [_engine threaded_openHandleAtPath:_path error:&error];
+        CK2SFTPSession *session = [_engine threaded_checkOutSession];
+        
+        NSError *error = nil;
+        BOOL result = NO;
+        BOOL begun = NO;
+        BOOL complete = NO;     // reached the end of the file, rather than being cancelled part way
+        BOOL canAppend = YES;
+        unsigned long long offset = 0;      // how much the server is known to have
+        unsigned long long written = 0;
+        unsigned long long reported = 0;    // progress already sent to the record, which mustn't count resent bytes again
+        NSUInteger retries = 0;
         
-        if (sftpHandle)
+        while (session && ![self isCancelled])
         {
-            [[_engine mainThreadProxy] transferDidBegin:_record];
+            // A resumed upload carries on from the end of what's there, since file handles can't seek
+            [reader seekToFileOffset:offset];
+            written = offset;
             
-            while (YES)
+            CK2SFTPFileHandle *sftpHandle = [_engine threaded_openHandleAtPath:_path
+                                                                         flags:(offset ?
+                                                                                LIBSSH2_FXF_WRITE|LIBSSH2_FXF_APPEND :
+                                                                                LIBSSH2_FXF_WRITE|LIBSSH2_FXF_CREAT|LIBSSH2_FXF_TRUNC)
+                                                                       session:session
+                                                                         error:&error];
+            result = (sftpHandle != nil);
+            
+            if (sftpHandle)
             {
-                NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
-                {{
-                    if ([self isCancelled]) break;
+                if (!begun)
+                {
+                    [[_engine mainThreadProxy] transferDidBegin:_record];
+                    begun = YES;
+                }
+                
+                while (![self isCancelled])
+                {
+                    NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+                    
+                    NSData *data = [reader readDataOfLength:CK2SFTPPreferredChunkSize error:&error];
+                    BOOL finished = ![data length];
                     
-                    NSData *data = [handle readDataOfLength:CK2SFTPPreferredChunkSize];
-                    if (![data length]) break;
-                    if ([self isCancelled]) break;
+                    if (!finished) [[_engine bandwidthLimiter] waitToTransferLength:[data length]];
                     
-                    if (![sftpHandle writeData:data error:&error])
+                    if (!data || (!finished && ![sftpHandle writeData:data error:&error]))
                     {
-                        [sftpHandle closeFile]; // don't care if it fails
-                        sftpHandle = nil;   // so error gets sent
+                        result = NO;    // so error gets sent
                         
                         // clean up memory stuff
                         [error retain];
@@ -840,33 +1735,210 @@
                         break;
                     }
                     
-                    [[_record mainThreadProxy] transfer:_record transferredDataOfLength:[data length]];
-                }}
-                [pool release];
+                    written += [data length];
+                    if (written > reported)
+                    {
+                        [[_record mainThreadProxy] transfer:_record transferredDataOfLength:(written - reported)];
+                        reported = written;
+                    }
+                    
+                    [pool release];
+                    if (finished)
+                    {
+                        complete = YES;
+                        break;
+                    }
+                }
+                
+                [sftpHandle closeFile]; // don't care if it fails
+                if (!complete) result = NO;
+                
+                // A server which ignored APPEND will have written over the start of the file instead, which the size
+                // gives away. Never try resuming there again
+                if (result && offset && ![self isCancelled])
+                {
+                    NSNumber *size = [_engine threaded_sizeOfItemAtPath:_path session:session];
+                    if ([size unsignedLongLongValue] != [reader fileSize])
+                    {
+                        canAppend = NO;
+                        complete = NO;
+                        offset = 0;
+                        if (retries++ < CKUploaderMaxRetries) continue;
+                        
+                        result = NO;
+                        error = [NSError errorWithDomain:CK2LibSSH2SFTPErrorDomain code:LIBSSH2_FX_FAILURE userInfo:nil];
+                    }
+                }
             }
+            
+            if (result || [self isCancelled]) break;
+            
+            
+            // Only worth another go if it was the connection that failed, rather than the server refusing
+            if (!CKSFTPUploadErrorIsTransient(error) || retries >= CKUploaderMaxRetries) break;
+            
+            [_engine threaded_replaceSession:session];
+            session = nil;
+            
+            if (!CKUploaderWaitToRetry(retries, ^BOOL{ return [self isCancelled]; })) break;
+            retries++;
+            
+            session = [_engine threaded_checkOutSession];
+            if (!session) break;
+            
+            // Resume from whatever the server confirms it has, so long as that's no more than was sent. Anything
+            // else means starting over
+            NSNumber *size = (canAppend ? [_engine threaded_sizeOfItemAtPath:_path session:session] : nil);
+            offset = [size unsignedLongLongValue];
+            if (offset > written) offset = 0;
         }
         
-        [handle closeFile];
-        [sftpHandle closeFile];
+        [reader closeFile];
+        [reader release];
         
-        if (![self isCancelled] && sftpHandle)
+        if (![self isCancelled] && result)
         {
             // Handle servers which ignore initial permissions setting
-            CK2SFTPSession *session = [_engine SFTPSession];
             NSAssert(session, @"Need session to set permissions");
             
-            BOOL result = [session setPermissions:[_engine posixPermissionsForPath:_path isDirectory:NO]
-                                    forItemAtPath:_path
-                                            error:&error];
-            if (!result) sftpHandle = nil;
+            result = [_engine threaded_setPermissions:[_engine posixPermissionsForPath:_path isDirectory:NO]
+                                        forItemAtPath:_path
+                                              session:session
+                                                error:&error];
+        }
+        
+        [_engine threaded_checkInSession:session];
+        
+        // A cancelled upload has to say so, or it would look like the partial file on the server is complete
+        if (!result && [self isCancelled])
+        {
+            error = [NSError errorWithDomain:NSURLErrorDomain code:NSURLErrorCancelled userInfo:nil];
+        }
+        else if (!result && !error)
+        {
+            error = [NSError errorWithDomain:NSURLErrorDomain code:NSURLErrorNetworkConnectionLost userInfo:nil];
         }
         
-        [[_record mainThreadProxy] transferDidFinish:_record error:(sftpHandle ? nil : error)];
+        [[_record mainThreadProxy] transferDidFinish:_record error:(result ? nil : error)];
     }
     else
     {
-        [[_record mainThreadProxy] transferDidFinish:_record error:nil];
+        NSError *error = [NSError errorWithDomain:NSPOSIXErrorDomain code:openError userInfo:nil];
+        [[_record mainThreadProxy] transferDidFinish:_record error:error];
+    }
+}
+
+@end
+
+
+#pragma mark -
+
+
+// How far past the current slice to ask the kernel to have pages ready
+#define CKSequentialFileReaderReadAhead (1024 * 1024)
+
+
+@implementation CKSequentialFileReader
+
+- (id)initWithPath:(NSString *)path;
+{
+    if (self = [self init])
+    {
+        _fd = open([path fileSystemRepresentation], O_RDONLY);
+        
+        struct stat info;
+        if (_fd < 0 || fstat(_fd, &info) != 0)
+        {
+            [self release];
+            return nil;
+        }
+        
+        _size = info.st_size;
+#ifdef F_RDAHEAD
+        fcntl(_fd, F_RDAHEAD, 1);
+#endif
+    }
+    
+    return self;
+}
+
+- (void)dealloc;
+{
+    [self closeFile];
+    [_buffer release];
+    
+    [super dealloc];
+}
+
+- (unsigned long long)fileSize;
+{
+    return _size;
+}
+
+- (void)seekToFileOffset:(unsigned long long)offset;
+{
+    _offset = MIN((off_t)offset, _size);
+}
+
+- (void)closeFile;
+{
+    if (_fd >= 0)
+    {
+        close(_fd);
+        _fd = -1;
+    }
+}
+
+- (NSData *)readDataOfLength:(NSUInteger)length error:(NSError **)outError;
+{
+    if (_fd < 0 || _offset >= _size) return [NSData data];
+    if ((off_t)length > _size - _offset) length = (NSUInteger)(_size - _offset);
+    
+    
+    // Something's rewriting the file. Whatever reaches the server would be a mix of old and new
+    struct stat info;
+    if (fstat(_fd, &info) != 0 || info.st_size != _size)
+    {
+        if (outError) *outError = [NSError errorWithDomain:NSCocoaErrorDomain code:NSFileReadUnknownError userInfo:nil];
+        return nil;
+    }
+    
+    
+    if (!_buffer) _buffer = [[NSMutableData alloc] initWithLength:length];
+    if ([_buffer length] < length) [_buffer setLength:length];
+    
+    ssize_t result;
+    do
+    {
+        result = pread(_fd, [_buffer mutableBytes], length, _offset);
+    } while (result < 0 && errno == EINTR);
+    
+    if (result < 0)
+    {
+        if (outError) *outError = [NSError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:nil];
+        return nil;
+    }
+    
+    if (result == 0)    // shrunk since the check above
+    {
+        if (outError) *outError = [NSError errorWithDomain:NSCocoaErrorDomain code:NSFileReadUnknownError userInfo:nil];
+        return nil;
+    }
+    
+    _offset += result;
+    
+#ifdef F_RDADVISE
+    // Get the next slice in flight while this one goes over the wire
+    if (_offset < _size)
+    {
+        struct radvisory advice;
+        advice.ra_offset = _offset;
+        advice.ra_count = (int)MIN((off_t)CKSequentialFileReaderReadAhead, _size - _offset);
+        fcntl(_fd, F_RDADVISE, &advice);
     }
+#endif
+    
+    return [NSData dataWithBytesNoCopy:[_buffer mutableBytes] length:result freeWhenDone:NO];
 }
 
 @end
@@ -977,6 +2049,30 @@
     [super didEnqueueUpload:record toPath:path];
 }
 
+// Dropped or timed out connections, as opposed to the server refusing the file
+static BOOL CKFTPUploadErrorIsTransient(NSError *error)
+{
+    if (!error) return NO;
+    
+    NSString *domain = [error domain];
+    NSInteger code = [error code];
+    
+    if ([domain isEqualToString:NSURLErrorDomain])
+    {
+        return (code == NSURLErrorTimedOut || code == NSURLErrorNetworkConnectionLost ||
+                code == NSURLErrorCannotConnectToHost || code == NSURLErrorNotConnectedToInternet);
+    }
+    
+    if ([domain isEqualToString:CURLcodeErrorDomain])
+    {
+        return (code == CURLE_COULDNT_CONNECT || code == CURLE_PARTIAL_FILE || code == CURLE_OPERATION_TIMEDOUT ||
+                code == CURLE_GOT_NOTHING || code == CURLE_SEND_ERROR || code == CURLE_RECV_ERROR);
+    }
+    
+    // curl's own code is often tucked away under a more general error
+    return CKFTPUploadErrorIsTransient([[error userInfo] objectForKey:NSUnderlyingErrorKey]);
+}
+
 - (void)uploadToPath:(NSString *)path
               record:(CKTransferRecord *)record
           usingBlock:(BOOL (^)(NSError **outError, void (^progressBlock)(NSUInteger bytesWritten)))uploadBlock;
@@ -989,12 +2085,37 @@
         }];
         
         NSError *error;
-        BOOL result = uploadBlock(&error, ^(NSUInteger bytesWritten) {
+        BOOL result;
+        NSUInteger retries = 0;
+        __block unsigned long long written;
+        __block unsigned long long reported = 0;
+        
+        while (YES)
+        {
+            written = 0;
+            result = uploadBlock(&error, ^(NSUInteger bytesWritten) {
+                
+                // Holding up curl's progress callback holds up the upload with it
+                [[self bandwidthLimiter] waitToTransferLength:bytesWritten];
+                
+                // A retry sends the file from the start again, so only what gets further than before is progress
+                written += bytesWritten;
+                if (written <= reported) return;
+                
+                unsigned long long length = written - reported;
+                reported = written;
+                
+                [[NSOperationQueue mainQueue] addOperationWithBlock:^{
+                    [record transfer:record transferredDataOfLength:length];
+                }];
+            });
             
-            [[NSOperationQueue mainQueue] addOperationWithBlock:^{
-                [record transfer:record transferredDataOfLength:bytesWritten];
-            }];
-        });
+            // CURLFTPSession can't start part way into a file, so after a dropped connection the best on offer is
+            // sending it again once things have had a moment to settle
+            if (result || !CKFTPUploadErrorIsTransient(error) || retries >= CKUploaderMaxRetries) break;
+            // -cancel lets go of the session, which is all there is to tell by
+            if (!CKUploaderWaitToRetry(retries++, ^BOOL{ return ([self FTPSession] == nil); })) break;
+        }
         
         if (result)
         {
@@ -1039,6 +2160,9 @@
 
 - (CKTransferRecord *)uploadFileAtURL:(NSURL *)localURL toPath:(NSString *)path
 {
+    if ([self shouldSkipUploadOfFileAtURL:localURL toPath:path]) return [self recordForSkippedUploadOfFileAtURL:localURL toPath:path];
+    BOOL touched = ([self manifestStatusOfFileAtURL:localURL toPath:path] == CKUploadManifestFileTouched);
+    
     CKTransferRecord *record = nil;
     
     if ([self FTPSession])
@@ -1050,8 +2174,19 @@
         
         [self uploadToPath:path record:record usingBlock:^BOOL(NSError **outError, void (^progressBlock)(NSUInteger bytesWritten)) {
             
+            // A skipped file still counts as fully sent, which is what the manifest looks for before recording it
+            if (touched && [self threaded_shouldSkipUploadOfFileAtURL:localURL toPath:path])
+            {
+                [[NSOperationQueue mainQueue] addOperationWithBlock:^{
+                    [record transfer:record transferredDataOfLength:[size unsignedLongLongValue]];
+                }];
+                return YES;
+            }
+            
             return [[self FTPSession] createFileAtPath:path withContentsOfURL:localURL withIntermediateDirectories:YES error:outError progressBlock:progressBlock];
         }];
+        
+        [self noteUploadOfFileAtURL:localURL toPath:path transferRecord:record];
     }
     
     return record;
@@ -1059,6 +2194,8 @@
 
 - (void)removeFileAtPath:(NSString *)path;
 {
+    [self noteRemovalOfFileAtPath:path];
+    
     [_queue addOperationWithBlock:^{
         [[self FTPSession] removeFileAtPath:path error:NULL];
     }];
@@ -1180,6 +2317,7 @@
 {
     [self cancelCurrentOperation];
     [_queue release]; _queue = nil;
+    [_currentTransferRecord release]; _currentTransferRecord = nil;
 }
 
 - (void)dealloc;
@@ -1189,6 +2327,7 @@
     [_currentTransferRecord release];
     [_inputStream release];
     [_writingStream release];
+    [_buffer release];
     [_URLForWritingTo release];
     
     [super dealloc];
@@ -1196,6 +2335,36 @@
 
 #pragma mark Upload
 
++ (BOOL)createDirectoryAtURL:(NSURL *)directoryURL permissions:(unsigned long)permissions;
+{
+    NSDictionary *attributes = [NSDictionary dictionaryWithObjectsAndKeys:
+                                [NSNumber numberWithUnsignedLong:permissions],
+                                NSFilePosixPermissions,
+                                nil];
+    
+    // Own instance as this may be called off the main thread
+    NSFileManager *fileManager = [[NSFileManager alloc] init];
+    BOOL result = NO;
+    
+    if ([NSFileManager instancesRespondToSelector:@selector(createDirectoryAtURL:withIntermediateDirectories:attributes:error:)])
+    {
+        result = [fileManager createDirectoryAtURL:directoryURL
+                       withIntermediateDirectories:YES
+                                        attributes:attributes
+                                             error:NULL];
+    }
+    else if ([directoryURL isFileURL])
+    {
+        result = [fileManager createDirectoryAtPath:[directoryURL path]
+                        withIntermediateDirectories:YES
+                                         attributes:attributes
+                                              error:NULL];
+    }
+    
+    [fileManager release];
+    return result;
+}
+
 - (void)setupOutputStream;
 {
     // Need to pass an absolute URL to NSOutputStream for it to work proper-like. http://openradar.appspot.com/radar?id=1643404
@@ -1249,6 +2418,16 @@
     NSNumber *size;
     if (![localURL getResourceValue:&size forKey:NSURLFileSizeKey error:NULL]) return nil;
     
+    if ([self shouldSkipUploadOfFileAtURL:localURL toPath:path]) return [self recordForSkippedUploadOfFileAtURL:localURL toPath:path];
+    
+    if ([localURL isFileURL])
+    {
+        BOOL touched = ([self manifestStatusOfFileAtURL:localURL toPath:path] == CKUploadManifestFileTouched);
+        CKTransferRecord *result = [self copyFileAtURL:localURL toPath:path size:[size unsignedLongLongValue] checkingManifest:touched];
+        [self noteUploadOfFileAtURL:localURL toPath:path transferRecord:result];
+        return result;
+    }
+    
     NSInputStream *stream = [[NSInputStream alloc] initWithURL:localURL];
     if (!stream)
     {
@@ -1264,6 +2443,148 @@
     return result;
 }
 
+- (BOOL)hasFileOfSize:(NSNumber *)size atPath:(NSString *)path;
+{
+    NSURL *URL = [[CKConnectionRegistry sharedConnectionRegistry] URLWithPath:path relativeToURL:_baseURL];
+    NSDictionary *attributes = [[NSFileManager defaultManager] attributesOfItemAtPath:[URL path] error:NULL];
+    return [[attributes objectForKey:NSFileSize] isEqualToNumber:size];
+}
+
+#pragma mark Copy
+
+// Chunk size for copies that have to be paced
+#define CKLocalFileUploaderLimitedChunkSize (64 * 1024)
+
+static int CKCopyLimitedFileContents(int in, int out, CKBandwidthLimiter *limiter)
+{
+    char *buffer = malloc(CKLocalFileUploaderLimitedChunkSize);
+    if (!buffer) return ENOMEM;
+    
+    int result = 0;
+    while (YES)
+    {
+        ssize_t length = read(in, buffer, CKLocalFileUploaderLimitedChunkSize);
+        if (length < 0 && errno == EINTR) continue;
+        if (length <= 0)
+        {
+            if (length < 0) result = errno;
+            break;
+        }
+        
+        [limiter waitToTransferLength:length];
+        
+        ssize_t written = 0;
+        while (written < length)
+        {
+            ssize_t chunk = write(out, buffer + written, length - written);
+            if (chunk < 0)
+            {
+                if (errno == EINTR) continue;
+                result = errno;
+                break;
+            }
+            written += chunk;
+        }
+        if (result) break;
+    }
+    
+    free(buffer);
+    return result;
+}
+
+/*  Copies without the data passing through our buffers: a clone where the volume supports it (only the metadata
+ *  gets written), otherwise fcopyfile(). With a bandwidth limit in force, it has to go a chunk at a time instead.
+ *  Returns 0 or an errno value
+ */
+static int CKCopyFileContents(const char *source, const char *destination, CKBandwidthLimiter *limiter)
+{
+#ifdef CK_HAVE_CLONEFILE
+    // Weak-linked; absent before 10.12. Can't clone over an existing file, so that falls through to copying
+    if (!limiter && clonefile != NULL && clonefile(source, destination, 0) == 0) return 0;
+#endif
+    
+    int in = open(source, O_RDONLY);
+    if (in < 0) return errno;
+    
+    int result = 0;
+    int out = open(destination, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out < 0)
+    {
+        result = errno;
+    }
+    else
+    {
+        if (limiter)
+        {
+            result = CKCopyLimitedFileContents(in, out, limiter);
+        }
+        else if (fcopyfile(in, out, NULL, COPYFILE_DATA) != 0)
+        {
+            result = errno;
+        }
+        if (close(out) != 0 && !result) result = errno;
+    }
+    
+    close(in);
+    return result;
+}
+
+- (CKTransferRecord *)copyFileAtURL:(NSURL *)localURL toPath:(NSString *)path size:(unsigned long long)size checkingManifest:(BOOL)checkManifest;
+{
+    CKTransferRecord *result = [CKTransferRecord recordWithName:[path lastPathComponent] size:size];
+    
+    [self addOperation:[NSBlockOperation blockOperationWithBlock:^{
+        
+        NSAssert(_inputStream == nil, @"Can only create one file at a time");
+        
+        _currentTransferRecord = [result retain];
+        
+        NSURL *outputURL = [[CKConnectionRegistry sharedConnectionRegistry] URLWithPath:path relativeToURL:_baseURL];
+        [_URLForWritingTo release]; _URLForWritingTo = [outputURL copy];
+        
+        [[self delegate] uploader:self didBeginUploadToPath:path];
+        [_currentTransferRecord transferDidBegin:_currentTransferRecord];
+        
+        unsigned long directoryPermissions = [self posixPermissionsForPath:nil isDirectory:YES];
+        CKBandwidthLimiter *limiter = ([[self bandwidthLimiter] isLimited] ? [self bandwidthLimiter] : nil);
+        
+        // The copy can take a while for big files, so keep it off the main thread
+        dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+            NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+            
+            // Touched files are hashed here rather than when queued
+            BOOL skip = (checkManifest && [self threaded_shouldSkipUploadOfFileAtURL:localURL toPath:path]);
+            int error = (skip ? 0 : CKCopyFileContents([[localURL path] fileSystemRepresentation], [[outputURL path] fileSystemRepresentation], limiter));
+            
+            // If it's because the parent folder doesn't exist yet, create it and retry
+            if (!skip && error == ENOENT &&
+                [CKLocalFileUploader createDirectoryAtURL:[outputURL URLByDeletingLastPathComponent] permissions:directoryPermissions])
+            {
+                error = CKCopyFileContents([[localURL path] fileSystemRepresentation], [[outputURL path] fileSystemRepresentation], limiter);
+            }
+            
+            [[NSOperationQueue mainQueue] addOperationWithBlock:^{
+                if (_currentTransferRecord != result) return;   // cancelled meanwhile
+                
+                if (error)
+                {
+                    [self finishCurrentOperationWithError:[NSError errorWithDomain:NSPOSIXErrorDomain code:error userInfo:nil]];
+                }
+                else
+                {
+                    [_currentTransferRecord transfer:_currentTransferRecord transferredDataOfLength:size];
+                    [self finishCurrentOperationIfWritingIsFinished];
+                }
+            }];
+            
+            [pool release];
+        });
+    }]];
+    
+    [self didEnqueueUpload:result toPath:path];
+    return result;
+}
+
 #pragma mark Queue
 
 - (void)addOperation:(NSOperation *)operation;
@@ -1291,7 +2612,7 @@
 
 - (BOOL)writeAsMuchOfBufferAsSpaceAvailableAllows
 {
-    NSInteger written = [_writingStream write:[_buffer bytes] maxLength:[_buffer length]];
+    NSInteger written = [_writingStream write:(const uint8_t *)[_buffer bytes] + _bufferStart maxLength:_bufferEnd - _bufferStart];
     if (written < 0)
     {
         // Bail out with error
@@ -1299,7 +2620,9 @@
         return NO;
     }
     
-    [_buffer replaceBytesInRange:NSMakeRange(0, written) withBytes:NULL length:0];
+    // Just move along rather than shuffling the rest of the buffer down; it's refilled from the start once empty
+    _bufferStart += written;
+    if (_bufferStart == _bufferEnd) _bufferStart = _bufferEnd = 0;
     
     [_currentTransferRecord transfer:_currentTransferRecord transferredDataOfLength:written];
     
@@ -1308,7 +2631,7 @@
 
 - (BOOL)finishCurrentOperationIfWritingIsFinished
 {
-    if (_inputStream == nil && [_buffer length] == 0)
+    if (_inputStream == nil && _bufferEnd == _bufferStart)
     {
         unsigned long permissions = [self posixPermissionsForPath:nil isDirectory:NO];
         
@@ -1330,7 +2653,7 @@
 
 - (void)finishReading;
 {
-    [_buffer setLength:0];
+    _bufferStart = _bufferEnd = 0;
     [_inputStream close];
     [_inputStream release]; _inputStream = nil;
     [self finishCurrentOperationIfWritingIsFinished];
@@ -1346,28 +2669,8 @@
             NSError *error = [aStream streamError];
             if ([[error domain] isEqualToString:NSPOSIXErrorDomain] && [error code] == ENOENT)
             {
-                NSDictionary *attributes = [NSDictionary dictionaryWithObjectsAndKeys:
-                                            [NSNumber numberWithUnsignedLong:[self posixPermissionsForPath:nil isDirectory:YES]],
-                                            NSFilePosixPermissions,
-                                            nil];
-                
-                NSURL *directoryURL = [_URLForWritingTo URLByDeletingLastPathComponent];
-                BOOL success = NO;
-                
-                if ([NSFileManager instancesRespondToSelector:@selector(createDirectoryAtURL:withIntermediateDirectories:attributes:error:)])
-                {
-                    success = [[NSFileManager defaultManager] createDirectoryAtURL:directoryURL
-                                                       withIntermediateDirectories:YES
-                                                                        attributes:attributes
-                                                                             error:NULL];
-                }
-                else if ([directoryURL isFileURL])
-                {
-                    success = [[NSFileManager defaultManager] createDirectoryAtPath:[directoryURL path]
-                                                        withIntermediateDirectories:YES
-                                                                         attributes:attributes
-                                                                              error:NULL];
-                }
+                BOOL success = [[self class] createDirectoryAtURL:[_URLForWritingTo URLByDeletingLastPathComponent]
+                                                      permissions:[self posixPermissionsForPath:nil isDirectory:YES]];
                 
                 if (success)
                 {
@@ -1384,12 +2687,12 @@
     }
     
     // Write out any remainder of the buffer
-    if ([_writingStream hasSpaceAvailable] && [_buffer length])
+    if ([_writingStream hasSpaceAvailable] && _bufferEnd > _bufferStart)
     {
         [self writeAsMuchOfBufferAsSpaceAvailableAllows];
         
         // If the buffer is still full, write again when ready
-        if ([_buffer length]) return;
+        if (_bufferEnd > _bufferStart) return;
         
         // That might have been the end of the file being written. If so, onto the next op!
         if ([self finishCurrentOperationIfWritingIsFinished]) return;
@@ -1397,17 +2700,15 @@
     
     if ([_inputStream hasBytesAvailable] && [_writingStream hasSpaceAvailable])
     {
-        // Prepare the buffer
-        if (!_buffer) _buffer = [[NSMutableData alloc] init];
-        [_buffer setLength:1024*1024];
+        // Prepare the buffer. Only ever read into once it's been fully written out, so always from the start
+        if (!_buffer) _buffer = [[NSMutableData alloc] initWithLength:1024*1024];
         
         // Read a chunk of data
         NSInteger read = [_inputStream read:[_buffer mutableBytes] maxLength:[_buffer length]];
         if (read > 0)
         {
-            // Clear out any wasted space in the buffer, then write it
-            [_buffer replaceBytesInRange:NSMakeRange(read, [_buffer length] - read)
-                               withBytes:NULL length:0];
+            _bufferStart = 0;
+            _bufferEnd = read;
             
             [self writeAsMuchOfBufferAsSpaceAvailableAllows];
         }
@@ -176,7 +176,27 @@ static void *sOpFinishObservationContext = &sOpFinishObservationContext;
 
 - (CKTransferRecord *)uploadFileAtURL:(NSURL *)url toPath:(NSString *)path openingPosixPermissions:(unsigned long)permissions;
 {
-    return [self uploadData:[NSData dataWithContentsOfURL:url] toPath:path openingPosixPermissions:permissions];
+    // DAVPutRequest wants its body as NSData. Mapped where that's safe, the file is paged in as it's sent rather than
+    // read up front; on network or removable volumes it has to be read, since pages vanishing would crash the app
+    NSError *error;
+    NSData *data = [NSData dataWithContentsOfURL:url options:NSDataReadingMappedIfSafe error:&error];
+    if (data) return [self uploadData:data toPath:path openingPosixPermissions:permissions];
+    
+    
+    // Fail it the way a PUT would, once the caller's had a chance to hold on to the record
+    path = [self canonicalPathForPath:path];
+    CKTransferRecord *result = [CKTransferRecord recordWithName:[path lastPathComponent] size:0];
+    
+    [[NSOperationQueue mainQueue] addOperationWithBlock:^{
+        [result transferDidFinish:result error:error];
+        
+        if ([[self delegate] respondsToSelector:@selector(connection:uploadDidFinish:error:)])
+        {
+            [[self delegate] connection:self uploadDidFinish:path error:error];
+        }
+    }];
+    
+    return result;
 }
 
 - (CKTransferRecord *)uploadData:(NSData *)data toPath:(NSString *)path openingPosixPermissions:(unsigned long)permissions;
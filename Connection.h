@@ -69,6 +69,7 @@ typedef unsigned int   NSUInteger;
 #import <Connection/NSNumber+Connection.h>
 
 #import <Connection/CKUploader.h>
+#import <Connection/CKBandwidthLimiter.h>
 #import <Connection/CKTransferRecord.h>
 #import <Connection/CKTransferProgressCell.h>
 
@@ -39,15 +39,21 @@
 #ifndef WIN32
 #include <unistd.h>
 #endif
+#include <errno.h>
+#ifdef HAVE_POLL
+# include <sys/poll.h>
+#endif
 
 /* {{{ libssh2_channel_nextid
  * Determine the next channel ID we can use at our end
  */
 unsigned long libssh2_channel_nextid(LIBSSH2_SESSION *session)
 {
-	unsigned long id = session->next_channel;
+	unsigned long id;
 	LIBSSH2_CHANNEL *channel;
 
+	LIBSSH2_LOCK(session, data_lock);
+	id = session->next_channel;
 	channel = session->channels.head;
 
 	while (channel) {
@@ -63,6 +69,7 @@ unsigned long libssh2_channel_nextid(LIBSSH2_SESSION *session)
 	 * Gets picked up by the new one.... Pretty unlikely all told...
 	 */
 	session->next_channel = id + 1;
+	LIBSSH2_UNLOCK(session, data_lock);
 #ifdef LIBSSH2_DEBUG_CONNECTION
 	_libssh2_debug(session, LIBSSH2_DBG_CONN, "Allocated new channel ID#%lu", id);
 #endif
@@ -75,20 +82,25 @@ unsigned long libssh2_channel_nextid(LIBSSH2_SESSION *session)
  */
 LIBSSH2_CHANNEL *libssh2_channel_locate(LIBSSH2_SESSION *session, unsigned long channel_id)
 {
-	LIBSSH2_CHANNEL *channel = session->channels.head;
+	LIBSSH2_CHANNEL *channel;
+
+	LIBSSH2_LOCK(session, data_lock);
+	channel = session->channels.head;
 	while (channel) {
 		if (channel->local.id == channel_id) {
-			return channel;
+			break;
 		}
 		channel = channel->next;
 	}
+	LIBSSH2_UNLOCK(session, data_lock);
 
-	return NULL;
+	return channel;
 }
 /* }}} */
 
 #define libssh2_channel_add(session, channel)	\
 {	\
+	LIBSSH2_LOCK(session, data_lock);	\
 	if ((session)->channels.tail) {	\
 		(session)->channels.tail->next = (channel);	\
 		(channel)->prev = (session)->channels.tail;	\
@@ -99,6 +111,7 @@ LIBSSH2_CHANNEL *libssh2_channel_locate(LIBSSH2_SESSION *session, unsigned long
 	(channel)->next = NULL;	\
 	(session)->channels.tail = (channel);	\
 	(channel)->session = (session); \
+	LIBSSH2_UNLOCK(session, data_lock);	\
 }
 
 /* {{{ libssh2_channel_open_session
@@ -202,6 +215,7 @@ LIBSSH2_API LIBSSH2_CHANNEL *libssh2_channel_open_ex(LIBSSH2_SESSION *session, c
 		unsigned char channel_id[4];
 		LIBSSH2_FREE(session, channel->channel_type);
 
+		LIBSSH2_LOCK(session, data_lock);
 		if (channel->next) {
 			channel->next->prev = channel->prev;
 		}
@@ -214,6 +228,7 @@ LIBSSH2_API LIBSSH2_CHANNEL *libssh2_channel_open_ex(LIBSSH2_SESSION *session, c
 		if (session->channels.tail == channel) {
 			session->channels.tail = channel->prev;
 		}
+		LIBSSH2_UNLOCK(session, data_lock);
 
 		/* Clear out packets meant for this channel */
 		libssh2_htonu32(channel_id, channel->local.id);
@@ -303,6 +318,7 @@ LIBSSH2_API LIBSSH2_LISTENER *libssh2_channel_forward_listen_ex(LIBSSH2_SESSION
 		return NULL;
 	}
 	LIBSSH2_FREE(session, packet);
+	libssh2_global_request_sent(session, 0);
 
 	if (libssh2_packet_requirev(session, reply_codes, &data, &data_len)) {
 		return NULL;
@@ -445,6 +461,7 @@ LIBSSH2_API LIBSSH2_CHANNEL *libssh2_channel_forward_accept(LIBSSH2_LISTENER *li
 			listener->queue->prev = NULL;
 		}
 
+		LIBSSH2_LOCK(session, data_lock);
 		channel->prev = NULL;
 		channel->next = session->channels.head;
 		session->channels.head = channel;
@@ -454,6 +471,7 @@ LIBSSH2_API LIBSSH2_CHANNEL *libssh2_channel_forward_accept(LIBSSH2_LISTENER *li
 		} else {
 			session->channels.tail = channel;
 		}
+		LIBSSH2_UNLOCK(session, data_lock);
 		listener->queue_size--;
 
 		return channel;
@@ -740,15 +758,28 @@ LIBSSH2_API void libssh2_channel_set_blocking(LIBSSH2_CHANNEL *channel, int bloc
 }
 /* }}} */
 
+/* {{{ libssh2_channel_schedule
+ * Set a channel's share of the outbound stream under LIBSSH2_FLAG_FAIR_SCHEDULE
+ * Channels of a higher priority are always served first, weight divides the stream between channels of equal priority
+ */
+LIBSSH2_API void libssh2_channel_schedule(LIBSSH2_CHANNEL *channel, unsigned int weight, int priority)
+{
+	channel->weight = weight;
+	channel->priority = priority;
+}
+/* }}} */
+
 /* {{{ libssh2_channel_flush_ex
  * Flush data from one (or all) stream
  * Returns number of bytes flushed, or -1 on failure
  */
 LIBSSH2_API int libssh2_channel_flush_ex(LIBSSH2_CHANNEL *channel, int streamid)
 {
-	LIBSSH2_PACKET *packet = channel->session->packets.head;
+	LIBSSH2_PACKET *packet;
 	unsigned long refund_bytes = 0, flush_bytes = 0;
 
+	LIBSSH2_LOCK(channel->session, data_lock);
+	packet = channel->session->packets.head;
 	while (packet) {
 		LIBSSH2_PACKET *next = packet->next;
 		unsigned char packet_type = packet->data[0];
@@ -786,6 +817,7 @@ LIBSSH2_API int libssh2_channel_flush_ex(LIBSSH2_CHANNEL *channel, int streamid)
 		}
 		packet = next;
 	}
+	LIBSSH2_UNLOCK(channel->session, data_lock);
 
 	if (refund_bytes) {
 		libssh2_channel_receive_window_adjust(channel, refund_bytes, 0);
@@ -844,7 +876,9 @@ LIBSSH2_API unsigned long libssh2_channel_receive_window_adjust(LIBSSH2_CHANNEL
 		libssh2_error(channel->session, LIBSSH2_ERROR_SOCKET_SEND, "Unable to send transfer-window adjustment packet, deferring", 0);
 		channel->adjust_queue = adjustment;
 	} else {
+		LIBSSH2_LOCK(channel->session, data_lock);
 		channel->remote.window_size += adjustment;
+		LIBSSH2_UNLOCK(channel->session, data_lock);
 	}
 
 	return channel->remote.window_size;
@@ -877,6 +911,8 @@ LIBSSH2_API int libssh2_channel_read_ex(LIBSSH2_CHANNEL *channel, int stream_id,
 {
 	LIBSSH2_SESSION *session = channel->session;
 	int bytes_read = 0, blocking_read = 0;
+	unsigned long refund_bytes = 0;
+	unsigned long gen = 0;
 
 #ifdef LIBSSH2_DEBUG_CONNECTION
 	_libssh2_debug(session, LIBSSH2_DBG_CONN, "Attempting to read %d bytes from channel %lu/%lu stream #%d", (int)buflen, channel->local.id, channel->remote.id, stream_id);
@@ -885,7 +921,10 @@ LIBSSH2_API int libssh2_channel_read_ex(LIBSSH2_CHANNEL *channel, int stream_id,
 		LIBSSH2_PACKET *packet;
 
 		/* Process any waiting packets */
-		while (libssh2_packet_read(session, blocking_read) > 0) blocking_read = 0;
+		while ((blocking_read ? libssh2_packet_read_since(session, gen) : libssh2_packet_read(session, 0)) > 0) blocking_read = 0;
+
+		gen = libssh2_packet_gen(session);
+		LIBSSH2_LOCK(session, data_lock);
 		packet = session->packets.head;
 
 		while (packet && (bytes_read < buflen)) {
@@ -930,12 +969,19 @@ LIBSSH2_API int libssh2_channel_read_ex(LIBSSH2_CHANNEL *channel, int stream_id,
 #ifdef LIBSSH2_DEBUG_CONNECTION
 	_libssh2_debug(session, LIBSSH2_DBG_CONN, "Unlinking empty packet buffer from channel %lu/%lu", channel->local.id, channel->remote.id);
 #endif
-					libssh2_channel_receive_window_adjust(channel, packet->data_len - (stream_id ? 13 : 9), 0);
+					/* Refunded once the brigade is let go of */
+					refund_bytes += packet->data_len - (stream_id ? 13 : 9);
 					LIBSSH2_FREE(session, packet);
 				}
 			}
 			packet = next;
 		}
+		LIBSSH2_UNLOCK(session, data_lock);
+
+		if (refund_bytes) {
+			libssh2_channel_receive_window_adjust(channel, refund_bytes, 0);
+			refund_bytes = 0;
+		}
 		blocking_read = 1;
 	} while (channel->blocking && (bytes_read == 0) && !channel->remote.close);
 
@@ -947,14 +993,201 @@ LIBSSH2_API int libssh2_channel_read_ex(LIBSSH2_CHANNEL *channel, int stream_id,
 }
 /* }}} */
 
+/* {{{ libssh2_channel_outq_run
+ * Send queued channel data, deficit round robin between the channels of the highest priority with anything queued
+ * Stops once channel (or every channel, when NULL) is down to target bytes, or after rounds rounds (0 for no limit)
+ * The channel list is walked under data_lock, let go of around each packet write; a channel with data queued
+ * can't be freed meanwhile, libssh2_channel_free() waits in libssh2_channel_outq_free() for the write_lock held here
+ */
+int libssh2_channel_outq_run(LIBSSH2_SESSION *session, LIBSSH2_CHANNEL *channel, unsigned long target, int rounds)
+{
+	int ret = 0;
+
+	LIBSSH2_LOCK(session, write_lock);
+	LIBSSH2_LOCK(session, data_lock);
+	while (channel ? (channel->outq_len > target) : (session->outq_len > target)) {
+		LIBSSH2_CHANNEL *c;
+		int priority = 0, waiting = 0;
+
+		for (c = session->channels.head; c; c = c->next) {
+			if (c->outq_head && (!waiting || (c->priority > priority))) {
+				priority = c->priority;
+				waiting = 1;
+			}
+		}
+		if (!waiting) {
+			break;
+		}
+
+		for (c = session->channels.head; c; c = c->next) {
+			if (!c->outq_head || (c->priority != priority)) {
+				continue;
+			}
+
+			c->deficit += LIBSSH2_CHANNEL_QUANTUM * (c->weight ? c->weight : 1);
+			while (c->outq_head && (c->outq_head->payload_len <= c->deficit)) {
+				LIBSSH2_OUTBOUND *out = c->outq_head;
+				int rc;
+
+				LIBSSH2_UNLOCK(session, data_lock);
+				rc = libssh2_packet_write(session, out->data, out->data_len);
+				LIBSSH2_LOCK(session, data_lock);
+				if (rc) {
+					libssh2_error(session, LIBSSH2_ERROR_SOCKET_SEND, "Unable to send channel data", 0);
+					ret = -1;
+					goto out;
+				}
+				c->deficit -= out->payload_len;
+				c->outq_len -= out->payload_len;
+				session->outq_len -= out->payload_len;
+
+				c->outq_head = out->next;
+				if (!c->outq_head) {
+					c->outq_tail = NULL;
+				}
+				LIBSSH2_FREE(session, out);
+			}
+			if (!c->outq_head) {
+				/* Idle channels don't get to save up */
+				c->deficit = 0;
+			}
+		}
+
+		if (rounds && !--rounds) {
+			break;
+		}
+	}
+
+out:
+	LIBSSH2_UNLOCK(session, data_lock);
+	LIBSSH2_UNLOCK(session, write_lock);
+	return ret;
+}
+/* }}} */
+
+/* {{{ libssh2_channel_write_scheduled
+ * libssh2_channel_write_ex() under LIBSSH2_FLAG_FAIR_SCHEDULE
+ * Data is split into packets on the channel's queue and sent by libssh2_channel_outq_run()
+ */
+static int libssh2_channel_write_scheduled(LIBSSH2_CHANNEL *channel, int stream_id, const char *buf, size_t buflen)
+{
+	LIBSSH2_SESSION *session = channel->session;
+	unsigned long header_len = stream_id ? 13 : 9; /* packet_type(1) + channelno(4) [ + streamid(4) ] + buflen(4) */
+	unsigned long bufwrote = 0;
+
+	while (buflen > 0) {
+		LIBSSH2_OUTBOUND *out;
+		unsigned char *s;
+		size_t bufwrite = buflen;
+		unsigned long gen;
+
+		if (channel->blocking) {
+			/* Make room in the queue, then wait for window space */
+			if ((channel->outq_len >= LIBSSH2_CHANNEL_OUTQ_MAX) &&
+				libssh2_channel_outq_run(session, channel, LIBSSH2_CHANNEL_OUTQ_MAX / 2, 0)) {
+				return -1;
+			}
+			gen = libssh2_packet_gen(session);
+			while (channel->local.window_size <= 0) {
+				if (libssh2_packet_read_since(session, gen) < 0) {
+					return -1;
+				}
+				gen = libssh2_packet_gen(session);
+			}
+		} else if ((channel->local.window_size <= 0) || (channel->outq_len >= LIBSSH2_CHANNEL_OUTQ_MAX)) {
+			break;
+		}
+
+		if (bufwrite > channel->local.window_size) {
+			bufwrite = channel->local.window_size;
+		}
+		if (bufwrite > channel->local.packet_size) {
+			bufwrite = channel->local.packet_size;
+		}
+		if (!channel->blocking && (bufwrite > (LIBSSH2_CHANNEL_OUTQ_MAX - channel->outq_len))) {
+			bufwrite = LIBSSH2_CHANNEL_OUTQ_MAX - channel->outq_len;
+		}
+
+		out = LIBSSH2_ALLOC(session, sizeof(LIBSSH2_OUTBOUND) + header_len + bufwrite);
+		if (!out) {
+			libssh2_error(session, LIBSSH2_ERROR_ALLOC, "Unable to allocte space for data transmission packet", 0);
+			return bufwrote ? bufwrote : -1;
+		}
+		s = out->data = (unsigned char *)(out + 1);
+
+		*(s++) = stream_id ? SSH_MSG_CHANNEL_EXTENDED_DATA : SSH_MSG_CHANNEL_DATA;
+		libssh2_htonu32(s, channel->remote.id);					s += 4;
+		if (stream_id) {
+			libssh2_htonu32(s, stream_id);						s += 4;
+		}
+		libssh2_htonu32(s, bufwrite);							s += 4;
+		memcpy(s, buf, bufwrite);								s += bufwrite;
+
+		out->data_len = s - out->data;
+		out->payload_len = bufwrite;
+		out->next = NULL;
+		LIBSSH2_LOCK(session, write_lock);
+		if (channel->outq_tail) {
+			channel->outq_tail->next = out;
+		} else {
+			channel->outq_head = out;
+		}
+		channel->outq_tail = out;
+		channel->outq_len += bufwrite;
+		session->outq_len += bufwrite;
+		LIBSSH2_UNLOCK(session, write_lock);
+
+		/* The window is spent as soon as the data is queued */
+		LIBSSH2_LOCK(session, data_lock);
+		channel->local.window_size -= bufwrite;
+		LIBSSH2_UNLOCK(session, data_lock);
+
+		buflen -= bufwrite;
+		buf += bufwrite;
+		bufwrote += bufwrite;
+	}
+
+	/* A blocking caller may be about to wait for an answer to what it just wrote, so it all has to go now
+	 * Non-blocking callers get one round, the rest goes out on later writes or the next packet read
+	 */
+	if (channel->blocking ? libssh2_channel_outq_run(session, channel, 0, 0) : libssh2_channel_outq_run(session, NULL, 0, 1)) {
+		return -1;
+	}
+
+	return bufwrote;
+}
+/* }}} */
+
+/* {{{ libssh2_channel_outq_free
+ * Drop whatever a channel still has queued
+ */
+static void libssh2_channel_outq_free(LIBSSH2_CHANNEL *channel)
+{
+	LIBSSH2_SESSION *session = channel->session;
+
+	LIBSSH2_LOCK(session, write_lock);
+	while (channel->outq_head) {
+		LIBSSH2_OUTBOUND *next = channel->outq_head->next;
+
+		session->outq_len -= channel->outq_head->payload_len;
+		LIBSSH2_FREE(session, channel->outq_head);
+		channel->outq_head = next;
+	}
+	channel->outq_tail = NULL;
+	channel->outq_len = 0;
+	LIBSSH2_UNLOCK(session, write_lock);
+}
+/* }}} */
+
 /* {{{ libssh2_channel_write_ex
  * Send data to a channel
+ * A non-blocking channel sends as much as the window takes and returns that, the rest is up to the caller
  */
 LIBSSH2_API int libssh2_channel_write_ex(LIBSSH2_CHANNEL *channel, int stream_id, const char *buf, size_t buflen)
 {
 	LIBSSH2_SESSION *session = channel->session;
-	unsigned char *packet;
-	unsigned long packet_len, bufwrote = 0;
+	unsigned long packet_len, header_len, bufwrote = 0;
+	int compress;
 
 #ifdef LIBSSH2_DEBUG_CONNECTION
 	_libssh2_debug(session, LIBSSH2_DBG_CONN, "Writing %d bytes on channel %lu/%lu, stream #%d", (int)buflen, channel->local.id, channel->remote.id, stream_id);
@@ -973,16 +1206,32 @@ LIBSSH2_API int libssh2_channel_write_ex(LIBSSH2_CHANNEL *channel, int stream_id
 		return 0;
 	}
 
-	packet_len = buflen + (stream_id ? 13 : 9); /* packet_type(1) + channelno(4) [ + streamid(4) ] + buflen(4) */
-	packet = LIBSSH2_ALLOC(session, packet_len);
-	if (!packet) {
-		libssh2_error(session, LIBSSH2_ERROR_ALLOC, "Unable to allocte space for data transmission packet", 0);
-		return -1;
+	if (session->flags & LIBSSH2_FLAG_FAIR_SCHEDULE) {
+		return libssh2_channel_write_scheduled(channel, stream_id, buf, buflen);
+	}
+
+	/* Compressed payloads have to be contiguous, otherwise only the header is built here and
+	 * each slice is encrypted straight out of the caller's buffer */
+	compress = (session->state & LIBSSH2_STATE_NEWKEYS) && strcmp(session->local.comp->name, "none");
+
+	header_len = stream_id ? 13 : 9; /* packet_type(1) + channelno(4) [ + streamid(4) ] + buflen(4) */
+	packet_len = header_len + (compress ? channel->local.packet_size : 0);
+	if (channel->write_buf_size < packet_len) {
+		unsigned char *write_buf = LIBSSH2_REALLOC(session, channel->write_buf, packet_len);
+
+		if (!write_buf) {
+			libssh2_error(session, LIBSSH2_ERROR_ALLOC, "Unable to allocte space for data transmission packet", 0);
+			return -1;
+		}
+		channel->write_buf = write_buf;
+		channel->write_buf_size = packet_len;
 	}
 
 	while (buflen > 0) {
 		size_t bufwrite = buflen;
-		unsigned char *s = packet;
+		unsigned char *s = channel->write_buf;
+		int ret;
+		unsigned long gen;
 
 		*(s++) = stream_id ? SSH_MSG_CHANNEL_EXTENDED_DATA : SSH_MSG_CHANNEL_DATA;
 		libssh2_htonu32(s, channel->remote.id);					s += 4;
@@ -990,12 +1239,19 @@ LIBSSH2_API int libssh2_channel_write_ex(LIBSSH2_CHANNEL *channel, int stream_id
 			libssh2_htonu32(s, stream_id);						s += 4;
 		}
 
-		/* twiddle our thumbs until there's window space available */
-		while (channel->local.window_size <= 0) {
-			/* Don't worry -- This is never hit unless it's a blocking channel anyway */
-			if (libssh2_packet_read(session, 1) < 0) {
-				/* Error occured, disconnect? */
-				return -1;
+		if (channel->local.window_size <= 0) {
+			if (!channel->blocking) {
+				/* Partial write, hand back what the window took */
+				break;
+			}
+			/* twiddle our thumbs until there's window space available */
+			gen = libssh2_packet_gen(session);
+			while (channel->local.window_size <= 0) {
+				if (libssh2_packet_read_since(session, gen) < 0) {
+					/* Error occured, disconnect? */
+					return bufwrote ? bufwrote : -1;
+				}
+				gen = libssh2_packet_gen(session);
 			}
 		}
 
@@ -1014,32 +1270,224 @@ LIBSSH2_API int libssh2_channel_write_ex(LIBSSH2_CHANNEL *channel, int stream_id
 			bufwrite = channel->local.packet_size;
 		}
 		libssh2_htonu32(s, bufwrite);							s += 4;
-		memcpy(s, buf, bufwrite);								s += bufwrite;
 
 #ifdef LIBSSH2_DEBUG_CONNECTION
 	_libssh2_debug(session, LIBSSH2_DBG_CONN, "Sending %d bytes on channel %lu/%lu, stream_id=%d", (int)bufwrite, channel->local.id, channel->remote.id, stream_id);
 #endif
-		if (libssh2_packet_write(session, packet, s - packet)) {
+		if (compress) {
+			memcpy(s, buf, bufwrite);							s += bufwrite;
+			ret = libssh2_packet_write(session, channel->write_buf, s - channel->write_buf);
+		} else {
+			ret = libssh2_packet_writev(session, channel->write_buf, s - channel->write_buf, (const unsigned char *)buf, bufwrite);
+		}
+		if (ret) {
 			libssh2_error(session, LIBSSH2_ERROR_SOCKET_SEND, "Unable to send channel data", 0);
-			LIBSSH2_FREE(session, packet);
 			return -1;
 		}
 		/* Shrink local window size */
+		LIBSSH2_LOCK(session, data_lock);
 		channel->local.window_size -= bufwrite;
+		LIBSSH2_UNLOCK(session, data_lock);
 
 		/* Adjust buf for next iteration */
 		buflen -= bufwrite;
 		buf += bufwrite;
 		bufwrote += bufwrite;
+	}
+
+	return bufwrote;
+}
+/* }}} */
+
+/* {{{ libssh2_channel_relay
+ * Pump a channel's standard stream to and from a local descriptor (typically a socket)
+ * until both directions have seen EOF or the remote end closes the channel
+ * Inbound data is written to fd straight out of the packet brigade and outbound data is
+ * read from fd straight into the packet being built, so neither direction takes a copy
+ * Receive window adjustments are batched, one per pass rather than one per packet
+ * The session must be doing its I/O on session->socket_fd, or through libssh2_session_io_uring()
+ * If poll() fails the error is LIBSSH2_ERROR_SOCKET_NONE and errno is left as poll() set it
+ */
+LIBSSH2_API int libssh2_channel_relay(LIBSSH2_CHANNEL *channel, int fd)
+{
+#ifdef HAVE_POLL
+	LIBSSH2_SESSION *session = channel->session;
+	unsigned char *outbound;
+	unsigned long pending_adjust = 0;
+	int local_eof = 0, remote_eof = 0, rc = 0;
+
+#ifdef LIBSSH2_DEBUG_CONNECTION
+	_libssh2_debug(session, LIBSSH2_DBG_CONN, "Relaying channel %lu/%lu to descriptor %d", channel->local.id, channel->remote.id, fd);
+#endif
+	/* packet_type(1) + channelno(4) + datalen(4) + data */
+	outbound = LIBSSH2_ALLOC(session, channel->local.packet_size + 9);
+	if (!outbound) {
+		libssh2_error(session, LIBSSH2_ERROR_ALLOC, "Unable to allocate relay buffer", 0);
+		return -1;
+	}
+
+	while (!(local_eof && remote_eof)) {
+		LIBSSH2_PACKET *packet, *next;
+		struct pollfd fds[2];
+		unsigned long want;
+		int fd_blocked = 0, inbound_left = 0, wait_ms, n;
+
+		/* Take in everything that's already arrived */
+		while ((n = libssh2_packet_read(session, 0)) > 0);
+		if (n < 0) {
+			rc = -1;
+			break;
+		}
+
+		/* Inbound: brigade -> fd
+		 * data_lock is let go of around each write(), the packet stays linked meanwhile and only this
+		 * channel's reader takes its packets off the brigade, so it's still there to unlink afterwards
+		 */
+		LIBSSH2_LOCK(session, data_lock);
+		packet = session->packets.head;
+		while (packet) {
+			if ((packet->data[0] != SSH_MSG_CHANNEL_DATA) || (channel->local.id != libssh2_ntohu32(packet->data + 1))) {
+				packet = packet->next;
+				continue;
+			}
+			if (fd_blocked) {
+				inbound_left = 1;
+				break;
+			}
+			LIBSSH2_UNLOCK(session, data_lock);
+
+			while (packet->data_head < packet->data_len) {
+				ssize_t written = write(fd, packet->data + packet->data_head, packet->data_len - packet->data_head);
+
+				if (written < 0) {
+					if (errno == EAGAIN || errno == EINTR) {
+						fd_blocked = 1;
+						break;
+					}
+					libssh2_error(session, LIBSSH2_ERROR_SOCKET_SEND, "Unable to write relayed data to local descriptor", 0);
+					rc = -1;
+					goto relay_done;
+				}
+				packet->data_head += written;
+			}
+
+			LIBSSH2_LOCK(session, data_lock);
+			if (packet->data_head < packet->data_len) {
+				inbound_left = 1;
+				break;
+			}
+
+			next = packet->next;
+			if (packet->prev) {
+				packet->prev->next = packet->next;
+			} else {
+				session->packets.head = packet->next;
+			}
+			if (packet->next) {
+				packet->next->prev = packet->prev;
+			} else {
+				session->packets.tail = packet->prev;
+			}
+			pending_adjust += packet->data_len - 9;
+			LIBSSH2_FREE(session, packet->data);
+			LIBSSH2_FREE(session, packet);
+			packet = next;
+		}
+		LIBSSH2_UNLOCK(session, data_lock);
+
+		if (pending_adjust) {
+			libssh2_channel_receive_window_adjust(channel, pending_adjust, 1);
+			pending_adjust = 0;
+		}
+
+		/* Half-close towards the local side once the remote is done and everything's been handed over */
+		if (!remote_eof && channel->remote.eof && !inbound_left) {
+			shutdown(fd, SHUT_WR);
+			remote_eof = 1;
+		}
+
+		/* Nothing more arrives after a close, but whatever came before it (DATA, EOF, CLOSE in one read, say)
+		 * still has to reach fd first, however long fd takes to accept it
+		 */
+		if (channel->remote.close && !inbound_left) {
+			break;
+		}
 
-		if (!channel->blocking) {
+		fds[0].fd = channel->remote.close ? -1 : LIBSSH2_POLL_FD(session);
+		fds[0].events = POLLIN;
+		LIBSSH2_LOCK(session, data_lock);
+		want = channel->local.packet_size;
+		if (want > channel->local.window_size) {
+			want = channel->local.window_size;
+		}
+		LIBSSH2_UNLOCK(session, data_lock);
+
+		/* Once fd's reached EOF it's only polled while inbound data is waiting for it to drain */
+		fds[1].fd = fd;
+		fds[1].events = (fd_blocked ? POLLOUT : 0) | ((!local_eof && !channel->remote.close && want) ? POLLIN : 0);
+		fds[0].revents = fds[1].revents = 0;
+
+		/* A transport of its own may have taken input in off the socket while sending (the window
+		 * adjust above, say), its descriptor won't signal that again, so only look at fd this pass
+		 */
+		wait_ms = -1;
+		if (session->transport_abstract && (fds[0].fd >= 0) && (LIBSSH2_WAIT(session, 0, 0) > 0)) {
+			wait_ms = 0;
+		}
+
+		if (poll(fds, fds[1].events ? 2 : 1, wait_ms) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			libssh2_error(session, LIBSSH2_ERROR_SOCKET_NONE, "Error polling relay descriptors", 0);
+			rc = -1;
 			break;
 		}
+
+		/* Outbound: fd -> channel, one packet per pass so inbound traffic stays interleaved
+		 * Only when this pass asked for input: after EOF, or with the window shut, read() returns 0
+		 * and a POLLHUP would turn that into a second or premature CHANNEL_EOF
+		 */
+		if ((fds[1].events & POLLIN) && (fds[1].revents & (POLLIN | POLLHUP))) {
+			ssize_t got = read(fd, outbound + 9, want);
+
+			if (got == 0) {
+				if (libssh2_channel_send_eof(channel)) {
+					rc = -1;
+					break;
+				}
+				local_eof = 1;
+			} else if (got < 0) {
+				if (errno != EAGAIN && errno != EINTR) {
+					libssh2_error(session, LIBSSH2_ERROR_SOCKET_NONE, "Unable to read relayed data from local descriptor", 0);
+					rc = -1;
+					break;
+				}
+			} else {
+				outbound[0] = SSH_MSG_CHANNEL_DATA;
+				libssh2_htonu32(outbound + 1, channel->remote.id);
+				libssh2_htonu32(outbound + 5, got);
+
+				if (libssh2_packet_write(session, outbound, got + 9)) {
+					libssh2_error(session, LIBSSH2_ERROR_SOCKET_SEND, "Unable to send relayed data", 0);
+					rc = -1;
+					break;
+				}
+				LIBSSH2_LOCK(session, data_lock);
+				channel->local.window_size -= got;
+				LIBSSH2_UNLOCK(session, data_lock);
+			}
+		}
 	}
 
-	LIBSSH2_FREE(session, packet);
+ relay_done:
+	LIBSSH2_FREE(session, outbound);
 
-	return bufwrote;
+	return rc;
+#else
+	libssh2_error(channel->session, LIBSSH2_ERROR_INVAL, "Channel relay needs poll()", 0);
+	return -1;
+#endif /* HAVE_POLL */
 }
 /* }}} */
 
@@ -1054,6 +1502,11 @@ LIBSSH2_API int libssh2_channel_send_eof(LIBSSH2_CHANNEL *channel)
 #ifdef LIBSSH2_DEBUG_CONNECTION
 	_libssh2_debug(session, LIBSSH2_DBG_CONN, "Sending EOF on channel %lu/%lu",channel->local.id, channel->remote.id);
 #endif
+	/* EOF goes after anything still queued */
+	if (channel->outq_head && libssh2_channel_outq_run(session, channel, 0, 0)) {
+		return -1;
+	}
+
 	packet[0] = SSH_MSG_CHANNEL_EOF;
 	libssh2_htonu32(packet + 1, channel->remote.id);
 	if (libssh2_packet_write(session, packet, 5)) {
@@ -1072,16 +1525,20 @@ LIBSSH2_API int libssh2_channel_send_eof(LIBSSH2_CHANNEL *channel)
 LIBSSH2_API int libssh2_channel_eof(LIBSSH2_CHANNEL *channel)
 {
 	LIBSSH2_SESSION *session = channel->session;
-	LIBSSH2_PACKET *packet = session->packets.head;
+	LIBSSH2_PACKET *packet;
 
+	LIBSSH2_LOCK(session, data_lock);
+	packet = session->packets.head;
 	while (packet) {
 		if (((packet->data[0] == SSH_MSG_CHANNEL_DATA) || (packet->data[0] == SSH_MSG_CHANNEL_EXTENDED_DATA)) &&
 			(channel->local.id == libssh2_ntohu32(packet->data + 1))) {
 			/* There's data waiting to be read yet, mask the EOF status */
+			LIBSSH2_UNLOCK(session, data_lock);
 			return 0;
 		}
 		packet = packet->next;
 	}
+	LIBSSH2_UNLOCK(session, data_lock);
 
 	return channel->remote.eof;
 }
@@ -1104,6 +1561,10 @@ LIBSSH2_API int libssh2_channel_close(LIBSSH2_CHANNEL *channel)
 	_libssh2_debug(session, LIBSSH2_DBG_CONN, "Closing channel %lu/%lu", channel->local.id, channel->remote.id);
 #endif
 
+	if (channel->outq_head && libssh2_channel_outq_run(session, channel, 0, 0)) {
+		return -1;
+	}
+
 	if (channel->close_cb) {
 		LIBSSH2_CHANNEL_CLOSE(session, channel);
 	}
@@ -1128,6 +1589,7 @@ LIBSSH2_API int libssh2_channel_close(LIBSSH2_CHANNEL *channel)
 LIBSSH2_API int libssh2_channel_wait_closed(LIBSSH2_CHANNEL *channel)
 {
 	LIBSSH2_SESSION* session = channel->session;
+	unsigned long gen;
 
 	if (!libssh2_channel_eof(channel)) {
 		libssh2_error(session, LIBSSH2_ERROR_INVAL, "libssh2_channel_wait_closed() invoked when channel is not in EOF state", 0);
@@ -1143,8 +1605,10 @@ LIBSSH2_API int libssh2_channel_wait_closed(LIBSSH2_CHANNEL *channel)
 	 * Either or channel will be closed
 	 * or network timeout will occur
 	 */
-	while (!channel->remote.close && libssh2_packet_read(session, 1) > 0)
-		;
+	gen = libssh2_packet_gen(session);
+	while (!channel->remote.close && libssh2_packet_read_since(session, gen) > 0) {
+		gen = libssh2_packet_gen(session);
+	}
 
 	return 1;
 }
@@ -1181,12 +1645,19 @@ LIBSSH2_API int libssh2_channel_free(LIBSSH2_CHANNEL *channel)
 		LIBSSH2_FREE(session, data);
 	}
 
+	/* Only left over if the connection went away */
+	libssh2_channel_outq_free(channel);
+	if (channel->write_buf) {
+		LIBSSH2_FREE(session, channel->write_buf);
+	}
+
 	/* free "channel_type" */
 	if (channel->channel_type) {
 		LIBSSH2_FREE(session, channel->channel_type);
 	}
 
 	/* Unlink from channel brigade */
+	LIBSSH2_LOCK(session, data_lock);
 	if (channel->prev) {
 		channel->prev->next = channel->next;
 	} else {
@@ -1197,6 +1668,7 @@ LIBSSH2_API int libssh2_channel_free(LIBSSH2_CHANNEL *channel)
 	} else {
 		session->channels.tail = channel->prev;
 	}
+	LIBSSH2_UNLOCK(session, data_lock);
 
 	LIBSSH2_FREE(session, channel);
 
@@ -97,6 +97,36 @@ static int crypt(LIBSSH2_SESSION *session, unsigned char *block, void **abstract
 				     cctx->encrypt, block);
 }
 
+static int crypt_span(LIBSSH2_SESSION *session, unsigned char *buf, unsigned long len, void **abstract)
+{
+	struct crypt_ctx *cctx = *(struct crypt_ctx **)abstract;
+	return _libssh2_cipher_crypt_span(&cctx->h, buf, len);
+}
+
+static int crypt_clone(LIBSSH2_SESSION *session, void **abstract, void **clone)
+{
+	struct crypt_ctx *cctx = *(struct crypt_ctx **)abstract;
+	struct crypt_ctx *ctx = LIBSSH2_ALLOC(session,
+					      sizeof(struct crypt_ctx));
+	if (!ctx) {
+		return -1;
+	}
+	ctx->encrypt = cctx->encrypt;
+	ctx->algo = cctx->algo;
+	if (_libssh2_cipher_copy(&ctx->h, &cctx->h)) {
+		LIBSSH2_FREE(session, ctx);
+		return -1;
+	}
+	*clone = ctx;
+	return 0;
+}
+
+static int crypt_set_iv(LIBSSH2_SESSION *session, const unsigned char *iv, void **abstract)
+{
+	struct crypt_ctx *cctx = *(struct crypt_ctx **)abstract;
+	return _libssh2_cipher_set_iv(&cctx->h, iv);
+}
+
 static int dtor(LIBSSH2_SESSION *session, void **abstract)
 {
 	struct crypt_ctx **cctx = (struct crypt_ctx **)abstract;
@@ -118,7 +148,10 @@ static LIBSSH2_CRYPT_METHOD libssh2_crypt_method_aes128_cbc = {
 	&init,
 	&crypt,
 	&dtor,
-	_libssh2_cipher_aes128
+	_libssh2_cipher_aes128,
+	&crypt_span,
+	&crypt_clone,
+	&crypt_set_iv
 };
 
 static LIBSSH2_CRYPT_METHOD libssh2_crypt_method_aes192_cbc = {
@@ -130,7 +163,10 @@ static LIBSSH2_CRYPT_METHOD libssh2_crypt_method_aes192_cbc = {
 	&init,
 	&crypt,
 	&dtor,
-	_libssh2_cipher_aes192
+	_libssh2_cipher_aes192,
+	&crypt_span,
+	&crypt_clone,
+	&crypt_set_iv
 };
 
 static LIBSSH2_CRYPT_METHOD libssh2_crypt_method_aes256_cbc = {
@@ -142,7 +178,10 @@ static LIBSSH2_CRYPT_METHOD libssh2_crypt_method_aes256_cbc = {
 	&init,
 	&crypt,
 	&dtor,
-	_libssh2_cipher_aes256
+	_libssh2_cipher_aes256,
+	&crypt_span,
+	&crypt_clone,
+	&crypt_set_iv
 };
 
 /* rijndael-cbc@lysator.liu.se == aes256-cbc */
@@ -155,7 +194,10 @@ static LIBSSH2_CRYPT_METHOD libssh2_crypt_method_rijndael_cbc_lysator_liu_se = {
 	&init,
 	&crypt,
 	&dtor,
-	_libssh2_cipher_aes256
+	_libssh2_cipher_aes256,
+	&crypt_span,
+	&crypt_clone,
+	&crypt_set_iv
 };
 #endif /* LIBSSH2_AES */
 
@@ -169,7 +211,10 @@ static LIBSSH2_CRYPT_METHOD libssh2_crypt_method_blowfish_cbc = {
 	&init,
 	&crypt,
 	&dtor,
-	_libssh2_cipher_blowfish
+	_libssh2_cipher_blowfish,
+	&crypt_span,
+	&crypt_clone,
+	&crypt_set_iv
 };
 #endif /* LIBSSH2_BLOWFISH */
 
@@ -183,7 +228,10 @@ static LIBSSH2_CRYPT_METHOD libssh2_crypt_method_arcfour = {
 	&init,
 	&crypt,
 	&dtor,
-	_libssh2_cipher_arcfour
+	_libssh2_cipher_arcfour,
+	&crypt_span,
+	NULL, /* stream cipher, no blocks to chain */
+	NULL
 };
 #endif /* LIBSSH2_RC4 */
 
@@ -197,7 +245,10 @@ static LIBSSH2_CRYPT_METHOD libssh2_crypt_method_cast128_cbc = {
 	&init,
 	&crypt,
 	&dtor,
-	_libssh2_cipher_cast5
+	_libssh2_cipher_cast5,
+	&crypt_span,
+	&crypt_clone,
+	&crypt_set_iv
 };
 #endif /* LIBSSH2_CAST */
 
@@ -211,7 +262,10 @@ static LIBSSH2_CRYPT_METHOD libssh2_crypt_method_3des_cbc = {
 	&init,
 	&crypt,
 	&dtor,
-	_libssh2_cipher_3des
+	_libssh2_cipher_3des,
+	&crypt_span,
+	&crypt_clone,
+	&crypt_set_iv
 };
 #endif
 
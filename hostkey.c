@@ -102,7 +102,6 @@ static int libssh2_hostkey_method_ssh_rsa_initPEM(LIBSSH2_SESSION *session,
 						  const char *privkeyfile, unsigned const char *passphrase, void **abstract)
 {
 	libssh2_rsa_ctx *rsactx;
-	FILE *fp;
 	int ret;
 
 	if (*abstract) {
@@ -110,13 +109,7 @@ static int libssh2_hostkey_method_ssh_rsa_initPEM(LIBSSH2_SESSION *session,
 		*abstract = NULL;
 	}
 
-	fp = fopen(privkeyfile, "r");
-	if (!fp) {
-		return -1;
-	}
-
-	ret = _libssh2_rsa_new_private (&rsactx, session, fp, passphrase);
-	fclose(fp);
+	ret = _libssh2_rsa_new_private_file (&rsactx, session, privkeyfile, passphrase);
 	if (ret) {
 		return -1;
 	}
@@ -262,7 +255,6 @@ static int libssh2_hostkey_method_ssh_dss_initPEM(LIBSSH2_SESSION *session,
 						  void **abstract)
 {
 	libssh2_dsa_ctx *dsactx;
-	FILE *fp;
 	int ret;
 
 	if (*abstract) {
@@ -270,13 +262,7 @@ static int libssh2_hostkey_method_ssh_dss_initPEM(LIBSSH2_SESSION *session,
 		*abstract = NULL;
 	}
 
-	fp = fopen(privkeyfile, "r");
-	if (!fp) {
-		return -1;
-	}
-
-	ret = _libssh2_dsa_new_private (&dsactx, session, fp, passphrase);
-	fclose(fp);
+	ret = _libssh2_dsa_new_private_file (&dsactx, session, privkeyfile, passphrase);
 	if (ret) {
 		return -1;
 	}
@@ -408,4 +394,15 @@ LIBSSH2_API const char *libssh2_hostkey_hash(LIBSSH2_SESSION *session, int hash_
 }
 /* }}} */
 
-
+/* {{{ libssh2_session_hostkey
+ * Returns the server's raw public key blob, as sent during key exchange
+ * Returned buffer should NOT be freed
+ */
+LIBSSH2_API const char *libssh2_session_hostkey(LIBSSH2_SESSION *session, unsigned long *len)
+{
+	if (len) {
+		*len = session->server_hostkey_len;
+	}
+	return (char *)session->server_hostkey;
+}
+/* }}} */
@@ -0,0 +1,195 @@
+/*
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ *   Redistributions of source code must retain the above
+ *   copyright notice, this list of conditions and the
+ *   following disclaimer.
+ *
+ *   Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following
+ *   disclaimer in the documentation and/or other materials
+ *   provided with the distribution.
+ *
+ *   Neither the name of the copyright holder nor the names
+ *   of any other contributors may be used to endorse or
+ *   promote products derived from this software without
+ *   specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+
+#include "libssh2_priv.h"
+
+/* Global requests awaiting a reply are tracked one bit each, oldest in bit 0 */
+#define LIBSSH2_KEEPALIVE_MAXPENDING	(sizeof(unsigned long) * 8)
+
+/* {{{ libssh2_keepalive_config
+ * Send keepalive@openssh.com requests once the session has been idle for interval seconds (0 disables)
+ * When want_reply is set, give up on the remote end after max_unanswered requests go unanswered (0 never gives up)
+ */
+LIBSSH2_API void libssh2_keepalive_config(LIBSSH2_SESSION *session, int want_reply, unsigned int interval, unsigned int max_unanswered)
+{
+	/* time() only counts whole seconds, so an interval of 1 would fire on nearly every call */
+	session->keepalive_interval = (interval == 1) ? 2 : interval;
+	session->keepalive_want_reply = want_reply ? 1 : 0;
+	session->keepalive_max = max_unanswered;
+}
+/* }}} */
+
+/* {{{ libssh2_global_request_sent
+ * Note a want_reply global request so its reply can be matched up later
+ */
+int libssh2_global_request_sent(LIBSSH2_SESSION *session, int keepalive)
+{
+	if (session->global_replies_len >= LIBSSH2_KEEPALIVE_MAXPENDING) {
+		return -1;
+	}
+	if (keepalive) {
+		session->global_replies |= 1UL << session->global_replies_len;
+	}
+	session->global_replies_len++;
+
+	return 0;
+}
+/* }}} */
+
+/* {{{ libssh2_global_reply_received
+ * Match an SSH_MSG_REQUEST_SUCCESS/FAILURE against the oldest outstanding request
+ * Returns 1 if the reply was for a keepalive, and shouldn't be queued
+ */
+int libssh2_global_reply_received(LIBSSH2_SESSION *session)
+{
+	int keepalive;
+
+	if (!session->global_replies_len) {
+		return 0;
+	}
+
+	keepalive = session->global_replies & 1;
+	session->global_replies >>= 1;
+	session->global_replies_len--;
+
+	if (keepalive) {
+		/* Success or failure, either way the remote end is still there */
+		session->keepalive_unanswered = 0;
+	}
+
+	return keepalive;
+}
+/* }}} */
+
+/* {{{ libssh2_keepalive_send
+ * Send a keepalive if the session has been idle long enough
+ * seconds_to_next (if not NULL) is set to how long the caller may wait before calling again
+ */
+LIBSSH2_API int libssh2_keepalive_send(LIBSSH2_SESSION *session, int *seconds_to_next)
+{
+	unsigned char packet[5 + sizeof("keepalive@openssh.com") - 1 + 1], *s = packet;
+					/* packet_type(1) + request_len(4) + request + want_reply(1) */
+	time_t now, last;
+	int want_reply;
+
+	if (!session->keepalive_interval) {
+		if (seconds_to_next) {
+			*seconds_to_next = 0;
+		}
+		return 0;
+	}
+
+	/* Only connection protocol messages may be sent, and none in the middle of a key exchange */
+	if (!(session->state & LIBSSH2_STATE_NEWKEYS) || (session->state & LIBSSH2_STATE_EXCHANGING_KEYS)) {
+		if (seconds_to_next) {
+			*seconds_to_next = session->keepalive_interval;
+		}
+		return 0;
+	}
+
+	now = time(NULL);
+	last = (session->keepalive_last_sent > session->last_recv) ? session->keepalive_last_sent : session->last_recv;
+
+	if (last && (now - last) < session->keepalive_interval) {
+		if (seconds_to_next) {
+			*seconds_to_next = session->keepalive_interval - (now - last);
+		}
+		return 0;
+	}
+
+	if (session->keepalive_max && session->keepalive_unanswered >= session->keepalive_max) {
+		libssh2_error(session, LIBSSH2_ERROR_SOCKET_TIMEOUT, "Remote host stopped answering keepalives", 0);
+		session->socket_state = LIBSSH2_SOCKET_DISCONNECTED;
+		return -1;
+	}
+
+	/* With too many requests already outstanding, send one anyway but don't ask for a reply */
+	want_reply = session->keepalive_want_reply && (session->global_replies_len < LIBSSH2_KEEPALIVE_MAXPENDING);
+
+	*(s++) = SSH_MSG_GLOBAL_REQUEST;
+	libssh2_htonu32(s, sizeof("keepalive@openssh.com") - 1);					s += 4;
+	memcpy(s, "keepalive@openssh.com", sizeof("keepalive@openssh.com") - 1);	s += sizeof("keepalive@openssh.com") - 1;
+	*(s++) = want_reply ? 0xFF : 0x00;
+
+#ifdef LIBSSH2_DEBUG_CONNECTION
+	_libssh2_debug(session, LIBSSH2_DBG_CONN, "Sending keepalive, %d unanswered", session->keepalive_unanswered);
+#endif
+	if (libssh2_packet_write(session, packet, s - packet)) {
+		libssh2_error(session, LIBSSH2_ERROR_SOCKET_SEND, "Unable to send keepalive message", 0);
+		return -1;
+	}
+	/* Keepalives are sent while waiting to read, so they can't sit in the cork buffer */
+	if (session->corked && libssh2_packet_flush(session)) {
+		return -1;
+	}
+
+	if (want_reply) {
+		libssh2_global_request_sent(session, 1);
+		session->keepalive_unanswered++;
+	}
+	session->keepalive_last_sent = now;
+
+	if (seconds_to_next) {
+		*seconds_to_next = session->keepalive_interval;
+	}
+
+	return 0;
+}
+/* }}} */
+
+/* {{{ libssh2_keepalive_wait
+ * LIBSSH2_WAIT for something to read, sending keepalives whenever the session goes idle in the meantime
+ */
+int libssh2_keepalive_wait(LIBSSH2_SESSION *session, long timeout)
+{
+	int next, ret;
+
+	while (session->keepalive_interval) {
+		if (libssh2_keepalive_send(session, &next)) {
+			return -1;
+		}
+		if ((next * 1000L) >= timeout) {
+			break;
+		}
+		ret = LIBSSH2_WAIT(session, 0, next * 1000L);
+		if (ret != 0) {
+			return ret;
+		}
+		timeout -= next * 1000L;
+	}
+
+	return LIBSSH2_WAIT(session, 0, timeout);
+}
+/* }}} */
@@ -362,6 +362,8 @@ static int libssh2_kex_method_diffie_hellman_groupGP_sha1_key_exchange(LIBSSH2_S
 	_libssh2_debug(session, LIBSSH2_DBG_KEX, "Client to Server IV and Key calculated");
 #endif
 
+	/* Along with the crypto workers' copies of it */
+	libssh2_pipeline_drop_keys(session);
 	if (session->remote.crypt->dtor) {
 		/* Cleanup any existing cipher */
 		session->remote.crypt->dtor(session, &session->remote.crypt_abstract);
@@ -1222,11 +1224,11 @@ static int libssh2_kex_agree_methods(LIBSSH2_SESSION *session, unsigned char *da
 }
 /* }}} */
 
-/* {{{ libssh2_kex_exchange
+/* {{{ libssh2_kex_exchange_unlocked
  * Exchange keys
  * Returns 0 on success, non-zero on failure
  */
-int libssh2_kex_exchange(LIBSSH2_SESSION *session, int reexchange) /* session->flags |= SERVER */
+static int libssh2_kex_exchange_unlocked(LIBSSH2_SESSION *session, int reexchange) /* session->flags |= SERVER */
 {
 	unsigned char *data;
 	unsigned long data_len;
@@ -1292,10 +1294,36 @@ int libssh2_kex_exchange(LIBSSH2_SESSION *session, int reexchange) /* session->f
 
 	session->state &= ~LIBSSH2_STATE_EXCHANGING_KEYS;
 
+	/* Restart the rekey limits, whichever end asked for these keys they answer a pending request too */
+	LIBSSH2_LOCK(session, data_lock);
+	session->kex_bytes = 0;
+	session->kex_time = time(NULL);
+	session->rekey_pending = 0;
+	LIBSSH2_UNLOCK(session, data_lock);
+	LIBSSH2_STAT_ADD(session, key_exchanges, 1);
+
 	return 0;
 }
 /* }}} */
 
+/* {{{ libssh2_kex_exchange
+ * With LIBSSH2_FLAG_THREADED, keys are exchanged holding both transport locks, so no other thread
+ * reads a packet under the old keys or slips a non-KEX packet in between KEXINIT and NEWKEYS
+ */
+int libssh2_kex_exchange(LIBSSH2_SESSION *session, int reexchange)
+{
+	int ret;
+
+	LIBSSH2_LOCK(session, read_lock);
+	LIBSSH2_LOCK(session, write_lock);
+	ret = libssh2_kex_exchange_unlocked(session, reexchange);
+	LIBSSH2_UNLOCK(session, write_lock);
+	LIBSSH2_UNLOCK(session, read_lock);
+
+	return ret;
+}
+/* }}} */
+
 /* {{{ libssh2_session_method_pref
  * Set preferred method
  */
@@ -0,0 +1,739 @@
+/*
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ *   Redistributions of source code must retain the above
+ *   copyright notice, this list of conditions and the
+ *   following disclaimer.
+ *
+ *   Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following
+ *   disclaimer in the documentation and/or other materials
+ *   provided with the distribution.
+ *
+ *   Neither the name of the copyright holder nor the names
+ *   of any other contributors may be used to endorse or
+ *   promote products derived from this software without
+ *   specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+
+#include "libssh2_priv.h"
+#include <stdlib.h>
+#include <fcntl.h>
+#ifndef WIN32
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+/* OpenSSH known_hosts support
+ *
+ * The file is parsed once into a hash table.  Plain entries are keyed on the
+ * name exactly as OpenSSH writes it ("host" for port 22, "[host]:port" otherwise),
+ * hashed entries ("|1|salt|hash") are keyed on their HMAC-SHA1 digest.  Hashed
+ * entries sharing a salt form one group, so resolving a name costs one HMAC per
+ * distinct salt rather than one per line.  OpenSSH gives every hashed line a salt
+ * of its own though, so the first lookup of a name against a hashed file is still
+ * one HMAC per line (a few hundred ms for 100,000 lines); the hashed entries it finds,
+ * or the fact that there are none, are then cached per name so repeat lookups are
+ * a hash probe.  The cache holds up to LIBSSH2_KNOWNHOST_RESOLVED_MAX names and is
+ * dropped whenever a hashed entry is added.  Lookups update the cache, so a store
+ * shared between threads needs the caller's own lock even for checks.
+ *
+ * Wildcard patterns and @cert-authority/@revoked markers are not interpreted;
+ * pattern names are only ever matched literally and marker lines are skipped.
+ */
+
+#define LIBSSH2_KNOWNHOST_HASH_MAGIC		"|1|"
+#define LIBSSH2_KNOWNHOST_INITIAL_BUCKETS	256
+#define LIBSSH2_KNOWNHOST_SALT_BUCKETS		4096
+#define LIBSSH2_KNOWNHOST_RESOLVED_BUCKETS	64
+#define LIBSSH2_KNOWNHOST_RESOLVED_MAX		1024
+
+typedef struct _libssh2_knownhost_entry libssh2_knownhost_entry;
+
+struct _libssh2_knownhost_entry {
+	libssh2_knownhost_entry *next;	/* bucket chain */
+
+	int hashed;
+	unsigned char *name;			/* host name, or SHA1 digest when hashed */
+	unsigned long name_len;
+
+	unsigned char *key;				/* raw public key blob */
+	unsigned long key_len;
+};
+
+typedef struct _libssh2_knownhost_salt libssh2_knownhost_salt;
+
+struct _libssh2_knownhost_salt {
+	libssh2_knownhost_salt *next;	/* bucket chain */
+	libssh2_knownhost_salt *all;	/* every salt, for lookups */
+	unsigned char salt[SHA_DIGEST_LENGTH];
+};
+
+typedef struct _libssh2_knownhost_resolved libssh2_knownhost_resolved;
+
+struct _libssh2_knownhost_resolved {
+	libssh2_knownhost_resolved *next;	/* bucket chain */
+
+	unsigned char *name;				/* name as OpenSSH writes it */
+	unsigned long name_len;
+
+	libssh2_knownhost_entry **entries;	/* hashed entries for name, possibly none */
+	unsigned long entry_count;
+};
+
+struct _LIBSSH2_KNOWNHOSTS {
+	LIBSSH2_SESSION *session;
+
+	libssh2_knownhost_entry **buckets;
+	unsigned long bucket_count;
+	unsigned long count;
+
+	/* Distinct salts seen in hashed entries */
+	libssh2_knownhost_salt **salt_buckets;
+	libssh2_knownhost_salt *salts;
+	unsigned long salt_count;
+
+	/* Names already looked up against the salts */
+	libssh2_knownhost_resolved *resolved[LIBSSH2_KNOWNHOST_RESOLVED_BUCKETS];
+	unsigned long resolved_count;
+};
+
+/* {{{ libssh2_knownhost_hashfunc
+ * FNV-1a, with the hashed flag mixed in so "host" and a digest can't collide by value
+ */
+static unsigned long libssh2_knownhost_hashfunc(int hashed, const unsigned char *name, unsigned long name_len)
+{
+	unsigned long h = 2166136261UL ^ (hashed ? 0xff : 0);
+	unsigned long i;
+
+	for(i = 0; i < name_len; i++) {
+		h ^= name[i];
+		h *= 16777619UL;
+	}
+	return h;
+}
+/* }}} */
+
+/* {{{ libssh2_knownhost_rehash
+ * Double the bucket count once the table averages two entries per bucket
+ */
+static int libssh2_knownhost_rehash(LIBSSH2_KNOWNHOSTS *hosts)
+{
+	LIBSSH2_SESSION *session = hosts->session;
+	libssh2_knownhost_entry **buckets;
+	unsigned long bucket_count = hosts->bucket_count * 2;
+	unsigned long i;
+
+	buckets = LIBSSH2_ALLOC(session, bucket_count * sizeof(libssh2_knownhost_entry *));
+	if (!buckets) {
+		/* Keep going with longer chains */
+		return -1;
+	}
+	memset(buckets, 0, bucket_count * sizeof(libssh2_knownhost_entry *));
+
+	for(i = 0; i < hosts->bucket_count; i++) {
+		libssh2_knownhost_entry *entry = hosts->buckets[i];
+
+		while (entry) {
+			libssh2_knownhost_entry *next = entry->next;
+			unsigned long b = libssh2_knownhost_hashfunc(entry->hashed, entry->name, entry->name_len) % bucket_count;
+
+			entry->next = buckets[b];
+			buckets[b] = entry;
+			entry = next;
+		}
+	}
+
+	LIBSSH2_FREE(session, hosts->buckets);
+	hosts->buckets = buckets;
+	hosts->bucket_count = bucket_count;
+
+	return 0;
+}
+/* }}} */
+
+/* {{{ libssh2_knownhost_insert
+ * Copy name and key into a new entry and link it into the table
+ */
+static int libssh2_knownhost_insert(LIBSSH2_KNOWNHOSTS *hosts, int hashed, const unsigned char *name, unsigned long name_len,
+																		const unsigned char *key, unsigned long key_len)
+{
+	LIBSSH2_SESSION *session = hosts->session;
+	libssh2_knownhost_entry *entry;
+	unsigned long b;
+
+	/* One allocation for the entry, its name and its key */
+	entry = LIBSSH2_ALLOC(session, sizeof(libssh2_knownhost_entry) + name_len + key_len);
+	if (!entry) {
+		libssh2_error(session, LIBSSH2_ERROR_ALLOC, "Unable to allocate memory for known host entry", 0);
+		return -1;
+	}
+	entry->hashed = hashed;
+	entry->name = (unsigned char *)(entry + 1);
+	entry->name_len = name_len;
+	memcpy(entry->name, name, name_len);
+	entry->key = entry->name + name_len;
+	entry->key_len = key_len;
+	memcpy(entry->key, key, key_len);
+
+	if (hosts->count >= (2 * hosts->bucket_count)) {
+		libssh2_knownhost_rehash(hosts);
+	}
+
+	b = libssh2_knownhost_hashfunc(hashed, name, name_len) % hosts->bucket_count;
+	entry->next = hosts->buckets[b];
+	hosts->buckets[b] = entry;
+	hosts->count++;
+
+	return 0;
+}
+/* }}} */
+
+/* {{{ libssh2_knownhost_add_salt
+ * Remember a salt if it hasn't been seen already
+ * Salts are random, so their leading bytes index the buckets directly
+ */
+static int libssh2_knownhost_add_salt(LIBSSH2_KNOWNHOSTS *hosts, const unsigned char *salt)
+{
+	LIBSSH2_SESSION *session = hosts->session;
+	libssh2_knownhost_salt *entry;
+	unsigned long b = libssh2_ntohu32(salt) % LIBSSH2_KNOWNHOST_SALT_BUCKETS;
+
+	for(entry = hosts->salt_buckets[b]; entry; entry = entry->next) {
+		if (!memcmp(entry->salt, salt, SHA_DIGEST_LENGTH)) {
+			return 0;
+		}
+	}
+
+	entry = LIBSSH2_ALLOC(session, sizeof(libssh2_knownhost_salt));
+	if (!entry) {
+		libssh2_error(session, LIBSSH2_ERROR_ALLOC, "Unable to allocate memory for known host salt", 0);
+		return -1;
+	}
+	memcpy(entry->salt, salt, SHA_DIGEST_LENGTH);
+	entry->next = hosts->salt_buckets[b];
+	hosts->salt_buckets[b] = entry;
+	entry->all = hosts->salts;
+	hosts->salts = entry;
+	hosts->salt_count++;
+
+	return 0;
+}
+/* }}} */
+
+/* {{{ libssh2_knownhost_flush_resolved
+ * Forget every cached lookup
+ */
+static void libssh2_knownhost_flush_resolved(LIBSSH2_KNOWNHOSTS *hosts)
+{
+	unsigned long i;
+
+	for(i = 0; i < LIBSSH2_KNOWNHOST_RESOLVED_BUCKETS; i++) {
+		while (hosts->resolved[i]) {
+			libssh2_knownhost_resolved *next = hosts->resolved[i]->next;
+
+			LIBSSH2_FREE(hosts->session, hosts->resolved[i]);
+			hosts->resolved[i] = next;
+		}
+	}
+	hosts->resolved_count = 0;
+}
+/* }}} */
+
+/* {{{ libssh2_knownhost_init
+ * Create an empty known hosts store, allocating through session
+ */
+LIBSSH2_API LIBSSH2_KNOWNHOSTS *libssh2_knownhost_init(LIBSSH2_SESSION *session)
+{
+	LIBSSH2_KNOWNHOSTS *hosts;
+
+	hosts = LIBSSH2_ALLOC(session, sizeof(LIBSSH2_KNOWNHOSTS));
+	if (!hosts) {
+		libssh2_error(session, LIBSSH2_ERROR_ALLOC, "Unable to allocate memory for known hosts", 0);
+		return NULL;
+	}
+	memset(hosts, 0, sizeof(LIBSSH2_KNOWNHOSTS));
+	hosts->session = session;
+
+	hosts->bucket_count = LIBSSH2_KNOWNHOST_INITIAL_BUCKETS;
+	hosts->buckets = LIBSSH2_ALLOC(session, hosts->bucket_count * sizeof(libssh2_knownhost_entry *));
+	if (!hosts->buckets) {
+		libssh2_error(session, LIBSSH2_ERROR_ALLOC, "Unable to allocate memory for known hosts", 0);
+		LIBSSH2_FREE(session, hosts);
+		return NULL;
+	}
+	memset(hosts->buckets, 0, hosts->bucket_count * sizeof(libssh2_knownhost_entry *));
+
+	hosts->salt_buckets = LIBSSH2_ALLOC(session, LIBSSH2_KNOWNHOST_SALT_BUCKETS * sizeof(libssh2_knownhost_salt *));
+	if (!hosts->salt_buckets) {
+		libssh2_error(session, LIBSSH2_ERROR_ALLOC, "Unable to allocate memory for known hosts", 0);
+		LIBSSH2_FREE(session, hosts->buckets);
+		LIBSSH2_FREE(session, hosts);
+		return NULL;
+	}
+	memset(hosts->salt_buckets, 0, LIBSSH2_KNOWNHOST_SALT_BUCKETS * sizeof(libssh2_knownhost_salt *));
+
+	return hosts;
+}
+/* }}} */
+
+/* {{{ libssh2_knownhost_free
+ * Release a known hosts store and every entry in it
+ */
+LIBSSH2_API void libssh2_knownhost_free(LIBSSH2_KNOWNHOSTS *hosts)
+{
+	LIBSSH2_SESSION *session;
+	unsigned long i;
+
+	if (!hosts) {
+		return;
+	}
+	session = hosts->session;
+
+	for(i = 0; i < hosts->bucket_count; i++) {
+		libssh2_knownhost_entry *entry = hosts->buckets[i];
+
+		while (entry) {
+			libssh2_knownhost_entry *next = entry->next;
+
+			LIBSSH2_FREE(session, entry);
+			entry = next;
+		}
+	}
+	LIBSSH2_FREE(session, hosts->buckets);
+
+	while (hosts->salts) {
+		libssh2_knownhost_salt *next = hosts->salts->all;
+
+		LIBSSH2_FREE(session, hosts->salts);
+		hosts->salts = next;
+	}
+	LIBSSH2_FREE(session, hosts->salt_buckets);
+
+	libssh2_knownhost_flush_resolved(hosts);
+
+	LIBSSH2_FREE(session, hosts);
+}
+/* }}} */
+
+/* {{{ libssh2_knownhost_name
+ * Write the name OpenSSH uses for host:port into buf
+ * Returns the name's length, or 0 if buf is too small
+ */
+static unsigned long libssh2_knownhost_name(char *buf, unsigned long buf_len, const char *host, int port)
+{
+	int len;
+
+	if (port == 22 || port <= 0) {
+		len = snprintf(buf, buf_len, "%s", host);
+	} else {
+		len = snprintf(buf, buf_len, "[%s]:%d", host, port);
+	}
+	if (len < 0 || (unsigned long)len >= buf_len) {
+		return 0;
+	}
+	return len;
+}
+/* }}} */
+
+/* {{{ libssh2_knownhost_parse_hashed
+ * Add one "|1|salt|hash" name
+ */
+static int libssh2_knownhost_parse_hashed(LIBSSH2_KNOWNHOSTS *hosts, const char *name, unsigned long name_len,
+																	  const unsigned char *key, unsigned long key_len)
+{
+	unsigned char salt[SHA_DIGEST_LENGTH + 1], digest[SHA_DIGEST_LENGTH + 1];
+	unsigned int salt_len = 0, digest_len = 0, quartet = 0;
+	const char *sep;
+
+	name += sizeof(LIBSSH2_KNOWNHOST_HASH_MAGIC) - 1;
+	name_len -= sizeof(LIBSSH2_KNOWNHOST_HASH_MAGIC) - 1;
+
+	sep = memchr(name, '|', name_len);
+	if (!sep ||
+		(sep - name) > (4 * ((SHA_DIGEST_LENGTH + 2) / 3)) ||
+		(name_len - (sep - name) - 1) > (4 * ((SHA_DIGEST_LENGTH + 2) / 3))) {
+		return -1;
+	}
+
+	libssh2_base64_decode_chunk(salt, &salt_len, &quartet, name, sep - name);
+	quartet = 0;
+	libssh2_base64_decode_chunk(digest, &digest_len, &quartet, sep + 1, name_len - (sep - name) - 1);
+	if (salt_len != SHA_DIGEST_LENGTH || digest_len != SHA_DIGEST_LENGTH) {
+		return -1;
+	}
+
+	if (libssh2_knownhost_add_salt(hosts, salt) ||
+		libssh2_knownhost_insert(hosts, 1, digest, SHA_DIGEST_LENGTH, key, key_len)) {
+		return -1;
+	}
+
+	/* Any name looked up so far may hash to this entry */
+	if (hosts->resolved_count) {
+		libssh2_knownhost_flush_resolved(hosts);
+	}
+	return 0;
+}
+/* }}} */
+
+/* {{{ libssh2_knownhost_parse_line
+ * Parse one known_hosts line: names, key type, base64 key, optional comment
+ * Lines which can't be understood are skipped rather than failing the whole file
+ */
+static int libssh2_knownhost_parse_line(LIBSSH2_KNOWNHOSTS *hosts, const char *line, unsigned long line_len)
+{
+	LIBSSH2_SESSION *session = hosts->session;
+	const char *end = line + line_len, *names, *names_end, *key64, *key64_end, *name;
+	unsigned char *key;
+	unsigned int key_len = 0, quartet = 0;
+	int rc = 0;
+
+	while (line < end && (*line == ' ' || *line == '\t')) line++;
+	if (line == end || *line == '#' || *line == '@') {
+		return 0;
+	}
+
+	names = line;
+	while (line < end && *line != ' ' && *line != '\t') line++;
+	names_end = line;
+
+	/* Key type is repeated inside the key blob itself, so it's only skipped over */
+	while (line < end && (*line == ' ' || *line == '\t')) line++;
+	while (line < end && *line != ' ' && *line != '\t') line++;
+	while (line < end && (*line == ' ' || *line == '\t')) line++;
+
+	key64 = line;
+	while (line < end && *line != ' ' && *line != '\t') line++;
+	key64_end = line;
+
+	if (key64 == key64_end) {
+		return 0;
+	}
+
+	key = LIBSSH2_ALLOC(session, (3 * (key64_end - key64) / 4) + 1);
+	if (!key) {
+		libssh2_error(session, LIBSSH2_ERROR_ALLOC, "Unable to allocate memory for known host key", 0);
+		return -1;
+	}
+	libssh2_base64_decode_chunk(key, &key_len, &quartet, key64, key64_end - key64);
+	if ((quartet % 4) == 1) {
+		LIBSSH2_FREE(session, key);
+		return 0;
+	}
+
+	for(name = names; name < names_end; ) {
+		const char *comma = memchr(name, ',', names_end - name);
+		const char *name_end = comma ? comma : names_end;
+
+		if (name_end > name) {
+			if (((unsigned long)(name_end - name) > (sizeof(LIBSSH2_KNOWNHOST_HASH_MAGIC) - 1)) &&
+				!memcmp(name, LIBSSH2_KNOWNHOST_HASH_MAGIC, sizeof(LIBSSH2_KNOWNHOST_HASH_MAGIC) - 1)) {
+				/* Malformed hashes are ignored, only allocation failure is fatal */
+				if (libssh2_knownhost_parse_hashed(hosts, name, name_end - name, key, key_len) &&
+					libssh2_session_last_error(session, NULL, NULL, 0) == LIBSSH2_ERROR_ALLOC) {
+					rc = -1;
+					break;
+				}
+			} else if (libssh2_knownhost_insert(hosts, 0, (const unsigned char *)name, name_end - name, key, key_len)) {
+				rc = -1;
+				break;
+			}
+		}
+		name = name_end + 1;
+	}
+
+	LIBSSH2_FREE(session, key);
+	return rc;
+}
+/* }}} */
+
+/* {{{ libssh2_knownhost_readfile
+ * Add every entry in an OpenSSH known_hosts file
+ * The file is mapped rather than read so large files are parsed without copying
+ * Returns the number of entries in the store afterwards, or -1 on failure
+ */
+LIBSSH2_API int libssh2_knownhost_readfile(LIBSSH2_KNOWNHOSTS *hosts, const char *filename)
+{
+	LIBSSH2_SESSION *session = hosts->session;
+	struct stat st;
+	const char *map, *s, *end;
+	int fd, rc = 0;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		libssh2_error(session, LIBSSH2_ERROR_FILE, "Unable to open known hosts file", 0);
+		return -1;
+	}
+	if (fstat(fd, &st)) {
+		libssh2_error(session, LIBSSH2_ERROR_FILE, "Unable to stat known hosts file", 0);
+		close(fd);
+		return -1;
+	}
+	if (st.st_size == 0) {
+		close(fd);
+		return hosts->count;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		libssh2_error(session, LIBSSH2_ERROR_FILE, "Unable to map known hosts file", 0);
+		return -1;
+	}
+
+	end = map + st.st_size;
+	for(s = map; s < end; ) {
+		const char *eol = memchr(s, '\n', end - s);
+		const char *line_end = eol ? eol : end;
+
+		if (line_end > s && *(line_end - 1) == '\r') {
+			line_end--;
+		}
+		if (libssh2_knownhost_parse_line(hosts, s, line_end - s)) {
+			rc = -1;
+			break;
+		}
+		s = eol ? eol + 1 : end;
+	}
+
+	munmap((void *)map, st.st_size);
+
+	return rc ? -1 : (int)hosts->count;
+}
+/* }}} */
+
+/* {{{ libssh2_knownhost_add
+ * Add a plain entry for host:port
+ */
+LIBSSH2_API int libssh2_knownhost_add(LIBSSH2_KNOWNHOSTS *hosts, const char *host, int port,
+																 const char *key, unsigned long key_len)
+{
+	char name[1024];
+	unsigned long name_len;
+
+	name_len = libssh2_knownhost_name(name, sizeof(name), host, port);
+	if (!name_len) {
+		libssh2_error(hosts->session, LIBSSH2_ERROR_INVAL, "Host name too long", 0);
+		return -1;
+	}
+
+	return libssh2_knownhost_insert(hosts, 0, (unsigned char *)name, name_len, (const unsigned char *)key, key_len);
+}
+/* }}} */
+
+/* {{{ libssh2_knownhost_appendfile
+ * Add a plain entry for host:port and append the matching line to filename
+ * The key type written is the one named inside the key blob
+ */
+LIBSSH2_API int libssh2_knownhost_appendfile(LIBSSH2_KNOWNHOSTS *hosts, const char *filename, const char *host, int port,
+																		const char *key, unsigned long key_len)
+{
+	LIBSSH2_SESSION *session = hosts->session;
+	char name[1024], *key64;
+	unsigned long name_len, type_len;
+	unsigned int key64_len;
+	FILE *fp;
+	int rc = 0;
+
+	if (key_len < 4 || (type_len = libssh2_ntohu32((const unsigned char *)key)) > (key_len - 4)) {
+		libssh2_error(session, LIBSSH2_ERROR_INVAL, "Invalid host key blob", 0);
+		return -1;
+	}
+
+	name_len = libssh2_knownhost_name(name, sizeof(name), host, port);
+	if (!name_len) {
+		libssh2_error(session, LIBSSH2_ERROR_INVAL, "Host name too long", 0);
+		return -1;
+	}
+
+	key64 = LIBSSH2_ALLOC(session, 4 * ((key_len + 2) / 3));
+	if (!key64) {
+		libssh2_error(session, LIBSSH2_ERROR_ALLOC, "Unable to allocate memory for known host line", 0);
+		return -1;
+	}
+	key64_len = libssh2_base64_encode_raw(key64, (const unsigned char *)key, key_len);
+
+	fp = fopen(filename, "a");
+	if (!fp) {
+		libssh2_error(session, LIBSSH2_ERROR_FILE, "Unable to open known hosts file for appending", 0);
+		LIBSSH2_FREE(session, key64);
+		return -1;
+	}
+	if (fprintf(fp, "%.*s %.*s %.*s\n", (int)name_len, name, (int)type_len, key + 4, (int)key64_len, key64) < 0) {
+		libssh2_error(session, LIBSSH2_ERROR_FILE, "Unable to write to known hosts file", 0);
+		rc = -1;
+	}
+	if (fclose(fp)) {
+		rc = -1;
+	}
+	LIBSSH2_FREE(session, key64);
+
+	if (rc) {
+		return -1;
+	}
+
+	return libssh2_knownhost_insert(hosts, 0, (unsigned char *)name, name_len, (const unsigned char *)key, key_len);
+}
+/* }}} */
+
+/* {{{ libssh2_knownhost_check_bucket
+ * Compare key against every entry called name
+ * Returns LIBSSH2_KNOWNHOST_CHECK_MATCH, _MISMATCH if the name is known under other keys, or _NOTFOUND
+ */
+static int libssh2_knownhost_check_bucket(LIBSSH2_KNOWNHOSTS *hosts, int hashed, const unsigned char *name, unsigned long name_len,
+																	  const unsigned char *key, unsigned long key_len)
+{
+	libssh2_knownhost_entry *entry;
+	int result = LIBSSH2_KNOWNHOST_CHECK_NOTFOUND;
+
+	entry = hosts->buckets[libssh2_knownhost_hashfunc(hashed, name, name_len) % hosts->bucket_count];
+	for(; entry; entry = entry->next) {
+		if (entry->hashed != hashed || entry->name_len != name_len || memcmp(entry->name, name, name_len)) {
+			continue;
+		}
+		if (entry->key_len == key_len && !memcmp(entry->key, key, key_len)) {
+			return LIBSSH2_KNOWNHOST_CHECK_MATCH;
+		}
+		result = LIBSSH2_KNOWNHOST_CHECK_MISMATCH;
+	}
+
+	return result;
+}
+/* }}} */
+
+/* {{{ libssh2_knownhost_resolve
+ * Find the hashed entries for name, from the cache or by trying every salt
+ * Returns NULL on allocation failure
+ */
+static libssh2_knownhost_resolved *libssh2_knownhost_resolve(LIBSSH2_KNOWNHOSTS *hosts, const char *name, unsigned long name_len)
+{
+	LIBSSH2_SESSION *session = hosts->session;
+	libssh2_knownhost_resolved *resolved;
+	libssh2_knownhost_entry **found = NULL, **grown, *entry;
+	unsigned long found_count = 0, found_size = 0;
+	unsigned long b = libssh2_knownhost_hashfunc(0, (const unsigned char *)name, name_len) % LIBSSH2_KNOWNHOST_RESOLVED_BUCKETS;
+	unsigned char digest[SHA_DIGEST_LENGTH];
+	libssh2_knownhost_salt *salt;
+
+	for(resolved = hosts->resolved[b]; resolved; resolved = resolved->next) {
+		if (resolved->name_len == name_len && !memcmp(resolved->name, name, name_len)) {
+			return resolved;
+		}
+	}
+
+	for(salt = hosts->salts; salt; salt = salt->all) {
+		libssh2_hmac_ctx ctx;
+
+		libssh2_hmac_sha1_init(&ctx, salt->salt, SHA_DIGEST_LENGTH);
+		libssh2_hmac_update(ctx, (unsigned char *)name, name_len);
+		libssh2_hmac_final(ctx, digest);
+		libssh2_hmac_cleanup(&ctx);
+
+		entry = hosts->buckets[libssh2_knownhost_hashfunc(1, digest, SHA_DIGEST_LENGTH) % hosts->bucket_count];
+		for(; entry; entry = entry->next) {
+			if (!entry->hashed || entry->name_len != SHA_DIGEST_LENGTH || memcmp(entry->name, digest, SHA_DIGEST_LENGTH)) {
+				continue;
+			}
+			if (found_count == found_size) {
+				found_size = found_size ? (2 * found_size) : 4;
+				grown = LIBSSH2_REALLOC(session, found, found_size * sizeof(libssh2_knownhost_entry *));
+				if (!grown) {
+					goto alloc_error;
+				}
+				found = grown;
+			}
+			found[found_count++] = entry;
+		}
+	}
+
+	if (hosts->resolved_count >= LIBSSH2_KNOWNHOST_RESOLVED_MAX) {
+		libssh2_knownhost_flush_resolved(hosts);
+	}
+
+	/* One allocation for the record, its entry list and its name */
+	resolved = LIBSSH2_ALLOC(session, sizeof(libssh2_knownhost_resolved) + (found_count * sizeof(libssh2_knownhost_entry *)) + name_len);
+	if (!resolved) {
+		goto alloc_error;
+	}
+	resolved->entries = (libssh2_knownhost_entry **)(resolved + 1);
+	resolved->entry_count = found_count;
+	if (found_count) {
+		memcpy(resolved->entries, found, found_count * sizeof(libssh2_knownhost_entry *));
+	}
+	resolved->name = (unsigned char *)(resolved->entries + found_count);
+	resolved->name_len = name_len;
+	memcpy(resolved->name, name, name_len);
+
+	resolved->next = hosts->resolved[b];
+	hosts->resolved[b] = resolved;
+	hosts->resolved_count++;
+
+	if (found) {
+		LIBSSH2_FREE(session, found);
+	}
+	return resolved;
+
+ alloc_error:
+	libssh2_error(session, LIBSSH2_ERROR_ALLOC, "Unable to allocate memory for known host lookup", 0);
+	if (found) {
+		LIBSSH2_FREE(session, found);
+	}
+	return NULL;
+}
+/* }}} */
+
+/* {{{ libssh2_knownhost_check
+ * Look host:port up, plain names first then the hashed entries resolved for it
+ */
+LIBSSH2_API int libssh2_knownhost_check(LIBSSH2_KNOWNHOSTS *hosts, const char *host, int port,
+																   const char *key, unsigned long key_len)
+{
+	char name[1024];
+	unsigned long name_len, i;
+	libssh2_knownhost_resolved *resolved;
+	int result;
+
+	name_len = libssh2_knownhost_name(name, sizeof(name), host, port);
+	if (!name_len) {
+		return LIBSSH2_KNOWNHOST_CHECK_FAILURE;
+	}
+
+	result = libssh2_knownhost_check_bucket(hosts, 0, (unsigned char *)name, name_len, (const unsigned char *)key, key_len);
+	if (result == LIBSSH2_KNOWNHOST_CHECK_MATCH || !hosts->salts) {
+		return result;
+	}
+
+	resolved = libssh2_knownhost_resolve(hosts, name, name_len);
+	if (!resolved) {
+		return LIBSSH2_KNOWNHOST_CHECK_FAILURE;
+	}
+
+	for(i = 0; i < resolved->entry_count; i++) {
+		libssh2_knownhost_entry *entry = resolved->entries[i];
+
+		if (entry->key_len == key_len && !memcmp(entry->key, key, key_len)) {
+			return LIBSSH2_KNOWNHOST_CHECK_MATCH;
+		}
+		result = LIBSSH2_KNOWNHOST_CHECK_MISMATCH;
+	}
+
+	return result;
+}
+/* }}} */
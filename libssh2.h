@@ -103,6 +103,18 @@ typedef long long libssh2_int64_t;
 /* Maximum size to allow a payload to deccompress to, plays it safe by allowing more than spec requires */
 #define LIBSSH2_PACKET_MAXDECOMP	40000
 
+/* Corked packets are sent early once this many bytes are waiting */
+#define LIBSSH2_CORK_MAXLEN			262144
+
+/* With LIBSSH2_FLAG_FAIR_SCHEDULE, bytes a channel may send per round (times its weight)
+ * and bytes of data a channel may have queued before writes block (or accept no more) */
+#define LIBSSH2_CHANNEL_QUANTUM		8192
+#define LIBSSH2_CHANNEL_OUTQ_MAX	131072
+
+/* Default rekey limits, as recommended by RFC4253 section 9 */
+#define LIBSSH2_REKEY_BYTES			1073741824
+#define LIBSSH2_REKEY_SECONDS		3600
+
 /* Maximum size for an inbound compressed payload, plays it safe by overshooting spec limits */
 #define LIBSSH2_PACKET_MAXPAYLOAD	40000
 
@@ -128,8 +140,15 @@ typedef struct _LIBSSH2_USERAUTH_KBDINT_RESPONSE
 #define LIBSSH2_USERAUTH_KBDINT_RESPONSE_FUNC(name_) void name_(const char* name, int name_len, const char* instruction, int instruction_len, int num_prompts, const LIBSSH2_USERAUTH_KBDINT_PROMPT* prompts, LIBSSH2_USERAUTH_KBDINT_RESPONSE* responses, void **abstract)
 
 /* Callbacks for reading and writing to a custom stream */
+struct iovec;
 #define LIBSSH2_WRITE_FUNC(name)							int name(uint8_t *buffer, int length, LIBSSH2_SESSION *session, void *userInfo)
 #define LIBSSH2_READ_FUNC(name)								int name(uint8_t *buffer, int length, LIBSSH2_SESSION *session, void *userInfo)
+#define LIBSSH2_WRITEV_FUNC(name)							int name(const struct iovec *iov, int iovcnt, LIBSSH2_SESSION *session, void *userInfo)
+/* Wait up to timeout milliseconds for the stream to become readable (or writable if for_write)
+ * Returns > 0 when ready, 0 on timeout, < 0 on error */
+#define LIBSSH2_WAIT_FUNC(name)								int name(int for_write, long timeout, LIBSSH2_SESSION *session, void *userInfo)
+/* Put the stream into blocking (non-zero) or non-blocking mode, returns 0 on success */
+#define LIBSSH2_BLOCKING_FUNC(name)							int name(int blocking, LIBSSH2_SESSION *session, void *userInfo)
 
 /* Callbacks for special SSH packets */
 #define LIBSSH2_IGNORE_FUNC(name)					void name(LIBSSH2_SESSION *session, const char *message, int message_len, void **abstract)
@@ -162,6 +181,16 @@ typedef struct _LIBSSH2_USERAUTH_KBDINT_RESPONSE
 
 /* session.flags bits */
 #define LIBSSH2_FLAG_SIGPIPE		0x00000001
+/* Don't wait for SERVICE_ACCEPT before sending the first userauth request */
+#define LIBSSH2_FLAG_PIPELINE_AUTH	0x00000002
+/* Answer libssh2_userauth_list() from the process wide cache when the host has been seen before */
+#define LIBSSH2_FLAG_AUTH_CACHE		0x00000004
+/* Keep parsed private keys around (keyed on path, mtime and passphrase) for later sessions */
+#define LIBSSH2_FLAG_KEY_CACHE		0x00000008
+/* Queue channel data and share the outbound stream between channels, see libssh2_channel_schedule() */
+#define LIBSSH2_FLAG_FAIR_SCHEDULE	0x00000010
+/* Let several threads drive channels of the same session, set before libssh2_session_startup() */
+#define LIBSSH2_FLAG_THREADED		0x00000020
 
 typedef struct _LIBSSH2_SESSION						LIBSSH2_SESSION;
 typedef struct _LIBSSH2_CHANNEL						LIBSSH2_CHANNEL;
@@ -180,6 +209,17 @@ typedef struct _LIBSSH2_POLLFD {
 	unsigned long revents; /* Returned Events */
 } LIBSSH2_POLLFD;
 
+/* Session counters for benchmarking, bytes are as they crossed the wire (after compression, with padding and MAC)
+ * transport_* count calls into the read/write/writev callbacks, allocs counts calls to the alloc/realloc callbacks */
+typedef struct _LIBSSH2_SESSION_STATS {
+	libssh2_uint64_t bytes_sent, bytes_received;
+	unsigned long packets_sent, packets_received;
+	unsigned long transport_writes, transport_reads;
+	unsigned long transport_syscalls;	/* made by the built in transports, custom callbacks aren't counted */
+	unsigned long allocs;
+	unsigned long key_exchanges;
+} LIBSSH2_SESSION_STATS;
+
 /* Poll FD Descriptor Types */
 #define LIBSSH2_POLLFD_SOCKET		1
 #define LIBSSH2_POLLFD_CHANNEL		2
@@ -258,6 +298,7 @@ typedef struct _LIBSSH2_POLLFD {
 #define LIBSSH2_ERROR_INVAL						-34
 #define LIBSSH2_ERROR_INVALID_POLL_TYPE			-35
 #define LIBSSH2_ERROR_PUBLICKEY_PROTOCOL		-36
+#define LIBSSH2_ERROR_ENCRYPT					-37
 
 /* Session API */
 LIBSSH2_API LIBSSH2_SESSION *libssh2_session_init_ex(LIBSSH2_ALLOC_FUNC((*my_alloc)), LIBSSH2_FREE_FUNC((*my_free)), LIBSSH2_REALLOC_FUNC((*my_realloc)), void *abstract);
@@ -267,6 +308,40 @@ LIBSSH2_API void **libssh2_session_abstract(LIBSSH2_SESSION *session);
 LIBSSH2_API void libssh2_session_set_user_info(LIBSSH2_SESSION *session, void *ui);
 LIBSSH2_API void libssh2_session_set_write(LIBSSH2_SESSION *session, void *callback);
 LIBSSH2_API void libssh2_session_set_read(LIBSSH2_SESSION *session, void *callback);
+LIBSSH2_API void libssh2_session_set_writev(LIBSSH2_SESSION *session, void *callback);
+LIBSSH2_API void libssh2_session_set_wait(LIBSSH2_SESSION *session, void *callback);
+LIBSSH2_API void libssh2_session_set_blocking_mode(LIBSSH2_SESSION *session, void *callback);
+
+/* Linux only: do the session's socket I/O through an io_uring of entries submission slots,
+ * receiving into buffers registered with the kernel; call before libssh2_session_startup(), not with LIBSSH2_FLAG_THREADED
+ * Returns 0, or -1 (leaving the BSD socket calls in place) where io_uring isn't available */
+LIBSSH2_API int libssh2_session_io_uring(LIBSSH2_SESSION *session, unsigned int entries);
+
+/* Decrypt received packets and check their MACs on a pool of worker threads while the calling thread reads
+ * the packets behind them (CBC ciphers only, and not while compression is on); 0, the default, does it all on
+ * the calling thread. Call before libssh2_session_startup(), returns 0 or -1 if the threads couldn't be started */
+LIBSSH2_API int libssh2_session_crypto_workers(LIBSSH2_SESSION *session, int workers);
+
+/* While corked, encrypted packets are collected and sent in one write when uncorked
+ * (or when libssh2 next needs to read from the remote end) */
+LIBSSH2_API int libssh2_session_cork(LIBSSH2_SESSION *session, int cork);
+
+/* Keys are re-exchanged once either limit has been passed since the last exchange (0 disables that limit)
+ * The write that passes a limit doesn't wait for the exchange, it starts on the next packet read (a blocking
+ * channel or SFTP call waiting on the remote end, libssh2_poll(), libssh2_channel_read()) */
+LIBSSH2_API void libssh2_session_rekey_limits(LIBSSH2_SESSION *session, libssh2_uint64_t bytes, long seconds);
+LIBSSH2_API int libssh2_session_rekey(LIBSSH2_SESSION *session);
+
+/* keepalive@openssh.com, sent from libssh2_poll() and while blocked waiting on the remote end */
+LIBSSH2_API void libssh2_keepalive_config(LIBSSH2_SESSION *session, int want_reply, unsigned int interval, unsigned int max_unanswered);
+LIBSSH2_API int libssh2_keepalive_send(LIBSSH2_SESSION *session, int *seconds_to_next);
+
+/* Non-zero if the session still looks usable, judged without a round trip to the remote end */
+LIBSSH2_API int libssh2_session_alive(LIBSSH2_SESSION *session);
+
+/* Counters since the session was created or last reset, only approximate under LIBSSH2_FLAG_THREADED */
+LIBSSH2_API void libssh2_session_stats(LIBSSH2_SESSION *session, LIBSSH2_SESSION_STATS *stats);
+LIBSSH2_API void libssh2_session_stats_reset(LIBSSH2_SESSION *session);
 
 LIBSSH2_API void *libssh2_session_callback_set(LIBSSH2_SESSION *session, int cbtype, void *callback);
 LIBSSH2_API int libssh2_banner_set(LIBSSH2_SESSION *session, const char *banner);
@@ -277,6 +352,7 @@ LIBSSH2_API int libssh2_session_disconnect_ex(LIBSSH2_SESSION *session, int reas
 LIBSSH2_API void libssh2_session_free(LIBSSH2_SESSION *session);
 
 LIBSSH2_API const char *libssh2_hostkey_hash(LIBSSH2_SESSION *session, int hash_type);
+LIBSSH2_API const char *libssh2_session_hostkey(LIBSSH2_SESSION *session, unsigned long *len);
 
 LIBSSH2_API int libssh2_session_method_pref(LIBSSH2_SESSION *session, int method_type, const char *prefs);
 LIBSSH2_API const char *libssh2_session_methods(LIBSSH2_SESSION *session, int method_type);
@@ -287,6 +363,8 @@ LIBSSH2_API int libssh2_session_flag(LIBSSH2_SESSION *session, int flag, int val
 /* Userauth API */
 LIBSSH2_API char *libssh2_userauth_list(LIBSSH2_SESSION *session, const char *username, unsigned int username_len);
 LIBSSH2_API int libssh2_userauth_authenticated(LIBSSH2_SESSION *session);
+LIBSSH2_API void libssh2_userauth_list_cache_flush(void);
+LIBSSH2_API void libssh2_key_cache_flush(void);
 LIBSSH2_API int libssh2_userauth_password_ex(LIBSSH2_SESSION *session, const char *username, unsigned int username_len, const char *password, unsigned int password_len, LIBSSH2_PASSWD_CHANGEREQ_FUNC((*passwd_change_cb)));
 #define libssh2_userauth_password(session, username, password)	libssh2_userauth_password_ex((session), (username), strlen(username), (password), strlen(password), NULL)
 
@@ -316,6 +394,23 @@ LIBSSH2_API int libssh2_userauth_keyboard_interactive_ex(LIBSSH2_SESSION* sessio
 
 LIBSSH2_API int libssh2_poll(LIBSSH2_POLLFD *fds, unsigned int nfds, long timeout);
 
+/* Known hosts API */
+typedef struct _LIBSSH2_KNOWNHOSTS					LIBSSH2_KNOWNHOSTS;
+
+/* libssh2_knownhost_check() results */
+#define LIBSSH2_KNOWNHOST_CHECK_MATCH		0
+#define LIBSSH2_KNOWNHOST_CHECK_MISMATCH	1
+#define LIBSSH2_KNOWNHOST_CHECK_NOTFOUND	2
+#define LIBSSH2_KNOWNHOST_CHECK_FAILURE		3
+
+LIBSSH2_API LIBSSH2_KNOWNHOSTS *libssh2_knownhost_init(LIBSSH2_SESSION *session);
+LIBSSH2_API void libssh2_knownhost_free(LIBSSH2_KNOWNHOSTS *hosts);
+LIBSSH2_API int libssh2_knownhost_readfile(LIBSSH2_KNOWNHOSTS *hosts, const char *filename);
+LIBSSH2_API int libssh2_knownhost_add(LIBSSH2_KNOWNHOSTS *hosts, const char *host, int port, const char *key, unsigned long key_len);
+LIBSSH2_API int libssh2_knownhost_appendfile(LIBSSH2_KNOWNHOSTS *hosts, const char *filename, const char *host, int port,
+																		const char *key, unsigned long key_len);
+LIBSSH2_API int libssh2_knownhost_check(LIBSSH2_KNOWNHOSTS *hosts, const char *host, int port, const char *key, unsigned long key_len);
+
 /* Channel API */
 #define LIBSSH2_CHANNEL_WINDOW_DEFAULT	65536
 #define LIBSSH2_CHANNEL_PACKET_DEFAULT	16384
@@ -370,10 +465,13 @@ LIBSSH2_API int libssh2_channel_write_ex(LIBSSH2_CHANNEL *channel, int stream_id
 #define libssh2_channel_write(channel, buf, buflen)					libssh2_channel_write_ex((channel), 0, (char *)(buf), (buflen))
 #define libssh2_channel_write_stderr(channel, buf, buflen)			libssh2_channel_write_ex((channel), SSH_EXTENDED_DATA_STDERR, (buf), (buflen))
 
+LIBSSH2_API int libssh2_channel_relay(LIBSSH2_CHANNEL *channel, int fd);
+
 LIBSSH2_API unsigned long libssh2_channel_window_write_ex(LIBSSH2_CHANNEL *channel, unsigned long *window_size_initial);
 #define libssh2_channel_window_write(channel)			libssh2_channel_window_write_ex((channel), NULL)
 
 LIBSSH2_API void libssh2_channel_set_blocking(LIBSSH2_CHANNEL *channel, int blocking);
+LIBSSH2_API void libssh2_channel_schedule(LIBSSH2_CHANNEL *channel, unsigned int weight, int priority);
 LIBSSH2_API void libssh2_channel_handle_extended_data(LIBSSH2_CHANNEL *channel, int ignore_mode);
 /* libssh2_channel_ignore_extended_data() is defined below for BC with version 0.1
  * Future uses should use libssh2_channel_handle_extended_data() directly
@@ -43,9 +43,11 @@
 #include "libssh2.h"
 
 #include <stdio.h>
+#include <time.h>
 
 #ifndef WIN32
 #include <sys/socket.h>
+#include <pthread.h>
 #endif
 
 #ifdef LIBSSH2_LIBGCRYPT
@@ -54,8 +56,10 @@
 #include "openssl.h"
 #endif
 
-#define LIBSSH2_ALLOC(session, count)								session->alloc((count), &(session)->abstract)
-#define LIBSSH2_REALLOC(session, ptr, count)						((ptr) ? session->realloc((ptr), (count), &(session)->abstract) : session->alloc((count), &(session)->abstract))
+#include "wire.h"
+
+#define LIBSSH2_ALLOC(session, count)								(LIBSSH2_STAT_ADD(session, allocs, 1), session->alloc((count), &(session)->abstract))
+#define LIBSSH2_REALLOC(session, ptr, count)						(LIBSSH2_STAT_ADD(session, allocs, 1), (ptr) ? session->realloc((ptr), (count), &(session)->abstract) : session->alloc((count), &(session)->abstract))
 #define LIBSSH2_FREE(session, ptr)									session->free((ptr), &(session)->abstract)
 
 #define LIBSSH2_IGNORE(session, data, datalen)						session->ssh_msg_ignore((session), (data), (datalen), &(session)->abstract)
@@ -69,8 +73,13 @@
 
 #define LIBSSH2_CHANNEL_CLOSE(session, channel)						channel->close_cb((session), &(session)->abstract, (channel), &(channel)->abstract)
 
-#define LIBSSH2_WRITE(session, buffer, length)						session->ssh_write((uint8_t *)buffer, length, session, session->userInfo)
-#define LIBSSH2_READ(session, buffer, length)						session->ssh_read((uint8_t *)buffer, length, session, session->userInfo)
+#define LIBSSH2_WRITE(session, buffer, length)						(LIBSSH2_STAT_ADD(session, transport_writes, 1), session->ssh_write((uint8_t *)buffer, length, session, session->userInfo))
+#define LIBSSH2_READ(session, buffer, length)						(LIBSSH2_STAT_ADD(session, transport_reads, 1), session->ssh_read((uint8_t *)buffer, length, session, session->userInfo))
+#define LIBSSH2_WRITEV(session, iov, iovcnt)						(LIBSSH2_STAT_ADD(session, transport_writes, 1), session->ssh_writev((iov), (iovcnt), session, session->userInfo))
+#define LIBSSH2_WAIT(session, for_write, timeout)					session->ssh_wait((for_write), (timeout), session, session->userInfo)
+#define LIBSSH2_BLOCKING(session, blocking)							session->ssh_blocking((blocking), session, session->userInfo)
+/* What to poll() for inbound traffic, a transport with state of its own (io_uring) has a descriptor of its own */
+#define LIBSSH2_POLL_FD(session)									((session)->transport_abstract ? (session)->transport_fd : (session)->socket_fd)
 
 typedef struct _LIBSSH2_KEX_METHOD			LIBSSH2_KEX_METHOD;
 typedef struct _LIBSSH2_HOSTKEY_METHOD		LIBSSH2_HOSTKEY_METHOD;
@@ -81,6 +90,9 @@ typedef struct _LIBSSH2_COMP_METHOD			LIBSSH2_COMP_METHOD;
 typedef struct _LIBSSH2_PACKET				LIBSSH2_PACKET;
 typedef struct _LIBSSH2_PACKET_BRIGADE		LIBSSH2_PACKET_BRIGADE;
 typedef struct _LIBSSH2_CHANNEL_BRIGADE		LIBSSH2_CHANNEL_BRIGADE;
+typedef struct _LIBSSH2_OUTBOUND			LIBSSH2_OUTBOUND;
+
+typedef struct _libssh2_pipeline			libssh2_pipeline;
 
 struct _LIBSSH2_PACKET {
 	unsigned char type;
@@ -134,6 +146,26 @@ struct _LIBSSH2_CHANNEL {
 
 	void *abstract;
 	LIBSSH2_CHANNEL_CLOSE_FUNC((*close_cb));
+
+	/* Outbound data waiting its turn under LIBSSH2_FLAG_FAIR_SCHEDULE, outq_len counts payload bytes */
+	unsigned int weight;
+	int priority;
+	unsigned long deficit;
+	LIBSSH2_OUTBOUND *outq_head, *outq_tail;
+	unsigned long outq_len;
+
+	/* Reused by libssh2_channel_write_ex(), never bigger than one packet */
+	unsigned char *write_buf;
+	unsigned long write_buf_size;
+};
+
+/* A complete CHANNEL_DATA/CHANNEL_EXTENDED_DATA packet, allocated together with its data */
+struct _LIBSSH2_OUTBOUND {
+	unsigned char *data;
+	unsigned long data_len;
+	unsigned long payload_len;
+
+	LIBSSH2_OUTBOUND *next;
 };
 
 struct _LIBSSH2_CHANNEL_BRIGADE {
@@ -186,7 +218,18 @@ struct _LIBSSH2_SESSION {
 	/* Read/Write callbacks */
 	LIBSSH2_WRITE_FUNC((*ssh_write));
 	LIBSSH2_READ_FUNC((*ssh_read));
+	LIBSSH2_WRITEV_FUNC((*ssh_writev));
+	LIBSSH2_WAIT_FUNC((*ssh_wait));
+	LIBSSH2_BLOCKING_FUNC((*ssh_blocking));
 	void *userInfo;
+
+	/* Set up by libssh2_session_crypto_workers() */
+	libssh2_pipeline *pipeline;
+
+	/* Set up by libssh2_session_io_uring(), transport_free() releases it */
+	void *transport_abstract;
+	int transport_fd;
+	void (*transport_free)(LIBSSH2_SESSION *session);
 	
 	/* Other callbacks */
 	LIBSSH2_IGNORE_FUNC((*ssh_msg_ignore));
@@ -243,6 +286,47 @@ struct _LIBSSH2_SESSION {
 	int socket_block;
 	int socket_state;
 
+	/* Encrypted packets held back by libssh2_session_cork(), flushed early past LIBSSH2_CORK_MAXLEN */
+	int corked;
+	unsigned char *outbuf;
+	unsigned long outbuf_len, outbuf_size;
+
+	/* Channel data queued by every channel, see libssh2_channel_outq_run() */
+	unsigned long outq_len;
+
+	/* See libssh2_session_stats() */
+	LIBSSH2_SESSION_STATS stats;
+
+	/* Traffic since the last key exchange, checked against the rekey limits after each write, all under data_lock
+	 * A writer that passes them only sets rekey_pending, the next packet read does the exchange */
+	libssh2_uint64_t rekey_bytes, kex_bytes;
+	long rekey_seconds;
+	time_t kex_time;
+	int rekey_pending;
+
+	/* keepalive@openssh.com state, last_recv is when the remote end was last heard from */
+	int keepalive_interval, keepalive_want_reply;
+	int keepalive_max, keepalive_unanswered;
+	time_t keepalive_last_sent, last_recv;
+
+	/* Global requests awaiting a reply, oldest in bit 0, bits set for keepalives */
+	unsigned long global_replies;
+	int global_replies_len;
+
+#ifndef WIN32
+	/* LIBSSH2_FLAG_THREADED: one thread at a time reads from the socket (holding read_lock),
+	 * the others wait on packet_cond for it to finish with a packet
+	 * write_lock serialises packet writes and the channel queues, data_lock covers the packet
+	 * brigade, the channel list and channel windows and is never held across any I/O
+	 * Taken in that order: read_lock, write_lock, data_lock
+	 * err_lock covers the err_* fields below and is taken last of all, nothing else is locked while it's held
+	 */
+	pthread_mutex_t read_lock, write_lock, data_lock, err_lock;
+	pthread_cond_t packet_cond;
+	unsigned long packet_gen;
+	int last_packet_type;
+#endif
+
 	/* Error tracking */
 	char *err_msg;
 	unsigned long err_msglen;
@@ -254,6 +338,30 @@ struct _LIBSSH2_SESSION {
 #define LIBSSH2_STATE_EXCHANGING_KEYS	0x00000001
 #define LIBSSH2_STATE_NEWKEYS			0x00000002
 #define LIBSSH2_STATE_AUTHENTICATED		0x00000004
+#define LIBSSH2_STATE_SERVICE_PENDING	0x00000008
+
+/* LIBSSH2_FLAG_THREADED helpers */
+#ifndef WIN32
+#define LIBSSH2_THREADED(session)				((session)->flags & LIBSSH2_FLAG_THREADED)
+#define LIBSSH2_LOCK(session, lock)				do { if (LIBSSH2_THREADED(session)) pthread_mutex_lock(&(session)->lock); } while (0)
+#define LIBSSH2_UNLOCK(session, lock)			do { if (LIBSSH2_THREADED(session)) pthread_mutex_unlock(&(session)->lock); } while (0)
+#else
+#define LIBSSH2_THREADED(session)				0
+#define LIBSSH2_LOCK(session, lock)
+#define LIBSSH2_UNLOCK(session, lock)
+#endif
+
+/* Session counters are bumped by whichever thread is reading, writing or allocating, so a threaded session
+ * updates (and libssh2_session_stats() reads) them atomically rather than under one of the locks above */
+#if !defined(WIN32) && defined(__GNUC__) && ((__GNUC__ > 4) || ((__GNUC__ == 4) && (__GNUC_MINOR__ >= 1)))
+#define LIBSSH2_STAT_ADD(session, counter, n)	((void)(LIBSSH2_THREADED(session) ? __sync_fetch_and_add(&(session)->stats.counter, (n)) : ((session)->stats.counter += (n))))
+#define LIBSSH2_STAT_GET(session, counter)		(LIBSSH2_THREADED(session) ? __sync_fetch_and_add(&(session)->stats.counter, 0) : (session)->stats.counter)
+#define LIBSSH2_STAT_CLEAR(session, counter)	((void)(LIBSSH2_THREADED(session) ? __sync_fetch_and_and(&(session)->stats.counter, 0) : ((session)->stats.counter = 0)))
+#else
+#define LIBSSH2_STAT_ADD(session, counter, n)	((void)((session)->stats.counter += (n)))
+#define LIBSSH2_STAT_GET(session, counter)		((session)->stats.counter)
+#define LIBSSH2_STAT_CLEAR(session, counter)	((void)((session)->stats.counter = 0))
+#endif
 
 /* session.flag helpers */
 #ifdef MSG_NOSIGNAL
@@ -304,6 +412,14 @@ struct _LIBSSH2_CRYPT_METHOD {
 	int (*dtor)(LIBSSH2_SESSION *session, void **abstract);
 
 	_libssh2_cipher_type(algo);
+
+	/* Optional: process len bytes (a multiple of blocksize) in one call */
+	int (*crypt_span)(LIBSSH2_SESSION *session, unsigned char *buf, unsigned long len, void **abstract);
+
+	/* Optional, chained (CBC) modes only: a copy of the context with the same key, and restarting a context at
+	 * a given IV, so a packet body can be decrypted away from the endpoint's own context (see pipeline.c) */
+	int (*crypt_clone)(LIBSSH2_SESSION *session, void **abstract, void **clone);
+	int (*crypt_set_iv)(LIBSSH2_SESSION *session, const unsigned char *iv, void **abstract);
 };
 
 struct _LIBSSH2_COMP_METHOD {
@@ -350,6 +466,7 @@ void _libssh2_debug(LIBSSH2_SESSION *session, int context, const char *format, .
 #ifdef LIBSSH2_DEBUG_ERRORS
 #define libssh2_error(session, errcode, errmsg, should_free)	\
 { \
+	LIBSSH2_LOCK(session, err_lock); \
 	if (session->err_msg && session->err_should_free) { \
 		LIBSSH2_FREE(session, session->err_msg); \
 	} \
@@ -358,12 +475,14 @@ void _libssh2_debug(LIBSSH2_SESSION *session, int context, const char *format, .
 	session->err_should_free = should_free; \
 	session->err_code = errcode; \
 	_libssh2_debug(session, LIBSSH2_DBG_ERROR, "%d - %s", session->err_code, session->err_msg); \
+	LIBSSH2_UNLOCK(session, err_lock); \
 }
 
 #else /* ! LIBSSH2_DEBUG_ERRORS */
 
 #define libssh2_error(session, errcode, errmsg, should_free)	\
 { \
+	LIBSSH2_LOCK(session, err_lock); \
 	if (session->err_msg && session->err_should_free) { \
 		LIBSSH2_FREE(session, session->err_msg); \
 	} \
@@ -371,6 +490,7 @@ void _libssh2_debug(LIBSSH2_SESSION *session, int context, const char *format, .
 	session->err_msglen = strlen(errmsg); \
 	session->err_should_free = should_free; \
 	session->err_code = errcode; \
+	LIBSSH2_UNLOCK(session, err_lock); \
 }
 
 #endif /* LIBSSH2_DEBUG_ENABLED */
@@ -442,13 +562,14 @@ void _libssh2_debug(LIBSSH2_SESSION *session, int context, const char *format, .
 #define SSH_MSG_CHANNEL_FAILURE						100
 
 void libssh2_session_shutdown(LIBSSH2_SESSION *session);
+int libssh2_session_service_accept(LIBSSH2_SESSION *session);
 
-unsigned long libssh2_ntohu32(const unsigned char *buf);
-libssh2_uint64_t libssh2_ntohu64(const unsigned char *buf);
-void libssh2_htonu32(unsigned char *buf, unsigned long val);
-void libssh2_htonu64(unsigned char *buf, libssh2_uint64_t val);
+unsigned int libssh2_base64_encode_raw(char *dest, const unsigned char *src, unsigned int src_len);
+void libssh2_base64_decode_chunk(unsigned char *d, unsigned int *len, unsigned int *quartet, const char *src, unsigned int src_len);
 
 int libssh2_packet_read(LIBSSH2_SESSION *session, int block);
+unsigned long libssh2_packet_gen(LIBSSH2_SESSION *session);
+int libssh2_packet_read_since(LIBSSH2_SESSION *session, unsigned long gen);
 int libssh2_packet_ask_ex(LIBSSH2_SESSION *session, unsigned char packet_type, unsigned char **data, unsigned long *data_len, unsigned long match_ofs, const unsigned char *match_buf, unsigned long match_len, int poll_socket);
 #define libssh2_packet_ask(session, packet_type, data, data_len, poll_socket)	\
 		libssh2_packet_ask_ex((session), (packet_type), (data), (data_len), 0, NULL, 0, (poll_socket))
@@ -463,9 +584,55 @@ int libssh2_packet_requirev_ex(LIBSSH2_SESSION *session, unsigned char *packet_t
 		libssh2_packet_requirev_ex((session), (packet_types), (data), (data_len), 0, NULL, 0)
 int libssh2_packet_burn(LIBSSH2_SESSION *session);
 int libssh2_packet_write(LIBSSH2_SESSION *session, unsigned char *data, unsigned long data_len);
+int libssh2_packet_writev(LIBSSH2_SESSION *session, unsigned char *data, unsigned long data_len, const unsigned char *tail, unsigned long tail_len);
+int libssh2_packet_flush(LIBSSH2_SESSION *session);
 int libssh2_kex_exchange(LIBSSH2_SESSION *session, int reexchange);
+
+int libssh2_global_request_sent(LIBSSH2_SESSION *session, int keepalive);
+int libssh2_global_reply_received(LIBSSH2_SESSION *session);
+int libssh2_keepalive_wait(LIBSSH2_SESSION *session, long timeout);
+
 unsigned long libssh2_channel_nextid(LIBSSH2_SESSION *session);
 LIBSSH2_CHANNEL *libssh2_channel_locate(LIBSSH2_SESSION *session, unsigned long channel_id);
+int libssh2_channel_outq_run(LIBSSH2_SESSION *session, LIBSSH2_CHANNEL *channel, unsigned long target, int rounds);
+
+/* pipeline.c, packets read ahead by libssh2_packet_read() for the crypto workers
+ * Only the thread reading packets (holding read_lock) calls these
+ */
+#define LIBSSH2_PIPELINE_MAXBLOCK	32
+#define LIBSSH2_PIPELINE_MAXMAC		20
+
+typedef struct _libssh2_pipeline_job {
+	/* payload_len bytes, padding included, the first span_off of them decrypted along with the length */
+	unsigned char *payload;
+	unsigned long payload_len, span_off;
+	int padding_len;
+
+	/* The ciphertext block the rest of the payload chains from */
+	unsigned char iv[LIBSSH2_PIPELINE_MAXBLOCK];
+
+	/* What the MAC covers ahead of the payload (length and padding length), and the MAC that came with it */
+	unsigned char head[5];
+	unsigned char mac[LIBSSH2_PIPELINE_MAXMAC];
+	unsigned long seqno;
+	LIBSSH2_MAC_METHOD *mac_method;
+	void *mac_abstract;
+
+	/* Nothing is read ahead of a packet that can change the keys or end the session */
+	int barrier;
+
+	/* Set by the worker */
+	int macstate, failed, done;
+} libssh2_pipeline_job;
+
+int libssh2_pipeline_ready(LIBSSH2_SESSION *session);
+int libssh2_pipeline_pending(LIBSSH2_SESSION *session);
+libssh2_pipeline_job *libssh2_pipeline_slot(LIBSSH2_SESSION *session);
+void libssh2_pipeline_submit(LIBSSH2_SESSION *session);
+libssh2_pipeline_job *libssh2_pipeline_head(LIBSSH2_SESSION *session, int wait);
+void libssh2_pipeline_pop(LIBSSH2_SESSION *session);
+void libssh2_pipeline_drop_keys(LIBSSH2_SESSION *session);
+void libssh2_pipeline_free(LIBSSH2_SESSION *session);
 
 /* Let crypt.c/hostkey.c/comp.c/mac.c expose their method structs */
 LIBSSH2_CRYPT_METHOD **libssh2_crypt_methods(void);
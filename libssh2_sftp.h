@@ -53,6 +53,7 @@ extern "C" {
 typedef struct _LIBSSH2_SFTP				LIBSSH2_SFTP;
 typedef struct _LIBSSH2_SFTP_HANDLE			LIBSSH2_SFTP_HANDLE;
 typedef struct _LIBSSH2_SFTP_ATTRIBUTES		LIBSSH2_SFTP_ATTRIBUTES;
+typedef struct _LIBSSH2_SFTP_SEGMENT		LIBSSH2_SFTP_SEGMENT;
 
 /* Flags for open_ex() */
 #define LIBSSH2_SFTP_OPENFILE			0
@@ -92,6 +93,23 @@ struct _LIBSSH2_SFTP_ATTRIBUTES {
 	unsigned long atime, mtime;
 };
 
+/* One byte range of a segmented download.
+ * transferred is updated as data lands in the local file, so a failed
+ * segment can be handed back to libssh2_sftp_segment_fetch() to resume
+ */
+struct _LIBSSH2_SFTP_SEGMENT {
+	libssh2_uint64_t offset;
+	libssh2_uint64_t length;
+	libssh2_uint64_t transferred;
+};
+
+/* Largest FXP_READ issued by libssh2_sftp_segment_fetch(), kept under LIBSSH2_SFTP_PACKET_MAXLEN */
+#define LIBSSH2_SFTP_SEGMENT_CHUNK	32768
+
+/* libssh2_sftp_segment_fetch() return when the remote file is shorter than the segment (truncated since
+ * libssh2_sftp_segments_init()); transferred says how much of the segment there was, length is left as it was */
+#define LIBSSH2_SFTP_SEGMENT_SHORT	1
+
 /* SFTP filetypes */
 #define LIBSSH2_SFTP_TYPE_REGULAR			1
 #define LIBSSH2_SFTP_TYPE_DIRECTORY			2
@@ -196,6 +214,14 @@ LIBSSH2_API int libssh2_sftp_fstat_ex(LIBSSH2_SFTP_HANDLE *handle, LIBSSH2_SFTP_
 #define libssh2_sftp_fstat(handle, attrs)				libssh2_sftp_fstat_ex((handle), (attrs), 0)
 #define libssh2_sftp_fsetstat(handle, attrs)			libssh2_sftp_fstat_ex((handle), (attrs), 1)
 
+/* Segmented download
+ * Each segment should be fetched over its own LIBSSH2_SFTP instance; to run them concurrently
+ * give every segment its own session (and thread), since a session is not reentrant
+ */
+LIBSSH2_API int libssh2_sftp_segments_init(int fd, libssh2_uint64_t filesize, LIBSSH2_SFTP_SEGMENT *segments, int segment_count);
+LIBSSH2_API int libssh2_sftp_segment_fetch(LIBSSH2_SFTP *sftp, char *filename, unsigned int filename_len, int fd, LIBSSH2_SFTP_SEGMENT *segment);
+#define libssh2_sftp_segment_complete(segment)			((segment)->transferred >= (segment)->length)
+
 
 
 /* Miscellaneous Ops */
@@ -37,58 +37,6 @@
 
 #include "libssh2_priv.h"
 
-/* {{{ libssh2_ntohu32
- */
-unsigned long libssh2_ntohu32(const unsigned char *buf)
-{
-	return (buf[0] << 24) | (buf[1] << 16) | (buf[2] << 8) | buf[3];
-}
-/* }}} */
-
-/* {{{ libssh2_ntohu64
- * Note: Some 32-bit platforms have issues with bitops on long longs
- * Work around this by doing expensive (but safer) arithmetic ops with optimization defying parentheses
- */
-libssh2_uint64_t libssh2_ntohu64(const unsigned char *buf)
-{
-	unsigned long msl, lsl;
-
-	msl = (buf[0] << 24) | (buf[1] << 16) | (buf[2] << 8) | buf[3];
-	lsl = (buf[4] << 24) | (buf[5] << 16) | (buf[6] << 8) | buf[7];
-
-	return ((msl * 65536) * 65536) + lsl;
-}
-/* }}} */
-
-/* {{{ libssh2_htonu32
- */
-void libssh2_htonu32(unsigned char *buf, unsigned long value)
-{
-	buf[0] = (value >> 24) & 0xFF;
-	buf[1] = (value >> 16) & 0xFF;
-	buf[2] = (value >> 8) & 0xFF;
-	buf[3] = value & 0xFF;
-}
-/* }}} */
-
-/* {{{ libssh2_htonu64
- */
-void libssh2_htonu64(unsigned char *buf, libssh2_uint64_t value)
-{
-	unsigned long msl = (value / 65536) / 65536;
-
-	buf[0] = (msl >> 24) & 0xFF;
-	buf[1] = (msl >> 16) & 0xFF;
-	buf[2] = (msl >> 8) & 0xFF;
-	buf[3] = msl & 0xFF;
-
-	buf[4] = (value >> 24) & 0xFF;
-	buf[5] = (value >> 16) & 0xFF;
-	buf[6] = (value >> 8) & 0xFF;
-	buf[7] = value & 0xFF;
-}
-/* }}} */
-
 /* Base64 Conversion */
 
 /* {{{ */
@@ -123,43 +71,88 @@ static const short libssh2_base64_reverse_table[256] = {
 /* }}} */
 
 
-/* {{{ libssh2_base64_decode
- * Decode a base64 chunk and store it into a newly alloc'd buffer
+/* {{{ libssh2_base64_encode_raw
+ * Encode src into dest, which must have room for 4 * ((src_len + 2) / 3) bytes
+ * Returns the number of characters written, dest is not NUL terminated
  */
-LIBSSH2_API int libssh2_base64_decode(LIBSSH2_SESSION *session, char **data, unsigned int *datalen,
-																char *src, unsigned int src_len)
+unsigned int libssh2_base64_encode_raw(char *dest, const unsigned char *src, unsigned int src_len)
 {
-	unsigned char *s, *d;
-	short v;
-	int i = 0, len = 0;
-
-	*data = LIBSSH2_ALLOC(session, (3 * src_len / 4) + 1);
-	d = (unsigned char *)*data;
-	if (!d) {
-		return -1;
+	char *d = dest;
+	unsigned int i;
+
+	for(i = 0; (i + 2) < src_len; i += 3) {
+		*(d++) = libssh2_base64_table[src[i] >> 2];
+		*(d++) = libssh2_base64_table[((src[i] & 0x03) << 4) | (src[i + 1] >> 4)];
+		*(d++) = libssh2_base64_table[((src[i + 1] & 0x0f) << 2) | (src[i + 2] >> 6)];
+		*(d++) = libssh2_base64_table[src[i + 2] & 0x3f];
+	}
+	if (i < src_len) {
+		*(d++) = libssh2_base64_table[src[i] >> 2];
+		if ((i + 1) < src_len) {
+			*(d++) = libssh2_base64_table[((src[i] & 0x03) << 4) | (src[i + 1] >> 4)];
+			*(d++) = libssh2_base64_table[(src[i + 1] & 0x0f) << 2];
+		} else {
+			*(d++) = libssh2_base64_table[(src[i] & 0x03) << 4];
+			*(d++) = libssh2_base64_pad;
+		}
+		*(d++) = libssh2_base64_pad;
 	}
 
-	for(s = (unsigned char *)src; ((char*)s) < (src + src_len); s++) {
+	return d - dest;
+}
+/* }}} */
+
+/* {{{ libssh2_base64_decode_chunk
+ * Decode src onto the end of d, which must have room for (3 * (pending + src_len) / 4) + 1 more bytes,
+ * pending being the characters of a partial quartet carried over from the last call (*quartet % 4)
+ * *quartet carries the position within the current group of four between calls,
+ * so a stream may be fed in pieces of any size
+ */
+void libssh2_base64_decode_chunk(unsigned char *d, unsigned int *len, unsigned int *quartet, const char *src, unsigned int src_len)
+{
+	const unsigned char *s;
+	short v;
+
+	for(s = (const unsigned char *)src; ((const char*)s) < (src + src_len); s++) {
 		if ((v = libssh2_base64_reverse_table[*s]) < 0) continue;
-		switch (i % 4) {
+		switch (*quartet % 4) {
 			case 0:
-				d[len] = v << 2;
+				d[*len] = v << 2;
 				break;
 			case 1:
-				d[len++] |= v >> 4;
-				d[len] = v << 4;
+				d[(*len)++] |= v >> 4;
+				d[*len] = v << 4;
 				break;
 			case 2:
-				d[len++] |= v >> 2;
-				d[len] = v << 6;
+				d[(*len)++] |= v >> 2;
+				d[*len] = v << 6;
 				break;
 			case 3:
-				d[len++] |= v;
+				d[(*len)++] |= v;
 				break;
 		}
-		i++;
+		(*quartet)++;
 	}
-	if ((i % 4) == 1) {
+}
+/* }}} */
+
+/* {{{ libssh2_base64_decode
+ * Decode a base64 chunk and store it into a newly alloc'd buffer
+ */
+LIBSSH2_API int libssh2_base64_decode(LIBSSH2_SESSION *session, char **data, unsigned int *datalen,
+																char *src, unsigned int src_len)
+{
+	unsigned char *d;
+	unsigned int len = 0, quartet = 0;
+
+	*data = LIBSSH2_ALLOC(session, (3 * src_len / 4) + 1);
+	d = (unsigned char *)*data;
+	if (!d) {
+		return -1;
+	}
+
+	libssh2_base64_decode_chunk(d, &len, &quartet, src, src_len);
+	if ((quartet % 4) == 1) {
 		/* Invalid -- We have a byte which belongs exclusively to a partial octet */
 		LIBSSH2_FREE(session, *data);
 		return -1;
@@ -38,6 +38,11 @@
 
 #include "libssh2_priv.h"
 #include <string.h>
+#include <stdlib.h>
+
+#ifndef WIN32
+#include <pthread.h>
+#endif
 
 int _libssh2_rsa_new(libssh2_rsa_ctx **rsa,
 		     const unsigned char *edata,
@@ -190,6 +195,34 @@ int _libssh2_cipher_crypt(_libssh2_cipher_ctx *ctx,
 	return ret == 1 ? 0 : 1;
 }
 
+/* Runs a whole span of blocks through the cipher in place, letting
+ * EVP use its multi-block code paths instead of one call per block */
+int _libssh2_cipher_crypt_span(_libssh2_cipher_ctx *ctx,
+			       unsigned char *buf,
+			       unsigned long len)
+{
+	return EVP_Cipher(ctx, buf, buf, len) == 1 ? 0 : 1;
+}
+
+/* A context of its own with the same cipher, key and state as src */
+int _libssh2_cipher_copy(_libssh2_cipher_ctx *dst,
+			 _libssh2_cipher_ctx *src)
+{
+	EVP_CIPHER_CTX_init(dst);
+	if (EVP_CIPHER_CTX_copy(dst, src) != 1) {
+		EVP_CIPHER_CTX_cleanup(dst);
+		return 1;
+	}
+	return 0;
+}
+
+/* Carry on from iv, keeping the key, for chained modes */
+int _libssh2_cipher_set_iv(_libssh2_cipher_ctx *ctx,
+			   const unsigned char *iv)
+{
+	return EVP_CipherInit_ex(ctx, NULL, NULL, NULL, iv, -1) == 1 ? 0 : 1;
+}
+
 /* TODO: Optionally call a passphrase callback specified by the
  * calling program
  */
@@ -311,3 +344,194 @@ int _libssh2_dsa_sha1_sign(libssh2_dsa_ctx *dsactx,
 
 	return 0;
 }
+
+/* Parsed private keys, keyed on path, mtime, size and a hash of the passphrase
+ * Entries hold their own reference on the key, lookups hand out another
+ */
+#define LIBSSH2_KEY_CACHE_SIZE	8
+
+typedef struct _libssh2_key_cache_entry {
+	int type;	/* EVP_PKEY_RSA or EVP_PKEY_DSA */
+	char *path;
+	time_t mtime;
+	off_t size;
+	unsigned char passphrase_sha1[SHA_DIGEST_LENGTH];
+	void *key;
+} libssh2_key_cache_entry;
+
+static libssh2_key_cache_entry libssh2_key_cache[LIBSSH2_KEY_CACHE_SIZE];
+static int libssh2_key_cache_next = 0;
+
+#ifndef WIN32
+static pthread_mutex_t libssh2_key_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define LIBSSH2_KEY_CACHE_LOCK()	pthread_mutex_lock(&libssh2_key_cache_mutex)
+#define LIBSSH2_KEY_CACHE_UNLOCK()	pthread_mutex_unlock(&libssh2_key_cache_mutex)
+#else
+#define LIBSSH2_KEY_CACHE_LOCK()
+#define LIBSSH2_KEY_CACHE_UNLOCK()
+#endif
+
+static void key_cache_release(int type, void *key)
+{
+	if (type == EVP_PKEY_RSA) {
+		RSA_free((RSA *)key);
+	} else {
+		DSA_free((DSA *)key);
+	}
+}
+
+static void key_cache_retain(int type, void *key)
+{
+	if (type == EVP_PKEY_RSA) {
+		RSA_up_ref((RSA *)key);
+	} else {
+		DSA_up_ref((DSA *)key);
+	}
+}
+
+/* {{{ key_cache_find
+ * Returns a new reference to a cached key, or NULL
+ */
+static void *key_cache_find(int type, const char *path, const struct stat *st,
+			    const unsigned char *passphrase_sha1)
+{
+	void *key = NULL;
+	int i;
+
+	LIBSSH2_KEY_CACHE_LOCK();
+	for(i = 0; i < LIBSSH2_KEY_CACHE_SIZE; i++) {
+		libssh2_key_cache_entry *entry = &libssh2_key_cache[i];
+
+		if (entry->key && entry->type == type &&
+		    entry->mtime == st->st_mtime && entry->size == st->st_size &&
+		    !memcmp(entry->passphrase_sha1, passphrase_sha1, SHA_DIGEST_LENGTH) &&
+		    !strcmp(entry->path, path)) {
+			key_cache_retain(type, entry->key);
+			key = entry->key;
+			break;
+		}
+	}
+	LIBSSH2_KEY_CACHE_UNLOCK();
+
+	return key;
+}
+/* }}} */
+
+/* {{{ key_cache_store
+ * Remember a freshly parsed key, replacing the oldest entry once full
+ */
+static void key_cache_store(int type, const char *path, const struct stat *st,
+			    const unsigned char *passphrase_sha1, void *key)
+{
+	libssh2_key_cache_entry *entry;
+	char *path_copy;
+
+	path_copy = strdup(path);
+	if (!path_copy) {
+		return;
+	}
+
+	LIBSSH2_KEY_CACHE_LOCK();
+	entry = &libssh2_key_cache[libssh2_key_cache_next];
+	libssh2_key_cache_next = (libssh2_key_cache_next + 1) % LIBSSH2_KEY_CACHE_SIZE;
+
+	if (entry->key) {
+		key_cache_release(entry->type, entry->key);
+	}
+	free(entry->path);
+
+	key_cache_retain(type, key);
+	entry->type = type;
+	entry->path = path_copy;
+	entry->mtime = st->st_mtime;
+	entry->size = st->st_size;
+	memcpy(entry->passphrase_sha1, passphrase_sha1, SHA_DIGEST_LENGTH);
+	entry->key = key;
+	LIBSSH2_KEY_CACHE_UNLOCK();
+}
+/* }}} */
+
+/* {{{ libssh2_key_cache_flush
+ * Drop every cached private key
+ */
+LIBSSH2_API void libssh2_key_cache_flush(void)
+{
+	int i;
+
+	LIBSSH2_KEY_CACHE_LOCK();
+	for(i = 0; i < LIBSSH2_KEY_CACHE_SIZE; i++) {
+		if (libssh2_key_cache[i].key) {
+			key_cache_release(libssh2_key_cache[i].type, libssh2_key_cache[i].key);
+		}
+		free(libssh2_key_cache[i].path);
+		memset(&libssh2_key_cache[i], 0, sizeof(libssh2_key_cache_entry));
+	}
+	libssh2_key_cache_next = 0;
+	LIBSSH2_KEY_CACHE_UNLOCK();
+}
+/* }}} */
+
+/* {{{ private_from_file
+ * Load an RSA or DSA private key by path, going through the key cache
+ * when the session has LIBSSH2_FLAG_KEY_CACHE set
+ */
+static int private_from_file(int type, void **key, LIBSSH2_SESSION *session,
+			     const char *filename, unsigned const char *passphrase)
+{
+	unsigned char passphrase_sha1[SHA_DIGEST_LENGTH];
+	int use_cache = (session->flags & LIBSSH2_FLAG_KEY_CACHE);
+	struct stat st;
+	FILE *fp;
+	int ret;
+
+	if (use_cache) {
+		if (stat(filename, &st)) {
+			return -1;
+		}
+		libssh2_sha1(passphrase ? passphrase : (unsigned const char *)"",
+			     passphrase ? strlen((const char *)passphrase) : 0,
+			     passphrase_sha1);
+
+		*key = key_cache_find(type, filename, &st, passphrase_sha1);
+		if (*key) {
+			return 0;
+		}
+	}
+
+	fp = fopen(filename, "r");
+	if (!fp) {
+		return -1;
+	}
+	if (type == EVP_PKEY_RSA) {
+		ret = _libssh2_rsa_new_private((libssh2_rsa_ctx **)key, session, fp, passphrase);
+	} else {
+		ret = _libssh2_dsa_new_private((libssh2_dsa_ctx **)key, session, fp, passphrase);
+	}
+	fclose(fp);
+	if (ret) {
+		return -1;
+	}
+
+	if (use_cache) {
+		key_cache_store(type, filename, &st, passphrase_sha1, *key);
+	}
+
+	return 0;
+}
+/* }}} */
+
+int _libssh2_rsa_new_private_file (libssh2_rsa_ctx **rsa,
+				   LIBSSH2_SESSION *session,
+				   const char *filename,
+				   unsigned const char *passphrase)
+{
+	return private_from_file(EVP_PKEY_RSA, (void **)rsa, session, filename, passphrase);
+}
+
+int _libssh2_dsa_new_private_file (libssh2_dsa_ctx **dsa,
+				   LIBSSH2_SESSION *session,
+				   const char *filename,
+				   unsigned const char *passphrase)
+{
+	return private_from_file(EVP_PKEY_DSA, (void **)dsa, session, filename, passphrase);
+}
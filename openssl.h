@@ -152,6 +152,10 @@ int _libssh2_rsa_new_private (libssh2_rsa_ctx **rsa,
 			      LIBSSH2_SESSION *session,
 			      FILE *fp,
 			      unsigned const char *passphrase);
+int _libssh2_rsa_new_private_file (libssh2_rsa_ctx **rsa,
+				   LIBSSH2_SESSION *session,
+				   const char *filename,
+				   unsigned const char *passphrase);
 int _libssh2_rsa_sha1_verify(libssh2_rsa_ctx *rsa,
 			     const unsigned char *sig,
 			     unsigned long sig_len,
@@ -183,6 +187,10 @@ int _libssh2_dsa_new_private (libssh2_dsa_ctx **dsa,
 			      LIBSSH2_SESSION *session,
 			      FILE *fp,
 			      unsigned const char *passphrase);
+int _libssh2_dsa_new_private_file (libssh2_dsa_ctx **dsa,
+				   LIBSSH2_SESSION *session,
+				   const char *filename,
+				   unsigned const char *passphrase);
 int _libssh2_dsa_sha1_verify(libssh2_dsa_ctx *dsactx,
 			     const unsigned char *sig,
 			     const unsigned char *m,
@@ -216,6 +224,16 @@ int _libssh2_cipher_crypt(_libssh2_cipher_ctx *ctx,
 			  int encrypt,
 			  unsigned char *block);
 
+int _libssh2_cipher_crypt_span(_libssh2_cipher_ctx *ctx,
+			       unsigned char *buf,
+			       unsigned long len);
+
+int _libssh2_cipher_copy(_libssh2_cipher_ctx *dst,
+			 _libssh2_cipher_ctx *src);
+
+int _libssh2_cipher_set_iv(_libssh2_cipher_ctx *ctx,
+			   const unsigned char *iv);
+
 #define _libssh2_cipher_dtor(ctx) EVP_CIPHER_CTX_cleanup(ctx)
 
 #define _libssh2_bn BIGNUM
@@ -37,7 +37,6 @@
 
 #include "libssh2_priv.h"
 #include <errno.h>
-#include <fcntl.h>
 #ifndef WIN32
 #include <unistd.h>
 #endif
@@ -71,13 +70,13 @@
  */
 #define MAX_SSH_PACKET_LEN 35000
 
-inline int libssh2_packet_queue_listener(LIBSSH2_SESSION *session, unsigned char *data, unsigned long datalen);
-inline int libssh2_packet_x11_open(LIBSSH2_SESSION *session, unsigned char *data, unsigned long datalen);
+static LIBSSH2_INLINE int libssh2_packet_queue_listener(LIBSSH2_SESSION *session, unsigned char *data, unsigned long datalen);
+static LIBSSH2_INLINE int libssh2_packet_x11_open(LIBSSH2_SESSION *session, unsigned char *data, unsigned long datalen);
 
 /* {{{ libssh2_packet_queue_listener
  * Queue a connection request for a listener
  */
-inline int libssh2_packet_queue_listener(LIBSSH2_SESSION *session, unsigned char *data, unsigned long datalen)
+static LIBSSH2_INLINE int libssh2_packet_queue_listener(LIBSSH2_SESSION *session, unsigned char *data, unsigned long datalen)
 {
 	/* Look for a matching listener */
 	unsigned char *s = data + (sizeof("forwarded-tcpip") - 1) + 5;
@@ -214,7 +213,7 @@ inline int libssh2_packet_queue_listener(LIBSSH2_SESSION *session, unsigned char
 /* {{{ libssh2_packet_x11_open
  * Accept a forwarded X11 connection
  */
-inline int libssh2_packet_x11_open(LIBSSH2_SESSION *session, unsigned char *data, unsigned long datalen)
+static LIBSSH2_INLINE int libssh2_packet_x11_open(LIBSSH2_SESSION *session, unsigned char *data, unsigned long datalen)
 {
 	int failure_code = 2; /* SSH_OPEN_CONNECT_FAILED */
 	unsigned char *s = data + (sizeof("x11") - 1) + 5;
@@ -285,6 +284,7 @@ inline int libssh2_packet_x11_open(LIBSSH2_SESSION *session, unsigned char *data
 		}
 
 		/* Link the channel into the session */
+		LIBSSH2_LOCK(session, data_lock);
 		if (session->channels.tail) {
 			session->channels.tail->next = channel;
 			channel->prev = session->channels.tail;
@@ -294,6 +294,7 @@ inline int libssh2_packet_x11_open(LIBSSH2_SESSION *session, unsigned char *data
 		}
 		channel->next = NULL;
 		session->channels.tail = channel;
+		LIBSSH2_UNLOCK(session, data_lock);
 		
 		/*
 		 * Pass control to the callback, they may turn right around and 
@@ -330,6 +331,7 @@ static int libssh2_packet_add(LIBSSH2_SESSION *session, unsigned char *data, siz
 {
 	LIBSSH2_PACKET *packet;
 	unsigned long data_head = 0;
+	unsigned char packet_type = data[0];	/* once it's in the brigade, another thread may take data and free it */
 
 #ifdef LIBSSH2_DEBUG_TRANSPORT
 	_libssh2_debug(session, LIBSSH2_DBG_TRANS, "Packet type %d received, length=%d", (int)data[0], (int)datalen);
@@ -355,6 +357,8 @@ static int libssh2_packet_add(LIBSSH2_SESSION *session, unsigned char *data, siz
 		}
 	}
 
+	session->last_recv = time(NULL);
+
 	/* A couple exceptions to the packet adding rule: */
 	switch (data[0]) {
 		case SSH_MSG_DISCONNECT:
@@ -400,6 +404,14 @@ static int libssh2_packet_add(LIBSSH2_SESSION *session, unsigned char *data, siz
 			LIBSSH2_FREE(session, (char *)data);
 			return 0;
 			break;
+		case SSH_MSG_REQUEST_SUCCESS:
+		case SSH_MSG_REQUEST_FAILURE:
+			if (libssh2_global_reply_received(session)) {
+				/* Answer to a keepalive, nobody is waiting for it */
+				LIBSSH2_FREE(session, data);
+				return 0;
+			}
+			break;
 		case SSH_MSG_DEBUG:
 		{
 			int always_display = data[0];
@@ -434,11 +446,27 @@ static int libssh2_packet_add(LIBSSH2_SESSION *session, unsigned char *data, siz
 		}
 			break;
 		case SSH_MSG_CHANNEL_EXTENDED_DATA:
-			data_head += 4; /* streamid(4) */
 		case SSH_MSG_CHANNEL_DATA:
-			data_head += 9; /* packet_type(1) + channelno(4) + datalen(4) */
 			{
-				LIBSSH2_CHANNEL *channel = libssh2_channel_locate(session, libssh2_ntohu32(data + 1));
+				LIBSSH2_CHANNEL *channel;
+				libssh2_wire_reader r;
+				const unsigned char *payload;
+				unsigned long channel_id, stream_id = 0, payload_len;
+
+				/* packet_type(1) + channelno(4) [ + streamid(4) ] + data(4 + n) */
+				libssh2_wire_reader_init(&r, data + 1, datalen - 1);
+				if (libssh2_wire_get_u32(&r, &channel_id) ||
+					((data[0] == SSH_MSG_CHANNEL_EXTENDED_DATA) && libssh2_wire_get_u32(&r, &stream_id)) ||
+					libssh2_wire_get_string(&r, &payload, &payload_len)) {
+					libssh2_error(session, LIBSSH2_ERROR_PROTO, "Truncated channel data packet, ignoring", 0);
+					LIBSSH2_FREE(session, data);
+					return 0;
+				}
+				/* Anything trailing the declared length isn't data */
+				data_head = payload - data;
+				datalen = data_head + payload_len;
+
+				channel = libssh2_channel_locate(session, channel_id);
 
 				if (!channel) {
 					libssh2_error(session, LIBSSH2_ERROR_CHANNEL_UNKNOWN, "Packet received for unknown channel, ignoring", 0);
@@ -446,15 +474,7 @@ static int libssh2_packet_add(LIBSSH2_SESSION *session, unsigned char *data, siz
 					return 0;
 				}
 #ifdef LIBSSH2_DEBUG_CONNECTION
-{
-	unsigned long stream_id = 0;
-
-	if (data[0] == SSH_MSG_CHANNEL_EXTENDED_DATA) {
-		stream_id = libssh2_ntohu32(data + 5);
-	}
-
 	_libssh2_debug(session, LIBSSH2_DBG_CONN, "%d bytes received for channel %lu/%lu stream #%lu", (int)(datalen - data_head), channel->local.id, channel->remote.id, stream_id);
-}
 #endif
 				if ((channel->remote.extended_data_ignore_mode == LIBSSH2_CHANNEL_EXTENDED_DATA_IGNORE) && (data[0] == SSH_MSG_CHANNEL_EXTENDED_DATA)) {
 					/* Pretend we didn't receive this */
@@ -475,7 +495,9 @@ static int libssh2_packet_add(LIBSSH2_SESSION *session, unsigned char *data, siz
 					libssh2_error(session, LIBSSH2_ERROR_CHANNEL_PACKET_EXCEEDED, "Packet contains more data than we offered to receive, truncating", 0);
 					datalen = channel->remote.packet_size + data_head;
 				}
+				LIBSSH2_LOCK(session, data_lock);
 				if (channel->remote.window_size <= 0) {
+					LIBSSH2_UNLOCK(session, data_lock);
 					/* Spec says we MAY ignore bytes sent beyond window_size */
 					libssh2_error(session, LIBSSH2_ERROR_CHANNEL_WINDOW_EXCEEDED, "The current receive window is full, data ignored", 0);
 					LIBSSH2_FREE(session, data);
@@ -491,6 +513,7 @@ static int libssh2_packet_add(LIBSSH2_SESSION *session, unsigned char *data, siz
 					/* Now that we've received it, shrink our window */
 					channel->remote.window_size -= datalen - data_head;
 				}
+				LIBSSH2_UNLOCK(session, data_lock);
 			}
 			break;
 		case SSH_MSG_CHANNEL_EOF:
@@ -577,7 +600,9 @@ static int libssh2_packet_add(LIBSSH2_SESSION *session, unsigned char *data, siz
 				unsigned long bytestoadd = libssh2_ntohu32(data + 5);
 
 				if (channel && bytestoadd) {
+					LIBSSH2_LOCK(session, data_lock);
 					channel->local.window_size += bytestoadd;
+					LIBSSH2_UNLOCK(session, data_lock);
 				}
 #ifdef LIBSSH2_DEBUG_CONNECTION
 	_libssh2_debug(session, LIBSSH2_DBG_CONN, "Window adjust received for channel %lu/%lu, adding %lu bytes, new window_size=%lu", channel->local.id, channel->remote.id, bytestoadd, channel->local.window_size);
@@ -599,6 +624,7 @@ static int libssh2_packet_add(LIBSSH2_SESSION *session, unsigned char *data, siz
 	packet->brigade = &session->packets;
 	packet->next = NULL;
 
+	LIBSSH2_LOCK(session, data_lock);
 	if (session->packets.tail) {
 		packet->prev = session->packets.tail;
 		packet->prev->next = packet;
@@ -608,8 +634,12 @@ static int libssh2_packet_add(LIBSSH2_SESSION *session, unsigned char *data, siz
 		session->packets.tail = packet;
 		packet->prev = NULL;
 	}
+#ifndef WIN32
+	session->last_packet_type = packet_type;
+#endif
+	LIBSSH2_UNLOCK(session, data_lock);
 
-	if (data[0] == SSH_MSG_KEXINIT && !(session->state & LIBSSH2_STATE_EXCHANGING_KEYS)) {
+	if (packet_type == SSH_MSG_KEXINIT && !(session->state & LIBSSH2_STATE_EXCHANGING_KEYS)) {
 		/* Remote wants new keys
 		 * Well, it's already in the brigade,
 		 * let's just call back into ourselves
@@ -635,14 +665,7 @@ static ssize_t libssh2_blocking_read(LIBSSH2_SESSION *session, unsigned char *bu
 	int polls = 0;
 #endif
 
-#ifndef WIN32
-	fcntl(session->socket_fd, F_SETFL, 0);
-#else
-	{
-		u_long block = FALSE;
-		ioctlsocket(session->socket_fd, FIONBIO, &block);
-	}
-#endif
+	LIBSSH2_BLOCKING(session, 1);
 
 #ifdef LIBSSH2_DEBUG_TRANSPORT
 	_libssh2_debug(session, LIBSSH2_DBG_TRANS, "Blocking read: %d bytes", (int)count);
@@ -663,34 +686,14 @@ static ssize_t libssh2_blocking_read(LIBSSH2_SESSION *session, unsigned char *bu
 			}
 #endif
 			if (errno == EAGAIN) {
-#ifdef HAVE_POLL
-				struct pollfd read_socket;
-
-				read_socket.fd = session->socket_fd;
-				read_socket.events = POLLIN;
-
-				if (poll(&read_socket, 1, 30000) <= 0) {
-					return -1;
-				}
-#elif defined(HAVE_SELECT)
-				fd_set read_socket;
-				struct timeval timeout;
-
-				FD_ZERO(&read_socket);
-				FD_SET(session->socket_fd, &read_socket);
-
-				timeout.tv_sec = 30;
-				timeout.tv_usec = 0;
-
-				if (select(session->socket_fd + 1, &read_socket, NULL, NULL, &timeout) <= 0) {
+#if !defined(HAVE_POLL) && !defined(HAVE_SELECT)
+				if (polls++ > LIBSSH2_SOCKET_POLL_MAXLOOPS) {
 					return -1;
 				}
-#else
-				if (polls++ > LIBSSH2_SOCKET_POLL_MAXLOOPS) {
+#endif
+				if (libssh2_keepalive_wait(session, 30000) <= 0) {
 					return -1;
 				}
-				usleep(LIBSSH2_SOCKET_POLL_UDELAY);
-#endif /* POLL/SELECT/SLEEP */
 				continue;
 			}
 			if (errno == EINTR) {
@@ -701,7 +704,11 @@ static ssize_t libssh2_blocking_read(LIBSSH2_SESSION *session, unsigned char *bu
 			}
 			return -1;
 		}
-		if (ret == 0) continue;
+		if (ret == 0) {
+			/* Remote end has gone, callers see the short read */
+			session->socket_state = LIBSSH2_SOCKET_DISCONNECTED;
+			break;
+		}
 
 		bytes_read += ret;
 	}
@@ -714,13 +721,328 @@ static ssize_t libssh2_blocking_read(LIBSSH2_SESSION *session, unsigned char *bu
 }
 /* }}} */
 
-/* {{{ libssh2_packet_read
+/* {{{ libssh2_blocking_writev
+ * Write all of iov, waiting for room whenever the socket is (or has been left, by another thread) non-blocking
+ * Returns 0, or -1 on failure with nothing said about how much went out
+ */
+static int libssh2_blocking_writev(LIBSSH2_SESSION *session, struct iovec *iov, int iovcnt)
+{
+	LIBSSH2_BLOCKING(session, 1);
+
+	while (iovcnt) {
+		int ret;
+
+		ret = (iovcnt == 1) ? LIBSSH2_WRITE(session, iov->iov_base, iov->iov_len) : LIBSSH2_WRITEV(session, iov, iovcnt);
+		if (ret < 0) {
+#ifdef WIN32
+			switch (WSAGetLastError()) {
+				case WSAEWOULDBLOCK:	errno = EAGAIN;		break;
+				case WSAEINTR:			errno = EINTR;		break;
+			}
+#endif
+			if (errno == EAGAIN) {
+				if (LIBSSH2_WAIT(session, 1, 30000) < 0) {
+					return -1;
+				}
+				continue;
+			}
+			if (errno == EINTR) {
+				continue;
+			}
+			if ((errno == EBADF) || (errno == EPIPE) || (errno == ENOTCONN)) {
+				session->socket_state = LIBSSH2_SOCKET_DISCONNECTED;
+			}
+			return -1;
+		}
+		if (ret == 0) {
+			return -1;
+		}
+
+		/* Step over whatever went out */
+		while (iovcnt && (size_t)ret >= iov->iov_len) {
+			ret -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt) {
+			iov->iov_base = (char *)iov->iov_base + ret;
+			iov->iov_len -= ret;
+		}
+	}
+
+	return 0;
+}
+/* }}} */
+
+/* {{{ libssh2_blocking_write
+ * Write all of buf, see libssh2_blocking_writev()
+ */
+static int libssh2_blocking_write(LIBSSH2_SESSION *session, unsigned char *buf, size_t count)
+{
+	struct iovec iov;
+
+	iov.iov_base = (char *)buf;
+	iov.iov_len = count;
+
+	return libssh2_blocking_writev(session, &iov, 1);
+}
+/* }}} */
+
+/* {{{ libssh2_crypt_span
+ * Run a multiple of blocksize bytes through the endpoint cipher in place,
+ * in one call when the method supports it
+ */
+static int libssh2_crypt_span(LIBSSH2_SESSION *session, LIBSSH2_CRYPT_METHOD *crypt, void **abstract,
+			      unsigned char *buf, unsigned long len)
+{
+	unsigned char *s;
+
+	if (crypt->crypt_span) {
+		return crypt->crypt_span(session, buf, len, abstract);
+	}
+
+	for(s = buf; s < buf + len; s += crypt->blocksize) {
+		if (crypt->crypt(session, s, abstract)) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+/* }}} */
+
+/* {{{ libssh2_rekey_due
+ * Has either rekey limit been passed? Called under data_lock, both ends of the transport count into kex_bytes
+ */
+static int libssh2_rekey_due(LIBSSH2_SESSION *session)
+{
+	if (session->rekey_bytes && session->kex_bytes >= session->rekey_bytes) {
+		return 1;
+	}
+	if (session->rekey_seconds && session->kex_time && (time(NULL) - session->kex_time) >= session->rekey_seconds) {
+		return 1;
+	}
+	return 0;
+}
+/* }}} */
+
+/* {{{ libssh2_rekey_pending
+ * Has a writer asked for new keys (and may the exchange start now)?
+ */
+static int libssh2_rekey_pending(LIBSSH2_SESSION *session)
+{
+	int pending;
+
+	if (!(session->state & LIBSSH2_STATE_NEWKEYS) || (session->state & LIBSSH2_STATE_EXCHANGING_KEYS)) {
+		return 0;
+	}
+	LIBSSH2_LOCK(session, data_lock);
+	pending = session->rekey_pending;
+	LIBSSH2_UNLOCK(session, data_lock);
+
+	return pending;
+}
+/* }}} */
+
+/* {{{ libssh2_packet_read_preamble
+ * Read and decrypt the first block of an encrypted packet into block, and check the lengths it gives
+ * The block as it arrived goes in cipher too (if not NULL), the next block of the packet chains from it
+ * Returns 1 with the packet length in *packet_len, otherwise as libssh2_packet_read_unlocked()
+ */
+static int libssh2_packet_read_preamble(LIBSSH2_SESSION *session, int should_block, unsigned char *block, unsigned char *cipher,
+										unsigned long *packet_len)
+{
+	unsigned long blocksize = session->remote.crypt->blocksize;
+	ssize_t read_len;
+
+	/* Note: If we add any cipher with a blocksize less than 6 we'll need to get more creative with this
+	 * For now, all blocksize sizes are 8+
+	 */
+	if (should_block) {
+		read_len = libssh2_blocking_read(session, block, blocksize);
+		if(read_len <= 0)
+			return read_len;
+	} else {
+		ssize_t nread;
+		read_len = LIBSSH2_READ(session, block, 1);
+		if (read_len <= 0) {
+			return 0;
+		}
+		nread = libssh2_blocking_read(session, block + read_len, blocksize - read_len);
+		if(nread <= 0)
+			return nread;
+
+		read_len += nread;
+	}
+	if (read_len < blocksize) {
+		return (session->socket_state == LIBSSH2_SOCKET_DISCONNECTED) ? 0 : -1;
+	}
+
+	if (cipher) {
+		memcpy(cipher, block, blocksize);
+	}
+	if (session->remote.crypt->crypt(session, block, &session->remote.crypt_abstract)) {
+		libssh2_error(session, LIBSSH2_ERROR_DECRYPT, "Error decrypting packet preamble", 0);
+		return -1;
+	}
+
+	*packet_len = libssh2_ntohu32(block);
+
+	/* RFC4253 section 6.1 Maximum Packet Length says:
+	 *
+	 * "All implementations MUST be able to process packets with
+	 * uncompressed payload length of 32768 bytes or less and
+	 * total packet size of 35000 bytes or less (including length,
+	 * padding length, payload, padding, and MAC.)."
+	 */
+	if(*packet_len > MAX_SSH_PACKET_LEN) {
+		return -1;
+	}
+
+	/* Sanity Check, the payload (padding_len(1) and the padding aside) has at least its type byte */
+	if (((*packet_len - 1) > LIBSSH2_PACKET_MAXPAYLOAD) ||
+		((*packet_len + 4) % blocksize) ||
+		(block[4] >= *packet_len - 1)) {
+		/* If something goes horribly wrong during the decryption phase, just bailout and die gracefully */
+		session->socket_state = LIBSSH2_SOCKET_DISCONNECTED;
+		libssh2_error(session, LIBSSH2_ERROR_PROTO, "Fatal protocol error, invalid payload size", 0);
+		return -1;
+	}
+
+	return 1;
+}
+/* }}} */
+
+/* {{{ libssh2_packet_read_ahead
+ * Read the next packet whole but decrypt only its first block, leaving the rest of it and the MAC check to
+ * the crypto workers; the session's own cipher context moves on to the packet's last block for the next one
+ * Returns 1 with job filled in, otherwise as libssh2_packet_read_unlocked()
+ */
+static int libssh2_packet_read_ahead(LIBSSH2_SESSION *session, libssh2_pipeline_job *job, int should_block)
+{
+	unsigned char block[LIBSSH2_PIPELINE_MAXBLOCK];
+	unsigned long blocksize = session->remote.crypt->blocksize;
+	unsigned long packet_len;
+	int mac_len = session->remote.mac->mac_len;
+	int ret;
+
+	if ((ret = libssh2_packet_read_preamble(session, should_block, block, job->iv, &packet_len)) <= 0) {
+		return ret;
+	}
+#ifdef LIBSSH2_DEBUG_TRANSPORT
+	_libssh2_debug(session, LIBSSH2_DBG_TRANS, "Reading ahead packet %lu bytes long (with %d bytes padding)", packet_len, (int)block[4]);
+#endif
+
+	job->payload_len = packet_len - 1; /* padding_len(1) */
+	job->padding_len = block[4];
+	job->payload = LIBSSH2_ALLOC(session, job->payload_len);
+	if (!job->payload) {
+		libssh2_error(session, LIBSSH2_ERROR_ALLOC, "Unable to allocate memory for packet", 0);
+		return -1;
+	}
+	job->span_off = blocksize - 5;
+	memcpy(job->payload, block + 5, job->span_off);
+
+	if ((libssh2_blocking_read(session, job->payload + job->span_off, job->payload_len - job->span_off) < (ssize_t)(job->payload_len - job->span_off)) ||
+		(libssh2_blocking_read(session, job->mac, mac_len) < mac_len)) {
+		LIBSSH2_FREE(session, job->payload);
+		return -1;
+	}
+
+	/* The next packet chains from this one's last block (the first, already decrypted, if that's all there is) */
+	if ((job->payload_len > job->span_off) &&
+		session->remote.crypt->crypt_set_iv(session, job->payload + job->payload_len - blocksize, &session->remote.crypt_abstract)) {
+		libssh2_error(session, LIBSSH2_ERROR_DECRYPT, "Error decrypting packet", 0);
+		LIBSSH2_FREE(session, job->payload);
+		return -1;
+	}
+
+	memcpy(job->head, block, 5);
+	job->seqno = session->remote.seqno++;
+	job->mac_method = session->remote.mac;
+	job->mac_abstract = session->remote.mac_abstract;
+	job->barrier = (block[5] == SSH_MSG_DISCONNECT) || ((block[5] >= SSH_MSG_KEXINIT) && (block[5] <= 49));
+
+	LIBSSH2_LOCK(session, data_lock);
+	session->kex_bytes += 4 + packet_len + mac_len;
+	LIBSSH2_UNLOCK(session, data_lock);
+	LIBSSH2_STAT_ADD(session, packets_received, 1);
+	LIBSSH2_STAT_ADD(session, bytes_received, 4 + packet_len + mac_len);
+
+	return 1;
+}
+/* }}} */
+
+/* {{{ libssh2_packet_add_job
+ * Add the packet from the oldest job, once the workers are done with it, to the brigade
+ */
+static int libssh2_packet_add_job(LIBSSH2_SESSION *session, libssh2_pipeline_job *job)
+{
+	unsigned char *payload = job->payload;
+	unsigned long payload_len = job->payload_len - job->padding_len;
+	int macstate = job->macstate;
+	int failed = job->failed;
+	int packet_type;
+
+	libssh2_pipeline_pop(session);
+
+	if (failed) {
+		libssh2_error(session, LIBSSH2_ERROR_DECRYPT, "Error decrypting packet", 0);
+		LIBSSH2_FREE(session, payload);
+		return -1;
+	}
+
+	packet_type = payload[0];
+	libssh2_packet_add(session, payload, payload_len, macstate);
+
+	return packet_type;
+}
+/* }}} */
+
+/* {{{ libssh2_packet_read_pipelined
+ * libssh2_packet_read_unlocked() with crypto workers: packets already read ahead come first, in order, and
+ * while the oldest is still with the workers whatever else has arrived is read ahead (if read_ahead)
+ */
+static int libssh2_packet_read_pipelined(LIBSSH2_SESSION *session, int should_block, int read_ahead)
+{
+	libssh2_pipeline_job *job;
+	int ret;
+
+	for(;;) {
+		if ((job = libssh2_pipeline_head(session, 0))) {
+			return libssh2_packet_add_job(session, job);
+		}
+		if (!read_ahead || !(job = libssh2_pipeline_slot(session))) {
+			break;
+		}
+		/* Only the first packet is waited for, the rest are read ahead if they're already here */
+		ret = libssh2_packet_read_ahead(session, job, should_block && !libssh2_pipeline_pending(session));
+		if (ret < 0) {
+			return -1;
+		}
+		if (!ret) {
+			break;
+		}
+		libssh2_pipeline_submit(session);
+
+		/* libssh2_blocking_read() left the socket blocking */
+		LIBSSH2_BLOCKING(session, 0);
+	}
+
+	if (!libssh2_pipeline_pending(session)) {
+		return 0;
+	}
+	return libssh2_packet_add_job(session, libssh2_pipeline_head(session, 1));
+}
+/* }}} */
+
+/* {{{ libssh2_packet_read_unlocked
  * Collect a packet into the input brigade
  * block only controls whether or not to wait for a packet to start,
  * Once a packet starts, libssh2 will block until it is complete
  * Returns packet type added to input brigade (0 if nothing added), or -1 on failure
  */
-int libssh2_packet_read(LIBSSH2_SESSION *session, int should_block)
+static int libssh2_packet_read_unlocked(LIBSSH2_SESSION *session, int should_block)
 {
 	int packet_type = -1;
 
@@ -728,14 +1050,39 @@ int libssh2_packet_read(LIBSSH2_SESSION *session, int should_block)
 		return 0;
 	}
 
-#ifndef WIN32
-	fcntl(session->socket_fd, F_SETFL, O_NONBLOCK);
-#else
-	{
-		u_long non_block = TRUE;
-		ioctlsocket(session->socket_fd, FIONBIO, &non_block);
+	/* Queued channel data goes out before we wait on a reply to it, except in the middle of a key exchange
+	 * Writers change outq_len under write_lock, so a threaded session leaves looking at it to libssh2_channel_outq_run()
+	 */
+	if ((LIBSSH2_THREADED(session) || session->outq_len) && !(session->state & LIBSSH2_STATE_EXCHANGING_KEYS) &&
+		libssh2_channel_outq_run(session, NULL, 0, 0)) {
+		return -1;
+	}
+
+	/* Anything corked has to go out before we wait on a reply to it */
+	if (session->outbuf_len && libssh2_packet_flush(session)) {
+		return -1;
+	}
+
+	/* Packets the crypto workers have been given go into the brigade first, nothing more is read ahead of them
+	 * while new keys are wanted
+	 */
+	if (libssh2_pipeline_pending(session)) {
+		return libssh2_packet_read_pipelined(session, should_block, libssh2_pipeline_ready(session) && !libssh2_rekey_pending(session));
 	}
+
+	/* A writer passed the rekey limits, exchange keys here on the read side rather than in the middle of its write
+	 * Like a KEXINIT from the remote end, see libssh2_packet_add()
+	 */
+	if (libssh2_rekey_pending(session)) {
+#ifdef LIBSSH2_DEBUG_TRANSPORT
+		_libssh2_debug(session, LIBSSH2_DBG_TRANS, "Rekey limit reached after %llu bytes", (unsigned long long)session->kex_bytes);
 #endif
+		if (libssh2_kex_exchange(session, 1)) {
+			return -1;
+		}
+	}
+
+	LIBSSH2_BLOCKING(session, 0);
 
 #ifdef LIBSSH2_DEBUG_TRANSPORT
 	_libssh2_debug(session, LIBSSH2_DBG_TRANS, "Checking for packet: will%s block", should_block ? "" : " not");
@@ -751,48 +1098,15 @@ int libssh2_packet_read(LIBSSH2_SESSION *session, int should_block)
 		int padding_len;
 		int macstate;
 		int free_payload = 1;
+		int ret;
 
-		/* Note: If we add any cipher with a blocksize less than 6 we'll need to get more creative with this
-		 * For now, all blocksize sizes are 8+
-		 */
-		if (should_block) {
-			read_len = libssh2_blocking_read(session, block, blocksize);
-			if(read_len <= 0)
-				return read_len;
-		} else {
-                        ssize_t nread;
-			read_len = LIBSSH2_READ(session, block, 1);
-			if (read_len <= 0) {
-				return 0;
-			}
-			nread = libssh2_blocking_read(session, block + read_len, blocksize - read_len);
-			if(nread <= 0)
-				return nread;
-
-			read_len += nread;
-		}
-		if (read_len < blocksize) {
-			return (session->socket_state == LIBSSH2_SOCKET_DISCONNECTED) ? 0 : -1;
-		}
-
-		if (session->remote.crypt->crypt(session, block, &session->remote.crypt_abstract)) {
-			libssh2_error(session, LIBSSH2_ERROR_DECRYPT, "Error decrypting packet preamble", 0);
-			return -1;
+		if (libssh2_pipeline_ready(session)) {
+			return libssh2_packet_read_pipelined(session, should_block, 1);
 		}
 
-		packet_len = libssh2_ntohu32(block);
-		
-		/* RFC4253 section 6.1 Maximum Packet Length says:
-		 *
-		 * "All implementations MUST be able to process packets with
-		 * uncompressed payload length of 32768 bytes or less and
-		 * total packet size of 35000 bytes or less (including length,
-		 * padding length, payload, padding, and MAC.)."
-		 */
-		if(packet_len > MAX_SSH_PACKET_LEN) {
-			return -1;
+		if ((ret = libssh2_packet_read_preamble(session, should_block, block, NULL, &packet_len)) <= 0) {
+			return ret;
 		}
-		
 		padding_len = block[4];
 #ifdef LIBSSH2_DEBUG_TRANSPORT
 	_libssh2_debug(session, LIBSSH2_DBG_TRANS, "Processing packet %lu bytes long (with %lu bytes padding)", packet_len, padding_len);
@@ -800,14 +1114,6 @@ int libssh2_packet_read(LIBSSH2_SESSION *session, int should_block)
 		memcpy(tmp, block, 5); /* Use this for MAC later */
 
 		payload_len = packet_len - 1; /* padding_len(1) */
-		/* Sanity Check */
-		if ((payload_len > LIBSSH2_PACKET_MAXPAYLOAD) ||
-			((packet_len + 4) % blocksize)) {
-			/* If something goes horribly wrong during the decryption phase, just bailout and die gracefully */
-			session->socket_state = LIBSSH2_SOCKET_DISCONNECTED;
-			libssh2_error(session, LIBSSH2_ERROR_PROTO, "Fatal protocol error, invalid payload size", 0);
-			return -1;
-		}
 
 		s = payload = LIBSSH2_ALLOC(session, payload_len);
 		memcpy(s, block + 5, blocksize - 5);
@@ -825,18 +1131,14 @@ int libssh2_packet_read(LIBSSH2_SESSION *session, int should_block)
 
 			p += read_len;
 
-    			while (s < p) {
-				memcpy(block, s, blocksize);
-
-				if (session->remote.crypt->crypt(session, block, &session->remote.crypt_abstract)) {
-					libssh2_error(session, LIBSSH2_ERROR_DECRYPT, "Error decrypting packet preamble", 0);
-					LIBSSH2_FREE(session, payload);
-					return -1;
-				}
-				memcpy(s, block, blocksize);
-
-				s += blocksize;
+			/* Every chunk but the last is a multiple of 4096, and the packet as a
+			 * whole is a multiple of blocksize, so s stays block aligned */
+			if (libssh2_crypt_span(session, session->remote.crypt, &session->remote.crypt_abstract, s, p - s)) {
+				libssh2_error(session, LIBSSH2_ERROR_DECRYPT, "Error decrypting packet", 0);
+				LIBSSH2_FREE(session, payload);
+				return -1;
 			}
+			s = p;
 		}
 
 		read_len = libssh2_blocking_read(session, block, session->remote.mac->mac_len);
@@ -851,6 +1153,11 @@ int libssh2_packet_read(LIBSSH2_SESSION *session, int should_block)
 		macstate =  (strncmp((char *)block, (char *)block + session->remote.mac->mac_len, session->remote.mac->mac_len) == 0) ? LIBSSH2_MAC_CONFIRMED : LIBSSH2_MAC_INVALID;
 
 		session->remote.seqno++;
+		LIBSSH2_LOCK(session, data_lock);
+		session->kex_bytes += 4 + packet_len + session->remote.mac->mac_len;
+		LIBSSH2_UNLOCK(session, data_lock);
+		LIBSSH2_STAT_ADD(session, packets_received, 1);
+		LIBSSH2_STAT_ADD(session, bytes_received, 4 + packet_len + session->remote.mac->mac_len);
 
 		/* Ignore padding */
 		payload_len -= padding_len;
@@ -914,7 +1221,7 @@ int libssh2_packet_read(LIBSSH2_SESSION *session, int should_block)
 			if (buf_len <= 0) {
                                 return buf_len;
 			}
-			nread = libssh2_blocking_read(session, buf, 5 - buf_len);
+			nread = libssh2_blocking_read(session, buf + buf_len, 5 - buf_len);
 			if(nread <= 0)
 				return -1;
 
@@ -967,18 +1274,125 @@ int libssh2_packet_read(LIBSSH2_SESSION *session, int should_block)
 		/* MACs don't exist in non-encrypted mode */
 		libssh2_packet_add(session, payload, payload_len, LIBSSH2_MAC_CONFIRMED);
 		session->remote.seqno++;
+		LIBSSH2_STAT_ADD(session, packets_received, 1);
+		LIBSSH2_STAT_ADD(session, bytes_received, 4 + packet_length);
 	}
 	return packet_type;
 }
 /* }}} */
 
+/* {{{ libssh2_packet_gen
+ * Snapshot for libssh2_packet_read_since(), to be taken before looking in the brigade (or at
+ * whatever else a packet would change) for what the caller is waiting on
+ */
+unsigned long libssh2_packet_gen(LIBSSH2_SESSION *session)
+{
+	unsigned long gen = 0;
+
+#ifndef WIN32
+	if (LIBSSH2_THREADED(session)) {
+		pthread_mutex_lock(&session->data_lock);
+		gen = session->packet_gen;
+		pthread_mutex_unlock(&session->data_lock);
+	}
+#endif
+	return gen;
+}
+/* }}} */
+
+#ifndef WIN32
+/* {{{ libssh2_packet_read_threaded
+ * With LIBSSH2_FLAG_THREADED only one thread reads at a time
+ * Anyone else wanting to block waits for that thread to finish with its packet, then
+ * gets the type of the last packet added (callers go back to the brigade to look for theirs)
+ * If a read has finished since gen was taken, what the caller looked for may have been added
+ * after it looked, so rather than block on the socket for something already here, that read
+ * counts as the one waited for
+ */
+static int libssh2_packet_read_threaded(LIBSSH2_SESSION *session, int should_block, unsigned long gen)
+{
+	int ret;
+
+	if (pthread_mutex_trylock(&session->read_lock) == 0) {
+		pthread_mutex_lock(&session->data_lock);
+		if (gen != session->packet_gen) {
+			ret = session->last_packet_type;
+			pthread_mutex_unlock(&session->data_lock);
+			pthread_mutex_unlock(&session->read_lock);
+			return ret;
+		}
+		pthread_mutex_unlock(&session->data_lock);
+
+		ret = libssh2_packet_read_unlocked(session, should_block);
+
+		/* read_lock goes first: anyone who sees the new generation and finds nothing for them
+		 * must be able to take over reading, not fail the trylock and wait on a finished reader */
+		pthread_mutex_unlock(&session->read_lock);
+
+		pthread_mutex_lock(&session->data_lock);
+		session->packet_gen++;
+		pthread_cond_broadcast(&session->packet_cond);
+		pthread_mutex_unlock(&session->data_lock);
+		return ret;
+	}
+
+	if (!should_block) {
+		return 0;
+	}
+
+	/* gen predates the failed trylock, so a reader finishing in between isn't missed */
+	pthread_mutex_lock(&session->data_lock);
+	while (gen == session->packet_gen) {
+		pthread_cond_wait(&session->packet_cond, &session->data_lock);
+	}
+	ret = session->last_packet_type;
+	pthread_mutex_unlock(&session->data_lock);
+
+	return (session->socket_state == LIBSSH2_SOCKET_DISCONNECTED) ? -1 : ret;
+}
+/* }}} */
+#endif
+
+/* {{{ libssh2_packet_read
+ * libssh2_packet_read_unlocked(), serialised between threads under LIBSSH2_FLAG_THREADED
+ */
+int libssh2_packet_read(LIBSSH2_SESSION *session, int should_block)
+{
+#ifndef WIN32
+	if (LIBSSH2_THREADED(session)) {
+		return libssh2_packet_read_threaded(session, should_block, libssh2_packet_gen(session));
+	}
+#endif
+
+	return libssh2_packet_read_unlocked(session, should_block);
+}
+/* }}} */
+
+/* {{{ libssh2_packet_read_since
+ * Blocking libssh2_packet_read() for callers which have just looked for something and not found it
+ * Under LIBSSH2_FLAG_THREADED another thread may have read it in since, so gen (from
+ * libssh2_packet_gen() before looking) decides whether there's any point waiting
+ */
+int libssh2_packet_read_since(LIBSSH2_SESSION *session, unsigned long gen)
+{
+#ifndef WIN32
+	if (LIBSSH2_THREADED(session)) {
+		return libssh2_packet_read_threaded(session, 1, gen);
+	}
+#endif
+	(void)gen;
+
+	return libssh2_packet_read_unlocked(session, 1);
+}
+/* }}} */
+
 /* {{{ libssh2_packet_ask
  * Scan the brigade for a matching packet type, optionally poll the socket for a packet first
  */
 int libssh2_packet_ask_ex(LIBSSH2_SESSION *session, unsigned char packet_type, unsigned char **data, unsigned long *data_len,
 													unsigned long match_ofs, const unsigned char *match_buf, unsigned long match_len, int poll_socket)
 {
-	LIBSSH2_PACKET *packet = session->packets.head;
+	LIBSSH2_PACKET *packet;
 
 	if (poll_socket) {
 		if (libssh2_packet_read(session, 0) < 0) {
@@ -988,6 +1402,8 @@ int libssh2_packet_ask_ex(LIBSSH2_SESSION *session, unsigned char packet_type, u
 #ifdef LIBSSH2_DEBUG_TRANSPORT
 	_libssh2_debug(session, LIBSSH2_DBG_TRANS, "Looking for packet of type: %d", (int)packet_type);
 #endif
+	LIBSSH2_LOCK(session, data_lock);
+	packet = session->packets.head;
 	while (packet) {
 		if (packet->data[0] == packet_type &&
 			(packet->data_len >= (match_ofs + match_len)) &&
@@ -1008,11 +1424,14 @@ int libssh2_packet_ask_ex(LIBSSH2_SESSION *session, unsigned char packet_type, u
 			}
 
 			LIBSSH2_FREE(session, packet);
+			LIBSSH2_UNLOCK(session, data_lock);
 
 			return 0;
 		}
 		packet = packet->next;
 	}
+	LIBSSH2_UNLOCK(session, data_lock);
+
 	return -1;
 }
 /* }}} */
@@ -1047,6 +1466,8 @@ int libssh2_packet_askv_ex(LIBSSH2_SESSION *session,
 int libssh2_packet_require_ex(LIBSSH2_SESSION *session, unsigned char packet_type, unsigned char **data, unsigned long *data_len,
 														unsigned long match_ofs, const unsigned char *match_buf, unsigned long match_len)
 {
+	unsigned long gen = libssh2_packet_gen(session);
+
 	if (libssh2_packet_ask_ex(session, packet_type, data, data_len, match_ofs, match_buf, match_len, 0) == 0) {
 		/* A packet was available in the packet brigade */
 		return 0;
@@ -1056,13 +1477,18 @@ int libssh2_packet_require_ex(LIBSSH2_SESSION *session, unsigned char packet_typ
 	_libssh2_debug(session, LIBSSH2_DBG_TRANS, "Blocking until packet of type %d becomes available", (int)packet_type);
 #endif
 	while (session->socket_state == LIBSSH2_SOCKET_CONNECTED) {
-		int ret = libssh2_packet_read(session, 1);
+		int ret = libssh2_packet_read_since(session, gen);
 		if (ret < 0) {
 			return -1;
 		}
-		if (ret == 0) continue;
 
-		if (packet_type == ret) {
+		if (LIBSSH2_THREADED(session)) {
+			/* Another thread may have done the reading, so look whatever ret was */
+			gen = libssh2_packet_gen(session);
+			if (libssh2_packet_ask_ex(session, packet_type, data, data_len, match_ofs, match_buf, match_len, 0) == 0) {
+				return 0;
+			}
+		} else if (ret && packet_type == ret) {
 			/* Be lazy, let packet_ask pull it out of the brigade */
 			return libssh2_packet_ask_ex(session, packet_type, data, data_len, match_ofs, match_buf, match_len, 0);
 		}
@@ -1123,21 +1549,26 @@ int libssh2_packet_burn(LIBSSH2_SESSION *session)
 int libssh2_packet_requirev_ex(LIBSSH2_SESSION *session, unsigned char *packet_types, unsigned char **data, unsigned long *data_len,
 														 unsigned long match_ofs, const unsigned char *match_buf, unsigned long match_len)
 {
+	unsigned long gen = libssh2_packet_gen(session);
+
 	if (libssh2_packet_askv_ex(session, packet_types, data, data_len, match_ofs, match_buf, match_len, 0) == 0) {
 		/* One of the packets listed was available in the packet brigade */
 		return 0;
 	}
 
 	while (session->socket_state != LIBSSH2_SOCKET_DISCONNECTED) {
-		int ret = libssh2_packet_read(session, 1);
+		int ret = libssh2_packet_read_since(session, gen);
 		if (ret < 0) {
 			return -1;
 		}
-		if (ret == 0) {
-			continue;
-		}
 
-		if (strchr((char *)packet_types, ret)) {
+		if (LIBSSH2_THREADED(session)) {
+			/* Another thread may have done the reading, so look whatever ret was */
+			gen = libssh2_packet_gen(session);
+			if (libssh2_packet_askv_ex(session, packet_types, data, data_len, match_ofs, match_buf, match_len, 0) == 0) {
+				return 0;
+			}
+		} else if (ret && strchr((char *)packet_types, ret)) {
 			/* Be lazy, let packet_ask pull it out of the brigade */
 			return libssh2_packet_askv_ex(session, packet_types, data, data_len, match_ofs, match_buf, match_len, 0);
 		}
@@ -1148,13 +1579,13 @@ int libssh2_packet_requirev_ex(LIBSSH2_SESSION *session, unsigned char *packet_t
 }
 /* }}} */
 
-/* {{{ libssh2_packet_write
+/* {{{ libssh2_packet_write_unlocked
  * Send a packet, encrypting it and adding a MAC code if necessary
  * Returns 0 on success, non-zero on failure
  */
-int libssh2_packet_write(LIBSSH2_SESSION *session, unsigned char *data, unsigned long data_len)
+static int libssh2_packet_write_unlocked(LIBSSH2_SESSION *session, unsigned char *data, unsigned long data_len, const unsigned char *tail, unsigned long tail_len)
 {
-	unsigned long packet_length = data_len + 1;
+	unsigned long packet_length = data_len + tail_len + 1;
 	unsigned long block_size = (session->state & LIBSSH2_STATE_NEWKEYS) ? session->local.crypt->blocksize : 8;
 	/* At this point packet_length doesn't include the packet_len field itself */
 	unsigned long padding_length;
@@ -1174,6 +1605,23 @@ int libssh2_packet_write(LIBSSH2_SESSION *session, unsigned char *data, unsigned
 	if ((session->state & LIBSSH2_STATE_NEWKEYS) &&
 		strcmp(session->local.comp->name, "none")) {
 
+		if (tail_len) {
+			/* The compressor wants the payload in one piece */
+			unsigned char *payload = LIBSSH2_ALLOC(session, data_len + tail_len);
+			int ret;
+
+			if (!payload) {
+				libssh2_error(session, LIBSSH2_ERROR_ALLOC, "Unable to allocate space for packet payload", 0);
+				return -1;
+			}
+			memcpy(payload, data, data_len);
+			memcpy(payload + data_len, tail, tail_len);
+			ret = libssh2_packet_write_unlocked(session, payload, data_len + tail_len, NULL, 0);
+			LIBSSH2_FREE(session, payload);
+
+			return ret;
+		}
+
 		if (session->local.comp->comp(session, 1, &data, &data_len, LIBSSH2_PACKET_MAXCOMP, &free_data, data, data_len, &session->local.comp_abstract)) {
 			return -1;
 		}
@@ -1182,16 +1630,7 @@ int libssh2_packet_write(LIBSSH2_SESSION *session, unsigned char *data, unsigned
 #endif
 	}
 
-#ifndef WIN32
-	fcntl(session->socket_fd, F_SETFL, 0);
-#else
-	{
-		u_long non_block = FALSE;
-		ioctlsocket(session->socket_fd, FIONBIO, &non_block);
-	}
-#endif
-
-	packet_length = data_len + 1; /* padding_length(1) -- MAC doesn't count -- Padding to be added soon */
+	packet_length = data_len + tail_len + 1; /* padding_length(1) -- MAC doesn't count -- Padding to be added soon */
 	padding_length = block_size - ((packet_length + 4) % block_size);
 	if (padding_length < 4) {
 		padding_length += block_size;
@@ -1207,11 +1646,42 @@ int libssh2_packet_write(LIBSSH2_SESSION *session, unsigned char *data, unsigned
 
 	if (session->state & LIBSSH2_STATE_NEWKEYS) {
 		/* Encryption is in effect */
-		unsigned char *encbuf, *s;
-		int ret, size, written = 0;
+		unsigned char *encbuf;
+		int ret, size;
 
-		/* include packet_length(4) itself and room for the hash at the end */
-		encbuf = LIBSSH2_ALLOC(session, 4 + packet_length + session->local.mac->mac_len);
+		size = 4 + packet_length + session->local.mac->mac_len;
+
+		if (session->corked) {
+			/* Build the packet in place at the end of the cork buffer */
+			if ((session->outbuf_len + size) > LIBSSH2_CORK_MAXLEN && libssh2_packet_flush(session)) {
+				if (free_data) {
+					LIBSSH2_FREE(session, data);
+				}
+				return -1;
+			}
+			if ((session->outbuf_len + size) > session->outbuf_size) {
+				unsigned long outbuf_size = session->outbuf_len + size;
+				unsigned char *outbuf;
+
+				if (outbuf_size < LIBSSH2_CORK_MAXLEN) {
+					outbuf_size = LIBSSH2_CORK_MAXLEN;
+				}
+				outbuf = LIBSSH2_REALLOC(session, session->outbuf, outbuf_size);
+				if (!outbuf) {
+					libssh2_error(session, LIBSSH2_ERROR_ALLOC, "Unable to allocate cork buffer", 0);
+					if (free_data) {
+						LIBSSH2_FREE(session, data);
+					}
+					return -1;
+				}
+				session->outbuf = outbuf;
+				session->outbuf_size = outbuf_size;
+			}
+			encbuf = session->outbuf + session->outbuf_len;
+		} else {
+			/* include packet_length(4) itself and room for the hash at the end */
+			encbuf = LIBSSH2_ALLOC(session, size);
+		}
 		if (!encbuf) {
 			libssh2_error(session, LIBSSH2_ERROR_ALLOC, "Unable to allocate encryption buffer", 0);
 			if (free_data) {
@@ -1223,7 +1693,11 @@ int libssh2_packet_write(LIBSSH2_SESSION *session, unsigned char *data, unsigned
 		/* Copy packet to encoding buffer */
 		memcpy(encbuf, buf, 5);
 		memcpy(encbuf + 5, data, data_len);
-		libssh2_random(encbuf + 5 + data_len, padding_length);
+		if (tail_len) {
+			/* Caller's data goes straight in behind the header, no intermediate copy */
+			memcpy(encbuf + 5 + data_len, tail, tail_len);
+		}
+		libssh2_random(encbuf + 5 + data_len + tail_len, padding_length);
 		if (free_data) {
 			LIBSSH2_FREE(session, data);
 		}
@@ -1232,23 +1706,37 @@ int libssh2_packet_write(LIBSSH2_SESSION *session, unsigned char *data, unsigned
  		session->local.mac->hash(session, encbuf + 4 + packet_length , session->local.seqno, encbuf, 4 + packet_length, NULL, 0, &session->local.mac_abstract);
 
 		/* Encrypt data */
-		for(s = encbuf; (s - encbuf) < (4 + packet_length) ; s += session->local.crypt->blocksize) {
-			session->local.crypt->crypt(session, s, &session->local.crypt_abstract);
+		if (libssh2_crypt_span(session, session->local.crypt, &session->local.crypt_abstract, encbuf, 4 + packet_length)) {
+			libssh2_error(session, LIBSSH2_ERROR_ENCRYPT, "Error encrypting packet", 0);
+			if (!session->corked) {
+				LIBSSH2_FREE(session, encbuf);
+			}
+			return -1;
 		}
 
 		session->local.seqno++;
 
-		/* Send It */
-		size = 4 + packet_length + session->local.mac->mac_len;
-		written = 0;
+		/* Current keys have been used long enough; the exchange is a round trip or two of DH, so rather than
+		 * hold this writer (and every reader, behind the transport locks) for it, leave it to the next packet read
+		 * (one finishing now clears the flag again)
+		 */
+		LIBSSH2_LOCK(session, data_lock);
+		session->kex_bytes += size;
+		if (libssh2_rekey_due(session)) {
+			session->rekey_pending = 1;
+		}
+		LIBSSH2_UNLOCK(session, data_lock);
+		LIBSSH2_STAT_ADD(session, packets_sent, 1);
+		LIBSSH2_STAT_ADD(session, bytes_sent, size);
 
-		while(written < size) {
-		    ret = LIBSSH2_WRITE(session, encbuf + written, size - written);
-		    if(ret > 0) written += ret;
-		    else break;
+		if (session->corked) {
+			/* Goes out with the rest on uncork or the next read */
+			session->outbuf_len += size;
+			return 0;
 		}
 
-		ret = written == size ? 0 : -1;
+		/* Send It */
+		ret = libssh2_blocking_write(session, encbuf, size);
 
 		/* Cleanup environment */
 		LIBSSH2_FREE(session, encbuf);
@@ -1256,7 +1744,7 @@ int libssh2_packet_write(LIBSSH2_SESSION *session, unsigned char *data, unsigned
 		return ret;
 	} else { /* LIBSSH2_ENDPOINT_CRYPT_NONE */
 		/* Simplified write for non-encrypted mode */
-		struct iovec data_vector[3];
+		struct iovec data_vector[4];
 
 		/* Using vectors means we don't have to alloc a new buffer -- a byte saved is a byte earned
 		 * No MAC during unencrypted phase
@@ -1265,17 +1753,69 @@ int libssh2_packet_write(LIBSSH2_SESSION *session, unsigned char *data, unsigned
 		data_vector[0].iov_len = 5;
 		data_vector[1].iov_base = (char*)data;
 		data_vector[1].iov_len = data_len;
-		data_vector[2].iov_base = buf + 5;
-		data_vector[2].iov_len = padding_length;
+		data_vector[2].iov_base = (char*)tail;
+		data_vector[2].iov_len = tail_len;
+		data_vector[3].iov_base = buf + 5;
+		data_vector[3].iov_len = padding_length;
 
 		session->local.seqno++;
+		LIBSSH2_STAT_ADD(session, packets_sent, 1);
+		LIBSSH2_STAT_ADD(session, bytes_sent, 4 + packet_length);
 
 		/* Ignore this, it can't actually happen :) */
 		if (free_data) {
 			LIBSSH2_FREE(session, data);
 		}
 
-		return ((packet_length + 4) == writev(session->socket_fd, data_vector, 3)) ? 0 : 1;
+		return libssh2_blocking_writev(session, data_vector, 4);
 	}
 }
 /* }}} */
+
+/* {{{ libssh2_packet_writev
+ * Send a packet whose payload is data followed by tail, flagging a key re-exchange once they've been used long enough
+ * With LIBSSH2_FLAG_THREADED the packet goes out under write_lock
+ */
+int libssh2_packet_writev(LIBSSH2_SESSION *session, unsigned char *data, unsigned long data_len, const unsigned char *tail, unsigned long tail_len)
+{
+	int ret;
+
+	LIBSSH2_LOCK(session, write_lock);
+	ret = libssh2_packet_write_unlocked(session, data, data_len, tail, tail_len);
+	LIBSSH2_UNLOCK(session, write_lock);
+
+	return ret;
+}
+/* }}} */
+
+/* {{{ libssh2_packet_write
+ * Send a packet
+ */
+int libssh2_packet_write(LIBSSH2_SESSION *session, unsigned char *data, unsigned long data_len)
+{
+	return libssh2_packet_writev(session, data, data_len, NULL, 0);
+}
+/* }}} */
+
+/* {{{ libssh2_packet_flush
+ * Send whatever has been collected while the session was corked
+ * With LIBSSH2_FLAG_THREADED this goes out under write_lock, like any other packet
+ */
+int libssh2_packet_flush(LIBSSH2_SESSION *session)
+{
+	int ret = 0;
+
+	LIBSSH2_LOCK(session, write_lock);
+	if (session->outbuf_len) {
+		/* The packets are already sequenced and MACed, on failure the session can't carry on anyway */
+		ret = libssh2_blocking_write(session, session->outbuf, session->outbuf_len);
+		if (ret) {
+			libssh2_error(session, LIBSSH2_ERROR_SOCKET_SEND, "Unable to send corked packets", 0);
+		}
+		session->outbuf_len = 0;
+	}
+	LIBSSH2_UNLOCK(session, write_lock);
+
+	return ret;
+}
+/* }}} */
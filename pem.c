@@ -63,8 +63,10 @@ int _libssh2_pem_parse (LIBSSH2_SESSION *session,
 			char **data, unsigned int *datalen)
 {
 	char line[LINE_SIZE];
-	char *b64data = NULL;
-	unsigned int b64datalen = 0;
+	unsigned char *out = NULL;
+	unsigned int outlen = 0, outsize, quartet = 0;
+	struct stat st;
+	long pos;
 	int ret;
 
 	do
@@ -76,26 +78,51 @@ int _libssh2_pem_parse (LIBSSH2_SESSION *session,
 	}
 	while (strcmp (line, headerbegin) != 0);
 
+	/* Whatever is left of the file bounds the decoded size, so
+	 * size the buffer once and decode each line straight into it */
+	pos = ftell (fp);
+	if (pos >= 0 && fstat (fileno (fp), &st) == 0 && st.st_size > pos)
+	{
+		outsize = (3 * (st.st_size - pos) / 4) + 1;
+	}
+	else
+	{
+		outsize = 3 * LINE_SIZE;
+	}
+	out = LIBSSH2_ALLOC (session, outsize);
+	if (!out)
+	{
+		return -1;
+	}
+
 	*line = '\0';
 
 	do
 	{
 		if (*line)
 		{
-			char *tmp;
-			size_t linelen;
+			size_t linelen, need;
 
 			linelen = strlen (line);
-			tmp = LIBSSH2_REALLOC (session, b64data,
-					       b64datalen + linelen);
-			if (!tmp)
+			/* Characters carried over from the last line's partial
+			 * quartet decode along with this line's */
+			need = outlen + (3 * ((quartet % 4) + linelen) / 4) + 1;
+			if (need > outsize)
 			{
-				ret = -1;
-				goto out;
+				/* Only reached when the file size wasn't available */
+				unsigned char *tmp;
+
+				outsize = 2 * need;
+				tmp = LIBSSH2_REALLOC (session, out, outsize);
+				if (!tmp)
+				{
+					ret = -1;
+					goto out;
+				}
+				out = tmp;
 			}
-			memcpy (tmp + b64datalen, line, linelen);
-			b64data = tmp;
-			b64datalen += linelen;
+			libssh2_base64_decode_chunk (out, &outlen, &quartet,
+						     line, linelen);
 		}
 
 		if (readline(line, LINE_SIZE, fp))
@@ -105,18 +132,19 @@ int _libssh2_pem_parse (LIBSSH2_SESSION *session,
 		}
 	} while (strcmp (line, headerend) != 0);
 
-	if (libssh2_base64_decode(session, data, datalen,
-				  b64data, b64datalen))
+	if ((quartet % 4) == 1)
 	{
+		/* Left with a character that can't make up a whole byte */
 		ret = -1;
 		goto out;
 	}
 
-	ret = 0;
+	*data = (char *)out;
+	*datalen = outlen;
+	return 0;
+
 out:
-	if (b64data) {
-		LIBSSH2_FREE (session, b64data);
-	}
+	LIBSSH2_FREE (session, out);
 	return ret;
 }
 
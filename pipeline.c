@@ -0,0 +1,387 @@
+/*
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ *   Redistributions of source code must retain the above
+ *   copyright notice, this list of conditions and the
+ *   following disclaimer.
+ *
+ *   Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following
+ *   disclaimer in the documentation and/or other materials
+ *   provided with the distribution.
+ *
+ *   Neither the name of the copyright holder nor the names
+ *   of any other contributors may be used to endorse or
+ *   promote products derived from this software without
+ *   specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+
+/* Crypto worker pool, see libssh2_session_crypto_workers()
+ * With CBC and an HMAC, decrypting a packet and checking its MAC is most of what reading it costs, and on a
+ * fast link that holds the reading thread to what one core can do. libssh2_packet_read() decrypts just the
+ * first block of each packet itself, for its length, reads the rest without decrypting it, and moves the
+ * session's cipher context on to the packet's last block; in CBC each block only needs the one before it,
+ * so the body can be decrypted anywhere the key is. The workers do that and the MAC, each with a copy of
+ * the remote cipher context, while the reading thread carries on reading the packets behind it. Packets
+ * reach the brigade in the order they arrived all the same
+ * The reading thread only reads ahead what has already arrived, and never past a packet that can change
+ * the keys (KEXINIT, NEWKEYS and the rest of 20 to 49) or end the session (DISCONNECT), see
+ * libssh2_pipeline_slot(); during a key exchange, and with compression on, packets are read as before
+ */
+
+#include "libssh2_priv.h"
+
+#ifndef WIN32
+
+#define LIBSSH2_PIPELINE_MAXWORKERS		16
+#define LIBSSH2_PIPELINE_DEPTH			32			/* packets read ahead at most */
+
+typedef struct _libssh2_pipeline_worker {
+	libssh2_pipeline *pipeline;
+	pthread_t thread;
+
+	/* This worker's copy of the remote cipher context */
+	void *crypt_abstract;
+} libssh2_pipeline_worker;
+
+struct _libssh2_pipeline {
+	LIBSSH2_SESSION *session;
+
+	int workers;
+	libssh2_pipeline_worker worker[LIBSSH2_PIPELINE_MAXWORKERS];
+
+	/* The remote cipher the workers' contexts are copies of, NULL until the first packet under new keys */
+	LIBSSH2_CRYPT_METHOD *crypt;
+
+	/* jobs[head % LIBSSH2_PIPELINE_DEPTH] is the oldest job, next the first no worker has taken yet and
+	 * tail the first free one; only the reading thread moves head and tail, and next is only moved under lock
+	 */
+	pthread_mutex_t lock;
+	pthread_cond_t work, done;
+	libssh2_pipeline_job jobs[LIBSSH2_PIPELINE_DEPTH];
+	unsigned int head, next, tail;
+	int stop;
+};
+
+/* {{{ libssh2_pipeline_work
+ * A worker: decrypt the body of each packet it takes and check its MAC
+ */
+static void *libssh2_pipeline_work(void *arg)
+{
+	libssh2_pipeline_worker *w = arg;
+	libssh2_pipeline *p = w->pipeline;
+	LIBSSH2_SESSION *session = p->session;
+	LIBSSH2_CRYPT_METHOD *crypt;
+	libssh2_pipeline_job *job;
+	unsigned char mac[LIBSSH2_PIPELINE_MAXMAC];
+
+	pthread_mutex_lock(&p->lock);
+	while (!p->stop) {
+		if (p->next == p->tail) {
+			pthread_cond_wait(&p->work, &p->lock);
+			continue;
+		}
+		job = &p->jobs[p->next++ % LIBSSH2_PIPELINE_DEPTH];
+		crypt = p->crypt;
+		pthread_mutex_unlock(&p->lock);
+
+		if ((job->payload_len > job->span_off) &&
+			(crypt->crypt_set_iv(session, job->iv, &w->crypt_abstract) ||
+			 crypt->crypt_span(session, job->payload + job->span_off, job->payload_len - job->span_off, &w->crypt_abstract))) {
+			job->failed = 1;
+		} else {
+			job->mac_method->hash(session, mac, job->seqno, job->head, 5, job->payload, job->payload_len, &job->mac_abstract);
+			job->macstate = memcmp(mac, job->mac, job->mac_method->mac_len) ? LIBSSH2_MAC_INVALID : LIBSSH2_MAC_CONFIRMED;
+		}
+
+		pthread_mutex_lock(&p->lock);
+		job->done = 1;
+		pthread_cond_signal(&p->done);
+	}
+	pthread_mutex_unlock(&p->lock);
+
+	return NULL;
+}
+/* }}} */
+
+/* {{{ libssh2_pipeline_drop_keys
+ * Free the workers' cipher contexts, with nothing queued; kex.c calls it before the remote keys are replaced
+ */
+void libssh2_pipeline_drop_keys(LIBSSH2_SESSION *session)
+{
+	libssh2_pipeline *p = session->pipeline;
+	int i;
+
+	if (!p || !p->crypt) {
+		return;
+	}
+	for(i = 0; i < p->workers; i++) {
+		if (p->worker[i].crypt_abstract) {
+			p->crypt->dtor(session, &p->worker[i].crypt_abstract);
+		}
+	}
+	p->crypt = NULL;
+}
+/* }}} */
+
+/* {{{ libssh2_pipeline_ready
+ * Can the next packet be read ahead for the workers? Gives them contexts for the current keys if need be
+ */
+int libssh2_pipeline_ready(LIBSSH2_SESSION *session)
+{
+	libssh2_pipeline *p = session->pipeline;
+	LIBSSH2_CRYPT_METHOD *crypt = session->remote.crypt;
+	int i;
+
+	if (!p || !(session->state & LIBSSH2_STATE_NEWKEYS) || (session->state & LIBSSH2_STATE_EXCHANGING_KEYS)) {
+		return 0;
+	}
+	if (!crypt->crypt_clone || !crypt->crypt_set_iv || !crypt->crypt_span || (crypt->blocksize > LIBSSH2_PIPELINE_MAXBLOCK) ||
+		(session->remote.mac->mac_len > LIBSSH2_PIPELINE_MAXMAC)) {
+		return 0;
+	}
+	if (session->remote.comp && strcmp(session->remote.comp->name, "none")) {
+		return 0;
+	}
+
+	if (!p->crypt) {
+		p->crypt = crypt;
+		for(i = 0; i < p->workers; i++) {
+			if (crypt->crypt_clone(session, &session->remote.crypt_abstract, &p->worker[i].crypt_abstract)) {
+				libssh2_pipeline_drop_keys(session);
+				return 0;
+			}
+		}
+	}
+
+	return 1;
+}
+/* }}} */
+
+/* {{{ libssh2_pipeline_pending
+ * Packets read ahead that haven't been taken back with libssh2_pipeline_pop()
+ */
+int libssh2_pipeline_pending(LIBSSH2_SESSION *session)
+{
+	libssh2_pipeline *p = session->pipeline;
+
+	return p ? (int)(p->tail - p->head) : 0;
+}
+/* }}} */
+
+/* {{{ libssh2_pipeline_slot
+ * A job to fill in for the next packet and pass to libssh2_pipeline_submit(), or NULL if nothing more may be
+ * read ahead: every slot is in use, or the last packet read can change the keys or end the session
+ */
+libssh2_pipeline_job *libssh2_pipeline_slot(LIBSSH2_SESSION *session)
+{
+	libssh2_pipeline *p = session->pipeline;
+	libssh2_pipeline_job *job;
+
+	if (p->tail - p->head == LIBSSH2_PIPELINE_DEPTH) {
+		return NULL;
+	}
+	if ((p->tail != p->head) && p->jobs[(p->tail - 1) % LIBSSH2_PIPELINE_DEPTH].barrier) {
+		return NULL;
+	}
+
+	job = &p->jobs[p->tail % LIBSSH2_PIPELINE_DEPTH];
+	memset(job, 0, sizeof(libssh2_pipeline_job));
+
+	return job;
+}
+/* }}} */
+
+/* {{{ libssh2_pipeline_submit
+ * Hand the job from libssh2_pipeline_slot() to the workers
+ */
+void libssh2_pipeline_submit(LIBSSH2_SESSION *session)
+{
+	libssh2_pipeline *p = session->pipeline;
+
+	pthread_mutex_lock(&p->lock);
+	p->tail++;
+	pthread_cond_signal(&p->work);
+	pthread_mutex_unlock(&p->lock);
+}
+/* }}} */
+
+/* {{{ libssh2_pipeline_head
+ * The oldest job, once the workers are done with it (waiting for that if wait), NULL if there isn't one
+ */
+libssh2_pipeline_job *libssh2_pipeline_head(LIBSSH2_SESSION *session, int wait)
+{
+	libssh2_pipeline *p = session->pipeline;
+	libssh2_pipeline_job *job;
+
+	if (!p || (p->head == p->tail)) {
+		return NULL;
+	}
+	job = &p->jobs[p->head % LIBSSH2_PIPELINE_DEPTH];
+
+	pthread_mutex_lock(&p->lock);
+	while (!job->done) {
+		if (!wait) {
+			pthread_mutex_unlock(&p->lock);
+			return NULL;
+		}
+		pthread_cond_wait(&p->done, &p->lock);
+	}
+	pthread_mutex_unlock(&p->lock);
+
+	return job;
+}
+/* }}} */
+
+/* {{{ libssh2_pipeline_pop
+ * Done with the job from libssh2_pipeline_head(), its payload is the caller's now
+ */
+void libssh2_pipeline_pop(LIBSSH2_SESSION *session)
+{
+	session->pipeline->head++;
+}
+/* }}} */
+
+/* {{{ libssh2_pipeline_free
+ * Stop the workers and drop whatever was read ahead
+ */
+void libssh2_pipeline_free(LIBSSH2_SESSION *session)
+{
+	libssh2_pipeline *p = session->pipeline;
+	int i;
+
+	pthread_mutex_lock(&p->lock);
+	p->stop = 1;
+	pthread_cond_broadcast(&p->work);
+	pthread_mutex_unlock(&p->lock);
+	for(i = 0; i < p->workers; i++) {
+		pthread_join(p->worker[i].thread, NULL);
+	}
+
+	for(; p->head != p->tail; p->head++) {
+		LIBSSH2_FREE(session, p->jobs[p->head % LIBSSH2_PIPELINE_DEPTH].payload);
+	}
+	libssh2_pipeline_drop_keys(session);
+
+	pthread_cond_destroy(&p->done);
+	pthread_cond_destroy(&p->work);
+	pthread_mutex_destroy(&p->lock);
+	LIBSSH2_FREE(session, p);
+	session->pipeline = NULL;
+}
+/* }}} */
+
+/* {{{ libssh2_session_crypto_workers
+ * Start (or with 0, stop) the pool of threads received packets are decrypted and checked on
+ */
+LIBSSH2_API int libssh2_session_crypto_workers(LIBSSH2_SESSION *session, int workers)
+{
+	libssh2_pipeline *p;
+
+	if (session->state & LIBSSH2_STATE_NEWKEYS) {
+		libssh2_error(session, LIBSSH2_ERROR_INVAL, "Crypto workers have to be set up before libssh2_session_startup()", 0);
+		return -1;
+	}
+	if (session->pipeline) {
+		libssh2_pipeline_free(session);
+	}
+	if (workers <= 0) {
+		return 0;
+	}
+	if (workers > LIBSSH2_PIPELINE_MAXWORKERS) {
+		workers = LIBSSH2_PIPELINE_MAXWORKERS;
+	}
+
+	p = LIBSSH2_ALLOC(session, sizeof(libssh2_pipeline));
+	if (!p) {
+		libssh2_error(session, LIBSSH2_ERROR_ALLOC, "Unable to allocate crypto worker state", 0);
+		return -1;
+	}
+	memset(p, 0, sizeof(libssh2_pipeline));
+	p->session = session;
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->work, NULL);
+	pthread_cond_init(&p->done, NULL);
+	session->pipeline = p;
+
+	for(p->workers = 0; p->workers < workers; p->workers++) {
+		p->worker[p->workers].pipeline = p;
+		if (pthread_create(&p->worker[p->workers].thread, NULL, libssh2_pipeline_work, &p->worker[p->workers])) {
+			libssh2_pipeline_free(session);
+			libssh2_error(session, LIBSSH2_ERROR_ALLOC, "Unable to start crypto workers", 0);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+/* }}} */
+
+#else
+
+int libssh2_pipeline_ready(LIBSSH2_SESSION *session)
+{
+	return 0;
+}
+
+int libssh2_pipeline_pending(LIBSSH2_SESSION *session)
+{
+	return 0;
+}
+
+libssh2_pipeline_job *libssh2_pipeline_slot(LIBSSH2_SESSION *session)
+{
+	return NULL;
+}
+
+void libssh2_pipeline_submit(LIBSSH2_SESSION *session)
+{
+}
+
+libssh2_pipeline_job *libssh2_pipeline_head(LIBSSH2_SESSION *session, int wait)
+{
+	return NULL;
+}
+
+void libssh2_pipeline_pop(LIBSSH2_SESSION *session)
+{
+}
+
+void libssh2_pipeline_drop_keys(LIBSSH2_SESSION *session)
+{
+}
+
+void libssh2_pipeline_free(LIBSSH2_SESSION *session)
+{
+}
+
+/* {{{ libssh2_session_crypto_workers
+ */
+LIBSSH2_API int libssh2_session_crypto_workers(LIBSSH2_SESSION *session, int workers)
+{
+	if (workers <= 0) {
+		return 0;
+	}
+	libssh2_error(session, LIBSSH2_ERROR_METHOD_NOT_SUPPORTED, "Crypto workers need pthreads", 0);
+	return -1;
+}
+/* }}} */
+
+#endif /* WIN32 */
@@ -39,6 +39,7 @@
 #include <errno.h>
 #ifndef WIN32
 #include <unistd.h>
+#include <fcntl.h>
 #endif
 #include <stdlib.h>
 
@@ -47,6 +48,10 @@
 #include <math.h>
 #endif
 
+#ifdef HAVE_SYS_UIO_H
+#include <sys/uio.h>
+#endif
+
 #ifdef HAVE_POLL
 # include <sys/poll.h>
 #else
@@ -90,14 +95,65 @@ static LIBSSH2_REALLOC_FUNC(libssh2_default_realloc)
  */
 static LIBSSH2_WRITE_FUNC(libssh2_default_write)
 {
+	LIBSSH2_STAT_ADD(session, transport_syscalls, 1);
 	return send(session->socket_fd, buffer, length, LIBSSH2_SOCKET_SEND_FLAGS(session));
 }
 
 static LIBSSH2_READ_FUNC(libssh2_default_read)
 {
+	LIBSSH2_STAT_ADD(session, transport_syscalls, 1);
 	return recv(session->socket_fd, buffer, length, LIBSSH2_SOCKET_RECV_FLAGS(session));
 }
 
+static LIBSSH2_WRITEV_FUNC(libssh2_default_writev)
+{
+	LIBSSH2_STAT_ADD(session, transport_syscalls, 1);
+	return writev(session->socket_fd, iov, iovcnt);
+}
+
+static LIBSSH2_WAIT_FUNC(libssh2_default_wait)
+{
+#ifdef HAVE_POLL
+	struct pollfd sock;
+
+	sock.fd = session->socket_fd;
+	sock.events = for_write ? POLLOUT : POLLIN;
+
+	LIBSSH2_STAT_ADD(session, transport_syscalls, 1);
+	return poll(&sock, 1, timeout);
+#elif defined(HAVE_SELECT)
+	fd_set sock;
+	struct timeval tv;
+
+	FD_ZERO(&sock);
+	FD_SET(session->socket_fd, &sock);
+
+	tv.tv_sec = timeout / 1000;
+	tv.tv_usec = (timeout % 1000) * 1000;
+
+	LIBSSH2_STAT_ADD(session, transport_syscalls, 1);
+	return select(session->socket_fd + 1, for_write ? NULL : &sock, for_write ? &sock : NULL, NULL, &tv);
+#else
+	/* Nothing to wait with, so nap briefly and let the caller retry */
+	usleep(LIBSSH2_SOCKET_POLL_UDELAY);
+	return 1;
+#endif /* POLL/SELECT/SLEEP */
+}
+
+static LIBSSH2_BLOCKING_FUNC(libssh2_default_blocking)
+{
+	LIBSSH2_STAT_ADD(session, transport_syscalls, 1);
+#ifndef WIN32
+	return fcntl(session->socket_fd, F_SETFL, blocking ? 0 : O_NONBLOCK) == -1 ? -1 : 0;
+#else
+	{
+		u_long non_block = blocking ? FALSE : TRUE;
+
+		return ioctlsocket(session->socket_fd, FIONBIO, &non_block) ? -1 : 0;
+	}
+#endif
+}
+/* }}} */
 
 /* {{{ libssh2_session_set_user_info 
  * ui is passed into the custom read / write functions
@@ -126,6 +182,146 @@ LIBSSH2_API void libssh2_session_set_read(LIBSSH2_SESSION *session, void *my_rea
 }
 /* }}} */
 
+/* {{{ libssh2_session_set_writev
+* Set a custom function to handle gathered writes to the socket/stream
+*/
+LIBSSH2_API void libssh2_session_set_writev(LIBSSH2_SESSION *session, void *my_writev)
+{
+	session->ssh_writev = my_writev;
+}
+/* }}} */
+
+/* {{{ libssh2_session_set_wait
+* Set a custom function to wait for the socket/stream to become ready
+*/
+LIBSSH2_API void libssh2_session_set_wait(LIBSSH2_SESSION *session, void *my_wait)
+{
+	session->ssh_wait = my_wait;
+}
+/* }}} */
+
+/* {{{ libssh2_session_set_blocking_mode
+* Set a custom function to switch the socket/stream between blocking and non-blocking mode
+*/
+LIBSSH2_API void libssh2_session_set_blocking_mode(LIBSSH2_SESSION *session, void *my_blocking)
+{
+	session->ssh_blocking = my_blocking;
+}
+/* }}} */
+
+/* {{{ libssh2_session_cork
+ * Hold back (cork != 0) or release (cork == 0) outgoing packets
+ * Uncorking sends anything collected in the meantime
+ */
+LIBSSH2_API int libssh2_session_cork(LIBSSH2_SESSION *session, int cork)
+{
+	session->corked = cork;
+	if (!cork) {
+		return libssh2_packet_flush(session);
+	}
+	return 0;
+}
+/* }}} */
+
+/* {{{ libssh2_session_rekey_limits
+ * Set how much traffic, or time, a set of keys is used for
+ */
+LIBSSH2_API void libssh2_session_rekey_limits(LIBSSH2_SESSION *session, libssh2_uint64_t bytes, long seconds)
+{
+	session->rekey_bytes = bytes;
+	session->rekey_seconds = seconds;
+}
+/* }}} */
+
+/* {{{ libssh2_session_rekey
+ * Re-exchange keys now
+ */
+LIBSSH2_API int libssh2_session_rekey(LIBSSH2_SESSION *session)
+{
+	if (!(session->state & LIBSSH2_STATE_NEWKEYS)) {
+		libssh2_error(session, LIBSSH2_ERROR_INVAL, "Keys have not been exchanged yet", 0);
+		return -1;
+	}
+	if (session->state & LIBSSH2_STATE_EXCHANGING_KEYS) {
+		return 0;
+	}
+	return libssh2_kex_exchange(session, 1);
+}
+/* }}} */
+
+/* {{{ libssh2_session_stats
+ * Copy out the session's traffic and allocation counters
+ * On a threaded session each counter is read atomically, but other threads may count between one and the next
+ */
+LIBSSH2_API void libssh2_session_stats(LIBSSH2_SESSION *session, LIBSSH2_SESSION_STATS *stats)
+{
+	stats->bytes_sent = LIBSSH2_STAT_GET(session, bytes_sent);
+	stats->bytes_received = LIBSSH2_STAT_GET(session, bytes_received);
+	stats->packets_sent = LIBSSH2_STAT_GET(session, packets_sent);
+	stats->packets_received = LIBSSH2_STAT_GET(session, packets_received);
+	stats->transport_writes = LIBSSH2_STAT_GET(session, transport_writes);
+	stats->transport_reads = LIBSSH2_STAT_GET(session, transport_reads);
+	stats->transport_syscalls = LIBSSH2_STAT_GET(session, transport_syscalls);
+	stats->allocs = LIBSSH2_STAT_GET(session, allocs);
+	stats->key_exchanges = LIBSSH2_STAT_GET(session, key_exchanges);
+}
+/* }}} */
+
+/* {{{ libssh2_session_stats_reset
+ * Zero the counters, e.g. once the handshake is done so a benchmark only sees its own traffic
+ */
+LIBSSH2_API void libssh2_session_stats_reset(LIBSSH2_SESSION *session)
+{
+	LIBSSH2_STAT_CLEAR(session, bytes_sent);
+	LIBSSH2_STAT_CLEAR(session, bytes_received);
+	LIBSSH2_STAT_CLEAR(session, packets_sent);
+	LIBSSH2_STAT_CLEAR(session, packets_received);
+	LIBSSH2_STAT_CLEAR(session, transport_writes);
+	LIBSSH2_STAT_CLEAR(session, transport_reads);
+	LIBSSH2_STAT_CLEAR(session, transport_syscalls);
+	LIBSSH2_STAT_CLEAR(session, allocs);
+	LIBSSH2_STAT_CLEAR(session, key_exchanges);
+}
+/* }}} */
+
+/* {{{ libssh2_session_alive
+ * Cheap check for whether a session is worth reusing, nothing is sent to the remote end
+ * Pending packets are processed, so a disconnect or keepalive reply already on the wire is noticed
+ */
+LIBSSH2_API int libssh2_session_alive(LIBSSH2_SESSION *session)
+{
+	if (session->socket_state == LIBSSH2_SOCKET_DISCONNECTED) {
+		return 0;
+	}
+
+	while (LIBSSH2_WAIT(session, 0, 0) > 0) {
+#ifndef WIN32
+		if (session->ssh_read == libssh2_default_read) {
+			char c;
+
+			/* A readable socket with nothing to read means the remote end has gone */
+			if (recv(session->socket_fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) == 0) {
+				session->socket_state = LIBSSH2_SOCKET_DISCONNECTED;
+				return 0;
+			}
+		}
+#endif
+		if (libssh2_packet_read(session, 0) <= 0) {
+			break;
+		}
+	}
+
+	if (session->socket_state == LIBSSH2_SOCKET_DISCONNECTED) {
+		return 0;
+	}
+	if (session->keepalive_max && session->keepalive_unanswered >= session->keepalive_max) {
+		return 0;
+	}
+
+	return 1;
+}
+/* }}} */
+
 /* {{{ libssh2_banner_receive
  * Wait for a hello from the remote host
  * Allocate a buffer and store the banner in session->remote.banner
@@ -281,6 +477,9 @@ LIBSSH2_API LIBSSH2_SESSION *libssh2_session_init_ex(
 	LIBSSH2_REALLOC_FUNC((*local_realloc))	= libssh2_default_realloc;
 	LIBSSH2_WRITE_FUNC((*local_write))		= libssh2_default_write;
 	LIBSSH2_READ_FUNC((*local_read))		= libssh2_default_read;
+	LIBSSH2_WRITEV_FUNC((*local_writev))	= libssh2_default_writev;
+	LIBSSH2_WAIT_FUNC((*local_wait))		= libssh2_default_wait;
+	LIBSSH2_BLOCKING_FUNC((*local_blocking))	= libssh2_default_blocking;
 	LIBSSH2_SESSION *session;
 
 	if (my_alloc)	local_alloc		= my_alloc;
@@ -295,6 +494,27 @@ LIBSSH2_API LIBSSH2_SESSION *libssh2_session_init_ex(
 	session->abstract	= abstract;
 	session->ssh_write	= local_write;
 	session->ssh_read	= local_read;
+	session->ssh_writev	= local_writev;
+	session->ssh_wait	= local_wait;
+	session->ssh_blocking	= local_blocking;
+	session->rekey_bytes	= LIBSSH2_REKEY_BYTES;
+	session->rekey_seconds	= LIBSSH2_REKEY_SECONDS;
+#ifndef WIN32
+	{
+		pthread_mutexattr_t attr;
+
+		/* Reads and writes can nest (key exchange, window adjusts sent while reading) */
+		pthread_mutexattr_init(&attr);
+		pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+		pthread_mutex_init(&session->read_lock, &attr);
+		pthread_mutex_init(&session->write_lock, &attr);
+		pthread_mutexattr_destroy(&attr);
+
+		pthread_mutex_init(&session->data_lock, NULL);
+		pthread_mutex_init(&session->err_lock, NULL);
+		pthread_cond_init(&session->packet_cond, NULL);
+	}
+#endif
 #ifdef LIBSSH2_DEBUG_TRANSPORT
 	_libssh2_debug(session, LIBSSH2_DBG_TRANS, "New session resource allocated");
 #endif
@@ -356,10 +576,7 @@ LIBSSH2_API void* libssh2_session_callback_set(LIBSSH2_SESSION *session, int cbt
  */
 LIBSSH2_API int libssh2_session_startup(LIBSSH2_SESSION *session, int socket)
 {
-	unsigned char *data;
-	unsigned long data_len;
 	unsigned char service[sizeof("ssh-userauth") + 5 - 1];
-	unsigned long service_length;
 
 #ifdef LIBSSH2_DEBUG_TRANSPORT
 	_libssh2_debug(session, LIBSSH2_DBG_TRANS, "session_startup for socket %d", socket);
@@ -401,6 +618,32 @@ LIBSSH2_API int libssh2_session_startup(LIBSSH2_SESSION *session, int socket)
 		return LIBSSH2_ERROR_SOCKET_SEND;
 	}
 
+	session->state |= LIBSSH2_STATE_SERVICE_PENDING;
+	if (session->flags & LIBSSH2_FLAG_PIPELINE_AUTH) {
+		/* Let the first userauth request ride along behind the service request,
+		 * the SERVICE_ACCEPT is collected once that request has gone out */
+		return 0;
+	}
+
+	return libssh2_session_service_accept(session);
+}
+/* }}} */
+
+/* {{{ libssh2_session_service_accept
+ * Collect the SERVICE_ACCEPT for an outstanding ssh-userauth request
+ * Returns 0 straight away if there's nothing outstanding
+ */
+int libssh2_session_service_accept(LIBSSH2_SESSION *session)
+{
+	unsigned char *data;
+	unsigned long data_len;
+	unsigned long service_length;
+
+	if (!(session->state & LIBSSH2_STATE_SERVICE_PENDING)) {
+		return 0;
+	}
+	session->state &= ~LIBSSH2_STATE_SERVICE_PENDING;
+
 	if (libssh2_packet_require(session, SSH_MSG_SERVICE_ACCEPT, &data, &data_len)) {
 		return LIBSSH2_ERROR_SOCKET_DISCONNECT;
 	}
@@ -449,6 +692,11 @@ LIBSSH2_API void libssh2_session_free(LIBSSH2_SESSION *session)
 		libssh2_channel_forward_cancel(session->listeners);
 	}
 
+	/* The crypto workers hold on to the remote keys */
+	if (session->pipeline) {
+		libssh2_pipeline_free(session);
+	}
+
 	if (session->state & LIBSSH2_STATE_NEWKEYS) {
 		/* hostkey */
 		if (session->hostkey && session->hostkey->dtor) {
@@ -543,6 +791,22 @@ LIBSSH2_API void libssh2_session_free(LIBSSH2_SESSION *session)
 		LIBSSH2_FREE(session, tmp);
 	}
 
+	if (session->outbuf) {
+		LIBSSH2_FREE(session, session->outbuf);
+	}
+
+	if (session->transport_free) {
+		session->transport_free(session);
+	}
+
+#ifndef WIN32
+	pthread_cond_destroy(&session->packet_cond);
+	pthread_mutex_destroy(&session->err_lock);
+	pthread_mutex_destroy(&session->data_lock);
+	pthread_mutex_destroy(&session->write_lock);
+	pthread_mutex_destroy(&session->read_lock);
+#endif
+
 	LIBSSH2_FREE(session, session);
 }
 /* }}} */
@@ -659,12 +923,9 @@ LIBSSH2_API void **libssh2_session_abstract(LIBSSH2_SESSION *session)
 }
 /* }}} */
 
-/* {{{ libssh2_session_last_error
- * Returns error code and populates an error string into errmsg
- * If want_buf is non-zero then the string placed into errmsg must be freed by the calling program
- * Otherwise it is assumed to be owned by libssh2
+/* {{{ libssh2_session_last_error_unlocked
  */
-LIBSSH2_API int libssh2_session_last_error(LIBSSH2_SESSION *session, char **errmsg, int *errmsg_len, int want_buf)
+static int libssh2_session_last_error_unlocked(LIBSSH2_SESSION *session, char **errmsg, int *errmsg_len, int want_buf)
 {
 	/* No error to report */
 	if (!session->err_code) {
@@ -714,12 +975,36 @@ LIBSSH2_API int libssh2_session_last_error(LIBSSH2_SESSION *session, char **errm
 }
 /* }}} */
 
+/* {{{ libssh2_session_last_error
+ * Returns error code and populates an error string into errmsg
+ * If want_buf is non-zero then the string placed into errmsg must be freed by the calling program
+ * Otherwise it is assumed to be owned by libssh2
+ * With LIBSSH2_FLAG_THREADED it's whichever thread's error came last, ask for a buffer to keep it past the next
+ */
+LIBSSH2_API int libssh2_session_last_error(LIBSSH2_SESSION *session, char **errmsg, int *errmsg_len, int want_buf)
+{
+	int ret;
+
+	LIBSSH2_LOCK(session, err_lock);
+	ret = libssh2_session_last_error_unlocked(session, errmsg, errmsg_len, want_buf);
+	LIBSSH2_UNLOCK(session, err_lock);
+
+	return ret;
+}
+/* }}} */
+
 /* {{{ libssh2_session_flag
  * Set/Get session flags
  * Passing flag==0 will avoid changing session->flags while still returning its current value
  */
 LIBSSH2_API int libssh2_session_flag(LIBSSH2_SESSION *session, int flag, int value)
 {
+	if ((flag & LIBSSH2_FLAG_THREADED) && (session->state || session->transport_abstract)) {
+		/* Switching locking on or off under a running session would leave locks held or unbalanced,
+		 * and the io_uring transport has no locking of its own */
+		flag &= ~LIBSSH2_FLAG_THREADED;
+	}
+
 	if (value) {
 		session->flags |= flag;
 	} else {
@@ -737,18 +1022,21 @@ LIBSSH2_API int libssh2_session_flag(LIBSSH2_SESSION *session, int flag, int val
 LIBSSH2_API int libssh2_poll_channel_read(LIBSSH2_CHANNEL *channel, int extended)
 {
 	LIBSSH2_SESSION *session = channel->session;
-	LIBSSH2_PACKET *packet = session->packets.head;
+	LIBSSH2_PACKET *packet;
 
+	LIBSSH2_LOCK(session, data_lock);
+	packet = session->packets.head;
 	while (packet) {
 		if (((packet->data[0] == SSH_MSG_CHANNEL_DATA) && (extended == 0) && (channel->local.id == libssh2_ntohu32(packet->data + 1))) ||
 			((packet->data[0] == SSH_MSG_CHANNEL_EXTENDED_DATA) && (extended != 0) && (channel->local.id == libssh2_ntohu32(packet->data + 1)))) {
 			/* Found data waiting to be read */
-			return 1;
+			break;
 		}
 		packet = packet->next;
 	}
+	LIBSSH2_UNLOCK(session, data_lock);
 
-	return 0;
+	return packet ? 1 : 0;
 }
 /* }}} */
 
@@ -758,6 +1046,10 @@ LIBSSH2_API int libssh2_poll_channel_read(LIBSSH2_CHANNEL *channel, int extended
  */
 inline int libssh2_poll_channel_write(LIBSSH2_CHANNEL *channel)
 {
+	if (channel->outq_len >= LIBSSH2_CHANNEL_OUTQ_MAX) {
+		/* Scheduled writes would be turned away until the queue drains */
+		return 0;
+	}
 	return channel->local.window_size ? 1 : 0;
 }
 /* }}} */
@@ -777,7 +1069,7 @@ inline int libssh2_poll_listener_queued(LIBSSH2_LISTENER *listener)
  */
 LIBSSH2_API int libssh2_poll(LIBSSH2_POLLFD *fds, unsigned int nfds, long timeout)
 {
-	long timeout_remaining;
+	long timeout_remaining, wait_time;
 	int i, active_fds;
 #ifdef HAVE_POLL
 	LIBSSH2_SESSION *session = NULL;
@@ -793,13 +1085,13 @@ LIBSSH2_API int libssh2_poll(LIBSSH2_POLLFD *fds, unsigned int nfds, long timeou
 				sockets[i].revents = 0;
 				break;
 			case LIBSSH2_POLLFD_CHANNEL:
-				sockets[i].fd = fds[i].fd.channel->session->socket_fd;
+				sockets[i].fd = LIBSSH2_POLL_FD(fds[i].fd.channel->session);
 				sockets[i].events  = POLLIN;
 				sockets[i].revents = 0;
 				if (!session) session = fds[i].fd.channel->session;
 				break;
 			case LIBSSH2_POLLFD_LISTENER:
-				sockets[i].fd = fds[i].fd.listener->session->socket_fd;
+				sockets[i].fd = LIBSSH2_POLL_FD(fds[i].fd.listener->session);
 				sockets[i].events  = POLLIN;
 				sockets[i].revents = 0;
 				if (!session) session = fds[i].fd.listener->session;
@@ -831,13 +1123,13 @@ LIBSSH2_API int libssh2_poll(LIBSSH2_POLLFD *fds, unsigned int nfds, long timeou
 				}
 				break;
 			case LIBSSH2_POLLFD_CHANNEL:
-				FD_SET(fds[i].fd.channel->session->socket_fd, &rfds);
-				if (fds[i].fd.channel->session->socket_fd > maxfd) maxfd = fds[i].fd.channel->session->socket_fd;
+				FD_SET(LIBSSH2_POLL_FD(fds[i].fd.channel->session), &rfds);
+				if (LIBSSH2_POLL_FD(fds[i].fd.channel->session) > maxfd) maxfd = LIBSSH2_POLL_FD(fds[i].fd.channel->session);
 				if (!session) session = fds[i].fd.channel->session;
 				break;
 			case LIBSSH2_POLLFD_LISTENER:
-				FD_SET(fds[i].fd.listener->session->socket_fd, &rfds);
-				if (fds[i].fd.listener->session->socket_fd > maxfd) maxfd = fds[i].fd.listener->session->socket_fd;
+				FD_SET(LIBSSH2_POLL_FD(fds[i].fd.listener->session), &rfds);
+				if (LIBSSH2_POLL_FD(fds[i].fd.listener->session) > maxfd) maxfd = LIBSSH2_POLL_FD(fds[i].fd.listener->session);
 				if (!session) session = fds[i].fd.listener->session;
 				break;
 			default:
@@ -865,6 +1157,10 @@ LIBSSH2_API int libssh2_poll(LIBSSH2_POLLFD *fds, unsigned int nfds, long timeou
 			if (fds[i].events != fds[i].revents) {
 				switch (fds[i].type) {
 					case LIBSSH2_POLLFD_CHANNEL:
+						if (fds[i].fd.channel->session->transport_abstract) {
+							/* Data the transport has already taken in won't show on its descriptor again */
+							while (libssh2_packet_read(fds[i].fd.channel->session, 0) > 0);
+						}
 						if ((fds[i].events & LIBSSH2_POLLFD_POLLIN) && /* Want to be ready for read */
 							((fds[i].revents & LIBSSH2_POLLFD_POLLIN) == 0)) { /* Not yet known to be ready for read */
 							fds[i].revents |= libssh2_poll_channel_read(fds[i].fd.channel, 0) ? LIBSSH2_POLLFD_POLLIN : 0;
@@ -885,6 +1181,9 @@ LIBSSH2_API int libssh2_poll(LIBSSH2_POLLFD *fds, unsigned int nfds, long timeou
 						}
 						break;
 					case LIBSSH2_POLLFD_LISTENER:
+						if (fds[i].fd.listener->session->transport_abstract) {
+							while (libssh2_packet_read(fds[i].fd.listener->session, 0) > 0);
+						}
 						if ((fds[i].events & LIBSSH2_POLLFD_POLLIN) && /* Want a connection */
 							((fds[i].revents & LIBSSH2_POLLFD_POLLIN) == 0)) { /* No connections known of yet */
 							fds[i].revents |= libssh2_poll_listener_queued(fds[i].fd.listener) ? LIBSSH2_POLLFD_POLLIN : 0;
@@ -905,6 +1204,19 @@ LIBSSH2_API int libssh2_poll(LIBSSH2_POLLFD *fds, unsigned int nfds, long timeou
 			timeout_remaining = 0;
 		}
 
+		wait_time = timeout_remaining;
+		if (session && session->keepalive_interval) {
+			int next;
+
+			if (libssh2_keepalive_send(session, &next)) {
+				return -1;
+			}
+			/* Wake up again in time for the next one */
+			if (wait_time < 0 || wait_time > next * 1000L) {
+				wait_time = next * 1000L;
+			}
+		}
+
 #ifdef HAVE_POLL
 
 #ifdef HAVE_GETTIMEOFDAY
@@ -912,7 +1224,7 @@ LIBSSH2_API int libssh2_poll(LIBSSH2_POLLFD *fds, unsigned int nfds, long timeou
 		struct timeval tv_begin, tv_end;
 
 		gettimeofday((struct timeval *)&tv_begin, NULL);
-		sysret = poll(sockets, nfds, timeout_remaining);
+		sysret = poll(sockets, nfds, wait_time);
 		gettimeofday((struct timeval *)&tv_end, NULL);
 		timeout_remaining -= (tv_end.tv_sec - tv_begin.tv_sec) * 1000;
 		timeout_remaining -= (tv_end.tv_usec - tv_begin.tv_usec) / 1000;
@@ -921,7 +1233,7 @@ LIBSSH2_API int libssh2_poll(LIBSSH2_POLLFD *fds, unsigned int nfds, long timeou
 		/* If the platform doesn't support gettimeofday,
 		 * then just make the call non-blocking and walk away
 		 */
-		sysret = poll(sockets, nfds, timeout_remaining);
+		sysret = poll(sockets, nfds, wait_time);
 		timeout_remaining = 0;
 #endif /* HAVE_GETTIMEOFDAY */
 
@@ -959,8 +1271,8 @@ LIBSSH2_API int libssh2_poll(LIBSSH2_POLLFD *fds, unsigned int nfds, long timeou
 			}
 		}
 #elif defined(HAVE_SELECT)
-		tv.tv_sec = timeout_remaining / 1000;
-		tv.tv_usec = (timeout_remaining % 1000) * 1000;
+		tv.tv_sec = wait_time / 1000;
+		tv.tv_usec = (wait_time % 1000) * 1000;
 #ifdef HAVE_GETTIMEOFDAY
 {
 		struct timeval tv_begin, tv_end;
@@ -995,13 +1307,13 @@ LIBSSH2_API int libssh2_poll(LIBSSH2_POLLFD *fds, unsigned int nfds, long timeou
 						}
 						break;
 					case LIBSSH2_POLLFD_CHANNEL:
-						if (FD_ISSET(fds[i].fd.channel->session->socket_fd, &rfds)) {
+						if (FD_ISSET(LIBSSH2_POLL_FD(fds[i].fd.channel->session), &rfds)) {
 							/* Spin session until no data available */
 							while (libssh2_packet_read(fds[i].fd.channel->session, 0) > 0);
 						}
 						break;
 					case LIBSSH2_POLLFD_LISTENER:
-						if (FD_ISSET(fds[i].fd.listener->session->socket_fd, &rfds)) {
+						if (FD_ISSET(LIBSSH2_POLL_FD(fds[i].fd.listener->session), &rfds)) {
 							/* Spin session until no data available */
 							while (libssh2_packet_read(fds[i].fd.listener->session, 0) > 0);
 						}
@@ -1010,7 +1322,8 @@ LIBSSH2_API int libssh2_poll(LIBSSH2_POLLFD *fds, unsigned int nfds, long timeou
 			}
 		}
 #endif /* else no select() or poll() -- timeout (and by extension timeout_remaining) will be equal to 0 */
-	} while ((timeout_remaining > 0) && !active_fds);
+		/* An infinite wait (timeout < 0) only wakes early to send keepalives, so carry on waiting */
+	} while (((timeout_remaining > 0) || (timeout < 0 && wait_time >= 0)) && !active_fds);
 
 	return active_fds;
 }
@@ -38,6 +38,10 @@
 #include "libssh2_priv.h"
 #include "libssh2_sftp.h"
 
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
 /* Note: Version 6 was documented at the time of writing
  * However it was marked as "DO NOT IMPLEMENT" due to pending changes
  *
@@ -111,6 +115,7 @@ struct _LIBSSH2_SFTP_HANDLE {
 			unsigned long names_left;
 			void *names_packet;
 			char *next_name;
+			char *names_end;
 		} dir;
 	} u;
 };
@@ -421,37 +426,46 @@ static int libssh2_sftp_attr2bin(unsigned char *p, LIBSSH2_SFTP_ATTRIBUTES *attr
 /* }}} */
 
 /* {{{ libssh2_sftp_bin2attr
+ * Returns the number of bytes consumed, or -1 when the block runs past len
  */
-static int libssh2_sftp_bin2attr(LIBSSH2_SFTP_ATTRIBUTES *attrs, unsigned char *p)
+static int libssh2_sftp_bin2attr(LIBSSH2_SFTP_ATTRIBUTES *attrs, const unsigned char *p, unsigned long len)
 {
+	libssh2_wire_reader r;
+	unsigned long flags;
+
 	if (!attrs)
 	{
 		return -1;
 	}
-	unsigned char *s = p;
 
+	libssh2_wire_reader_init(&r, p, len);
 	memset(attrs, 0, sizeof(LIBSSH2_SFTP_ATTRIBUTES));
-	attrs->flags = libssh2_ntohu32(s);				s += 4;
+	if (libssh2_wire_get_u32(&r, &flags)) {
+		return -1;
+	}
+	attrs->flags = flags;
 
-	if (attrs->flags & LIBSSH2_SFTP_ATTR_SIZE) {
-		attrs->filesize = libssh2_ntohu64(s);		s += 8;
+	if ((flags & LIBSSH2_SFTP_ATTR_SIZE) &&
+		libssh2_wire_get_u64(&r, &attrs->filesize)) {
+		return -1;
 	}
 
-	if (attrs->flags & LIBSSH2_SFTP_ATTR_UIDGID) {
-		attrs->uid = libssh2_ntohu32(s);			s += 4;
-		attrs->gid = libssh2_ntohu32(s);			s += 4;
+	if ((flags & LIBSSH2_SFTP_ATTR_UIDGID) &&
+		(libssh2_wire_get_u32(&r, &attrs->uid) || libssh2_wire_get_u32(&r, &attrs->gid))) {
+		return -1;
 	}
 
-	if (attrs->flags & LIBSSH2_SFTP_ATTR_PERMISSIONS) {
-		attrs->permissions = libssh2_ntohu32(s);	s += 4;
+	if ((flags & LIBSSH2_SFTP_ATTR_PERMISSIONS) &&
+		libssh2_wire_get_u32(&r, &attrs->permissions)) {
+		return -1;
 	}
 
-	if (attrs->flags & LIBSSH2_SFTP_ATTR_ACMODTIME) {
-		attrs->atime = libssh2_ntohu32(s);			s += 4;
-		attrs->mtime = libssh2_ntohu32(s);			s += 4;
+	if ((flags & LIBSSH2_SFTP_ATTR_ACMODTIME) &&
+		(libssh2_wire_get_u32(&r, &attrs->atime) || libssh2_wire_get_u32(&r, &attrs->mtime))) {
+		return -1;
 	}
 
-	return (s - p);
+	return (r.p - p);
 }
 /* }}} */
 
@@ -764,6 +778,39 @@ LIBSSH2_API size_t libssh2_sftp_read(LIBSSH2_SFTP_HANDLE *handle, char *buffer,
 }
 /* }}} */
 
+/* {{{ libssh2_sftp_readdir_name
+ * Pull one filename/longname/attrs entry out of an FXP_NAME reply
+ */
+static int libssh2_sftp_readdir_name(libssh2_wire_reader *r, char *buffer, size_t buffer_maxlen, LIBSSH2_SFTP_ATTRIBUTES *attrs)
+{
+	const unsigned char *filename, *longname;
+	unsigned long filename_len, longname_len;
+	int attrs_len;
+
+	if (libssh2_wire_get_string(r, &filename, &filename_len) ||
+		libssh2_wire_get_string(r, &longname, &longname_len)) {
+		return -1;
+	}
+	attrs_len = libssh2_sftp_bin2attr(attrs, r->p, libssh2_wire_left(r));
+	if (attrs_len < 0) {
+		return -1;
+	}
+	r->p += attrs_len;
+
+	if (filename_len > buffer_maxlen) {
+		filename_len = buffer_maxlen;
+	}
+	memcpy(buffer, filename, filename_len);
+
+	/* The filename is not null terminated, make it so if possible */
+	if (filename_len < buffer_maxlen) {
+		buffer[filename_len] = '\0';
+	}
+
+	return filename_len;
+}
+/* }}} */
+
 /* {{{ libssh2_sftp_readdir
  * Read from an SFTP directory handle
  */
@@ -777,36 +824,29 @@ LIBSSH2_API int libssh2_sftp_readdir(LIBSSH2_SFTP_HANDLE *handle, char *buffer,
 	LIBSSH2_CHANNEL *channel = sftp->channel;
 	LIBSSH2_SESSION *session = channel->session;
 	LIBSSH2_SFTP_ATTRIBUTES attrs_dummy;
-	unsigned long data_len, request_id, filename_len, num_names;
+	unsigned long data_len, request_id, num_names;
 	unsigned long packet_len = handle->handle_len + 13; /* packet_len(4) + packet_type(1) + request_id(4) + handle_len(4) */
 	unsigned char *packet, *s, *data;
 	unsigned char read_responses[2] = { SSH_FXP_NAME,		SSH_FXP_STATUS };
 
 	if (handle->u.dir.names_left) {
 		/* A prior request returned more than one directory entry, feed it back from the buffer */
-		unsigned char *s = (unsigned char *)handle->u.dir.next_name;
-		unsigned long real_filename_len = libssh2_ntohu32(s);
-
-		filename_len = real_filename_len;			s += 4;
-		if (filename_len > buffer_maxlen) {
-			filename_len = buffer_maxlen;
-		}
-		memcpy(buffer, s, filename_len);			s += real_filename_len;
-
-		/* Skip longname */
-		s += 4 + libssh2_ntohu32(s);
+		libssh2_wire_reader r;
+		int ret;
 
-		if (attrs) {
-			memset(attrs, 0, sizeof(LIBSSH2_SFTP_ATTRIBUTES));
-		}
-		s += libssh2_sftp_bin2attr(attrs ? attrs : &attrs_dummy, s);
+		libssh2_wire_reader_init(&r, (unsigned char *)handle->u.dir.next_name, handle->u.dir.names_end - handle->u.dir.next_name);
+		ret = libssh2_sftp_readdir_name(&r, buffer, buffer_maxlen, attrs ? attrs : &attrs_dummy);
 
-		handle->u.dir.next_name = (char *)s;
-		if ((--handle->u.dir.names_left) == 0) {
+		handle->u.dir.next_name = (char *)r.p;
+		if ((ret < 0) || ((--handle->u.dir.names_left) == 0)) {
+			handle->u.dir.names_left = 0;
 			LIBSSH2_FREE(session, handle->u.dir.names_packet);
 		}
+		if (ret < 0) {
+			libssh2_error(session, LIBSSH2_ERROR_SFTP_PROTOCOL, "Malformed FXP_NAME entry", 0);
+		}
 
-		return filename_len;
+		return ret;
 	}
 
 	/* Request another entry(entries?) */
@@ -853,6 +893,11 @@ LIBSSH2_API int libssh2_sftp_readdir(LIBSSH2_SFTP_HANDLE *handle, char *buffer,
 		}
 	}
 
+	if (data_len < 9) {
+		LIBSSH2_FREE(session, data);
+		libssh2_error(session, LIBSSH2_ERROR_SFTP_PROTOCOL, "Malformed FXP_NAME packet", 0);
+		return -1;
+	}
 	num_names = libssh2_ntohu32(data + 5);
 #ifdef LIBSSH2_DEBUG_SFTP
 	_libssh2_debug(session, LIBSSH2_DBG_SFTP, "%lu entries returned", num_names);
@@ -863,31 +908,23 @@ LIBSSH2_API int libssh2_sftp_readdir(LIBSSH2_SFTP_HANDLE *handle, char *buffer,
 	}
 
 	if (num_names == 1) {
-		unsigned long real_filename_len = libssh2_ntohu32(data + 9);
+		libssh2_wire_reader r;
+		int ret;
 
-		filename_len = real_filename_len;
-		if (filename_len > buffer_maxlen) {
-			filename_len = buffer_maxlen;
-		}
-		memcpy(buffer, data + 13, filename_len);
-		
-		/* The filename is not null terminated, make it so if possible */
-		if (filename_len < buffer_maxlen) {
-			buffer[filename_len] = '\0';
-		}
-		
-		if (attrs) {
-			memset(attrs, 0, sizeof(LIBSSH2_SFTP_ATTRIBUTES));
-			libssh2_sftp_bin2attr(attrs, data + 13 + real_filename_len + (4 + libssh2_ntohu32(data + 13 + real_filename_len)));
-		}
+		libssh2_wire_reader_init(&r, data + 9, data_len - 9);
+		ret = libssh2_sftp_readdir_name(&r, buffer, buffer_maxlen, attrs ? attrs : &attrs_dummy);
 		LIBSSH2_FREE(session, data);
+		if (ret < 0) {
+			libssh2_error(session, LIBSSH2_ERROR_SFTP_PROTOCOL, "Malformed FXP_NAME entry", 0);
+		}
 
-		return filename_len; 
+		return ret;
 	}
 
 	handle->u.dir.names_left = num_names;
 	handle->u.dir.names_packet = data;
 	handle->u.dir.next_name = (char *)data + 9;
+	handle->u.dir.names_end = (char *)data + data_len;
 
 	/* Be lazy, just use the name popping mechanism from the start of the function */
 	return libssh2_sftp_readdir(handle, buffer, buffer_maxlen, attrs);
@@ -1018,7 +1055,12 @@ LIBSSH2_API int libssh2_sftp_fstat_ex(LIBSSH2_SFTP_HANDLE *handle, LIBSSH2_SFTP_
 		}
 	}
 
-	libssh2_sftp_bin2attr(attrs, data + 5);
+	if (libssh2_sftp_bin2attr(attrs, data + 5, data_len - 5) < 0) {
+		LIBSSH2_FREE(session, data);
+		libssh2_error(session, LIBSSH2_ERROR_SFTP_PROTOCOL, "Malformed FXP_ATTRS packet", 0);
+		return -1;
+	}
+	LIBSSH2_FREE(session, data);
 
 	return 0;
 }
@@ -1045,6 +1087,113 @@ LIBSSH2_API size_t libssh2_sftp_tell(LIBSSH2_SFTP_HANDLE *handle)
 }
 /* }}} */
 
+/* {{{ libssh2_sftp_segments_init
+ * Preallocate the local file and split filesize into segment_count contiguous ranges
+ */
+LIBSSH2_API int libssh2_sftp_segments_init(int fd, libssh2_uint64_t filesize, LIBSSH2_SFTP_SEGMENT *segments, int segment_count)
+{
+	libssh2_uint64_t offset = 0, length;
+	int i;
+
+	if (!segments || segment_count < 1) {
+		return -1;
+	}
+
+	if (ftruncate(fd, (off_t)filesize)) {
+		return -1;
+	}
+
+	length = filesize / segment_count;
+	for(i = 0; i < segment_count; i++) {
+		segments[i].offset = offset;
+		/* The last segment picks up the remainder */
+		segments[i].length = (i == (segment_count - 1)) ? (filesize - offset) : length;
+		segments[i].transferred = 0;
+		offset += segments[i].length;
+	}
+
+	return 0;
+}
+/* }}} */
+
+/* {{{ libssh2_sftp_segment_fetch
+ * Download one segment of a remote file into the matching range of fd
+ * Picks up from segment->transferred, so an interrupted segment can simply be fetched again
+ * Returns 0 once the segment is complete, -1 on failure, or LIBSSH2_SFTP_SEGMENT_SHORT if the remote file ends first
+ */
+LIBSSH2_API int libssh2_sftp_segment_fetch(LIBSSH2_SFTP *sftp, char *filename, unsigned int filename_len, int fd, LIBSSH2_SFTP_SEGMENT *segment)
+{
+	if (!sftp || !segment)
+	{
+		return -1;
+	}
+	LIBSSH2_SESSION *session = sftp->channel->session;
+	LIBSSH2_SFTP_HANDLE *handle;
+	char *buffer;
+	size_t want, bytes_read;
+	int rc = 0;
+
+	if (libssh2_sftp_segment_complete(segment)) {
+		return 0;
+	}
+
+	handle = libssh2_sftp_open_ex(sftp, filename, filename_len, LIBSSH2_FXF_READ, 0, LIBSSH2_SFTP_OPENFILE);
+	if (!handle) {
+		return -1;
+	}
+
+	buffer = LIBSSH2_ALLOC(session, LIBSSH2_SFTP_SEGMENT_CHUNK);
+	if (!buffer) {
+		libssh2_error(session, LIBSSH2_ERROR_ALLOC, "Unable to allocate segment read buffer", 0);
+		libssh2_sftp_close_handle(handle);
+		return -1;
+	}
+
+	/* Set the offset directly rather than via libssh2_sftp_seek(), which is limited to size_t */
+	handle->u.file.offset = segment->offset + segment->transferred;
+
+#ifdef LIBSSH2_DEBUG_SFTP
+	_libssh2_debug(session, LIBSSH2_DBG_SFTP, "Fetching segment at %llu, %llu of %llu bytes already transferred",
+				   (unsigned long long)segment->offset, (unsigned long long)segment->transferred, (unsigned long long)segment->length);
+#endif
+	while (!libssh2_sftp_segment_complete(segment)) {
+		want = LIBSSH2_SFTP_SEGMENT_CHUNK;
+		if ((segment->length - segment->transferred) < want) {
+			want = segment->length - segment->transferred;
+		}
+
+		/* Only an FXP_STATUS sets last_errno, so don't let an earlier one be mistaken for this read's */
+		sftp->last_errno = LIBSSH2_FX_OK;
+		bytes_read = libssh2_sftp_read(handle, buffer, want);
+		if ((bytes_read == (size_t)-1) && (sftp->last_errno != LIBSSH2_FX_EOF)) {
+			rc = -1;
+			break;
+		}
+		if ((bytes_read == (size_t)-1) || (bytes_read == 0)) {
+			/* Remote file shrank underneath us (an empty DATA reply says the same as FX_EOF)
+			 * length stays as asked for, so the segment still reads as incomplete and the shortfall shows
+			 */
+			sftp->last_errno = LIBSSH2_FX_EOF;
+			libssh2_error(session, LIBSSH2_ERROR_SFTP_PROTOCOL, "Remote file ended before the segment did", 0);
+			rc = LIBSSH2_SFTP_SEGMENT_SHORT;
+			break;
+		}
+
+		if (pwrite(fd, buffer, bytes_read, (off_t)(segment->offset + segment->transferred)) != (ssize_t)bytes_read) {
+			libssh2_error(session, LIBSSH2_ERROR_FILE, "Unable to write segment to local file", 0);
+			rc = -1;
+			break;
+		}
+		segment->transferred += bytes_read;
+	}
+
+	LIBSSH2_FREE(session, buffer);
+	libssh2_sftp_close_handle(handle);
+
+	return rc;
+}
+/* }}} */
+
 
 /* {{{ libssh2_sftp_close_handle
  * Close a file or directory handle
@@ -1453,8 +1602,11 @@ LIBSSH2_API int libssh2_sftp_stat_ex(LIBSSH2_SFTP *sftp, char *path, unsigned in
 		}
 	}
 
-	memset(attrs, 0, sizeof(LIBSSH2_SFTP_ATTRIBUTES));
-	libssh2_sftp_bin2attr(attrs, data + 5);
+	if (libssh2_sftp_bin2attr(attrs, data + 5, data_len - 5) < 0) {
+		LIBSSH2_FREE(session, data);
+		libssh2_error(session, LIBSSH2_ERROR_SFTP_PROTOCOL, "Malformed FXP_ATTRS packet", 0);
+		return -1;
+	}
 	LIBSSH2_FREE(session, data);
 
 	return 0;
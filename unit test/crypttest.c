@@ -0,0 +1,274 @@
+/*
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ *   Redistributions of source code must retain the above
+ *   copyright notice, this list of conditions and the
+ *   following disclaimer.
+ *
+ *   Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following
+ *   disclaimer in the documentation and/or other materials
+ *   provided with the distribution.
+ *
+ *   Neither the name of the copyright holder nor the names
+ *   of any other contributors may be used to endorse or
+ *   promote products derived from this software without
+ *   specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+
+/* Test for the cipher methods' crypt_span hook against their block at a time crypt()
+ * Runs a series of packets of assorted lengths through each cipher three ways, each on a context of its
+ * own that carries its state from one packet to the next as the transport's does: a block at a time
+ * through crypt(), each packet whole through crypt_span() as libssh2_packet_write() sends it, and back
+ * with the first block through crypt() and the rest through crypt_span() as libssh2_packet_read() takes
+ * it in. The two ciphertexts have to match and the decryption has to give back the plaintext
+ * Methods with crypt_clone and crypt_set_iv decrypt the other copy of the ciphertext a fourth way, as the
+ * crypto workers do (see pipeline.c): the first block through crypt(), the rest on a copy of the context
+ * restarted at the first block's ciphertext, with the first context restarted at the packet's last block
+ *
+ * Not part of the framework target, build it against the libssh2 sources on their own:
+ *   cc -g -O2 -I. -DLIBSSH2_HAVE_ZLIB "unit test/crypttest.c" channel.c comp.c crypt.c hostkey.c \
+ *      keepalive.c kex.c knownhost.c mac.c misc.c openssl.c packet.c pipeline.c pem.c publickey.c scp.c session.c \
+ *      sftp.c uring.c userauth.c -o crypttest -lcrypto -lz -lpthread
+ *
+ * Usage: crypttest [method ...]
+ * Every method with a crypt_span hook unless some are named
+ */
+
+#include "libssh2_priv.h"
+
+/* Packet lengths in blocks, one block up to a full 32K packet and back */
+static const unsigned long test_packets[] = { 1, 2, 3, 17, 1, 128, 2048, 5, 2047, 1 };
+
+#define TEST_PACKETS		(sizeof(test_packets) / sizeof(test_packets[0]))
+
+static int test_failures;
+
+/* {{{ test_fill
+ */
+static void test_fill(unsigned char *buf, unsigned long len)
+{
+	unsigned long i, seed = 54321;
+
+	for(i = 0; i < len; i++) {
+		seed = (seed * 1103515245 + 12345) & 0x7FFFFFFF;
+		buf[i] = seed >> 16;
+	}
+}
+/* }}} */
+
+/* {{{ test_init
+ */
+static int test_init(LIBSSH2_SESSION *session, LIBSSH2_CRYPT_METHOD *method, int encrypt, void **abstract)
+{
+	unsigned char iv[64], secret[64];
+	int free_iv = 0, free_secret = 0;
+
+	memset(iv, 0x5A, sizeof(iv));
+	memset(secret, 0xA5, sizeof(secret));
+	*abstract = NULL;
+
+	if (method->init && method->init(session, method, iv, &free_iv, secret, &free_secret, encrypt, abstract)) {
+		fprintf(stderr, "crypttest: %s: init failed\n", method->name);
+		test_failures++;
+		return -1;
+	}
+	return 0;
+}
+/* }}} */
+
+/* {{{ test_method
+ */
+static void test_method(LIBSSH2_SESSION *session, LIBSSH2_CRYPT_METHOD *method, const unsigned char *plain,
+						unsigned char *block, unsigned char *span, unsigned long len)
+{
+	void *block_abstract, *span_abstract, *decrypt_abstract, *clone_abstract = NULL;
+	unsigned char first[16], last[16];
+	unsigned long i, ofs, packet_ofs;
+
+	memcpy(block, plain, len);
+	memcpy(span, plain, len);
+
+	if (test_init(session, method, 1, &block_abstract)) {
+		return;
+	}
+	if (test_init(session, method, 1, &span_abstract)) {
+		method->dtor(session, &block_abstract);
+		return;
+	}
+	if (test_init(session, method, 0, &decrypt_abstract)) {
+		method->dtor(session, &block_abstract);
+		method->dtor(session, &span_abstract);
+		return;
+	}
+
+	packet_ofs = 0;
+	for(i = 0; i < TEST_PACKETS; i++) {
+		unsigned long packet_len = test_packets[i] * method->blocksize;
+
+		for(ofs = packet_ofs; ofs < packet_ofs + packet_len; ofs += method->blocksize) {
+			if (method->crypt(session, block + ofs, &block_abstract)) {
+				fprintf(stderr, "crypttest: %s: crypt failed\n", method->name);
+				test_failures++;
+				goto test_done;
+			}
+		}
+		if (method->crypt_span(session, span + packet_ofs, packet_len, &span_abstract)) {
+			fprintf(stderr, "crypttest: %s: crypt_span failed on %lu bytes\n", method->name, packet_len);
+			test_failures++;
+			goto test_done;
+		}
+		if (memcmp(block + packet_ofs, span + packet_ofs, packet_len)) {
+			fprintf(stderr, "crypttest: %s: packet %lu (%lu bytes) encrypts differently a span at a time\n",
+					method->name, i, packet_len);
+			test_failures++;
+			goto test_done;
+		}
+		packet_ofs += packet_len;
+	}
+
+	packet_ofs = 0;
+	for(i = 0; i < TEST_PACKETS; i++) {
+		unsigned long packet_len = test_packets[i] * method->blocksize;
+
+		if (method->crypt(session, span + packet_ofs, &decrypt_abstract) ||
+			((test_packets[i] > 1) &&
+			 method->crypt_span(session, span + packet_ofs + method->blocksize, packet_len - method->blocksize, &decrypt_abstract))) {
+			fprintf(stderr, "crypttest: %s: decryption failed\n", method->name);
+			test_failures++;
+			goto test_done;
+		}
+		if (memcmp(span + packet_ofs, plain + packet_ofs, packet_len)) {
+			fprintf(stderr, "crypttest: %s: packet %lu (%lu bytes) doesn't decrypt to its plaintext\n",
+					method->name, i, packet_len);
+			test_failures++;
+			goto test_done;
+		}
+		packet_ofs += packet_len;
+	}
+
+	if (method->crypt_clone && method->crypt_set_iv) {
+		method->dtor(session, &decrypt_abstract);
+		if (test_init(session, method, 0, &decrypt_abstract)) {
+			goto test_done;
+		}
+		if (method->crypt_clone(session, &decrypt_abstract, &clone_abstract)) {
+			fprintf(stderr, "crypttest: %s: crypt_clone failed\n", method->name);
+			test_failures++;
+			goto test_done;
+		}
+
+		packet_ofs = 0;
+		for(i = 0; i < TEST_PACKETS; i++) {
+			unsigned long packet_len = test_packets[i] * method->blocksize;
+
+			memcpy(first, block + packet_ofs, method->blocksize);
+			memcpy(last, block + packet_ofs + packet_len - method->blocksize, method->blocksize);
+			if (method->crypt(session, block + packet_ofs, &decrypt_abstract) ||
+				method->crypt_set_iv(session, last, &decrypt_abstract) ||
+				((test_packets[i] > 1) &&
+				 (method->crypt_set_iv(session, first, &clone_abstract) ||
+				  method->crypt_span(session, block + packet_ofs + method->blocksize, packet_len - method->blocksize, &clone_abstract)))) {
+				fprintf(stderr, "crypttest: %s: decryption on a copy of the context failed\n", method->name);
+				test_failures++;
+				goto test_done;
+			}
+			if (memcmp(block + packet_ofs, plain + packet_ofs, packet_len)) {
+				fprintf(stderr, "crypttest: %s: packet %lu (%lu bytes) doesn't decrypt to its plaintext on a copy of the context\n",
+						method->name, i, packet_len);
+				test_failures++;
+				goto test_done;
+			}
+			packet_ofs += packet_len;
+		}
+	}
+
+	printf("%-28s %lu packets, %lu bytes%s\n", method->name, (unsigned long)TEST_PACKETS, len,
+		   clone_abstract ? ", chained from copies" : "");
+
+ test_done:
+	method->dtor(session, &block_abstract);
+	method->dtor(session, &span_abstract);
+	method->dtor(session, &decrypt_abstract);
+	if (clone_abstract) {
+		method->dtor(session, &clone_abstract);
+	}
+}
+/* }}} */
+
+int main(int argc, char *argv[])
+{
+	LIBSSH2_SESSION *session;
+	LIBSSH2_CRYPT_METHOD **method;
+	unsigned char *plain, *block, *span;
+	unsigned long blocks = 0, i;
+	int tested = 0;
+
+	libssh2_crypto_init();
+
+	for(i = 0; i < TEST_PACKETS; i++) {
+		blocks += test_packets[i];
+	}
+	session = libssh2_session_init();
+	/* 16 bytes is the largest blocksize of any method */
+	plain = malloc(blocks * 16);
+	block = malloc(blocks * 16);
+	span = malloc(blocks * 16);
+	if (!session || !plain || !block || !span) {
+		fprintf(stderr, "crypttest: couldn't set up a session\n");
+		return 1;
+	}
+	test_fill(plain, blocks * 16);
+
+	for(method = libssh2_crypt_methods(); *method; method++) {
+		if (argc > 1) {
+			int n;
+
+			for(n = 1; n < argc; n++) {
+				if (!strcmp(argv[n], (*method)->name)) {
+					break;
+				}
+			}
+			if (n == argc) {
+				continue;
+			}
+		}
+		if (!(*method)->crypt_span) {
+			continue;
+		}
+		test_method(session, *method, plain, block, span, blocks * (*method)->blocksize);
+		tested++;
+	}
+
+	free(span);
+	free(block);
+	free(plain);
+	libssh2_session_free(session);
+
+	if (!tested) {
+		fprintf(stderr, "crypttest: no methods with crypt_span to test\n");
+		return 1;
+	}
+	if (test_failures) {
+		fprintf(stderr, "crypttest: %d methods failed\n", test_failures);
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,270 @@
+/*
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ *   Redistributions of source code must retain the above
+ *   copyright notice, this list of conditions and the
+ *   following disclaimer.
+ *
+ *   Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following
+ *   disclaimer in the documentation and/or other materials
+ *   provided with the distribution.
+ *
+ *   Neither the name of the copyright holder nor the names
+ *   of any other contributors may be used to endorse or
+ *   promote products derived from this software without
+ *   specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+
+/* Test for the known hosts store against a large hashed file
+ * Writes a synthetic OpenSSH known_hosts file of hashed entries, each with a salt of its own as
+ * ssh-keygen -H leaves them, reads it back and checks matches, mismatches, misses, non-default
+ * ports and plain entries, then that names cached by a lookup see hashed entries read in later and
+ * survive the cache being recycled. Prints the time to read the file and to look a name up the first
+ * time, when every salt has to be tried, and again, when the cached result is used
+ *
+ * Not part of the framework target, build it against the libssh2 sources on their own:
+ *   cc -g -O2 -I. -DLIBSSH2_HAVE_ZLIB "unit test/knownhosttest.c" channel.c comp.c crypt.c \
+ *      hostkey.c keepalive.c kex.c knownhost.c mac.c misc.c openssl.c packet.c pipeline.c pem.c publickey.c scp.c \
+ *      session.c sftp.c uring.c userauth.c -o knownhosttest -lcrypto -lz -lpthread
+ *
+ * Usage: knownhosttest [entries]
+ */
+
+#include "libssh2_priv.h"
+
+#include <unistd.h>
+
+#define TEST_ENTRIES		100000
+#define TEST_REPEATS		10000
+#define TEST_KEY_LEN		(4 + 7 + 32)	/* string "ssh-rsa", then filler */
+
+static int test_failures;
+
+/* {{{ test_now
+ */
+static double test_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+/* }}} */
+
+/* {{{ test_key
+ * A key blob unique to n, only ever compared byte for byte
+ */
+static void test_key(unsigned char *key, unsigned long n)
+{
+	int i;
+
+	libssh2_htonu32(key, 7);
+	memcpy(key + 4, "ssh-rsa", 7);
+	for(i = 0; i < 32; i += 4) {
+		libssh2_htonu32(key + 11 + i, n * 2654435761UL + i);
+	}
+}
+/* }}} */
+
+/* {{{ test_write_hashed
+ * Write one "|1|salt|hash ssh-rsa key" line for name under a fresh salt
+ */
+static int test_write_hashed(FILE *fp, const char *name, unsigned long n)
+{
+	unsigned char salt[SHA_DIGEST_LENGTH], digest[SHA_DIGEST_LENGTH], key[TEST_KEY_LEN];
+	char salt64[4 * ((SHA_DIGEST_LENGTH + 2) / 3)], digest64[sizeof(salt64)], key64[4 * ((TEST_KEY_LEN + 2) / 3)];
+	unsigned int salt64_len, digest64_len, key64_len;
+	libssh2_hmac_ctx ctx;
+
+	libssh2_random(salt, SHA_DIGEST_LENGTH);
+	libssh2_hmac_sha1_init(&ctx, salt, SHA_DIGEST_LENGTH);
+	libssh2_hmac_update(ctx, (unsigned char *)name, strlen(name));
+	libssh2_hmac_final(ctx, digest);
+	libssh2_hmac_cleanup(&ctx);
+	test_key(key, n);
+
+	salt64_len = libssh2_base64_encode_raw(salt64, salt, SHA_DIGEST_LENGTH);
+	digest64_len = libssh2_base64_encode_raw(digest64, digest, SHA_DIGEST_LENGTH);
+	key64_len = libssh2_base64_encode_raw(key64, key, TEST_KEY_LEN);
+
+	return fprintf(fp, "|1|%.*s|%.*s ssh-rsa %.*s\n", (int)salt64_len, salt64, (int)digest64_len, digest64,
+				   (int)key64_len, key64) < 0 ? -1 : 0;
+}
+/* }}} */
+
+/* {{{ test_expect
+ */
+static void test_expect(LIBSSH2_KNOWNHOSTS *hosts, const char *what, const char *host, int port, unsigned long n, int expected)
+{
+	unsigned char key[TEST_KEY_LEN];
+	int result;
+
+	test_key(key, n);
+	result = libssh2_knownhost_check(hosts, host, port, (char *)key, TEST_KEY_LEN);
+	if (result != expected) {
+		fprintf(stderr, "knownhosttest: %s: %s port %d gave %d, expected %d\n", what, host, port, result, expected);
+		test_failures++;
+	}
+}
+/* }}} */
+
+int main(int argc, char *argv[])
+{
+	LIBSSH2_SESSION *session;
+	LIBSSH2_KNOWNHOSTS *hosts;
+	char filename[] = "/tmp/knownhosttestXXXXXX", host[64];
+	unsigned char key[TEST_KEY_LEN];
+	unsigned long entries = TEST_ENTRIES, i;
+	double start, read_time, first_time, repeat_time;
+	FILE *fp;
+	int fd, count;
+
+	if (argc > 1) {
+		entries = strtoul(argv[1], NULL, 10);
+	}
+	if (entries < 10) {
+		fprintf(stderr, "knownhosttest: at least 10 entries\n");
+		return 1;
+	}
+
+	session = libssh2_session_init();
+	if (!session) {
+		fprintf(stderr, "knownhosttest: couldn't create a session\n");
+		return 1;
+	}
+
+	/* hostN.example.com keyed with N, plus one host on a non-default port and one plain entry */
+	fd = mkstemp(filename);
+	if (fd < 0 || !(fp = fdopen(fd, "w"))) {
+		perror("knownhosttest: temporary file");
+		return 1;
+	}
+	for(i = 0; i < entries; i++) {
+		snprintf(host, sizeof(host), "host%lu.example.com", i);
+		if (test_write_hashed(fp, host, i)) {
+			perror("knownhosttest: write");
+			return 1;
+		}
+	}
+	test_write_hashed(fp, "[host1.example.com]:2222", entries);
+	test_key(key, entries + 1);
+	fprintf(fp, "# plain entries still work alongside hashed ones\n");
+	fprintf(fp, "plain.example.com ssh-rsa ");
+	{
+		char key64[4 * ((TEST_KEY_LEN + 2) / 3)];
+		unsigned int key64_len = libssh2_base64_encode_raw(key64, key, TEST_KEY_LEN);
+
+		fprintf(fp, "%.*s\n", (int)key64_len, key64);
+	}
+	if (fclose(fp)) {
+		perror("knownhosttest: close");
+		return 1;
+	}
+
+	hosts = libssh2_knownhost_init(session);
+	start = test_now();
+	count = libssh2_knownhost_readfile(hosts, filename);
+	read_time = test_now() - start;
+	if (count != (int)(entries + 2)) {
+		fprintf(stderr, "knownhosttest: read %d entries, expected %lu\n", count, entries + 2);
+		return 1;
+	}
+
+	/* First lookup of a name tries every salt */
+	start = test_now();
+	test_expect(hosts, "first lookup", "host7.example.com", 22, 7, LIBSSH2_KNOWNHOST_CHECK_MATCH);
+	first_time = test_now() - start;
+
+	/* Repeats are answered from the cache */
+	start = test_now();
+	for(i = 0; i < TEST_REPEATS; i++) {
+		test_expect(hosts, "repeat lookup", "host7.example.com", 22, 7, LIBSSH2_KNOWNHOST_CHECK_MATCH);
+	}
+	repeat_time = (test_now() - start) / TEST_REPEATS;
+
+	test_expect(hosts, "mismatch", "host7.example.com", 22, 8, LIBSSH2_KNOWNHOST_CHECK_MISMATCH);
+	test_expect(hosts, "last entry", "host1.example.com", 0, 1, LIBSSH2_KNOWNHOST_CHECK_MATCH);
+	snprintf(host, sizeof(host), "host%lu.example.com", entries - 1);
+	test_expect(hosts, "first entry", host, 22, entries - 1, LIBSSH2_KNOWNHOST_CHECK_MATCH);
+	test_expect(hosts, "port", "host1.example.com", 2222, entries, LIBSSH2_KNOWNHOST_CHECK_MATCH);
+	test_expect(hosts, "port mismatch", "host1.example.com", 2222, 1, LIBSSH2_KNOWNHOST_CHECK_MISMATCH);
+	test_expect(hosts, "other port", "host2.example.com", 2222, 2, LIBSSH2_KNOWNHOST_CHECK_NOTFOUND);
+	test_expect(hosts, "plain", "plain.example.com", 22, entries + 1, LIBSSH2_KNOWNHOST_CHECK_MATCH);
+	test_expect(hosts, "miss", "new.example.com", 22, 0, LIBSSH2_KNOWNHOST_CHECK_NOTFOUND);
+	test_expect(hosts, "cached miss", "new.example.com", 22, 0, LIBSSH2_KNOWNHOST_CHECK_NOTFOUND);
+
+	/* A plain entry added later is found despite the cached miss */
+	test_key(key, entries + 2);
+	libssh2_knownhost_add(hosts, "new.example.com", 22, (char *)key, TEST_KEY_LEN);
+	test_expect(hosts, "added", "new.example.com", 22, entries + 2, LIBSSH2_KNOWNHOST_CHECK_MATCH);
+
+	/* So is a hashed entry read in later, and a second key for a cached name */
+	if (!(fp = fopen(filename, "w"))) {
+		perror("knownhosttest: temporary file");
+		return 1;
+	}
+	test_write_hashed(fp, "late.example.com", entries + 3);
+	test_write_hashed(fp, "host7.example.com", entries + 4);
+	fclose(fp);
+	test_expect(hosts, "miss before reading", "late.example.com", 22, entries + 3, LIBSSH2_KNOWNHOST_CHECK_NOTFOUND);
+	if (libssh2_knownhost_readfile(hosts, filename) != (int)(entries + 5)) {
+		fprintf(stderr, "knownhosttest: second file not read\n");
+		test_failures++;
+	}
+	test_expect(hosts, "read later", "late.example.com", 22, entries + 3, LIBSSH2_KNOWNHOST_CHECK_MATCH);
+	test_expect(hosts, "second key", "host7.example.com", 22, entries + 4, LIBSSH2_KNOWNHOST_CHECK_MATCH);
+	test_expect(hosts, "first key", "host7.example.com", 22, 7, LIBSSH2_KNOWNHOST_CHECK_MATCH);
+
+	unlink(filename);
+	libssh2_knownhost_free(hosts);
+
+	/* A small store looked up under more names than the cache holds */
+	strcpy(filename, "/tmp/knownhosttestXXXXXX");
+	fd = mkstemp(filename);
+	if (fd < 0 || !(fp = fdopen(fd, "w"))) {
+		perror("knownhosttest: temporary file");
+		return 1;
+	}
+	for(i = 0; i < 10; i++) {
+		snprintf(host, sizeof(host), "host%lu.example.com", i);
+		test_write_hashed(fp, host, i);
+	}
+	fclose(fp);
+	hosts = libssh2_knownhost_init(session);
+	libssh2_knownhost_readfile(hosts, filename);
+	unlink(filename);
+	for(i = 0; i < 5000; i++) {
+		snprintf(host, sizeof(host), "host%lu.example.com", i);
+		test_expect(hosts, "recycled cache", host, 22, i, i < 10 ? LIBSSH2_KNOWNHOST_CHECK_MATCH : LIBSSH2_KNOWNHOST_CHECK_NOTFOUND);
+	}
+	test_expect(hosts, "after recycling", "host3.example.com", 22, 3, LIBSSH2_KNOWNHOST_CHECK_MATCH);
+	libssh2_knownhost_free(hosts);
+
+	libssh2_session_free(session);
+
+	printf("%lu hashed entries: read in %.1fms, first lookup %.1fms, repeat lookup %.2fus\n",
+		   entries, read_time * 1e3, first_time * 1e3, repeat_time * 1e6);
+	if (test_failures) {
+		fprintf(stderr, "knownhosttest: %d checks failed\n", test_failures);
+		return 1;
+	}
+	return 0;
+}
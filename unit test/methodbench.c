@@ -0,0 +1,340 @@
+/*
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ *   Redistributions of source code must retain the above
+ *   copyright notice, this list of conditions and the
+ *   following disclaimer.
+ *
+ *   Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following
+ *   disclaimer in the documentation and/or other materials
+ *   provided with the distribution.
+ *
+ *   Neither the name of the copyright holder nor the names
+ *   of any other contributors may be used to endorse or
+ *   promote products derived from this software without
+ *   specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+
+/* Per-method cost of every registered cipher, MAC and compression method
+ * Drives the method structs the transport uses, one packet at a time, at sizes from 32 bytes to 32K
+ *
+ * Not part of the framework target, build it against the libssh2 sources on their own:
+ *   cc -O2 -I. -DLIBSSH2_HAVE_ZLIB "unit test/methodbench.c" channel.c comp.c crypt.c hostkey.c keepalive.c kex.c \
+ *      knownhost.c mac.c misc.c openssl.c packet.c pipeline.c pem.c publickey.c scp.c session.c sftp.c uring.c userauth.c \
+ *      -o methodbench -lcrypto -lz -lpthread
+ *
+ * One line per method, path and packet size: name, path, bytes, MB/s, packets/s, cycles/byte
+ * (cycles/byte is 0 where there's no cycle counter to read)
+ */
+
+#include "libssh2_priv.h"
+
+#ifdef __APPLE__
+#include <mach/mach_time.h>
+#endif
+
+#define BENCH_MIN_SIZE		32
+#define BENCH_MAX_SIZE		32768
+#define BENCH_SECONDS		0.2
+
+/* {{{ bench_now
+ * Monotonic seconds
+ */
+static double bench_now(void)
+{
+#ifdef __APPLE__
+	static mach_timebase_info_data_t timebase;
+
+	if (!timebase.denom) {
+		mach_timebase_info(&timebase);
+	}
+	return (double)mach_absolute_time() * timebase.numer / timebase.denom / 1e9;
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + (ts.tv_nsec / 1e9);
+#endif
+}
+/* }}} */
+
+/* {{{ bench_cycles
+ */
+static libssh2_uint64_t bench_cycles(void)
+{
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+	unsigned int lo, hi;
+
+	__asm__ __volatile__ ("rdtsc" : "=a" (lo), "=d" (hi));
+	return ((libssh2_uint64_t)hi << 32) | lo;
+#else
+	return 0;
+#endif
+}
+/* }}} */
+
+/* {{{ bench_report
+ */
+static void bench_report(const char *name, const char *path, unsigned long size, unsigned long packets, double seconds, libssh2_uint64_t cycles)
+{
+	double bytes = (double)size * packets;
+
+	printf("%-24s %-10s %6lu %10.1f %12.0f %8.2f\n", name, path, size,
+		   bytes / seconds / (1024 * 1024), packets / seconds, cycles ? (double)cycles / bytes : 0.0);
+}
+/* }}} */
+
+/* {{{ bench_fill
+ * Text-like data so compression has something realistic to chew on
+ */
+static void bench_fill(unsigned char *buf, unsigned long len)
+{
+	static const char alphabet[] = "etaoinshrdlcumwfgypbvkjxqz       \n<>=/\".";
+	unsigned long i, seed = 12345;
+
+	for(i = 0; i < len; i++) {
+		seed = (seed * 1103515245 + 12345) & 0x7FFFFFFF;
+		buf[i] = alphabet[(seed >> 16) % (sizeof(alphabet) - 1)];
+	}
+}
+/* }}} */
+
+/* {{{ bench_crypt
+ * Block at a time through crypt(), then the whole packet through crypt_span() where the method has one
+ */
+static void bench_crypt(LIBSSH2_SESSION *session, LIBSSH2_CRYPT_METHOD *method, unsigned char *buf)
+{
+	unsigned char iv[64], secret[64];
+	unsigned long size;
+	int path;
+
+	memset(iv, 0x5A, sizeof(iv));
+	memset(secret, 0xA5, sizeof(secret));
+
+	for(path = 0; path < 2; path++) {
+		if (path && !method->crypt_span) {
+			break;
+		}
+		for(size = BENCH_MIN_SIZE; size <= BENCH_MAX_SIZE; size *= 2) {
+			void *abstract = NULL;
+			int free_iv = 0, free_secret = 0;
+			unsigned long packets = 0, len = size - (size % method->blocksize);
+			libssh2_uint64_t cycles;
+			double start, elapsed;
+
+			if (method->init && method->init(session, method, iv, &free_iv, secret, &free_secret, 1, &abstract)) {
+				fprintf(stderr, "%s: init failed\n", method->name);
+				return;
+			}
+
+			start = bench_now();
+			cycles = bench_cycles();
+			do {
+				unsigned long i;
+
+				for(i = 0; i < 64; i++, packets++) {
+					if (path) {
+						method->crypt_span(session, buf, len, &abstract);
+					} else {
+						unsigned long ofs;
+
+						for(ofs = 0; ofs < len; ofs += method->blocksize) {
+							method->crypt(session, buf + ofs, &abstract);
+						}
+					}
+				}
+				elapsed = bench_now() - start;
+			} while (elapsed < BENCH_SECONDS);
+			cycles = bench_cycles() - cycles;
+
+			bench_report(method->name, path ? "span" : "block", len, packets, elapsed, cycles);
+
+			if (method->dtor) {
+				method->dtor(session, &abstract);
+			}
+		}
+	}
+}
+/* }}} */
+
+/* {{{ bench_mac
+ */
+static void bench_mac(LIBSSH2_SESSION *session, LIBSSH2_MAC_METHOD *method, unsigned char *buf)
+{
+	unsigned char out[64];
+	unsigned long size;
+
+	for(size = BENCH_MIN_SIZE; size <= BENCH_MAX_SIZE; size *= 2) {
+		void *abstract = NULL;
+		unsigned char *key = NULL;
+		int free_key = 0;
+		unsigned long packets = 0;
+		libssh2_uint64_t cycles;
+		double start, elapsed;
+
+		if (method->key_len) {
+			/* The simple MACs keep the key and free it in their dtor */
+			key = LIBSSH2_ALLOC(session, method->key_len);
+			if (!key) {
+				return;
+			}
+			memset(key, 0x3C, method->key_len);
+		}
+		if (method->init && method->init(session, key, &free_key, &abstract)) {
+			fprintf(stderr, "%s: init failed\n", method->name);
+			LIBSSH2_FREE(session, key);
+			return;
+		}
+		if (free_key) {
+			LIBSSH2_FREE(session, key);
+		}
+
+		start = bench_now();
+		cycles = bench_cycles();
+		do {
+			unsigned long i;
+
+			/* Same shape as the transport: 5 byte header, then the payload */
+			for(i = 0; i < 64; i++, packets++) {
+				method->hash(session, out, packets, buf, 5, buf + 5, size - 5, &abstract);
+			}
+			elapsed = bench_now() - start;
+		} while (elapsed < BENCH_SECONDS);
+		cycles = bench_cycles() - cycles;
+
+		bench_report(method->name, "hash", size, packets, elapsed, cycles);
+
+		if (method->dtor) {
+			method->dtor(session, &abstract);
+		}
+	}
+}
+/* }}} */
+
+/* {{{ bench_comp
+ * Compress and inflate streams are timed separately, each against its own packet
+ */
+static void bench_comp(LIBSSH2_SESSION *session, LIBSSH2_COMP_METHOD *method, unsigned char *buf)
+{
+	unsigned long size;
+
+	for(size = BENCH_MIN_SIZE; size <= BENCH_MAX_SIZE; size *= 2) {
+		void *deflate_abstract = NULL, *inflate_abstract = NULL;
+		unsigned long packets = 0, inflated_packets = 0;
+		libssh2_uint64_t cycles, inflate_cycles = 0;
+		double start, elapsed = 0, inflate_time = 0;
+		int failed = 0;
+
+		if (method->init && (method->init(session, 1, &deflate_abstract) || method->init(session, 0, &inflate_abstract))) {
+			fprintf(stderr, "%s: init failed\n", method->name);
+			return;
+		}
+
+		start = bench_now();
+		cycles = bench_cycles();
+		do {
+			unsigned char *dest, *plain;
+			unsigned long dest_len, plain_len;
+			int free_dest = 0, free_plain = 0;
+			double inflate_start;
+			libssh2_uint64_t inflate_start_cycles;
+
+			if (method->comp(session, 1, &dest, &dest_len, 2 * BENCH_MAX_SIZE, &free_dest, buf, size, &deflate_abstract)) {
+				fprintf(stderr, "%s: compression failed at %lu bytes\n", method->name, size);
+				failed = 1;
+				break;
+			}
+			packets++;
+
+			/* Inflate runs in step so it always sees a stream it can follow */
+			inflate_start = bench_now();
+			inflate_start_cycles = bench_cycles();
+			if (method->comp(session, 0, &plain, &plain_len, 2 * BENCH_MAX_SIZE, &free_plain, dest, dest_len, &inflate_abstract)) {
+				fprintf(stderr, "%s: decompression failed at %lu bytes\n", method->name, size);
+				if (free_dest) {
+					LIBSSH2_FREE(session, dest);
+				}
+				failed = 1;
+				break;
+			}
+			inflate_cycles += bench_cycles() - inflate_start_cycles;
+			inflate_time += bench_now() - inflate_start;
+			inflated_packets++;
+
+			if (free_plain) {
+				LIBSSH2_FREE(session, plain);
+			}
+			if (free_dest) {
+				LIBSSH2_FREE(session, dest);
+			}
+			elapsed = bench_now() - start;
+		} while (elapsed < 2 * BENCH_SECONDS);
+		cycles = bench_cycles() - cycles;
+
+		/* A failed round has nothing worth reporting */
+		if (!failed) {
+			bench_report(method->name, "compress", size, packets, elapsed - inflate_time, cycles ? cycles - inflate_cycles : 0);
+			bench_report(method->name, "inflate", size, inflated_packets, inflate_time, inflate_cycles);
+		}
+
+		if (method->dtor) {
+			method->dtor(session, 1, &deflate_abstract);
+			method->dtor(session, 0, &inflate_abstract);
+		}
+	}
+}
+/* }}} */
+
+int main(int argc, char *argv[])
+{
+	LIBSSH2_SESSION *session;
+	LIBSSH2_CRYPT_METHOD **crypt;
+	LIBSSH2_MAC_METHOD **mac;
+	LIBSSH2_COMP_METHOD **comp;
+	unsigned char *buf;
+
+	libssh2_crypto_init();
+
+	session = libssh2_session_init();
+	buf = malloc(BENCH_MAX_SIZE);
+	if (!session || !buf) {
+		fprintf(stderr, "Unable to set up a session\n");
+		return 1;
+	}
+	bench_fill(buf, BENCH_MAX_SIZE);
+
+	printf("%-24s %-10s %6s %10s %12s %8s\n", "method", "path", "bytes", "MB/s", "packets/s", "cyc/B");
+
+	for(crypt = libssh2_crypt_methods(); *crypt; crypt++) {
+		bench_crypt(session, *crypt, buf);
+	}
+	for(mac = libssh2_mac_methods(); *mac; mac++) {
+		bench_mac(session, *mac, buf);
+	}
+	for(comp = libssh2_comp_methods(); *comp; comp++) {
+		bench_comp(session, *comp, buf);
+	}
+
+	free(buf);
+	libssh2_session_free(session);
+
+	return 0;
+}
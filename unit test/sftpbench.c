@@ -0,0 +1,970 @@
+/*
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ *   Redistributions of source code must retain the above
+ *   copyright notice, this list of conditions and the
+ *   following disclaimer.
+ *
+ *   Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following
+ *   disclaimer in the documentation and/or other materials
+ *   provided with the distribution.
+ *
+ *   Neither the name of the copyright holder nor the names
+ *   of any other contributors may be used to endorse or
+ *   promote products derived from this software without
+ *   specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+
+/* SFTP benchmark against the in-process server stand-in (sshstandin.c)
+ * Every workload runs over its own connection, set up before the clock starts (bar handshake, which
+ * is nothing but setup), through a link with the latency, bandwidth and loss asked for:
+ *   handshake  banner, group14 key exchange, userauth_list, password auth and sftp_init, then
+ *              disconnect; -a pipelines the service request into the first userauth request and
+ *              answers userauth_list from the method cache once the first connection has filled it
+ *   read       one file of -s bytes, -c bytes per libssh2_sftp_read()
+ *   write      the same the other way
+ *   readdir    a directory of -e entries
+ *   stat       -n libssh2_sftp_stat() calls on distinct names
+ *   relay      -s bytes through libssh2_channel_relay() and a direct-tcpip channel the stand-in echoes,
+ *              written and read back by an application thread at the far end of a socketpair
+ *   relay_rtt  -n 64 byte round trips the same way, one at a time, for the latency a relay adds
+ *   load       -n 64 byte round trips on a direct-tcpip echo channel while a discard channel on the
+ *              same session takes 1MB non-blocking writes as fast as its window allows, all from one
+ *              thread; latency percentiles are the round trips', bytes the discard channel's. Run it
+ *              with and without -F for what LIBSSH2_FLAG_FAIR_SCHEDULE does for the small channel
+ *   segments   one file in -S segments, each over a session, thread and link of its own, so -b
+ *              is per segment and the scaling shown is what latency-bound transfers gain:
+ *                for n in 1 2 4 8; do sftpbench -w segments -S $n -l 5; done
+ *
+ * -R re-keys every so many bytes, so a long read or write shows what the exchanges in the middle of it
+ * cost (each result's key_exchanges counts them):
+ *   sftpbench -w read,write -s 1g -R 64m
+ *
+ * -W hands received packets to that many crypto workers (libssh2_session_crypto_workers()); only what the
+ * client receives goes through them, so read is the workload that scales:
+ *   for n in 0 1 2 4; do sftpbench -w read -s 1g -c 256k -W $n; done
+ *
+ * CPU is the client's threads' only (RUSAGE_THREAD), syscalls and allocations are libssh2's own
+ * LIBSSH2_SESSION_STATS counts, transport_syscalls and allocs; the stand-in's share of the box isn't in
+ * any of them. Results go to stdout as one JSON document for regression tracking, progress to stderr
+ *
+ * Linux only, not part of the framework target; build it against the libssh2 sources on their own:
+ *   cc -O2 -I. -I"unit test" -DLIBSSH2_HAVE_ZLIB "unit test/sftpbench.c" "unit test/sshstandin.c" \
+ *      channel.c comp.c crypt.c hostkey.c keepalive.c kex.c knownhost.c mac.c misc.c openssl.c packet.c pipeline.c \
+ *      pem.c publickey.c scp.c session.c sftp.c uring.c userauth.c -o sftpbench -lcrypto -lz -lpthread
+ *
+ * Usage: sftpbench [-l latency_ms] [-b bandwidth_mbit] [-p loss_percent] [-s size] [-c chunk]
+ *                  [-n stats] [-e entries] [-H handshakes] [-S segments] [-C cipher] [-M mac] [-R rekey_bytes]
+ *                  [-W workers] [-u] [-a] [-F] [-w workload,...]
+ * -u puts the client on libssh2_session_io_uring(), -F sets LIBSSH2_FLAG_FAIR_SCHEDULE on it; sizes
+ * take a k, m or g suffix
+ */
+
+#define _GNU_SOURCE		/* RUSAGE_THREAD */
+
+#include "libssh2_priv.h"
+#include "libssh2_sftp.h"
+#include "sshstandin.h"
+
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_DIR			"/bench"
+#define BENCH_FILE			BENCH_DIR "/file000000.dat"
+#define BENCH_UPLOAD		BENCH_DIR "/upload.dat"
+#define BENCH_SEGMENTS_MAX	64
+#define BENCH_LOAD_WRITE	(1024 * 1024)
+
+typedef struct _bench_result {
+	const char *workload;
+	unsigned long ops;
+	libssh2_uint64_t bytes;			/* SFTP or relayed payload moved, 0 for the metadata workloads */
+	double started, seconds, cpu;
+	double latency_p50, latency_p99, latency_max;	/* seconds, only the workloads that time each op */
+	LIBSSH2_SESSION_STATS stats;	/* summed over every session the workload used */
+	int failed;
+} bench_result;
+
+typedef struct _bench_client {
+	standin_conn conn;
+	LIBSSH2_SESSION *session;
+	LIBSSH2_SFTP *sftp;
+} bench_client;
+
+typedef struct _bench_relay_app {
+	int fd;
+	int failed;
+} bench_relay_app;
+
+typedef struct _bench_segment {
+	LIBSSH2_SFTP_SEGMENT segment;
+	int fd;
+	bench_result result;
+} bench_segment;
+
+static standin_config bench_config;
+static size_t bench_chunk = 32768;
+static unsigned long bench_stats = 1000;
+static unsigned long bench_handshakes = 20;
+static int bench_segments = 4;
+static int bench_uring;
+static int bench_auth_flags;
+static int bench_fair;
+static libssh2_uint64_t bench_rekey_bytes;
+static int bench_workers;
+static pthread_barrier_t bench_segments_ready;
+
+/* {{{ bench_now
+ */
+static double bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+/* }}} */
+
+/* {{{ bench_cpu
+ * User plus system time of the calling thread
+ */
+static double bench_cpu(void)
+{
+	struct rusage usage;
+
+	getrusage(RUSAGE_THREAD, &usage);
+	return usage.ru_utime.tv_sec + (usage.ru_utime.tv_usec / 1e6) +
+		   usage.ru_stime.tv_sec + (usage.ru_stime.tv_usec / 1e6);
+}
+/* }}} */
+
+/* {{{ bench_stats_add
+ */
+static void bench_stats_add(LIBSSH2_SESSION_STATS *total, const LIBSSH2_SESSION_STATS *stats)
+{
+	total->bytes_sent += stats->bytes_sent;
+	total->bytes_received += stats->bytes_received;
+	total->packets_sent += stats->packets_sent;
+	total->packets_received += stats->packets_received;
+	total->transport_writes += stats->transport_writes;
+	total->transport_reads += stats->transport_reads;
+	total->transport_syscalls += stats->transport_syscalls;
+	total->allocs += stats->allocs;
+	total->key_exchanges += stats->key_exchanges;
+}
+/* }}} */
+
+/* {{{ bench_size
+ * A byte count with an optional k, m or g suffix
+ */
+static libssh2_uint64_t bench_size(const char *arg)
+{
+	char *end;
+	libssh2_uint64_t size = strtoull(arg, &end, 10);
+
+	switch (*end) {
+		case 'g': case 'G':
+			size *= 1024;
+			/* fall through */
+		case 'm': case 'M':
+			size *= 1024;
+			/* fall through */
+		case 'k': case 'K':
+			size *= 1024;
+	}
+	return size;
+}
+/* }}} */
+
+/* {{{ bench_connect
+ * A new connection to the stand-in, as far as an SFTP subsystem
+ */
+static int bench_connect(bench_client *client)
+{
+	char *message, *methods;
+
+	memset(client, 0, sizeof(bench_client));
+	if (standin_connect(&client->conn, &bench_config)) {
+		return -1;
+	}
+	client->session = libssh2_session_init();
+	if (!client->session) {
+		standin_close(&client->conn);
+		return -1;
+	}
+	if (bench_uring && libssh2_session_io_uring(client->session, 64)) {
+		goto fail;
+	}
+	if (bench_auth_flags) {
+		libssh2_session_flag(client->session, LIBSSH2_FLAG_PIPELINE_AUTH, 1);
+		libssh2_session_flag(client->session, LIBSSH2_FLAG_AUTH_CACHE, 1);
+	}
+	if (bench_fair) {
+		libssh2_session_flag(client->session, LIBSSH2_FLAG_FAIR_SCHEDULE, 1);
+	}
+	if (bench_rekey_bytes) {
+		libssh2_session_rekey_limits(client->session, bench_rekey_bytes, 0);
+	}
+	if (bench_workers && libssh2_session_crypto_workers(client->session, bench_workers)) {
+		goto fail;
+	}
+	if (libssh2_session_startup(client->session, client->conn.fd) ||
+		!(methods = libssh2_userauth_list(client->session, "bench", 5))) {
+		goto fail;
+	}
+	LIBSSH2_FREE(client->session, methods);
+	if (libssh2_userauth_password(client->session, "bench", "bench")) {
+		goto fail;
+	}
+	client->sftp = libssh2_sftp_init(client->session);
+	if (!client->sftp) {
+		goto fail;
+	}
+	return 0;
+
+ fail:
+	libssh2_session_last_error(client->session, &message, NULL, 0);
+	fprintf(stderr, "sftpbench: connect: %s\n", message);
+	libssh2_session_free(client->session);
+	standin_close(&client->conn);
+	return -1;
+}
+/* }}} */
+
+/* {{{ bench_disconnect
+ * Tears the connection down, adding its session's counts to stats first
+ */
+static void bench_disconnect(bench_client *client, LIBSSH2_SESSION_STATS *stats)
+{
+	LIBSSH2_SESSION_STATS session_stats;
+
+	libssh2_session_stats(client->session, &session_stats);
+	bench_stats_add(stats, &session_stats);
+
+	libssh2_sftp_shutdown(client->sftp);
+	libssh2_session_disconnect(client->session, "done");
+	libssh2_session_free(client->session);
+	standin_close(&client->conn);
+}
+/* }}} */
+
+/* {{{ bench_begin
+ * Counts from here on, setup excluded
+ */
+static void bench_begin(bench_client *client, bench_result *result)
+{
+	if (client) {
+		libssh2_session_stats_reset(client->session);
+	}
+	result->started = bench_now();
+	result->cpu = bench_cpu();
+}
+/* }}} */
+
+/* {{{ bench_end
+ */
+static void bench_end(bench_result *result)
+{
+	result->seconds = bench_now() - result->started;
+	result->cpu = bench_cpu() - result->cpu;
+}
+/* }}} */
+
+/* {{{ bench_handshake
+ */
+static int bench_handshake(bench_result *result)
+{
+	bench_client client;
+	unsigned long i;
+
+	bench_begin(NULL, result);
+	for(i = 0; i < bench_handshakes; i++) {
+		if (bench_connect(&client)) {
+			return -1;
+		}
+		bench_disconnect(&client, &result->stats);
+		result->ops++;
+	}
+	bench_end(result);
+
+	return 0;
+}
+/* }}} */
+
+/* {{{ bench_read
+ */
+static int bench_read(bench_client *client, bench_result *result)
+{
+	LIBSSH2_SFTP_HANDLE *handle;
+	char *buffer = malloc(bench_chunk);
+	ssize_t got;
+
+	if (!buffer) {
+		return -1;
+	}
+	bench_begin(client, result);
+	handle = libssh2_sftp_open(client->sftp, BENCH_FILE, LIBSSH2_FXF_READ, 0);
+	if (!handle) {
+		free(buffer);
+		return -1;
+	}
+	while ((got = (ssize_t)libssh2_sftp_read(handle, buffer, bench_chunk)) > 0) {
+		result->bytes += got;
+		result->ops++;
+	}
+	libssh2_sftp_close(handle);
+	bench_end(result);
+	free(buffer);
+
+	/* A read at end of file comes back as an FX_EOF status */
+	return (result->bytes == bench_config.file_size) ? 0 : -1;
+}
+/* }}} */
+
+/* {{{ bench_write
+ */
+static int bench_write(bench_client *client, bench_result *result)
+{
+	LIBSSH2_SFTP_HANDLE *handle;
+	char *buffer = malloc(bench_chunk);
+
+	if (!buffer) {
+		return -1;
+	}
+	memset(buffer, 'y', bench_chunk);
+	bench_begin(client, result);
+	handle = libssh2_sftp_open(client->sftp, BENCH_UPLOAD, LIBSSH2_FXF_WRITE | LIBSSH2_FXF_CREAT | LIBSSH2_FXF_TRUNC, 0644);
+	if (!handle) {
+		free(buffer);
+		return -1;
+	}
+	while (result->bytes < bench_config.file_size) {
+		size_t count = bench_chunk;
+		ssize_t written;
+
+		if (count > bench_config.file_size - result->bytes) {
+			count = (size_t)(bench_config.file_size - result->bytes);
+		}
+		written = (ssize_t)libssh2_sftp_write(handle, buffer, count);
+		if (written <= 0) {
+			break;
+		}
+		result->bytes += written;
+		result->ops++;
+	}
+	libssh2_sftp_close(handle);
+	bench_end(result);
+	free(buffer);
+
+	return (result->bytes == bench_config.file_size) ? 0 : -1;
+}
+/* }}} */
+
+/* {{{ bench_readdir
+ */
+static int bench_readdir(bench_client *client, bench_result *result)
+{
+	LIBSSH2_SFTP_HANDLE *handle;
+	LIBSSH2_SFTP_ATTRIBUTES attrs;
+	char name[512];
+
+	bench_begin(client, result);
+	handle = libssh2_sftp_opendir(client->sftp, BENCH_DIR);
+	if (!handle) {
+		return -1;
+	}
+	while (libssh2_sftp_readdir(handle, name, sizeof(name), &attrs) > 0) {
+		result->ops++;
+	}
+	libssh2_sftp_closedir(handle);
+	bench_end(result);
+
+	return (result->ops == bench_config.dir_entries) ? 0 : -1;
+}
+/* }}} */
+
+/* {{{ bench_stat
+ */
+static int bench_stat(bench_client *client, bench_result *result)
+{
+	LIBSSH2_SFTP_ATTRIBUTES attrs;
+	char path[64];
+	unsigned long i;
+
+	bench_begin(client, result);
+	for(i = 0; i < bench_stats; i++) {
+		snprintf(path, sizeof(path), BENCH_DIR "/file%06lu.dat", i);
+		if (libssh2_sftp_stat(client->sftp, path, &attrs) || attrs.filesize != bench_config.file_size) {
+			return -1;
+		}
+		result->ops++;
+	}
+	bench_end(result);
+
+	return 0;
+}
+/* }}} */
+
+/* {{{ bench_relay_bulk
+ * Thread body, the application end of the relay: writes -s bytes while reading them back
+ */
+static void *bench_relay_bulk(void *arg)
+{
+	bench_relay_app *app = arg;
+	unsigned char buf[32768];
+	libssh2_uint64_t sent = 0, received = 0;
+
+	memset(buf, 'r', sizeof(buf));
+	while (received < bench_config.file_size) {
+		struct pollfd pfd;
+		ssize_t n;
+
+		pfd.fd = app->fd;
+		pfd.events = POLLIN | (sent < bench_config.file_size ? POLLOUT : 0);
+		if (poll(&pfd, 1, -1) < 0) {
+			continue;
+		}
+		if (pfd.revents & POLLOUT) {
+			size_t want = sizeof(buf);
+
+			if (want > bench_config.file_size - sent) {
+				want = (size_t)(bench_config.file_size - sent);
+			}
+			n = write(app->fd, buf, want);
+			if (n > 0 && (sent += n) == bench_config.file_size) {
+				shutdown(app->fd, SHUT_WR);
+			}
+		}
+		if (pfd.revents & (POLLIN | POLLHUP)) {
+			n = read(app->fd, buf, sizeof(buf));
+			if (n <= 0) {
+				break;
+			}
+			received += n;
+		}
+	}
+	app->failed = (received != bench_config.file_size || read(app->fd, buf, 1) != 0);
+
+	return NULL;
+}
+/* }}} */
+
+/* {{{ bench_relay_ping
+ * Thread body, the application end of the relay: -n round trips of 64 bytes, one at a time
+ */
+static void *bench_relay_ping(void *arg)
+{
+	bench_relay_app *app = arg;
+	unsigned char buf[64];
+	unsigned long i;
+
+	memset(buf, 'p', sizeof(buf));
+	for(i = 0; i < bench_stats; i++) {
+		size_t got = 0;
+
+		if (write(app->fd, buf, sizeof(buf)) != sizeof(buf)) {
+			break;
+		}
+		while (got < sizeof(buf)) {
+			ssize_t n = read(app->fd, buf + got, sizeof(buf) - got);
+
+			if (n <= 0) {
+				break;
+			}
+			got += n;
+		}
+		if (got < sizeof(buf)) {
+			break;
+		}
+	}
+	shutdown(app->fd, SHUT_WR);
+	app->failed = (i < bench_stats || read(app->fd, buf, 1) != 0);
+
+	return NULL;
+}
+/* }}} */
+
+/* {{{ bench_relay_run
+ * Relays a direct-tcpip channel, alongside the SFTP one, to an application thread until it's done
+ */
+static int bench_relay_run(bench_client *client, bench_result *result, void *(*app_run)(void *))
+{
+	LIBSSH2_CHANNEL *channel;
+	bench_relay_app app;
+	pthread_t thread;
+	int sv[2], rc;
+
+	channel = libssh2_channel_direct_tcpip(client->session, "echo", 7);
+	if (!channel) {
+		return -1;
+	}
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) {
+		libssh2_channel_free(channel);
+		return -1;
+	}
+	/* The relay's end has to be non-blocking, it's polled alongside the session */
+	fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL) | O_NONBLOCK);
+	app.fd = sv[1];
+	app.failed = 0;
+
+	bench_begin(client, result);
+	pthread_create(&thread, NULL, app_run, &app);
+	rc = libssh2_channel_relay(channel, sv[0]);
+	close(sv[0]);
+	pthread_join(thread, NULL);
+	bench_end(result);
+
+	close(sv[1]);
+	libssh2_channel_free(channel);
+
+	return (rc || app.failed) ? -1 : 0;
+}
+/* }}} */
+
+/* {{{ bench_relay
+ */
+static int bench_relay(bench_client *client, bench_result *result)
+{
+	if (bench_relay_run(client, result, bench_relay_bulk)) {
+		return -1;
+	}
+	result->bytes = bench_config.file_size;
+	result->ops = 1;
+
+	return 0;
+}
+/* }}} */
+
+/* {{{ bench_relay_rtt
+ */
+static int bench_relay_rtt(bench_client *client, bench_result *result)
+{
+	if (bench_relay_run(client, result, bench_relay_ping)) {
+		return -1;
+	}
+	result->ops = bench_stats;
+
+	return 0;
+}
+/* }}} */
+
+/* {{{ bench_latency_cmp
+ */
+static int bench_latency_cmp(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+/* }}} */
+
+/* {{{ bench_load
+ * One thread drives both channels non-blocking: a ping goes out as soon as the last one is back, the
+ * discard channel is handed another 1MB each time round, and libssh2_poll() waits whenever neither moves
+ */
+static int bench_load(bench_client *client, bench_result *result)
+{
+	LIBSSH2_CHANNEL *bulk, *echo;
+	char *buf, reply[64];
+	double *latencies, sent_at = 0;
+	size_t ping_sent = 0, ping_got = 0;
+	int ret = -1;
+
+	bulk = libssh2_channel_direct_tcpip(client->session, "discard", 9);
+	echo = libssh2_channel_direct_tcpip(client->session, "echo", 7);
+	buf = malloc(BENCH_LOAD_WRITE);
+	latencies = malloc(bench_stats * sizeof(double));
+	if (!bulk || !echo || !buf || !latencies || !bench_stats) {
+		goto load_done;
+	}
+	memset(buf, 'l', BENCH_LOAD_WRITE);
+	libssh2_channel_set_blocking(bulk, 0);
+	libssh2_channel_set_blocking(echo, 0);
+
+	bench_begin(client, result);
+	while (result->ops < bench_stats) {
+		LIBSSH2_POLLFD fds[2];
+		int progress = 0, n;
+
+		if (ping_sent < sizeof(reply)) {
+			if (!ping_sent) {
+				sent_at = bench_now();
+			}
+			n = libssh2_channel_write(echo, buf, sizeof(reply) - ping_sent);
+			if (n < 0) {
+				goto load_done;
+			}
+			ping_sent += n;
+			progress |= n;
+		}
+
+		n = libssh2_channel_write(bulk, buf, BENCH_LOAD_WRITE);
+		if (n < 0) {
+			goto load_done;
+		}
+		result->bytes += n;
+		progress |= n;
+
+		n = libssh2_channel_read(echo, reply + ping_got, sizeof(reply) - ping_got);
+		if (n < 0) {
+			goto load_done;
+		}
+		ping_got += n;
+		progress |= n;
+		if (ping_got == sizeof(reply)) {
+			latencies[result->ops++] = bench_now() - sent_at;
+			ping_sent = ping_got = 0;
+		}
+
+		if (progress) {
+			continue;
+		}
+		fds[0].type = fds[1].type = LIBSSH2_POLLFD_CHANNEL;
+		fds[0].fd.channel = echo;
+		fds[0].events = LIBSSH2_POLLFD_POLLIN;
+		fds[1].fd.channel = bulk;
+		fds[1].events = LIBSSH2_POLLFD_POLLOUT;
+		if (libssh2_poll(fds, 2, 1000) < 0) {
+			goto load_done;
+		}
+	}
+	bench_end(result);
+
+	qsort(latencies, bench_stats, sizeof(double), bench_latency_cmp);
+	result->latency_p50 = latencies[bench_stats / 2];
+	result->latency_p99 = latencies[(bench_stats * 99) / 100];
+	result->latency_max = latencies[bench_stats - 1];
+	ret = 0;
+
+ load_done:
+	/* Blocking again so whatever the discard channel still has queued goes before its close */
+	if (bulk) {
+		libssh2_channel_set_blocking(bulk, 1);
+		libssh2_channel_free(bulk);
+	}
+	if (echo) {
+		libssh2_channel_set_blocking(echo, 1);
+		libssh2_channel_free(echo);
+	}
+	free(latencies);
+	free(buf);
+
+	return ret;
+}
+/* }}} */
+
+/* {{{ bench_segment_run
+ * Thread body, one segment over a connection of its own; times its own thread
+ * Every thread connects first, the clocks only start once they all have
+ */
+static void *bench_segment_run(void *arg)
+{
+	bench_segment *segment = arg;
+	bench_client client;
+	int failed = bench_connect(&client);
+
+	pthread_barrier_wait(&bench_segments_ready);
+	if (failed) {
+		segment->result.failed = 1;
+		return NULL;
+	}
+	bench_begin(&client, &segment->result);
+	if (libssh2_sftp_segment_fetch(client.sftp, BENCH_FILE, sizeof(BENCH_FILE) - 1, segment->fd, &segment->segment) ||
+		!libssh2_sftp_segment_complete(&segment->segment)) {
+		segment->result.failed = 1;
+	}
+	bench_end(&segment->result);
+	bench_disconnect(&client, &segment->result.stats);
+
+	return NULL;
+}
+/* }}} */
+
+/* {{{ bench_segmented
+ * Wall clock from the first segment's start to the last one's finish
+ */
+static int bench_segmented(bench_result *result)
+{
+	LIBSSH2_SFTP_SEGMENT segments[BENCH_SEGMENTS_MAX];
+	bench_segment workers[BENCH_SEGMENTS_MAX];
+	pthread_t threads[BENCH_SEGMENTS_MAX];
+	char path[] = "/tmp/sftpbench.XXXXXX";
+	double start = 0, end = 0;
+	int fd, i, ret = 0;
+
+	fd = mkstemp(path);
+	if (fd < 0) {
+		return -1;
+	}
+	unlink(path);
+	if (libssh2_sftp_segments_init(fd, bench_config.file_size, segments, bench_segments)) {
+		close(fd);
+		return -1;
+	}
+
+	pthread_barrier_init(&bench_segments_ready, NULL, bench_segments);
+	for(i = 0; i < bench_segments; i++) {
+		memset(&workers[i], 0, sizeof(bench_segment));
+		workers[i].segment = segments[i];
+		workers[i].fd = fd;
+		pthread_create(&threads[i], NULL, bench_segment_run, &workers[i]);
+	}
+	for(i = 0; i < bench_segments; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	pthread_barrier_destroy(&bench_segments_ready);
+	close(fd);
+
+	for(i = 0; i < bench_segments; i++) {
+		bench_result *worker = &workers[i].result;
+
+		if (worker->failed) {
+			ret = -1;
+			continue;
+		}
+		if (!i || worker->started < start) {
+			start = worker->started;
+		}
+		if (!i || worker->started + worker->seconds > end) {
+			end = worker->started + worker->seconds;
+		}
+		result->cpu += worker->cpu;
+		result->bytes += workers[i].segment.transferred;
+		bench_stats_add(&result->stats, &worker->stats);
+		result->ops++;
+	}
+	result->started = start;
+	result->seconds = end - start;
+
+	return (ret || result->bytes != bench_config.file_size) ? -1 : 0;
+}
+/* }}} */
+
+typedef struct _bench_workload {
+	const char *name;
+	int (*run)(bench_client *client, bench_result *result);	/* over a connection set up beforehand */
+	int (*run_alone)(bench_result *result);					/* makes its own */
+} bench_workload;
+
+static const bench_workload bench_workloads[] = {
+	{ "handshake",	NULL,			bench_handshake },
+	{ "read",		bench_read,		NULL },
+	{ "write",		bench_write,	NULL },
+	{ "readdir",	bench_readdir,	NULL },
+	{ "stat",		bench_stat,		NULL },
+	{ "relay",		bench_relay,	NULL },
+	{ "relay_rtt",	bench_relay_rtt,	NULL },
+	{ "load",		bench_load,		NULL },
+	{ "segments",	NULL,			bench_segmented },
+	{ NULL,			NULL,			NULL }
+};
+
+/* {{{ bench_run
+ */
+static int bench_run(const bench_workload *workload, bench_result *result)
+{
+	bench_client client;
+
+	memset(result, 0, sizeof(bench_result));
+	result->workload = workload->name;
+
+	if (workload->run_alone) {
+		result->failed = workload->run_alone(result) ? 1 : 0;
+		return result->failed;
+	}
+
+	if (bench_connect(&client)) {
+		result->failed = 1;
+		return 1;
+	}
+	result->failed = workload->run(&client, result) ? 1 : 0;
+	bench_disconnect(&client, &result->stats);
+
+	return result->failed;
+}
+/* }}} */
+
+/* {{{ bench_json_result
+ */
+static void bench_json_result(const bench_result *result, int last)
+{
+	const LIBSSH2_SESSION_STATS *stats = &result->stats;
+	libssh2_uint64_t wire = stats->bytes_sent + stats->bytes_received;
+	double seconds = result->seconds > 0 ? result->seconds : 1e-9;
+
+	printf("    {\"workload\": \"%s\", \"failed\": %s, \"ops\": %lu, \"bytes\": %llu, \"seconds\": %.6f,\n",
+		   result->workload, result->failed ? "true" : "false", result->ops,
+		   (unsigned long long)result->bytes, result->seconds);
+	printf("     \"mb_per_s\": %.3f, \"ops_per_s\": %.1f, \"cpu_seconds\": %.6f, ",
+		   result->bytes / seconds / 1e6, result->ops / seconds, result->cpu);
+	if (result->bytes) {
+		printf("\"cpu_ns_per_byte\": %.3f, ", result->cpu * 1e9 / result->bytes);
+	} else {
+		printf("\"cpu_ns_per_byte\": null, ");
+	}
+	printf("\"cpu_ns_per_wire_byte\": %.3f, \"cpu_us_per_op\": %.3f,\n",
+		   wire ? result->cpu * 1e9 / wire : 0.0, result->ops ? result->cpu * 1e6 / result->ops : 0.0);
+	if (result->latency_max > 0) {
+		printf("     \"latency_us_p50\": %.1f, \"latency_us_p99\": %.1f, \"latency_us_max\": %.1f,\n",
+			   result->latency_p50 * 1e6, result->latency_p99 * 1e6, result->latency_max * 1e6);
+	} else {
+		printf("     \"latency_us_p50\": null, \"latency_us_p99\": null, \"latency_us_max\": null,\n");
+	}
+	printf("     \"syscalls\": %lu, \"allocs\": %lu, \"packets_sent\": %lu, \"packets_received\": %lu, "
+		   "\"wire_bytes_sent\": %llu, \"wire_bytes_received\": %llu, \"key_exchanges\": %lu}%s\n",
+		   stats->transport_syscalls, stats->allocs, stats->packets_sent, stats->packets_received,
+		   (unsigned long long)stats->bytes_sent, (unsigned long long)stats->bytes_received,
+		   stats->key_exchanges, last ? "" : ",");
+}
+/* }}} */
+
+/* {{{ bench_listed
+ * Is name one of the comma separated workloads in list?
+ */
+static int bench_listed(const char *list, const char *name)
+{
+	size_t len = strlen(name);
+
+	while (*list) {
+		size_t token = strcspn(list, ",");
+
+		if (token == len && !strncmp(list, name, len)) {
+			return 1;
+		}
+		list += token;
+		if (*list) {
+			list++;
+		}
+	}
+	return 0;
+}
+/* }}} */
+
+/* {{{ bench_usage
+ */
+static int bench_usage(void)
+{
+	fprintf(stderr, "usage: sftpbench [-l latency_ms] [-b bandwidth_mbit] [-p loss_percent] [-s size] [-c chunk]\n"
+					"                 [-n stats] [-e entries] [-H handshakes] [-S segments] [-C cipher] [-M mac] [-R rekey_bytes]\n"
+					"                 [-W workers] [-u] [-a] [-F] [-w handshake,read,write,readdir,stat,relay,relay_rtt,load,segments]\n");
+	return 2;
+}
+/* }}} */
+
+int main(int argc, char *argv[])
+{
+	const bench_workload *selected[sizeof(bench_workloads) / sizeof(bench_workloads[0])];
+	const char *workloads = NULL;
+	double latency_ms = 0, bandwidth_mbit = 0, loss_percent = 0;
+	int count = 0, failed = 0, opt, i;
+
+	bench_config.cipher = "aes128-cbc";
+	bench_config.mac = "hmac-sha1";
+	bench_config.file_size = 16 * 1024 * 1024;
+	bench_config.dir_entries = 10000;
+
+	while ((opt = getopt(argc, argv, "l:b:p:s:c:n:e:H:S:C:M:R:W:uaFw:")) != -1) {
+		switch (opt) {
+			case 'l': latency_ms = atof(optarg); break;
+			case 'b': bandwidth_mbit = atof(optarg); break;
+			case 'p': loss_percent = atof(optarg); break;
+			case 's': bench_config.file_size = bench_size(optarg); break;
+			case 'c': bench_chunk = (size_t)bench_size(optarg); break;
+			case 'n': bench_stats = strtoul(optarg, NULL, 10); break;
+			case 'e': bench_config.dir_entries = strtoul(optarg, NULL, 10); break;
+			case 'H': bench_handshakes = strtoul(optarg, NULL, 10); break;
+			case 'S': bench_segments = atoi(optarg); break;
+			case 'C': bench_config.cipher = optarg; break;
+			case 'M': bench_config.mac = optarg; break;
+			case 'R': bench_rekey_bytes = bench_size(optarg); break;
+			case 'W': bench_workers = atoi(optarg); break;
+			case 'u': bench_uring = 1; break;
+			case 'a': bench_auth_flags = 1; break;
+			case 'F': bench_fair = 1; break;
+			case 'w': workloads = optarg; break;
+			default: return bench_usage();
+		}
+	}
+	if (!bench_chunk || bench_workers < 0 || bench_segments < 1 || bench_segments > BENCH_SEGMENTS_MAX ||
+		loss_percent < 0 || loss_percent > 100) {
+		return bench_usage();
+	}
+	bench_config.link.latency = latency_ms / 1000;
+	bench_config.link.bandwidth = bandwidth_mbit * 1e6 / 8;
+	bench_config.link.loss = loss_percent / 100;
+
+	/* Run in the table's order whatever order -w names them in */
+	for(i = 0; bench_workloads[i].name; i++) {
+		if (!workloads || bench_listed(workloads, bench_workloads[i].name)) {
+			selected[count++] = &bench_workloads[i];
+		}
+	}
+	if (workloads) {
+		/* and every name listed has to be one of the table's */
+		const char *p;
+		int listed = 1;
+
+		for(p = workloads; *p; p++) {
+			listed += (*p == ',');
+		}
+		if (listed != count) {
+			return bench_usage();
+		}
+	}
+	if (!count) {
+		return bench_usage();
+	}
+
+	if (standin_init()) {
+		fprintf(stderr, "sftpbench: couldn't load the stand-in's host key\n");
+		return 1;
+	}
+
+	printf("{\n  \"benchmark\": \"sftpbench\",\n  \"transport\": \"%s\",\n  \"cipher\": \"%s\",\n  \"mac\": \"%s\",\n",
+		   bench_uring ? "io_uring" : "bsd", bench_config.cipher, bench_config.mac);
+	printf("  \"pipelined_auth\": %s, \"fair_schedule\": %s, \"rekey_bytes\": %llu, \"crypto_workers\": %d,\n",
+		   bench_auth_flags ? "true" : "false", bench_fair ? "true" : "false", (unsigned long long)bench_rekey_bytes, bench_workers);
+	printf("  \"link\": {\"latency_ms\": %g, \"bandwidth_mbit\": %g, \"loss_percent\": %g},\n",
+		   latency_ms, bandwidth_mbit, loss_percent);
+	printf("  \"file_size\": %llu, \"chunk\": %lu, \"dir_entries\": %lu, \"segments\": %d,\n  \"results\": [\n",
+		   (unsigned long long)bench_config.file_size, (unsigned long)bench_chunk, bench_config.dir_entries, bench_segments);
+
+	for(i = 0; i < count; i++) {
+		bench_result result;
+
+		fprintf(stderr, "sftpbench: %s...\n", selected[i]->name);
+		if (bench_run(selected[i], &result)) {
+			fprintf(stderr, "sftpbench: %s failed\n", selected[i]->name);
+			failed = 1;
+		}
+		bench_json_result(&result, i == count - 1);
+		fflush(stdout);
+	}
+	printf("  ]\n}\n");
+
+	standin_cleanup();
+	return failed;
+}
@@ -0,0 +1,88 @@
+/*
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ *   Redistributions of source code must retain the above
+ *   copyright notice, this list of conditions and the
+ *   following disclaimer.
+ *
+ *   Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following
+ *   disclaimer in the documentation and/or other materials
+ *   provided with the distribution.
+ *
+ *   Neither the name of the copyright holder nor the names
+ *   of any other contributors may be used to endorse or
+ *   promote products derived from this software without
+ *   specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+
+/* In-process SSH/SFTP server stand-in for the benchmarks
+ * Speaks just enough of the protocol for libssh2's client: diffie-hellman-group14-sha1 with an ssh-rsa
+ * host key, any one cipher and MAC libssh2 itself implements (it borrows libssh2's own method tables),
+ * any userauth but "none", and up to eight channels at once. Session channels take the sftp subsystem,
+ * SFTP v3 over a virtual tree in which every file is config->file_size bytes and every directory holds
+ * config->dir_entries files; writes are accepted and thrown away. direct-tcpip channels echo back
+ * what they're sent, bar those to port 9 which discard it, and close once the client sends EOF
+ *
+ * Each connection is a socketpair served by a thread of its own. Given a link with latency, bandwidth
+ * or loss, a pump thread per direction sits in the middle and shapes the byte stream; see
+ * sshstandin.c for how loss is modelled on a stream that can't drop bytes
+ */
+
+#ifndef SSHSTANDIN_H
+#define SSHSTANDIN_H 1
+
+#include <pthread.h>
+
+typedef struct _standin_link {
+	double latency;			/* one way, seconds */
+	double bandwidth;		/* bytes per second, 0 for unlimited */
+	double loss;			/* probability a 1448 byte segment is lost, 0..1 */
+} standin_link;
+
+typedef struct _standin_config {
+	const char *cipher;		/* names from libssh2's own tables, e.g. "aes128-cbc", "hmac-sha1" */
+	const char *mac;
+	unsigned long long file_size;
+	unsigned long dir_entries;
+	standin_link link;
+} standin_config;
+
+typedef struct _standin_conn {
+	int fd;					/* the client's end, hand it to libssh2_session_startup() */
+
+	int link_fd[2];
+	pthread_t server;
+	pthread_t pump[2];
+	int pumps;
+	void *state;
+} standin_conn;
+
+/* Loads the host key, once per process; 0 on success */
+int standin_init(void);
+void standin_cleanup(void);
+
+/* Starts serving a new connection; 0 on success. config must outlive the connection */
+int standin_connect(standin_conn *conn, const standin_config *config);
+
+/* Closes the client's end and waits for the server and link threads to finish */
+void standin_close(standin_conn *conn);
+
+#endif /* SSHSTANDIN_H */
@@ -0,0 +1,425 @@
+/*
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ *   Redistributions of source code must retain the above
+ *   copyright notice, this list of conditions and the
+ *   following disclaimer.
+ *
+ *   Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following
+ *   disclaimer in the documentation and/or other materials
+ *   provided with the distribution.
+ *
+ *   Neither the name of the copyright holder nor the names
+ *   of any other contributors may be used to endorse or
+ *   promote products derived from this software without
+ *   specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+
+/* Stress test for LIBSSH2_FLAG_THREADED packet reading
+ * Several threads each block in libssh2_packet_require() on a packet type of their own while an
+ * in-process peer at the far end of a socketpair sends them plaintext packets in shuffled order, one
+ * per thread per round. Whichever thread wins read_lock reads for everyone, and once it has its own
+ * packet it stops reading until the next round, so a waiter whose wakeup was missed hangs there for
+ * good; the alarm, re-armed every round, catches that. A packet handed to the wrong thread or out of order fails the run
+ *
+ * With -s the threads instead each open an SFTP channel of their own on one session to the server stand-in
+ * (sshstandin.c), with LIBSSH2_FLAG_FAIR_SCHEDULE set so their writes go through the shared channel queues
+ * and a rekey limit low enough that keys are re-exchanged every few rounds, and every round read a file back
+ * whole and write one. Each opens a new channel every few rounds, so the channel list changes under the others. The main thread samples the session's counters meanwhile, and the alarm is re-armed
+ * whenever a worker finishes a round. Up to eight threads, the stand-in's channel limit
+ *
+ * Not part of the framework target, build it against the libssh2 sources on their own, ideally with
+ * ThreadSanitizer:
+ *   cc -g -O1 -fsanitize=thread -I. -I"unit test" -DLIBSSH2_HAVE_ZLIB "unit test/threadstress.c" \
+ *      "unit test/sshstandin.c" channel.c comp.c crypt.c hostkey.c keepalive.c kex.c knownhost.c mac.c \
+ *      misc.c openssl.c packet.c pipeline.c pem.c publickey.c scp.c session.c sftp.c uring.c userauth.c \
+ *      -o threadstress -lcrypto -lz -lpthread
+ *
+ * Usage: threadstress [-s] [threads [rounds]]
+ */
+
+#include "libssh2_priv.h"
+#include "libssh2_sftp.h"
+#include "sshstandin.h"
+
+#include <sys/socket.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+
+#define STRESS_THREADS		8
+#define STRESS_ROUNDS		10000
+#define STRESS_TIMEOUT		10	/* seconds a round may take */
+#define STRESS_FIRST_TYPE	192	/* local extension range, nothing in libssh2_packet_add() claims these */
+#define STRESS_SFTP_THREADS	4
+#define STRESS_SFTP_ROUNDS	200
+#define STRESS_SFTP_SIZE	(64 * 1024)
+#define STRESS_SFTP_CHUNK	8192
+#define STRESS_SFTP_REKEY	(1024 * 1024)
+#define STRESS_SFTP_REOPEN	4		/* rounds per SFTP channel */
+#define STRESS_SFTP_FILE	"/stress/file000000.dat"
+#define STRESS_SFTP_UPLOAD	"/stress/upload.dat"
+
+static LIBSSH2_SESSION *stress_session;
+static int stress_peer_fd;
+static int stress_threads = STRESS_THREADS;
+static unsigned long stress_rounds = STRESS_ROUNDS;
+static pthread_barrier_t stress_round_done;
+static unsigned long stress_progress;
+
+/* {{{ stress_timeout
+ */
+static void stress_timeout(int sig)
+{
+	static const char message[] = "threadstress: no progress, a reader's wakeup was lost\n";
+	(void)sig;
+
+	write(2, message, sizeof(message) - 1);
+	_exit(1);
+}
+/* }}} */
+
+/* {{{ stress_write_all
+ */
+static int stress_write_all(int fd, const unsigned char *buf, size_t len)
+{
+	while (len) {
+		ssize_t written = write(fd, buf, len);
+
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		buf += written;
+		len -= written;
+	}
+	return 0;
+}
+/* }}} */
+
+/* {{{ stress_peer
+ * Sends each thread's packet for a round in shuffled order, then waits for all of them to arrive
+ * Plaintext framing: packet_length(4) padding_length(1) payload padding
+ */
+static void *stress_peer(void *arg)
+{
+	unsigned char *out, *s;
+	int *order;
+	unsigned long round, seed = 4242;
+	int i;
+	(void)arg;
+
+	out = malloc(stress_threads * 16);
+	order = malloc(stress_threads * sizeof(int));
+	if (!out || !order) {
+		abort();
+	}
+
+	for(round = 0; round < stress_rounds; round++) {
+		for(i = 0; i < stress_threads; i++) {
+			order[i] = i;
+		}
+		for(i = stress_threads - 1; i > 0; i--) {
+			int j, t;
+
+			seed = (seed * 1103515245 + 12345) & 0x7FFFFFFF;
+			j = (seed >> 16) % (i + 1);
+			t = order[i];
+			order[i] = order[j];
+			order[j] = t;
+		}
+
+		alarm(STRESS_TIMEOUT);
+
+		s = out;
+		for(i = 0; i < stress_threads; i++) {
+			libssh2_htonu32(s, 1 + 5 + 4);	/* padding_length + payload + padding */
+			s[4] = 4;
+			s[5] = STRESS_FIRST_TYPE + order[i];
+			libssh2_htonu32(s + 6, round);
+			memset(s + 10, 0, 4);
+			s += 14;
+		}
+		if (stress_write_all(stress_peer_fd, out, s - out)) {
+			perror("threadstress: peer write");
+			abort();
+		}
+		pthread_barrier_wait(&stress_round_done);
+	}
+
+	free(order);
+	free(out);
+	return NULL;
+}
+/* }}} */
+
+/* {{{ stress_worker
+ * Waits for every round of its own packet type, in order
+ */
+static void *stress_worker(void *arg)
+{
+	unsigned char type = STRESS_FIRST_TYPE + (int)(long)arg;
+	unsigned long round;
+
+	for(round = 0; round < stress_rounds; round++) {
+		unsigned char *data;
+		unsigned long data_len;
+
+		if (libssh2_packet_require(stress_session, type, &data, &data_len)) {
+			fprintf(stderr, "threadstress: type %d failed at round %lu\n", (int)type, round);
+			exit(1);
+		}
+		if (data_len != 5 || data[0] != type || libssh2_ntohu32(data + 1) != round) {
+			fprintf(stderr, "threadstress: type %d expected round %lu, got type %d round %lu\n",
+					(int)type, round, (int)data[0], data_len >= 5 ? libssh2_ntohu32(data + 1) : 0);
+			exit(1);
+		}
+		LIBSSH2_FREE(stress_session, data);
+		pthread_barrier_wait(&stress_round_done);
+	}
+
+	return NULL;
+}
+/* }}} */
+
+/* {{{ stress_sftp_worker
+ * Reads the file back whole and writes one, every round, over an SFTP channel of its own
+ */
+static void *stress_sftp_worker(void *arg)
+{
+	LIBSSH2_SFTP *sftp = NULL;
+	char buffer[STRESS_SFTP_CHUNK];
+	unsigned long round;
+	int worker = (int)(long)arg;
+
+	memset(buffer, 'a' + worker, sizeof(buffer));
+
+	for(round = 0; round < stress_rounds; round++) {
+		LIBSSH2_SFTP_HANDLE *handle;
+		unsigned long total = 0;
+		ssize_t got;
+
+		if (!(round % STRESS_SFTP_REOPEN)) {
+			if (sftp) {
+				libssh2_sftp_shutdown(sftp);
+			}
+			sftp = libssh2_sftp_init(stress_session);
+			if (!sftp) {
+				fprintf(stderr, "threadstress: worker %d couldn't start SFTP at round %lu\n", worker, round);
+				exit(1);
+			}
+		}
+
+		handle = libssh2_sftp_open(sftp, STRESS_SFTP_FILE, LIBSSH2_FXF_READ, 0);
+		if (!handle) {
+			fprintf(stderr, "threadstress: worker %d couldn't open for reading at round %lu\n", worker, round);
+			exit(1);
+		}
+		while ((got = (ssize_t)libssh2_sftp_read(handle, buffer, sizeof(buffer))) > 0) {
+			total += got;
+		}
+		libssh2_sftp_close(handle);
+		if (total != STRESS_SFTP_SIZE) {
+			fprintf(stderr, "threadstress: worker %d read %lu of %d bytes at round %lu\n", worker, total, STRESS_SFTP_SIZE, round);
+			exit(1);
+		}
+
+		handle = libssh2_sftp_open(sftp, STRESS_SFTP_UPLOAD, LIBSSH2_FXF_WRITE | LIBSSH2_FXF_CREAT | LIBSSH2_FXF_TRUNC, 0644);
+		if (!handle) {
+			fprintf(stderr, "threadstress: worker %d couldn't open for writing at round %lu\n", worker, round);
+			exit(1);
+		}
+		for(total = 0; total < STRESS_SFTP_SIZE; total += sizeof(buffer)) {
+			if (libssh2_sftp_write(handle, buffer, sizeof(buffer)) != sizeof(buffer)) {
+				fprintf(stderr, "threadstress: worker %d write failed at round %lu\n", worker, round);
+				exit(1);
+			}
+		}
+		libssh2_sftp_close(handle);
+
+		__sync_fetch_and_add(&stress_progress, 1);
+	}
+
+	if (sftp) {
+		libssh2_sftp_shutdown(sftp);
+	}
+	return NULL;
+}
+/* }}} */
+
+/* {{{ stress_sftp
+ */
+static int stress_sftp(void)
+{
+	standin_config config;
+	standin_conn conn;
+	LIBSSH2_SESSION_STATS stats;
+	pthread_t *workers;
+	unsigned long seen = 0, done, samples = 0;
+	int i;
+	double start, elapsed;
+	struct timespec ts;
+
+	memset(&config, 0, sizeof(config));
+	config.cipher = "aes128-cbc";
+	config.mac = "hmac-sha1";
+	config.file_size = STRESS_SFTP_SIZE;
+	config.dir_entries = 1;
+
+	if (standin_init() || standin_connect(&conn, &config)) {
+		fprintf(stderr, "threadstress: couldn't start the stand-in\n");
+		return 1;
+	}
+	stress_session = libssh2_session_init();
+	if (!stress_session || !(libssh2_session_flag(stress_session, LIBSSH2_FLAG_THREADED, 1) & LIBSSH2_FLAG_THREADED)) {
+		fprintf(stderr, "threadstress: couldn't set up a threaded session\n");
+		return 1;
+	}
+	libssh2_session_flag(stress_session, LIBSSH2_FLAG_FAIR_SCHEDULE, 1);
+	libssh2_session_rekey_limits(stress_session, STRESS_SFTP_REKEY, 0);
+	if (libssh2_session_startup(stress_session, conn.fd) || libssh2_userauth_password(stress_session, "stress", "stress")) {
+		char *message;
+
+		libssh2_session_last_error(stress_session, &message, NULL, 0);
+		fprintf(stderr, "threadstress: connect: %s\n", message);
+		return 1;
+	}
+
+	signal(SIGALRM, stress_timeout);
+	alarm(STRESS_TIMEOUT);
+
+	workers = malloc(stress_threads * sizeof(pthread_t));
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	start = ts.tv_sec + (ts.tv_nsec / 1e9);
+
+	for(i = 0; i < stress_threads; i++) {
+		pthread_create(&workers[i], NULL, stress_sftp_worker, (void *)(long)i);
+	}
+
+	/* Sample the counters while the workers run, they're being bumped from every thread */
+	while ((done = __sync_fetch_and_add(&stress_progress, 0)) < stress_rounds * stress_threads) {
+		if (done != seen) {
+			alarm(STRESS_TIMEOUT);
+			seen = done;
+		}
+		libssh2_session_stats(stress_session, &stats);
+		samples++;
+		usleep(1000);
+	}
+
+	for(i = 0; i < stress_threads; i++) {
+		pthread_join(workers[i], NULL);
+	}
+	alarm(0);
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	elapsed = ts.tv_sec + (ts.tv_nsec / 1e9) - start;
+	libssh2_session_stats(stress_session, &stats);
+	printf("%d SFTP channels, %lu rounds in %.2fs, %.0f rounds/s, %lu packets, %lu key exchanges, %lu counter samples\n",
+		   stress_threads, stress_rounds * stress_threads, elapsed, stress_rounds * stress_threads / elapsed,
+		   stats.packets_sent + stats.packets_received, stats.key_exchanges, samples);
+
+	free(workers);
+	libssh2_session_disconnect(stress_session, "done");
+	libssh2_session_free(stress_session);
+	standin_close(&conn);
+	standin_cleanup();
+	return 0;
+}
+/* }}} */
+
+int main(int argc, char *argv[])
+{
+	pthread_t peer, *workers;
+	int sv[2], i, sftp = 0;
+	double start, elapsed;
+	struct timespec ts;
+
+	if (argc > 1 && !strcmp(argv[1], "-s")) {
+		sftp = 1;
+		stress_threads = STRESS_SFTP_THREADS;
+		stress_rounds = STRESS_SFTP_ROUNDS;
+		argc--;
+		argv++;
+	}
+	if (argc > 1) {
+		stress_threads = atoi(argv[1]);
+	}
+	if (argc > 2) {
+		stress_rounds = strtoul(argv[2], NULL, 10);
+	}
+	if (sftp) {
+		if (stress_threads < 2 || stress_threads > 8) {
+			fprintf(stderr, "threadstress: between 2 and 8 threads with -s\n");
+			return 1;
+		}
+		return stress_sftp();
+	}
+	if (stress_threads < 2 || stress_threads > 256 - STRESS_FIRST_TYPE) {
+		fprintf(stderr, "threadstress: between 2 and %d threads\n", 256 - STRESS_FIRST_TYPE);
+		return 1;
+	}
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) {
+		perror("threadstress: socketpair");
+		return 1;
+	}
+
+	/* Nothing is ever sent to the peer, so the session can skip the banner and key exchange
+	 * and read in plaintext mode straight away */
+	stress_session = libssh2_session_init();
+	if (!stress_session || !(libssh2_session_flag(stress_session, LIBSSH2_FLAG_THREADED, 1) & LIBSSH2_FLAG_THREADED)) {
+		fprintf(stderr, "threadstress: couldn't set up a threaded session\n");
+		return 1;
+	}
+	stress_session->socket_fd = sv[0];
+	stress_peer_fd = sv[1];
+
+	pthread_barrier_init(&stress_round_done, NULL, stress_threads + 1);
+	signal(SIGALRM, stress_timeout);
+
+	workers = malloc(stress_threads * sizeof(pthread_t));
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	start = ts.tv_sec + (ts.tv_nsec / 1e9);
+
+	for(i = 0; i < stress_threads; i++) {
+		pthread_create(&workers[i], NULL, stress_worker, (void *)(long)i);
+	}
+	pthread_create(&peer, NULL, stress_peer, NULL);
+
+	pthread_join(peer, NULL);
+	for(i = 0; i < stress_threads; i++) {
+		pthread_join(workers[i], NULL);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	elapsed = ts.tv_sec + (ts.tv_nsec / 1e9) - start;
+	printf("%d threads, %lu packets in %.2fs, %.0f packets/s\n", stress_threads,
+		   stress_rounds * stress_threads, elapsed, stress_rounds * stress_threads / elapsed);
+
+	free(workers);
+	pthread_barrier_destroy(&stress_round_done);
+	libssh2_session_free(stress_session);
+	close(sv[1]);
+	return 0;
+}
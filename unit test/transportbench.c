@@ -0,0 +1,309 @@
+/*
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ *   Redistributions of source code must retain the above
+ *   copyright notice, this list of conditions and the
+ *   following disclaimer.
+ *
+ *   Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following
+ *   disclaimer in the documentation and/or other materials
+ *   provided with the distribution.
+ *
+ *   Neither the name of the copyright holder nor the names
+ *   of any other contributors may be used to endorse or
+ *   promote products derived from this software without
+ *   specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+
+/* Transport comparison over loopback TCP: the BSD socket calls against libssh2_session_io_uring()
+ * A peer thread at the far end of the connection streams plaintext packets in (read) or drains the ones
+ * libssh2_packet_write() sends out (write), so the figures are the transport's, not a cipher's. Packets
+ * are taken with libssh2_packet_require() one at a time, as the channel and SFTP code takes them
+ *
+ * Not part of the framework target, build it against the libssh2 sources on their own (Linux 6.0 or
+ * later for the io_uring rows):
+ *   cc -O2 -I. -DLIBSSH2_HAVE_ZLIB "unit test/transportbench.c" channel.c comp.c crypt.c hostkey.c \
+ *      keepalive.c kex.c knownhost.c mac.c misc.c openssl.c packet.c pipeline.c pem.c publickey.c scp.c session.c \
+ *      sftp.c uring.c userauth.c -o transportbench -lcrypto -lz -lpthread
+ *
+ * Usage: transportbench [packets]
+ * One line per transport, direction and payload size: MB/s, packets/s, and the system calls libssh2
+ * made per packet (LIBSSH2_SESSION_STATS transport_syscalls; the peer's own aren't counted)
+ */
+
+#include "libssh2_priv.h"
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <unistd.h>
+
+#define BENCH_PACKETS		100000
+#define BENCH_TYPE			192		/* local extension range, nothing in libssh2_packet_add() claims it */
+
+typedef struct _bench_peer {
+	int fd;
+	unsigned long payload, packets;
+	int failed;
+} bench_peer;
+
+/* {{{ bench_now
+ */
+static double bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+/* }}} */
+
+/* {{{ bench_packet_len
+ * Bytes on the wire for a plaintext packet, padded to 8 with at least 4 as libssh2_packet_write() does
+ */
+static unsigned long bench_packet_len(unsigned long payload)
+{
+	unsigned long padding = 8 - ((4 + 1 + payload) % 8);
+
+	if (padding < 4) {
+		padding += 8;
+	}
+	return 4 + 1 + payload + padding;
+}
+/* }}} */
+
+/* {{{ bench_connect
+ * Both ends of a loopback TCP connection
+ */
+static int bench_connect(int *local, int *remote)
+{
+	struct sockaddr_in sin;
+	socklen_t sin_len = sizeof(sin);
+	int listener, one = 1;
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	listener = socket(AF_INET, SOCK_STREAM, 0);
+	if (listener < 0 || bind(listener, (struct sockaddr *)&sin, sizeof(sin)) || listen(listener, 1) ||
+		getsockname(listener, (struct sockaddr *)&sin, &sin_len)) {
+		return -1;
+	}
+	*local = socket(AF_INET, SOCK_STREAM, 0);
+	if (*local < 0 || connect(*local, (struct sockaddr *)&sin, sizeof(sin))) {
+		return -1;
+	}
+	*remote = accept(listener, NULL, NULL);
+	close(listener);
+	if (*remote < 0) {
+		return -1;
+	}
+	setsockopt(*local, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	setsockopt(*remote, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	return 0;
+}
+/* }}} */
+
+/* {{{ bench_sender
+ * Peer for the read test, plaintext framing: packet_length(4) padding_length(1) payload padding
+ * Packets go out in batches of up to 64K, as a remote end streaming data would send them
+ */
+static void *bench_sender(void *arg)
+{
+	bench_peer *peer = arg;
+	unsigned long packet_len = bench_packet_len(peer->payload), per_batch, sent = 0, i;
+	unsigned char *batch, *s;
+
+	per_batch = 65536 / packet_len;
+	if (!per_batch) {
+		per_batch = 1;
+	}
+	batch = calloc(per_batch, packet_len);
+	for(i = 0, s = batch; i < per_batch; i++, s += packet_len) {
+		libssh2_htonu32(s, packet_len - 4);
+		s[4] = packet_len - 5 - peer->payload;
+		s[5] = BENCH_TYPE;
+	}
+
+	while (sent < peer->packets) {
+		unsigned long n = (peer->packets - sent < per_batch) ? peer->packets - sent : per_batch;
+		unsigned char *p = batch;
+		size_t left = n * packet_len;
+
+		while (left) {
+			ssize_t written = write(peer->fd, p, left);
+
+			if (written < 0) {
+				if (errno == EINTR) {
+					continue;
+				}
+				peer->failed = 1;
+				free(batch);
+				return NULL;
+			}
+			p += written;
+			left -= written;
+		}
+		sent += n;
+	}
+
+	free(batch);
+	return NULL;
+}
+/* }}} */
+
+/* {{{ bench_drainer
+ * Peer for the write test, reads until everything libssh2 is due to send has arrived
+ */
+static void *bench_drainer(void *arg)
+{
+	bench_peer *peer = arg;
+	unsigned long long due = (unsigned long long)peer->packets * bench_packet_len(peer->payload), got = 0;
+	unsigned char buf[65536];
+
+	while (got < due) {
+		ssize_t n = read(peer->fd, buf, sizeof(buf));
+
+		if (n <= 0) {
+			if (n < 0 && errno == EINTR) {
+				continue;
+			}
+			peer->failed = 1;
+			break;
+		}
+		got += n;
+	}
+
+	return NULL;
+}
+/* }}} */
+
+/* {{{ bench_run
+ * One transport, direction and payload size
+ */
+static int bench_run(const char *transport, int use_uring, int writing, unsigned long payload, unsigned long packets)
+{
+	LIBSSH2_SESSION *session;
+	LIBSSH2_SESSION_STATS stats;
+	bench_peer peer;
+	pthread_t thread;
+	unsigned char *out = NULL;
+	unsigned long i;
+	double start, elapsed;
+	int local, remote;
+
+	if (bench_connect(&local, &remote)) {
+		perror("transportbench: loopback connection");
+		return -1;
+	}
+
+	/* Nothing is exchanged but test packets, so the session can skip the banner and key exchange
+	 * and work in plaintext mode straight away */
+	session = libssh2_session_init();
+	if (!session) {
+		return -1;
+	}
+	if (use_uring && libssh2_session_io_uring(session, 64)) {
+		printf("%-9s %-6s %6lu  unavailable\n", transport, writing ? "write" : "read", payload);
+		libssh2_session_free(session);
+		close(local);
+		close(remote);
+		return 0;
+	}
+	session->socket_fd = local;
+
+	peer.fd = remote;
+	peer.payload = payload;
+	peer.packets = packets;
+	peer.failed = 0;
+
+	if (writing) {
+		out = calloc(1, payload);
+		out[0] = BENCH_TYPE;
+	}
+
+	libssh2_session_stats_reset(session);
+	start = bench_now();
+	pthread_create(&thread, NULL, writing ? bench_drainer : bench_sender, &peer);
+
+	for(i = 0; i < packets; i++) {
+		if (writing) {
+			if (libssh2_packet_write(session, out, payload)) {
+				fprintf(stderr, "transportbench: %s write failed at packet %lu\n", transport, i);
+				return -1;
+			}
+		} else {
+			unsigned char *data;
+			unsigned long data_len;
+
+			if (libssh2_packet_require(session, BENCH_TYPE, &data, &data_len) || data_len != payload) {
+				fprintf(stderr, "transportbench: %s read failed at packet %lu\n", transport, i);
+				return -1;
+			}
+			LIBSSH2_FREE(session, data);
+		}
+	}
+
+	pthread_join(thread, NULL);
+	elapsed = bench_now() - start;
+	libssh2_session_stats(session, &stats);
+	if (peer.failed) {
+		fprintf(stderr, "transportbench: %s peer failed\n", transport);
+		return -1;
+	}
+
+	printf("%-9s %-6s %6lu %10.1f %12.0f %10.3f\n", transport, writing ? "write" : "read", payload,
+		   packets * (double)payload / elapsed / 1e6, packets / elapsed, (double)stats.transport_syscalls / packets);
+
+	free(out);
+	libssh2_session_free(session);
+	close(local);
+	close(remote);
+	return 0;
+}
+/* }}} */
+
+int main(int argc, char *argv[])
+{
+	static const unsigned long payloads[] = { 64, 1024, 16384, 32000 };
+	unsigned long packets = BENCH_PACKETS;
+	int writing, i;
+
+	if (argc > 1) {
+		packets = strtoul(argv[1], NULL, 10);
+	}
+
+	printf("%-9s %-6s %6s %10s %12s %10s\n", "transport", "dir", "bytes", "MB/s", "packets/s", "syscalls");
+	for(writing = 0; writing < 2; writing++) {
+		for(i = 0; i < (int)(sizeof(payloads) / sizeof(payloads[0])); i++) {
+			if (bench_run("bsd", 0, writing, payloads[i], packets) ||
+				bench_run("io_uring", 1, writing, payloads[i], packets)) {
+				return 1;
+			}
+		}
+	}
+
+	return 0;
+}
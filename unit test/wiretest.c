@@ -0,0 +1,667 @@
+/*
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ *   Redistributions of source code must retain the above
+ *   copyright notice, this list of conditions and the
+ *   following disclaimer.
+ *
+ *   Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following
+ *   disclaimer in the documentation and/or other materials
+ *   provided with the distribution.
+ *
+ *   Neither the name of the copyright holder nor the names
+ *   of any other contributors may be used to endorse or
+ *   promote products derived from this software without
+ *   specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+
+/* Malformed input test for the wire codec (wire.h) and the parsers built on it
+ * Each well formed message is cut short at every length in turn, and random ones are thrown at the
+ * same parsers, each in a buffer allocated to its exact length so that an overread lands outside it
+ * (build with -fsanitize=address to have one reported):
+ *   reader     byte, u32, u64 and string fields, and string lengths that run past the end
+ *   writer     the same message into buffers too small for it
+ *   bin2attr   libssh2_sftp_bin2attr() on every combination of attribute flags
+ *   names      libssh2_sftp_readdir_name() on an FXP_NAME entry, into exact and short buffers
+ *   channel    truncated CHANNEL_DATA and CHANNEL_EXTENDED_DATA packets fed to libssh2_packet_add(),
+ *              through a session reading plaintext from a socketpair as threadstress does
+ * Then prints what a parse of each costs
+ *
+ * Not part of the framework target, build it against the libssh2 sources on their own; sftp.c is
+ * included rather than linked, for its static parsers:
+ *   cc -g -O2 -fsanitize=address -I. -DLIBSSH2_HAVE_ZLIB "unit test/wiretest.c" channel.c comp.c crypt.c \
+ *      hostkey.c keepalive.c kex.c knownhost.c mac.c misc.c openssl.c packet.c pipeline.c pem.c publickey.c scp.c \
+ *      session.c uring.c userauth.c -o wiretest -lcrypto -lz -lpthread
+ *
+ * Usage: wiretest [iterations]
+ */
+
+#include "sftp.c"
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define TEST_ITERATIONS		100000
+#define TEST_CHANNEL_ID		7
+#define TEST_SENTINEL		192		/* local extension range, marks the end of the channel packets */
+
+/* byte 0x42, u32, string "hello", u64, empty string, byte 0x07 */
+static const unsigned char test_message[] = {
+	0x42,
+	0xDE, 0xAD, 0xBE, 0xEF,
+	0x00, 0x00, 0x00, 0x05, 'h', 'e', 'l', 'l', 'o',
+	0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08,
+	0x00, 0x00, 0x00, 0x00,
+	0x07
+};
+/* where each field ends */
+static const unsigned long test_message_ends[] = { 1, 5, 14, 22, 26, 27 };
+
+#define TEST_FIELDS			(sizeof(test_message_ends) / sizeof(test_message_ends[0]))
+
+static int test_failures;
+static unsigned long test_seed = 20250101;
+
+/* {{{ test_fail
+ */
+static void test_fail(const char *what, unsigned long len)
+{
+	fprintf(stderr, "wiretest: %s at %lu bytes\n", what, len);
+	test_failures++;
+}
+/* }}} */
+
+/* {{{ test_random
+ */
+static unsigned long test_random(void)
+{
+	test_seed = (test_seed * 1103515245 + 12345) & 0x7FFFFFFF;
+	return test_seed >> 8;
+}
+/* }}} */
+
+/* {{{ test_now
+ */
+static double test_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+/* }}} */
+
+/* {{{ test_copy
+ * len bytes of src in an allocation of exactly that size
+ */
+static unsigned char *test_copy(const unsigned char *src, unsigned long len)
+{
+	unsigned char *buf = malloc(len ? len : 1);
+
+	if (!buf) {
+		fprintf(stderr, "wiretest: out of memory\n");
+		exit(1);
+	}
+	memcpy(buf, src, len);
+	return buf;
+}
+/* }}} */
+
+/* {{{ test_read_field
+ * Reads field n of test_message, checking what it gives back when it succeeds
+ */
+static int test_read_field(libssh2_wire_reader *r, int n, unsigned long len)
+{
+	const unsigned char *str;
+	unsigned long val, str_len;
+	libssh2_uint64_t val64;
+	unsigned char byte;
+
+	switch (n) {
+		case 0:
+		case 5:
+			if (libssh2_wire_get_byte(r, &byte)) {
+				return -1;
+			}
+			if (byte != (n ? 0x07 : 0x42)) {
+				test_fail("reader: wrong byte", len);
+			}
+			return 0;
+		case 1:
+			if (libssh2_wire_get_u32(r, &val)) {
+				return -1;
+			}
+			if (val != 0xDEADBEEFUL) {
+				test_fail("reader: wrong u32", len);
+			}
+			return 0;
+		case 3:
+			if (libssh2_wire_get_u64(r, &val64)) {
+				return -1;
+			}
+			if (val64 != (((libssh2_uint64_t)0x01020304 << 32) | 0x05060708)) {
+				test_fail("reader: wrong u64", len);
+			}
+			return 0;
+		default:
+			if (libssh2_wire_get_string(r, &str, &str_len)) {
+				return -1;
+			}
+			if ((n == 2) ? (str_len != 5 || memcmp(str, "hello", 5)) : (str_len != 0)) {
+				test_fail("reader: wrong string", len);
+			}
+			return 0;
+	}
+}
+/* }}} */
+
+/* {{{ test_reader
+ */
+static void test_reader(unsigned long iterations)
+{
+	static const unsigned long lengths[] = { 0xFFFFFFFFUL, 0xFFFFFFFCUL, 0x80000000UL, 5, 1 };
+	unsigned long len, i;
+
+	/* Every field wholly inside the buffer reads, the first that isn't fails and leaves the position alone */
+	for(len = 0; len <= sizeof(test_message); len++) {
+		unsigned char *buf = test_copy(test_message, len);
+		libssh2_wire_reader r;
+		unsigned int n;
+
+		libssh2_wire_reader_init(&r, buf, len);
+		for(n = 0; n < TEST_FIELDS; n++) {
+			const unsigned char *before = r.p;
+
+			if (test_read_field(&r, n, len)) {
+				if (test_message_ends[n] <= len) {
+					test_fail("reader: a whole field failed", len);
+				}
+				if (r.p != before) {
+					test_fail("reader: a failed get moved the position", len);
+				}
+				break;
+			}
+			if (test_message_ends[n] > len) {
+				test_fail("reader: read past the end", len);
+			}
+		}
+		free(buf);
+	}
+
+	/* String lengths that don't fit what's left */
+	for(i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+		unsigned char raw[8], *buf;
+		const unsigned char *str;
+		unsigned long str_len;
+		libssh2_wire_reader r;
+
+		libssh2_htonu32(raw, lengths[i]);
+		memset(raw + 4, 'x', 4);
+		len = 4 + (lengths[i] > 4 ? 4 : lengths[i] - 1);
+		buf = test_copy(raw, len);
+		libssh2_wire_reader_init(&r, buf, len);
+		if (!libssh2_wire_get_string(&r, &str, &str_len)) {
+			test_fail("reader: string longer than the buffer accepted", lengths[i]);
+		}
+		free(buf);
+	}
+
+	/* Random buffers, random gets; nothing may end up outside the buffer */
+	for(i = 0; i < iterations; i++) {
+		unsigned char raw[64], *buf;
+		libssh2_wire_reader r;
+		unsigned long j;
+
+		len = test_random() % (sizeof(raw) + 1);
+		for(j = 0; j < len; j++) {
+			/* mostly small bytes, so string lengths sometimes fit */
+			raw[j] = (test_random() % 4) ? (test_random() % 8) : test_random();
+		}
+		buf = test_copy(raw, len);
+		libssh2_wire_reader_init(&r, buf, len);
+		for(j = 0; j < 16; j++) {
+			const unsigned char *str;
+			unsigned long val;
+			libssh2_uint64_t val64;
+			unsigned char byte;
+
+			switch (test_random() % 5) {
+				case 0: libssh2_wire_get_byte(&r, &byte); break;
+				case 1: libssh2_wire_get_u32(&r, &val); break;
+				case 2: libssh2_wire_get_u64(&r, &val64); break;
+				case 3: libssh2_wire_skip(&r, test_random() % 8); break;
+				default:
+					if (!libssh2_wire_get_string(&r, &str, &val) && (str < buf || str + val > buf + len)) {
+						test_fail("reader: string outside the buffer", len);
+					}
+					break;
+			}
+			if (r.p < buf || r.p > buf + len) {
+				test_fail("reader: position outside the buffer", len);
+				break;
+			}
+		}
+		free(buf);
+	}
+}
+/* }}} */
+
+/* {{{ test_writer
+ */
+static void test_writer(void)
+{
+	unsigned long len;
+
+	for(len = 0; len <= sizeof(test_message); len++) {
+		unsigned char *buf = test_copy(test_message, len);
+		libssh2_wire_writer w;
+		unsigned int n;
+
+		memset(buf, 0, len);
+		libssh2_wire_writer_init(&w, buf, len);
+		for(n = 0; n < TEST_FIELDS; n++) {
+			unsigned char *before = w.p;
+			int bad;
+
+			switch (n) {
+				case 0: bad = libssh2_wire_put_byte(&w, 0x42); break;
+				case 1: bad = libssh2_wire_put_u32(&w, 0xDEADBEEFUL); break;
+				case 2: bad = libssh2_wire_put_string(&w, (const unsigned char *)"hello", 5); break;
+				case 3: bad = libssh2_wire_put_u64(&w, ((libssh2_uint64_t)0x01020304 << 32) | 0x05060708); break;
+				case 4: bad = libssh2_wire_put_string(&w, (const unsigned char *)"", 0); break;
+				default: bad = libssh2_wire_put_byte(&w, 0x07); break;
+			}
+			if (bad) {
+				if (test_message_ends[n] <= len) {
+					test_fail("writer: a field with room failed", len);
+				}
+				if (w.p != before) {
+					test_fail("writer: a failed put moved the position", len);
+				}
+				break;
+			}
+			if (test_message_ends[n] > len) {
+				test_fail("writer: wrote past the end", len);
+			}
+		}
+		if ((n == TEST_FIELDS) && memcmp(buf, test_message, len)) {
+			test_fail("writer: wrong bytes", len);
+		}
+		free(buf);
+	}
+}
+/* }}} */
+
+/* {{{ test_byteorder
+ * The inline accessors against plain shifting, at every alignment
+ */
+static void test_byteorder(unsigned long iterations)
+{
+	unsigned char buf[16];
+	unsigned long i;
+
+	for(i = 0; i < iterations; i++) {
+		unsigned long val = (test_random() << 8) ^ test_random(), ofs = i % 8;
+		libssh2_uint64_t val64 = ((libssh2_uint64_t)val << 32) | (test_random() ^ (test_random() << 16));
+		libssh2_uint64_t expected64 = 0;
+		int j;
+
+		val &= 0xFFFFFFFFUL;
+		libssh2_htonu32(buf + ofs, val);
+		if (buf[ofs] != ((val >> 24) & 0xFF) || buf[ofs + 1] != ((val >> 16) & 0xFF) ||
+			buf[ofs + 2] != ((val >> 8) & 0xFF) || buf[ofs + 3] != (val & 0xFF) || libssh2_ntohu32(buf + ofs) != val) {
+			test_fail("byteorder: u32 mismatch", ofs);
+			return;
+		}
+		libssh2_htonu64(buf + ofs, val64);
+		for(j = 0; j < 8; j++) {
+			expected64 = (expected64 << 8) | buf[ofs + j];
+		}
+		if (expected64 != val64 || libssh2_ntohu64(buf + ofs) != val64) {
+			test_fail("byteorder: u64 mismatch", ofs);
+			return;
+		}
+	}
+}
+/* }}} */
+
+/* {{{ test_attrs
+ */
+static void test_attrs(unsigned long flags, LIBSSH2_SFTP_ATTRIBUTES *attrs)
+{
+	memset(attrs, 0, sizeof(LIBSSH2_SFTP_ATTRIBUTES));
+	attrs->flags = flags;
+	if (flags & LIBSSH2_SFTP_ATTR_SIZE) {
+		attrs->filesize = ((libssh2_uint64_t)0x12345 << 32) | 0x6789ABCD;
+	}
+	if (flags & LIBSSH2_SFTP_ATTR_UIDGID) {
+		attrs->uid = 1000;
+		attrs->gid = 100;
+	}
+	if (flags & LIBSSH2_SFTP_ATTR_PERMISSIONS) {
+		attrs->permissions = 0100644;
+	}
+	if (flags & LIBSSH2_SFTP_ATTR_ACMODTIME) {
+		attrs->atime = 1700000000;
+		attrs->mtime = 1700000001;
+	}
+}
+/* }}} */
+
+/* {{{ test_bin2attr
+ */
+static void test_bin2attr(unsigned long iterations)
+{
+	unsigned long flags, len, i;
+
+	for(flags = 0; flags < 16; flags++) {
+		LIBSSH2_SFTP_ATTRIBUTES attrs, parsed;
+		unsigned char raw[64];
+		int full;
+
+		test_attrs(flags, &attrs);
+		full = libssh2_sftp_attr2bin(raw, &attrs);
+		memset(raw + full, 0xEE, sizeof(raw) - full);
+
+		for(len = 0; len <= (unsigned long)full + 4; len++) {
+			unsigned char *buf = test_copy(raw, len);
+			int ret = libssh2_sftp_bin2attr(&parsed, buf, len);
+
+			if (len < (unsigned long)full ? (ret != -1) : (ret != full)) {
+				test_fail("bin2attr: wrong length consumed", len);
+			} else if ((ret == full) && memcmp(&attrs, &parsed, sizeof(attrs))) {
+				test_fail("bin2attr: attributes differ", len);
+			}
+			free(buf);
+		}
+	}
+
+	for(i = 0; i < iterations; i++) {
+		LIBSSH2_SFTP_ATTRIBUTES parsed;
+		unsigned char raw[48], *buf;
+		unsigned long j;
+		int ret;
+
+		len = test_random() % (sizeof(raw) + 1);
+		for(j = 0; j < len; j++) {
+			raw[j] = test_random();
+		}
+		if (len >= 4) {
+			/* Unknown bits too, EXTENDED included */
+			libssh2_htonu32(raw, (test_random() % 16) | ((test_random() % 4) ? 0 : 0x80000000UL));
+		}
+		buf = test_copy(raw, len);
+		ret = libssh2_sftp_bin2attr(&parsed, buf, len);
+		if (ret > (int)len || ret < -1) {
+			test_fail("bin2attr: consumed more than it was given", len);
+		}
+		free(buf);
+	}
+}
+/* }}} */
+
+/* {{{ test_name_entry
+ * An FXP_NAME entry: filename, longname, attrs; returns its length
+ */
+static unsigned long test_name_entry(unsigned char *raw, unsigned long size, const char *filename, unsigned long flags)
+{
+	LIBSSH2_SFTP_ATTRIBUTES attrs;
+	libssh2_wire_writer w;
+	unsigned char attrs_raw[64];
+	int attrs_len;
+
+	test_attrs(flags, &attrs);
+	attrs_len = libssh2_sftp_attr2bin(attrs_raw, &attrs);
+
+	libssh2_wire_writer_init(&w, raw, size);
+	libssh2_wire_put_string(&w, (const unsigned char *)filename, strlen(filename));
+	libssh2_wire_put_string(&w, (const unsigned char *)"-rw-r--r-- 1 u g 0 Jan 1 00:00 x", 32);
+	memcpy(w.p, attrs_raw, attrs_len);
+
+	return (w.p - raw) + attrs_len;
+}
+/* }}} */
+
+/* {{{ test_names
+ */
+static void test_names(unsigned long iterations)
+{
+	unsigned char raw[256];
+	unsigned long full, len, maxlen, i;
+
+	full = test_name_entry(raw, sizeof(raw), "file000042.dat", 0x0F);
+
+	for(len = 0; len <= full; len++) {
+		unsigned char *buf = test_copy(raw, len);
+		LIBSSH2_SFTP_ATTRIBUTES attrs;
+		libssh2_wire_reader r;
+		char filename[15];
+		int ret;
+
+		libssh2_wire_reader_init(&r, buf, len);
+		ret = libssh2_sftp_readdir_name(&r, filename, sizeof(filename), &attrs);
+		if (len < full ? (ret != -1) : (ret != 14 || strcmp(filename, "file000042.dat") || libssh2_wire_left(&r))) {
+			test_fail("names: wrong result", len);
+		}
+		free(buf);
+	}
+
+	/* Names longer than the caller's buffer are cut to fit, and only terminated when there's room */
+	for(maxlen = 1; maxlen <= 16; maxlen++) {
+		LIBSSH2_SFTP_ATTRIBUTES attrs;
+		libssh2_wire_reader r;
+		char *filename = malloc(maxlen);
+		int ret;
+
+		libssh2_wire_reader_init(&r, raw, full);
+		ret = libssh2_sftp_readdir_name(&r, filename, maxlen, &attrs);
+		if ((ret != (int)(maxlen < 14 ? maxlen : 14)) || memcmp(filename, "file000042.dat", ret) ||
+			((maxlen > 14) && filename[14])) {
+			test_fail("names: wrong truncation", maxlen);
+		}
+		free(filename);
+	}
+
+	for(i = 0; i < iterations; i++) {
+		LIBSSH2_SFTP_ATTRIBUTES attrs;
+		libssh2_wire_reader r;
+		unsigned char *buf;
+		char filename[32];
+		unsigned long j;
+
+		len = test_name_entry(raw, sizeof(raw), "name", test_random() % 16);
+		/* Corrupt a few bytes, then cut it somewhere */
+		for(j = test_random() % 4; j > 0; j--) {
+			raw[test_random() % len] = (test_random() % 2) ? test_random() : 0xFF;
+		}
+		len = test_random() % (len + 1);
+		buf = test_copy(raw, len);
+		libssh2_wire_reader_init(&r, buf, len);
+		if ((libssh2_sftp_readdir_name(&r, filename, sizeof(filename), &attrs) > (int)sizeof(filename)) ||
+			(r.p < buf) || (r.p > buf + len)) {
+			test_fail("names: parsed outside the buffer", len);
+		}
+		free(buf);
+	}
+}
+/* }}} */
+
+/* {{{ test_send_packet
+ * Plaintext framing: packet_length(4) padding_length(1) payload padding(4)
+ */
+static void test_send_packet(int fd, const unsigned char *payload, unsigned long len)
+{
+	unsigned char frame[64];
+
+	libssh2_htonu32(frame, 1 + len + 4);
+	frame[4] = 4;
+	memcpy(frame + 5, payload, len);
+	memset(frame + 5 + len, 0, 4);
+	if (write(fd, frame, 5 + len + 4) != (ssize_t)(5 + len + 4)) {
+		perror("wiretest: peer write");
+		exit(1);
+	}
+}
+/* }}} */
+
+/* {{{ test_channel
+ * Only whole headers make it into the brigade, and only the declared length counts as data
+ */
+static void test_channel(void)
+{
+	static const unsigned char truncated[][16] = {
+		{ 1, SSH_MSG_CHANNEL_DATA },
+		{ 3, SSH_MSG_CHANNEL_DATA, 0, 0 },
+		{ 7, SSH_MSG_CHANNEL_DATA, 0, 0, 0, TEST_CHANNEL_ID, 0, 0 },
+		{ 15, SSH_MSG_CHANNEL_DATA, 0, 0, 0, TEST_CHANNEL_ID, 0, 0, 0, 100, 'a', 'b', 'c', 'd', 'e', 'f' },
+		{ 9, SSH_MSG_CHANNEL_DATA, 0, 0, 0, TEST_CHANNEL_ID, 0xFF, 0xFF, 0xFF, 0xFF },
+		{ 11, SSH_MSG_CHANNEL_EXTENDED_DATA, 0, 0, 0, TEST_CHANNEL_ID, 0, 0, 0, 1, 'x', 'y' },
+		{ 10, SSH_MSG_CHANNEL_DATA, 0, 0, 0, 99, 0, 0, 0, 1, 'x' },
+	};
+	/* Three bytes trailing the declared length */
+	static const unsigned char extended[] = { SSH_MSG_CHANNEL_EXTENDED_DATA, 0, 0, 0, TEST_CHANNEL_ID, 0, 0, 0, 1,
+											  0, 0, 0, 5, 'h', 'e', 'l', 'l', 'o', 'j', 'n', 'k' };
+	static const unsigned char data[] = { SSH_MSG_CHANNEL_DATA, 0, 0, 0, TEST_CHANNEL_ID, 0, 0, 0, 3, 'a', 'b', 'c' };
+	static const unsigned char sentinel[] = { TEST_SENTINEL };
+	LIBSSH2_SESSION *session;
+	LIBSSH2_CHANNEL *channel;
+	LIBSSH2_PACKET *packet;
+	unsigned char *reply;
+	unsigned long reply_len, i;
+	int sv[2], count = 0;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) {
+		perror("wiretest: socketpair");
+		exit(1);
+	}
+	/* Nothing is sent to the peer, so the session can read plaintext straight away */
+	session = libssh2_session_init();
+	channel = session ? LIBSSH2_ALLOC(session, sizeof(LIBSSH2_CHANNEL)) : NULL;
+	if (!channel) {
+		fprintf(stderr, "wiretest: couldn't set up a session\n");
+		exit(1);
+	}
+	session->socket_fd = sv[0];
+	memset(channel, 0, sizeof(LIBSSH2_CHANNEL));
+	channel->session = session;
+	channel->blocking = 1;
+	channel->local.id = TEST_CHANNEL_ID;
+	channel->remote.window_size = channel->remote.window_size_initial = 65536;
+	channel->remote.packet_size = 32768;
+	session->channels.head = session->channels.tail = channel;
+
+	for(i = 0; i < sizeof(truncated) / sizeof(truncated[0]); i++) {
+		test_send_packet(sv[1], truncated[i] + 1, truncated[i][0]);
+	}
+	test_send_packet(sv[1], extended, sizeof(extended));
+	test_send_packet(sv[1], data, sizeof(data));
+	test_send_packet(sv[1], sentinel, sizeof(sentinel));
+
+	if (libssh2_packet_require(session, TEST_SENTINEL, &reply, &reply_len)) {
+		test_fail("channel: packets not read", 0);
+	} else {
+		LIBSSH2_FREE(session, reply);
+	}
+
+	for(packet = session->packets.head; packet; packet = packet->next, count++) {
+		const unsigned char *want = (count == 0) ? (const unsigned char *)"hello" : (const unsigned char *)"abc";
+		unsigned long want_len = (count == 0) ? 5 : 3;
+
+		if ((count > 1) || (packet->data_len - packet->data_head != want_len) ||
+			memcmp(packet->data + packet->data_head, want, want_len)) {
+			test_fail("channel: wrong data in the brigade", packet->data_len);
+		}
+	}
+	if (count != 2) {
+		test_fail("channel: wrong number of packets kept", count);
+	}
+	if (channel->remote.window_size != 65536 - 8) {
+		test_fail("channel: window charged for bytes that weren't data", channel->remote.window_size);
+	}
+
+	while (session->packets.head) {
+		packet = session->packets.head;
+		session->packets.head = packet->next;
+		LIBSSH2_FREE(session, packet->data);
+		LIBSSH2_FREE(session, packet);
+	}
+	session->packets.tail = NULL;
+	session->channels.head = session->channels.tail = NULL;
+	LIBSSH2_FREE(session, channel);
+	libssh2_session_free(session);
+	close(sv[0]);
+	close(sv[1]);
+}
+/* }}} */
+
+int main(int argc, char *argv[])
+{
+	LIBSSH2_SFTP_ATTRIBUTES attrs;
+	unsigned char raw[256], attrs_raw[64];
+	unsigned long iterations = TEST_ITERATIONS, entry_len, i, sum = 0;
+	double start, u32_time, attrs_time, name_time;
+	char filename[64];
+
+	if (argc > 1) {
+		iterations = strtoul(argv[1], NULL, 10);
+	}
+
+	test_reader(iterations);
+	test_writer();
+	test_byteorder(iterations);
+	test_bin2attr(iterations);
+	test_names(iterations);
+	test_channel();
+
+	/* What a parse costs, over a buffer of u32s and the all-flags attribute block and name entry */
+	test_attrs(0x0F, &attrs);
+	libssh2_sftp_attr2bin(attrs_raw, &attrs);
+	entry_len = test_name_entry(raw, sizeof(raw), "file000042.dat", 0x0F);
+
+	start = test_now();
+	for(i = 0; i < iterations * 100; i++) {
+		sum += libssh2_ntohu32(raw + (i & 127));
+	}
+	u32_time = test_now() - start;
+
+	start = test_now();
+	for(i = 0; i < iterations * 10; i++) {
+		sum += libssh2_sftp_bin2attr(&attrs, attrs_raw, sizeof(attrs_raw));
+	}
+	attrs_time = test_now() - start;
+
+	start = test_now();
+	for(i = 0; i < iterations * 10; i++) {
+		libssh2_wire_reader r;
+
+		libssh2_wire_reader_init(&r, raw, entry_len);
+		sum += libssh2_sftp_readdir_name(&r, filename, sizeof(filename), &attrs);
+	}
+	name_time = test_now() - start;
+
+	printf("ntohu32 %.2fns, bin2attr %.1fns, FXP_NAME entry %.1fns (checksum %lu)\n",
+		   u32_time * 1e9 / (iterations * 100), attrs_time * 1e9 / (iterations * 10), name_time * 1e9 / (iterations * 10), sum);
+	if (test_failures) {
+		fprintf(stderr, "wiretest: %d checks failed\n", test_failures);
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,602 @@
+/*
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ *   Redistributions of source code must retain the above
+ *   copyright notice, this list of conditions and the
+ *   following disclaimer.
+ *
+ *   Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following
+ *   disclaimer in the documentation and/or other materials
+ *   provided with the distribution.
+ *
+ *   Neither the name of the copyright holder nor the names
+ *   of any other contributors may be used to endorse or
+ *   promote products derived from this software without
+ *   specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+
+/* io_uring transport for Linux, see libssh2_session_io_uring()
+ * One multishot receive stays armed on the socket and fills buffers registered with the kernel as data
+ * arrives, so a run of packet reads costs a copy out of those buffers rather than a recv() (and the
+ * blocking mode fcntl()s either side of it) each. Sends are submitted in the same io_uring_enter() as any
+ * receive that needs rearming and wait for their completion, so they keep send()'s semantics; batching
+ * many packets into one send is what libssh2_session_cork() is for
+ * No locking of its own, so not for use with LIBSSH2_FLAG_THREADED
+ */
+
+#include "libssh2_priv.h"
+#include <errno.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+#endif
+
+#if defined(IORING_RECV_MULTISHOT) && defined(__NR_io_uring_setup)
+
+#define LIBSSH2_URING_BUFFERS		32			/* power of two */
+#define LIBSSH2_URING_BUFSIZE		16384
+#define LIBSSH2_URING_BGID			0
+
+/* user_data of each kind of request */
+#define LIBSSH2_URING_RECV			1
+#define LIBSSH2_URING_SEND			2
+#define LIBSSH2_URING_CANCEL		3
+
+typedef struct _libssh2_uring_rx {
+	unsigned short bid;
+	unsigned int off, len;
+} libssh2_uring_rx;
+
+typedef struct _libssh2_uring {
+	int fd;
+
+	/* Submission and completion rings, in one mapping (IORING_FEAT_SINGLE_MMAP) */
+	void *rings;
+	size_t rings_len;
+	unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array, sq_entries;
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+	struct io_uring_sqe *sqes;
+	size_t sqes_len;
+	unsigned int sq_local_tail, to_submit;
+
+	/* Receive buffers provided to the kernel, bufs[bid * LIBSSH2_URING_BUFSIZE] */
+	struct io_uring_buf_ring *buf_ring;
+	size_t buf_ring_len;
+	unsigned char *bufs;
+	unsigned short buf_tail;
+
+	/* Filled buffers not yet read through, oldest first */
+	libssh2_uring_rx rx[LIBSSH2_URING_BUFFERS];
+	unsigned int rx_head, rx_count;
+
+	int recv_armed, recv_eof, recv_errno;
+	int send_done, send_res;
+
+	/* Set when the ring itself has failed, nothing more is submitted */
+	int failed;
+
+	int blocking;
+} libssh2_uring;
+
+/* {{{ libssh2_uring_enter
+ * Submit whatever is queued, then wait (if min_complete) up to timeout milliseconds (forever if < 0)
+ * Returns as io_uring_enter(2), -1 with errno ETIME when the wait times out
+ */
+static int libssh2_uring_enter(LIBSSH2_SESSION *session, libssh2_uring *u, unsigned int min_complete, long timeout)
+{
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	unsigned int flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+	void *argp = NULL;
+	size_t argsz = 0;
+	int ret;
+
+	__atomic_store_n(u->sq_tail, u->sq_local_tail, __ATOMIC_RELEASE);
+
+	if (min_complete && timeout >= 0) {
+		memset(&arg, 0, sizeof(arg));
+		ts.tv_sec = timeout / 1000;
+		ts.tv_nsec = (timeout % 1000) * 1000000;
+		arg.ts = (unsigned long)&ts;
+		flags |= IORING_ENTER_EXT_ARG;
+		argp = &arg;
+		argsz = sizeof(arg);
+	}
+
+	LIBSSH2_STAT_ADD(session, transport_syscalls, 1);
+	ret = syscall(__NR_io_uring_enter, u->fd, u->to_submit, min_complete, flags, argp, argsz);
+	if (ret >= 0) {
+		u->to_submit -= ((unsigned int)ret < u->to_submit) ? ret : u->to_submit;
+	} else if (errno != EINTR && errno != ETIME && errno != EAGAIN && errno != EBUSY) {
+		u->failed = errno;
+	}
+
+	return ret;
+}
+/* }}} */
+
+/* {{{ libssh2_uring_sqe
+ * Next free submission entry, cleared
+ */
+static struct io_uring_sqe *libssh2_uring_sqe(LIBSSH2_SESSION *session, libssh2_uring *u)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int idx;
+
+	while ((u->sq_local_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE)) >= u->sq_entries) {
+		if (libssh2_uring_enter(session, u, 0, 0) < 0 && u->failed) {
+			return NULL;
+		}
+	}
+
+	idx = u->sq_local_tail & *u->sq_mask;
+	sqe = &u->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	u->sq_array[idx] = idx;
+	u->sq_local_tail++;
+	u->to_submit++;
+
+	return sqe;
+}
+/* }}} */
+
+/* {{{ libssh2_uring_recycle
+ * Hand a receive buffer back to the kernel
+ */
+static void libssh2_uring_recycle(libssh2_uring *u, unsigned short bid)
+{
+	struct io_uring_buf *buf = &u->buf_ring->bufs[u->buf_tail & (LIBSSH2_URING_BUFFERS - 1)];
+
+	buf->addr = (unsigned long)(u->bufs + (bid * LIBSSH2_URING_BUFSIZE));
+	buf->len = LIBSSH2_URING_BUFSIZE;
+	buf->bid = bid;
+	u->buf_tail++;
+	__atomic_store_n(&u->buf_ring->tail, u->buf_tail, __ATOMIC_RELEASE);
+}
+/* }}} */
+
+/* {{{ libssh2_uring_reap
+ * Take in every completion posted so far
+ */
+static void libssh2_uring_reap(libssh2_uring *u)
+{
+	unsigned int head = *u->cq_head;
+	unsigned int tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+
+	for(; head != tail; head++) {
+		struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+
+		switch (cqe->user_data) {
+			case LIBSSH2_URING_RECV:
+				if (cqe->res > 0) {
+					libssh2_uring_rx *rx = &u->rx[(u->rx_head + u->rx_count) % LIBSSH2_URING_BUFFERS];
+
+					rx->bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+					rx->off = 0;
+					rx->len = cqe->res;
+					u->rx_count++;
+				} else if (cqe->res == 0) {
+					u->recv_eof = 1;
+				} else if (cqe->res != -ENOBUFS && cqe->res != -ECANCELED) {
+					u->recv_errno = -cqe->res;
+				}
+				/* Out of buffers, or finished for good, either way it has to be armed again */
+				if (!(cqe->flags & IORING_CQE_F_MORE)) {
+					u->recv_armed = 0;
+				}
+				break;
+			case LIBSSH2_URING_SEND:
+				u->send_done = 1;
+				u->send_res = cqe->res;
+				break;
+		}
+	}
+
+	__atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+}
+/* }}} */
+
+/* {{{ libssh2_uring_arm
+ * Queue the multishot receive if it isn't running and can usefully be, it goes in with the next submission
+ */
+static int libssh2_uring_arm(LIBSSH2_SESSION *session, libssh2_uring *u)
+{
+	struct io_uring_sqe *sqe;
+
+	if (u->recv_armed || u->recv_eof || u->recv_errno || u->rx_count == LIBSSH2_URING_BUFFERS) {
+		return 0;
+	}
+
+	sqe = libssh2_uring_sqe(session, u);
+	if (!sqe) {
+		return -1;
+	}
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = session->socket_fd;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = LIBSSH2_URING_BGID;
+	sqe->user_data = LIBSSH2_URING_RECV;
+	u->recv_armed = 1;
+
+	return 0;
+}
+/* }}} */
+
+/* {{{ libssh2_uring_readable
+ * Wait up to timeout milliseconds (forever if < 0) for something to read, end of stream or an error
+ * Returns 1 once there is, 0 on timeout, -1 (errno set) if the wait itself failed
+ */
+static int libssh2_uring_readable(LIBSSH2_SESSION *session, libssh2_uring *u, long timeout)
+{
+	for(;;) {
+		libssh2_uring_reap(u);
+		if (u->rx_count || u->recv_eof || u->recv_errno) {
+			return 1;
+		}
+		if (u->failed) {
+			errno = u->failed;
+			return -1;
+		}
+		if (libssh2_uring_arm(session, u)) {
+			errno = u->failed;
+			return -1;
+		}
+		if (timeout == 0 && !u->to_submit) {
+			return 0;
+		}
+
+		if (libssh2_uring_enter(session, u, timeout ? 1 : 0, timeout) < 0) {
+			if (errno == ETIME) {
+				return 0;
+			}
+			return -1;
+		}
+		if (timeout == 0) {
+			libssh2_uring_reap(u);
+			return (u->rx_count || u->recv_eof || u->recv_errno) ? 1 : 0;
+		}
+	}
+}
+/* }}} */
+
+/* {{{ libssh2_uring_read
+ */
+static LIBSSH2_READ_FUNC(libssh2_uring_read)
+{
+	libssh2_uring *u = session->transport_abstract;
+	int copied = 0;
+	(void)userInfo;
+
+	for(;;) {
+		while (u->rx_count && copied < length) {
+			libssh2_uring_rx *rx = &u->rx[u->rx_head];
+			unsigned int n = rx->len - rx->off;
+
+			if (n > (unsigned int)(length - copied)) {
+				n = length - copied;
+			}
+			memcpy(buffer + copied, u->bufs + (rx->bid * LIBSSH2_URING_BUFSIZE) + rx->off, n);
+			copied += n;
+			rx->off += n;
+			if (rx->off == rx->len) {
+				libssh2_uring_recycle(u, rx->bid);
+				u->rx_head = (u->rx_head + 1) % LIBSSH2_URING_BUFFERS;
+				u->rx_count--;
+			}
+		}
+		if (copied) {
+			return copied;
+		}
+		if (u->recv_errno) {
+			errno = u->recv_errno;
+			return -1;
+		}
+		if (u->recv_eof) {
+			/* As libssh2_session_alive() would find with MSG_PEEK on the socket */
+			session->socket_state = LIBSSH2_SOCKET_DISCONNECTED;
+			return 0;
+		}
+
+		switch (libssh2_uring_readable(session, u, u->blocking ? -1 : 0)) {
+			case -1:
+				return -1;
+			case 0:
+				errno = EAGAIN;
+				return -1;
+		}
+	}
+}
+/* }}} */
+
+/* {{{ libssh2_uring_send
+ * Submit a send (along with the receive, if that needs rearming) and wait for it to complete
+ */
+static int libssh2_uring_send(LIBSSH2_SESSION *session, libssh2_uring *u, int opcode, void *addr, unsigned int len)
+{
+	struct io_uring_sqe *sqe;
+
+	if (u->failed) {
+		errno = u->failed;
+		return -1;
+	}
+
+	sqe = libssh2_uring_sqe(session, u);
+	if (!sqe) {
+		errno = u->failed;
+		return -1;
+	}
+	sqe->opcode = opcode;
+	sqe->fd = session->socket_fd;
+	sqe->addr = (unsigned long)addr;
+	sqe->len = len;
+	sqe->msg_flags = LIBSSH2_SOCKET_SEND_FLAGS(session) | MSG_WAITALL;
+	sqe->user_data = LIBSSH2_URING_SEND;
+	u->send_done = 0;
+
+	libssh2_uring_arm(session, u);
+
+	/* The kernel has the caller's buffer until the completion turns up, so there's no giving up early */
+	while (!u->send_done) {
+		if (libssh2_uring_enter(session, u, 1, -1) < 0 && u->failed) {
+			errno = u->failed;
+			return -1;
+		}
+		libssh2_uring_reap(u);
+	}
+
+	if (u->send_res < 0) {
+		errno = -u->send_res;
+		return -1;
+	}
+	return u->send_res;
+}
+/* }}} */
+
+/* {{{ libssh2_uring_write
+ */
+static LIBSSH2_WRITE_FUNC(libssh2_uring_write)
+{
+	(void)userInfo;
+
+	return libssh2_uring_send(session, session->transport_abstract, IORING_OP_SEND, buffer, length);
+}
+/* }}} */
+
+/* {{{ libssh2_uring_writev
+ */
+static LIBSSH2_WRITEV_FUNC(libssh2_uring_writev)
+{
+	struct msghdr msg;
+	(void)userInfo;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = (struct iovec *)iov;
+	msg.msg_iovlen = iovcnt;
+
+	return libssh2_uring_send(session, session->transport_abstract, IORING_OP_SENDMSG, &msg, 1);
+}
+/* }}} */
+
+/* {{{ libssh2_uring_wait
+ */
+static LIBSSH2_WAIT_FUNC(libssh2_uring_wait)
+{
+	(void)userInfo;
+
+	if (for_write) {
+		/* Sends have completed by the time libssh2_uring_send() returns, there's never one to wait out */
+		return 1;
+	}
+	return libssh2_uring_readable(session, session->transport_abstract, timeout);
+}
+/* }}} */
+
+/* {{{ libssh2_uring_blocking
+ * Only decides whether a read with nothing buffered waits, the socket itself is left alone
+ */
+static LIBSSH2_BLOCKING_FUNC(libssh2_uring_blocking)
+{
+	libssh2_uring *u = session->transport_abstract;
+	(void)userInfo;
+
+	u->blocking = blocking;
+	return 0;
+}
+/* }}} */
+
+/* {{{ libssh2_uring_release
+ * Unmap and close whatever of u has been set up
+ */
+static void libssh2_uring_release(LIBSSH2_SESSION *session, libssh2_uring *u)
+{
+	if (u->buf_ring) {
+		munmap(u->buf_ring, u->buf_ring_len);
+	}
+	if (u->sqes) {
+		munmap(u->sqes, u->sqes_len);
+	}
+	if (u->rings) {
+		munmap(u->rings, u->rings_len);
+	}
+	if (u->fd >= 0) {
+		close(u->fd);
+	}
+	if (u->bufs) {
+		LIBSSH2_FREE(session, u->bufs);
+	}
+	LIBSSH2_FREE(session, u);
+}
+/* }}} */
+
+/* {{{ libssh2_uring_free
+ */
+static void libssh2_uring_free(LIBSSH2_SESSION *session)
+{
+	libssh2_uring *u = session->transport_abstract;
+
+	if (u->recv_armed && !u->failed) {
+		/* The receive could still fill a buffer, cancel it and see it finish before they're freed */
+		struct io_uring_sqe *sqe = libssh2_uring_sqe(session, u);
+
+		if (sqe) {
+			sqe->opcode = IORING_OP_ASYNC_CANCEL;
+			sqe->addr = LIBSSH2_URING_RECV;
+			sqe->user_data = LIBSSH2_URING_CANCEL;
+		}
+		while (u->recv_armed && !u->failed) {
+			libssh2_uring_enter(session, u, 1, -1);
+			libssh2_uring_reap(u);
+		}
+	}
+
+	libssh2_uring_release(session, u);
+	session->transport_abstract = NULL;
+	session->transport_free = NULL;
+}
+/* }}} */
+
+/* {{{ libssh2_session_io_uring
+ * Switch the session's transport callbacks over to an io_uring of its own
+ */
+LIBSSH2_API int libssh2_session_io_uring(LIBSSH2_SESSION *session, unsigned int entries)
+{
+	struct io_uring_params p;
+	struct io_uring_buf_reg reg;
+	libssh2_uring *u;
+	unsigned char *rings;
+	size_t cq_len;
+	int i;
+
+	if (session->transport_abstract) {
+		return 0;
+	}
+	if (LIBSSH2_THREADED(session)) {
+		libssh2_error(session, LIBSSH2_ERROR_INVAL, "io_uring transport can't be shared between threads", 0);
+		return -1;
+	}
+
+	u = LIBSSH2_ALLOC(session, sizeof(libssh2_uring));
+	if (!u) {
+		libssh2_error(session, LIBSSH2_ERROR_ALLOC, "Unable to allocate io_uring state", 0);
+		return -1;
+	}
+	memset(u, 0, sizeof(libssh2_uring));
+	u->blocking = 1;
+
+	memset(&p, 0, sizeof(p));
+	u->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (u->fd < 0 || !(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_EXT_ARG)) {
+		goto io_uring_unavailable;
+	}
+
+	u->rings_len = p.sq_off.array + (p.sq_entries * sizeof(unsigned int));
+	cq_len = p.cq_off.cqes + (p.cq_entries * sizeof(struct io_uring_cqe));
+	if (cq_len > u->rings_len) {
+		u->rings_len = cq_len;
+	}
+	u->rings = mmap(NULL, u->rings_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	if (u->rings == MAP_FAILED) {
+		u->rings = NULL;
+		goto io_uring_unavailable;
+	}
+	u->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	u->sqes = mmap(NULL, u->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED) {
+		u->sqes = NULL;
+		goto io_uring_unavailable;
+	}
+
+	rings = u->rings;
+	u->sq_head = (unsigned int *)(rings + p.sq_off.head);
+	u->sq_tail = (unsigned int *)(rings + p.sq_off.tail);
+	u->sq_mask = (unsigned int *)(rings + p.sq_off.ring_mask);
+	u->sq_array = (unsigned int *)(rings + p.sq_off.array);
+	u->sq_entries = p.sq_entries;
+	u->sq_local_tail = *u->sq_tail;
+	u->cq_head = (unsigned int *)(rings + p.cq_off.head);
+	u->cq_tail = (unsigned int *)(rings + p.cq_off.tail);
+	u->cq_mask = (unsigned int *)(rings + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)(rings + p.cq_off.cqes);
+
+	/* The buffer ring has to be page aligned */
+	u->buf_ring_len = LIBSSH2_URING_BUFFERS * sizeof(struct io_uring_buf);
+	u->buf_ring = mmap(NULL, u->buf_ring_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (u->buf_ring == MAP_FAILED) {
+		u->buf_ring = NULL;
+		goto io_uring_unavailable;
+	}
+	u->bufs = LIBSSH2_ALLOC(session, LIBSSH2_URING_BUFFERS * LIBSSH2_URING_BUFSIZE);
+	if (!u->bufs) {
+		goto io_uring_unavailable;
+	}
+
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (unsigned long)u->buf_ring;
+	reg.ring_entries = LIBSSH2_URING_BUFFERS;
+	reg.bgid = LIBSSH2_URING_BGID;
+	if (syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+		goto io_uring_unavailable;
+	}
+	for(i = 0; i < LIBSSH2_URING_BUFFERS; i++) {
+		libssh2_uring_recycle(u, i);
+	}
+
+	session->transport_abstract = u;
+	session->transport_fd = u->fd;
+	session->transport_free = libssh2_uring_free;
+	session->ssh_read = libssh2_uring_read;
+	session->ssh_write = libssh2_uring_write;
+	session->ssh_writev = libssh2_uring_writev;
+	session->ssh_wait = libssh2_uring_wait;
+	session->ssh_blocking = libssh2_uring_blocking;
+
+	return 0;
+
+ io_uring_unavailable:
+	libssh2_error(session, LIBSSH2_ERROR_METHOD_NOT_SUPPORTED, "io_uring (with multishot receive into provided buffers) unavailable", 0);
+	libssh2_uring_release(session, u);
+	return -1;
+}
+/* }}} */
+
+#else
+
+/* {{{ libssh2_session_io_uring
+ */
+LIBSSH2_API int libssh2_session_io_uring(LIBSSH2_SESSION *session, unsigned int entries)
+{
+	(void)entries;
+
+	libssh2_error(session, LIBSSH2_ERROR_METHOD_NOT_SUPPORTED, "io_uring isn't available on this platform", 0);
+	return -1;
+}
+/* }}} */
+
+#endif /* IORING_RECV_MULTISHOT */
@@ -36,12 +36,130 @@
  */
 
 #include "libssh2_priv.h"
+#include <stdlib.h>
 
 /* Needed for struct iovec on some platforms */
 #ifdef HAVE_SYS_UIO_H
 #include <sys/uio.h>
 #endif
 
+#ifndef WIN32
+#include <pthread.h>
+#endif
+
+/* Allowed method lists, keyed on the server's hostkey and the username
+ * Shared between sessions, so allocated with plain malloc rather than a session's allocator
+ */
+#define LIBSSH2_USERAUTH_LIST_CACHE_SIZE	16
+
+typedef struct _libssh2_userauth_list_entry {
+	unsigned char hostkey_sha1[SHA_DIGEST_LENGTH];
+	char *username;
+	unsigned int username_len;
+	char *methods;
+	unsigned long methods_len;
+} libssh2_userauth_list_entry;
+
+static libssh2_userauth_list_entry libssh2_userauth_list_cache[LIBSSH2_USERAUTH_LIST_CACHE_SIZE];
+static int libssh2_userauth_list_cache_next = 0;
+
+#ifndef WIN32
+static pthread_mutex_t libssh2_userauth_list_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define LIBSSH2_USERAUTH_LIST_CACHE_LOCK()		pthread_mutex_lock(&libssh2_userauth_list_cache_mutex)
+#define LIBSSH2_USERAUTH_LIST_CACHE_UNLOCK()	pthread_mutex_unlock(&libssh2_userauth_list_cache_mutex)
+#else
+#define LIBSSH2_USERAUTH_LIST_CACHE_LOCK()
+#define LIBSSH2_USERAUTH_LIST_CACHE_UNLOCK()
+#endif
+
+/* {{{ libssh2_userauth_list_cache_find
+ * Returns a session allocated copy of the cached method list, or NULL
+ */
+static char *libssh2_userauth_list_cache_find(LIBSSH2_SESSION *session, const char *username, unsigned int username_len)
+{
+	char *methods = NULL;
+	int i;
+
+	LIBSSH2_USERAUTH_LIST_CACHE_LOCK();
+	for(i = 0; i < LIBSSH2_USERAUTH_LIST_CACHE_SIZE; i++) {
+		libssh2_userauth_list_entry *entry = &libssh2_userauth_list_cache[i];
+
+		if (!entry->methods ||
+			entry->username_len != username_len ||
+			memcmp(entry->hostkey_sha1, session->server_hostkey_sha1, SHA_DIGEST_LENGTH) ||
+			(username_len && memcmp(entry->username, username, username_len))) {
+			continue;
+		}
+
+		methods = LIBSSH2_ALLOC(session, entry->methods_len + 1);
+		if (methods) {
+			memcpy(methods, entry->methods, entry->methods_len + 1);
+		}
+		break;
+	}
+	LIBSSH2_USERAUTH_LIST_CACHE_UNLOCK();
+
+	return methods;
+}
+/* }}} */
+
+/* {{{ libssh2_userauth_list_cache_store
+ * Remember a method list, replacing the oldest entry once the cache is full
+ */
+static void libssh2_userauth_list_cache_store(LIBSSH2_SESSION *session, const char *username, unsigned int username_len,
+																		const char *methods, unsigned long methods_len)
+{
+	libssh2_userauth_list_entry *entry;
+	char *username_copy = NULL, *methods_copy;
+
+	methods_copy = malloc(methods_len + 1);
+	if (username_len) {
+		username_copy = malloc(username_len);
+	}
+	if (!methods_copy || (username_len && !username_copy)) {
+		/* Not caching is never fatal */
+		free(methods_copy);
+		free(username_copy);
+		return;
+	}
+	memcpy(methods_copy, methods, methods_len + 1);
+	if (username_len) {
+		memcpy(username_copy, username, username_len);
+	}
+
+	LIBSSH2_USERAUTH_LIST_CACHE_LOCK();
+	entry = &libssh2_userauth_list_cache[libssh2_userauth_list_cache_next];
+	libssh2_userauth_list_cache_next = (libssh2_userauth_list_cache_next + 1) % LIBSSH2_USERAUTH_LIST_CACHE_SIZE;
+
+	free(entry->username);
+	free(entry->methods);
+	memcpy(entry->hostkey_sha1, session->server_hostkey_sha1, SHA_DIGEST_LENGTH);
+	entry->username = username_copy;
+	entry->username_len = username_len;
+	entry->methods = methods_copy;
+	entry->methods_len = methods_len;
+	LIBSSH2_USERAUTH_LIST_CACHE_UNLOCK();
+}
+/* }}} */
+
+/* {{{ libssh2_userauth_list_cache_flush
+ * Forget every cached method list
+ */
+LIBSSH2_API void libssh2_userauth_list_cache_flush(void)
+{
+	int i;
+
+	LIBSSH2_USERAUTH_LIST_CACHE_LOCK();
+	for(i = 0; i < LIBSSH2_USERAUTH_LIST_CACHE_SIZE; i++) {
+		free(libssh2_userauth_list_cache[i].username);
+		free(libssh2_userauth_list_cache[i].methods);
+		memset(&libssh2_userauth_list_cache[i], 0, sizeof(libssh2_userauth_list_entry));
+	}
+	libssh2_userauth_list_cache_next = 0;
+	LIBSSH2_USERAUTH_LIST_CACHE_UNLOCK();
+}
+/* }}} */
+
 
 /* {{{ proto libssh2_userauth_list
  * List authentication methods
@@ -57,6 +175,17 @@ LIBSSH2_API char *libssh2_userauth_list(LIBSSH2_SESSION *session, const char *us
 	unsigned long methods_len;
 	unsigned char *data, *s;
 
+	if (session->flags & LIBSSH2_FLAG_AUTH_CACHE) {
+		char *methods = libssh2_userauth_list_cache_find(session, username, username_len);
+
+		if (methods) {
+#ifdef LIBSSH2_DEBUG_USERAUTH
+			_libssh2_debug(session, LIBSSH2_DBG_AUTH, "Permitted auth methods (cached): %s", methods);
+#endif
+			return methods;
+		}
+	}
+
 	s = data = LIBSSH2_ALLOC(session, data_len);
 	if (!data) {
 		libssh2_error(session, LIBSSH2_ERROR_ALLOC, "Unable to allocate memory for userauth_list", 0);
@@ -82,6 +211,10 @@ LIBSSH2_API char *libssh2_userauth_list(LIBSSH2_SESSION *session, const char *us
 	}
 	LIBSSH2_FREE(session, data);
 
+	if (libssh2_session_service_accept(session)) {
+		return NULL;
+	}
+
 	if (libssh2_packet_requirev(session, reply_codes, &data, &data_len)) {
 		return NULL;
 	}
@@ -93,12 +226,21 @@ LIBSSH2_API char *libssh2_userauth_list(LIBSSH2_SESSION *session, const char *us
 		return NULL;
 	}
 
-	methods_len = libssh2_ntohu32(data + 1);
-	memcpy(data, data + 5, methods_len);
+	methods_len = (data_len >= 5) ? libssh2_ntohu32(data + 1) : 0;
+	if (data_len < 5 || methods_len > (data_len - 5)) {
+		libssh2_error(session, LIBSSH2_ERROR_PROTO, "Malformed list of authentication methods", 0);
+		LIBSSH2_FREE(session, data);
+		return NULL;
+	}
+	/* The list moves down over its own length field */
+	memmove(data, data + 5, methods_len);
 	data[methods_len] = '\0';
 #ifdef LIBSSH2_DEBUG_USERAUTH
 	_libssh2_debug(session, LIBSSH2_DBG_AUTH, "Permitted auth methods: %s", data);
 #endif
+	if (session->flags & LIBSSH2_FLAG_AUTH_CACHE) {
+		libssh2_userauth_list_cache_store(session, username, username_len, (const char *)data, methods_len);
+	}
 	return (char *)data;
 }
 /* }}} */
@@ -155,6 +297,10 @@ LIBSSH2_API int libssh2_userauth_password_ex(LIBSSH2_SESSION *session, const cha
 	}
 	LIBSSH2_FREE(session, data);
 
+	if (libssh2_session_service_accept(session)) {
+		return -1;
+	}
+
  password_response:
 	if (libssh2_packet_requirev(session, reply_codes, &data, &data_len)) {
 		return -1;
@@ -457,6 +603,10 @@ LIBSSH2_API int libssh2_userauth_hostbased_fromfile_ex(LIBSSH2_SESSION *session,
 	}
 	LIBSSH2_FREE(session, packet);
 
+	if (libssh2_session_service_accept(session)) {
+		return -1;
+	}
+
 	if (libssh2_packet_requirev(session, reply_codes, &data, &data_len)) {
 		return -1;
 	}
@@ -535,7 +685,8 @@ LIBSSH2_API int libssh2_userauth_publickey_fromfile_ex(LIBSSH2_SESSION *session,
 		return -1;
 	}
 
-	if (libssh2_packet_requirev(session, reply_codes, &data, &data_len)) {
+	if (libssh2_session_service_accept(session) ||
+		libssh2_packet_requirev(session, reply_codes, &data, &data_len)) {
 		LIBSSH2_FREE(session, packet);
 		LIBSSH2_FREE(session, method);
 		LIBSSH2_FREE(session, pubkeydata);
@@ -706,6 +857,10 @@ LIBSSH2_API int libssh2_userauth_keyboard_interactive_ex(LIBSSH2_SESSION *sessio
 	}
 	LIBSSH2_FREE(session, data);
 
+	if (libssh2_session_service_accept(session)) {
+		return -1;
+	}
+
 	for (;;) {
 		unsigned char reply_codes[4] = { SSH_MSG_USERAUTH_SUCCESS, SSH_MSG_USERAUTH_FAILURE, SSH_MSG_USERAUTH_INFO_REQUEST, 0 };
 		unsigned int auth_name_len;
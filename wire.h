@@ -0,0 +1,307 @@
+/*
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ *   Redistributions of source code must retain the above
+ *   copyright notice, this list of conditions and the
+ *   following disclaimer.
+ *
+ *   Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following
+ *   disclaimer in the documentation and/or other materials
+ *   provided with the distribution.
+ *
+ *   Neither the name of the copyright holder nor the names
+ *   of any other contributors may be used to endorse or
+ *   promote products derived from this software without
+ *   specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+
+#ifndef LIBSSH2_WIRE_H
+#define LIBSSH2_WIRE_H 1
+
+/* Big-endian accessors and a bounds-checked reader/writer for SSH wire data
+ * Everything here is inline, packet parsing calls these once or twice per field
+ */
+
+#ifdef _MSC_VER
+# define LIBSSH2_INLINE __inline
+#else
+# define LIBSSH2_INLINE inline
+#endif
+
+/* Unaligned loads plus a byte swap where the compiler has one, shifting everywhere else */
+#if defined(__GNUC__) && ((__GNUC__ > 4) || ((__GNUC__ == 4) && (__GNUC_MINOR__ >= 3)))
+# if defined(__LITTLE_ENDIAN__) || (defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__))
+#  define LIBSSH2_WIRE_BSWAP 1
+# elif defined(__BIG_ENDIAN__) || (defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__))
+#  define LIBSSH2_WIRE_NATIVE 1
+# endif
+#endif
+
+/* {{{ libssh2_ntohu32
+ */
+static LIBSSH2_INLINE unsigned long libssh2_ntohu32(const unsigned char *buf)
+{
+#if defined(LIBSSH2_WIRE_BSWAP) || defined(LIBSSH2_WIRE_NATIVE)
+	unsigned int val;
+
+	memcpy(&val, buf, 4);
+# ifdef LIBSSH2_WIRE_BSWAP
+	val = __builtin_bswap32(val);
+# endif
+	return val;
+#else
+	return ((unsigned long)buf[0] << 24) | ((unsigned long)buf[1] << 16) | ((unsigned long)buf[2] << 8) | buf[3];
+#endif
+}
+/* }}} */
+
+/* {{{ libssh2_ntohu64
+ * Note: Some 32-bit platforms have issues with bitops on long longs
+ * Work around this by doing expensive (but safer) arithmetic ops with optimization defying parentheses
+ */
+static LIBSSH2_INLINE libssh2_uint64_t libssh2_ntohu64(const unsigned char *buf)
+{
+#if defined(LIBSSH2_WIRE_BSWAP) || defined(LIBSSH2_WIRE_NATIVE)
+	libssh2_uint64_t val;
+
+	memcpy(&val, buf, 8);
+# ifdef LIBSSH2_WIRE_BSWAP
+	val = __builtin_bswap64(val);
+# endif
+	return val;
+#else
+	unsigned long msl, lsl;
+
+	msl = libssh2_ntohu32(buf);
+	lsl = libssh2_ntohu32(buf + 4);
+
+	return ((msl * 65536) * 65536) + lsl;
+#endif
+}
+/* }}} */
+
+/* {{{ libssh2_htonu32
+ */
+static LIBSSH2_INLINE void libssh2_htonu32(unsigned char *buf, unsigned long value)
+{
+#if defined(LIBSSH2_WIRE_BSWAP) || defined(LIBSSH2_WIRE_NATIVE)
+	unsigned int val = (unsigned int)value;
+
+# ifdef LIBSSH2_WIRE_BSWAP
+	val = __builtin_bswap32(val);
+# endif
+	memcpy(buf, &val, 4);
+#else
+	buf[0] = (value >> 24) & 0xFF;
+	buf[1] = (value >> 16) & 0xFF;
+	buf[2] = (value >> 8) & 0xFF;
+	buf[3] = value & 0xFF;
+#endif
+}
+/* }}} */
+
+/* {{{ libssh2_htonu64
+ */
+static LIBSSH2_INLINE void libssh2_htonu64(unsigned char *buf, libssh2_uint64_t value)
+{
+#if defined(LIBSSH2_WIRE_BSWAP) || defined(LIBSSH2_WIRE_NATIVE)
+# ifdef LIBSSH2_WIRE_BSWAP
+	value = __builtin_bswap64(value);
+# endif
+	memcpy(buf, &value, 8);
+#else
+	libssh2_htonu32(buf, (unsigned long)((value / 65536) / 65536));
+	libssh2_htonu32(buf + 4, (unsigned long)(value & 0xFFFFFFFF));
+#endif
+}
+/* }}} */
+
+/* A reader never walks past end, every get returns -1 instead and leaves the position alone */
+typedef struct _libssh2_wire_reader {
+	const unsigned char *p;
+	const unsigned char *end;
+} libssh2_wire_reader;
+
+/* A writer likewise refuses to run past end */
+typedef struct _libssh2_wire_writer {
+	unsigned char *p;
+	unsigned char *end;
+} libssh2_wire_writer;
+
+/* {{{ libssh2_wire_reader_init
+ */
+static LIBSSH2_INLINE void libssh2_wire_reader_init(libssh2_wire_reader *r, const unsigned char *buf, unsigned long len)
+{
+	r->p = buf;
+	r->end = buf + len;
+}
+/* }}} */
+
+/* {{{ libssh2_wire_left
+ */
+static LIBSSH2_INLINE unsigned long libssh2_wire_left(const libssh2_wire_reader *r)
+{
+	return r->end - r->p;
+}
+/* }}} */
+
+/* {{{ libssh2_wire_skip
+ */
+static LIBSSH2_INLINE int libssh2_wire_skip(libssh2_wire_reader *r, unsigned long len)
+{
+	if (len > libssh2_wire_left(r)) {
+		return -1;
+	}
+	r->p += len;
+
+	return 0;
+}
+/* }}} */
+
+/* {{{ libssh2_wire_get_byte
+ */
+static LIBSSH2_INLINE int libssh2_wire_get_byte(libssh2_wire_reader *r, unsigned char *val)
+{
+	if (r->p >= r->end) {
+		return -1;
+	}
+	*val = *(r->p++);
+
+	return 0;
+}
+/* }}} */
+
+/* {{{ libssh2_wire_get_u32
+ */
+static LIBSSH2_INLINE int libssh2_wire_get_u32(libssh2_wire_reader *r, unsigned long *val)
+{
+	if (libssh2_wire_left(r) < 4) {
+		return -1;
+	}
+	*val = libssh2_ntohu32(r->p);
+	r->p += 4;
+
+	return 0;
+}
+/* }}} */
+
+/* {{{ libssh2_wire_get_u64
+ */
+static LIBSSH2_INLINE int libssh2_wire_get_u64(libssh2_wire_reader *r, libssh2_uint64_t *val)
+{
+	if (libssh2_wire_left(r) < 8) {
+		return -1;
+	}
+	*val = libssh2_ntohu64(r->p);
+	r->p += 8;
+
+	return 0;
+}
+/* }}} */
+
+/* {{{ libssh2_wire_get_string
+ * Point str at a length prefixed string inside the buffer, nothing is copied or terminated
+ */
+static LIBSSH2_INLINE int libssh2_wire_get_string(libssh2_wire_reader *r, const unsigned char **str, unsigned long *len)
+{
+	unsigned long str_len;
+
+	if (libssh2_wire_left(r) < 4) {
+		return -1;
+	}
+	str_len = libssh2_ntohu32(r->p);
+	if (str_len > libssh2_wire_left(r) - 4) {
+		return -1;
+	}
+	*str = r->p + 4;
+	*len = str_len;
+	r->p += 4 + str_len;
+
+	return 0;
+}
+/* }}} */
+
+/* {{{ libssh2_wire_writer_init
+ */
+static LIBSSH2_INLINE void libssh2_wire_writer_init(libssh2_wire_writer *w, unsigned char *buf, unsigned long len)
+{
+	w->p = buf;
+	w->end = buf + len;
+}
+/* }}} */
+
+/* {{{ libssh2_wire_put_byte
+ */
+static LIBSSH2_INLINE int libssh2_wire_put_byte(libssh2_wire_writer *w, unsigned char val)
+{
+	if (w->p >= w->end) {
+		return -1;
+	}
+	*(w->p++) = val;
+
+	return 0;
+}
+/* }}} */
+
+/* {{{ libssh2_wire_put_u32
+ */
+static LIBSSH2_INLINE int libssh2_wire_put_u32(libssh2_wire_writer *w, unsigned long val)
+{
+	if ((unsigned long)(w->end - w->p) < 4) {
+		return -1;
+	}
+	libssh2_htonu32(w->p, val);
+	w->p += 4;
+
+	return 0;
+}
+/* }}} */
+
+/* {{{ libssh2_wire_put_u64
+ */
+static LIBSSH2_INLINE int libssh2_wire_put_u64(libssh2_wire_writer *w, libssh2_uint64_t val)
+{
+	if ((unsigned long)(w->end - w->p) < 8) {
+		return -1;
+	}
+	libssh2_htonu64(w->p, val);
+	w->p += 8;
+
+	return 0;
+}
+/* }}} */
+
+/* {{{ libssh2_wire_put_string
+ */
+static LIBSSH2_INLINE int libssh2_wire_put_string(libssh2_wire_writer *w, const unsigned char *str, unsigned long len)
+{
+	if ((unsigned long)(w->end - w->p) < 4 || len > (unsigned long)(w->end - w->p) - 4) {
+		return -1;
+	}
+	libssh2_htonu32(w->p, len);
+	memcpy(w->p + 4, str, len);
+	w->p += 4 + len;
+
+	return 0;
+}
+/* }}} */
+
+#endif /* LIBSSH2_WIRE_H */